@@ -0,0 +1,250 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hash.c - Hashes of local data to check against ones made on the host
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#include <pspkernel.h>
+#include <psputils.h>
+#include <string.h>
+#include "hash.h"
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define XXH_PRIME1  0x9E3779B1U
+#define XXH_PRIME2  0x85EBCA77U
+#define XXH_PRIME3  0xC2B2AE3DU
+#define XXH_PRIME4  0x27D4EB2FU
+#define XXH_PRIME5  0x165667B1U
+
+static u32 g_crctable[256];
+
+static void build_crctable(void)
+{
+	u32 c;
+	int i, j;
+
+	for(i = 0; i < 256; i++)
+	{
+		c = i;
+		for(j = 0; j < 8; j++)
+		{
+			c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+		}
+		g_crctable[i] = c;
+	}
+}
+
+static u32 get_le32(const u8 *p)
+{
+	return ((u32) p[3] << 24) | ((u32) p[2] << 16) | ((u32) p[1] << 8) | p[0];
+}
+
+static void put_be32(u8 *p, u32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static u32 xxh32_round(u32 acc, u32 input)
+{
+	acc += input * XXH_PRIME2;
+	acc = ROL32(acc, 13);
+
+	return acc * XXH_PRIME1;
+}
+
+static void xxh32_update(HashCtx *ctx, const u8 *data, unsigned int len)
+{
+	ctx->total += len;
+
+	if(ctx->used > 0)
+	{
+		unsigned int n = 16 - ctx->used;
+
+		n = n > len ? len : n;
+		memcpy(ctx->buf + ctx->used, data, n);
+		ctx->used += n;
+		data += n;
+		len -= n;
+		if(ctx->used < 16)
+		{
+			return;
+		}
+		ctx->v[0] = xxh32_round(ctx->v[0], get_le32(ctx->buf));
+		ctx->v[1] = xxh32_round(ctx->v[1], get_le32(ctx->buf + 4));
+		ctx->v[2] = xxh32_round(ctx->v[2], get_le32(ctx->buf + 8));
+		ctx->v[3] = xxh32_round(ctx->v[3], get_le32(ctx->buf + 12));
+		ctx->used = 0;
+	}
+
+	while(len >= 16)
+	{
+		ctx->v[0] = xxh32_round(ctx->v[0], get_le32(data));
+		ctx->v[1] = xxh32_round(ctx->v[1], get_le32(data + 4));
+		ctx->v[2] = xxh32_round(ctx->v[2], get_le32(data + 8));
+		ctx->v[3] = xxh32_round(ctx->v[3], get_le32(data + 12));
+		data += 16;
+		len -= 16;
+	}
+
+	memcpy(ctx->buf, data, len);
+	ctx->used = len;
+}
+
+static u32 xxh32_final(HashCtx *ctx)
+{
+	const u8 *p = ctx->buf;
+	int left = ctx->used;
+	u32 h;
+
+	if(ctx->total >= 16)
+	{
+		h = ROL32(ctx->v[0], 1) + ROL32(ctx->v[1], 7) + ROL32(ctx->v[2], 12) + ROL32(ctx->v[3], 18);
+	}
+	else
+	{
+		h = ctx->v[2] + XXH_PRIME5;
+	}
+	h += ctx->total;
+
+	while(left >= 4)
+	{
+		h += get_le32(p) * XXH_PRIME3;
+		h = ROL32(h, 17) * XXH_PRIME4;
+		p += 4;
+		left -= 4;
+	}
+
+	while(left > 0)
+	{
+		h += *p * XXH_PRIME5;
+		h = ROL32(h, 11) * XXH_PRIME1;
+		p++;
+		left--;
+	}
+
+	h ^= h >> 15;
+	h *= XXH_PRIME2;
+	h ^= h >> 13;
+	h *= XXH_PRIME3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+int hash_type(const char *name)
+{
+	if(strcmp(name, "crc32") == 0)
+	{
+		return HOSTHASH_CRC32;
+	}
+	else if(strcmp(name, "sha1") == 0)
+	{
+		return HOSTHASH_SHA1;
+	}
+	else if(strcmp(name, "xxh32") == 0)
+	{
+		return HOSTHASH_XXH32;
+	}
+
+	return -1;
+}
+
+int hash_init(HashCtx *ctx, int type)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->type = type;
+
+	switch(type)
+	{
+		case HOSTHASH_CRC32: if(g_crctable[1] == 0)
+							 {
+								 build_crctable();
+							 }
+							 ctx->crc = 0xFFFFFFFF;
+							 break;
+		case HOSTHASH_SHA1: sceKernelUtilsSha1BlockInit(&ctx->sha1);
+							break;
+		case HOSTHASH_XXH32: ctx->v[0] = XXH_PRIME1 + XXH_PRIME2;
+							 ctx->v[1] = XXH_PRIME2;
+							 ctx->v[2] = 0;
+							 ctx->v[3] = 0 - XXH_PRIME1;
+							 break;
+		default: return -1;
+	};
+
+	return 0;
+}
+
+void hash_update(HashCtx *ctx, const void *data, unsigned int len)
+{
+	const u8 *p = (const u8 *) data;
+	u32 crc;
+
+	switch(ctx->type)
+	{
+		case HOSTHASH_CRC32: crc = ctx->crc;
+							 while(len > 0)
+							 {
+								 crc = g_crctable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+								 len--;
+							 }
+							 ctx->crc = crc;
+							 break;
+		case HOSTHASH_SHA1: sceKernelUtilsSha1BlockUpdate(&ctx->sha1, (u8 *) p, len);
+							break;
+		case HOSTHASH_XXH32: xxh32_update(ctx, p, len);
+							 break;
+		default: break;
+	};
+}
+
+int hash_final(HashCtx *ctx, u8 *digest)
+{
+	memset(digest, 0, HOSTHASH_MAXDIGEST);
+
+	switch(ctx->type)
+	{
+		case HOSTHASH_CRC32: put_be32(digest, ctx->crc ^ 0xFFFFFFFF);
+							 return 4;
+		case HOSTHASH_SHA1: sceKernelUtilsSha1BlockResult(&ctx->sha1, digest);
+							return 20;
+		case HOSTHASH_XXH32: put_be32(digest, xxh32_final(ctx));
+							 return 4;
+		default: break;
+	};
+
+	return 0;
+}
+
+u32 hash_weak(const void *data, unsigned int len)
+{
+	const u8 *p = (const u8 *) data;
+	u32 s1 = 0, s2 = 0;
+	unsigned int i;
+
+	for(i = 0; i < len; i++)
+	{
+		s1 += p[i];
+		s2 += (len - i) * p[i];
+	}
+
+	return (s1 & 0xFFFF) | (s2 << 16);
+}
+
+u32 hash_xxh32(const void *data, unsigned int len)
+{
+	HashCtx ctx;
+
+	hash_init(&ctx, HOSTHASH_XXH32);
+	xxh32_update(&ctx, (const u8 *) data, len);
+
+	return xxh32_final(&ctx);
+}
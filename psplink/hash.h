@@ -0,0 +1,75 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hash.h - header file for hash.c
+ *
+ * Copyright (c) pspdev
+ *
+ */
+
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <psptypes.h>
+#include <psputils.h>
+#include <usbhostfs.h>
+
+typedef struct _HashCtx
+{
+	/* One of HOSTHASH_* */
+	int type;
+	u32 crc;
+	SceKernelUtilsSha1Context sha1;
+	u32 v[4];
+	u32 total;
+	u8 buf[16];
+	int used;
+} HashCtx;
+
+/**
+ * Get the hash type from its name
+ *
+ * @param name - crc32, sha1 or xxh32
+ *
+ * @return One of HOSTHASH_*, < 0 if the name is unknown
+ */
+int hash_type(const char *name);
+
+/**
+ * Start a hash, the digests match those usbhostfs_pc gives for DEVCTL_HOST_HASH
+ *
+ * @param ctx - The hash state
+ * @param type - One of HOSTHASH_*
+ *
+ * @return 0 on success, < 0 if the type is unknown
+ */
+int hash_init(HashCtx *ctx, int type);
+
+/**
+ * Add data to a hash
+ */
+void hash_update(HashCtx *ctx, const void *data, unsigned int len);
+
+/**
+ * Finish a hash
+ *
+ * @param ctx - The hash state
+ * @param digest - Filled in with the digest, HOSTHASH_MAXDIGEST bytes long
+ *
+ * @return The length of the digest
+ */
+int hash_final(HashCtx *ctx, u8 *digest);
+
+/**
+ * The rolling checksum the host matches blocks with in a sync
+ */
+u32 hash_weak(const void *data, unsigned int len);
+
+/**
+ * XXH32 of a buffer with a seed of 0
+ */
+u32 hash_xxh32(const void *data, unsigned int len);
+
+#endif
@@ -46,6 +46,7 @@
 #include "tty.h"
 #include "shellcmd.h"
 #include "usbshell.h"
+#include "hash.h"
 
 #define MAX_SHELL_VAR      128
 #define MAX_CLI            4096
@@ -1915,10 +1916,63 @@ static int rmdir_cmd(int argc, char **argv, unsigned int *vRet)
 	return CMD_OK;
 }
 
+/* Get the drive number of a hostN: path and the path on the drive, -1 if it isn't one */
+static int host_drive(const char *path, const char **rel)
+{
+	if((strncmp(path, "host", 4) == 0) && (path[4] >= '0') && (path[4] <= '7') && (path[5] == ':'))
+	{
+		*rel = &path[6];
+		return path[4] - '0';
+	}
+
+	return -1;
+}
+
+/* Have usbhostfs_pc copy between two host paths, so the data never crosses USB */
+static int host_copy(const char *src, const char *dst, int recursive)
+{
+	char buf[sizeof(struct DevctlHostCopy) + (MAXPATHLEN * 2)];
+	struct DevctlHostCopy *req = (struct DevctlHostCopy *) buf;
+	struct DevctlHostCopyResult res;
+	const char *srel, *drel;
+	char dev[8];
+	int srcfs, dstfs;
+	int len;
+	int ret;
+
+	srcfs = host_drive(src, &srel);
+	dstfs = host_drive(dst, &drel);
+	if((srcfs < 0) || (dstfs < 0))
+	{
+		return -1;
+	}
+
+	req->srcfs = srcfs;
+	req->dstfs = dstfs;
+	req->flags = recursive ? HOSTCOPY_RECURSIVE : 0;
+	len = sizeof(struct DevctlHostCopy);
+	strcpy(&buf[len], srel);
+	len += strlen(srel) + 1;
+	strcpy(&buf[len], drel);
+	len += strlen(drel) + 1;
+
+	sprintf(dev, "host%d:", srcfs);
+	memset(&res, 0, sizeof(res));
+	ret = sceIoDevctl(dev, DEVCTL_HOST_COPY, buf, len, &res, sizeof(res));
+	if(ret == 0)
+	{
+		SHELL_PRINT("Copied %d file(s), %d KiB on the host\n", res.files, (unsigned int) (res.bytes >> 10));
+	}
+
+	return ret;
+}
+
 static int cp_cmd(int argc, char **argv, unsigned int *vRet)
 {
 	int in, out;
 	int n;
+	int ret;
+	int recursive = 0;
 	char *source;
 	char *destination;
 	char *slash;
@@ -1931,12 +1985,18 @@ static int cp_cmd(int argc, char **argv, unsigned int *vRet)
 	destination = argv[1];
 
 	if( !handlepath(g_context.currdir, source, fsrc, TYPE_FILE, 1) )
-		return CMD_ERROR;
+	{
+		/* A directory, only copied between host drives */
+		if( !handlepath(g_context.currdir, source, fsrc, TYPE_FILE, 0) || !isdir(fsrc) )
+			return CMD_ERROR;
+		recursive = 1;
+	}
 	
 	if( !handlepath(g_context.currdir, destination, fdst, TYPE_ETHER, 0) )
 		return CMD_ERROR;
 
-	if(isdir(fdst))
+	/* The host puts a directory inside an existing one itself */
+	if((!recursive) && (isdir(fdst)))
 	{
 		int len;
 
@@ -1952,6 +2012,19 @@ static int cp_cmd(int argc, char **argv, unsigned int *vRet)
 
 	SHELL_PRINT("cp %s -> %s\n", fsrc, fdst);
 
+	ret = host_copy(fsrc, fdst, recursive);
+	if(ret == 0)
+	{
+		return CMD_OK;
+	}
+
+	if(recursive)
+	{
+		SHELL_PRINT("Couldn't copy directory %s, 0x%08X\n", fsrc, ret);
+		return CMD_ERROR;
+	}
+
+	/* Not between host drives, or the host couldn't do it, copy it through here */
 	in = sceIoOpen(fsrc, PSP_O_RDONLY, 0777);
 	if(in < 0)
 	{
@@ -1983,6 +2056,721 @@ static int cp_cmd(int argc, char **argv, unsigned int *vRet)
 	return CMD_OK;
 }
 
+/* Size of the buffer a local file is hashed through */
+#define HOSTSUM_BUFSIZE (64*1024)
+
+struct HostSumArgs
+{
+	const char *path;
+	int type;
+	u64 len;
+	struct DevctlHostHashResult res;
+	int ret;
+};
+
+/* Have usbhostfs_pc hash a host file, so only the digest crosses USB */
+static int host_hash(const char *path, int type, u64 len, struct DevctlHostHashResult *res)
+{
+	char buf[sizeof(struct DevctlHostHash) + MAXPATHLEN];
+	struct DevctlHostHash *req = (struct DevctlHostHash *) buf;
+	const char *rel;
+	char dev[8];
+	int fs;
+
+	fs = host_drive(path, &rel);
+	if(fs < 0)
+	{
+		return -1;
+	}
+
+	memset(req, 0, sizeof(*req));
+	req->type = type;
+	req->len = len;
+	strcpy(&buf[sizeof(struct DevctlHostHash)], rel);
+
+	sprintf(dev, "host%d:", fs);
+	memset(res, 0, sizeof(*res));
+
+	return sceIoDevctl(dev, DEVCTL_HOST_HASH, buf, sizeof(struct DevctlHostHash) + strlen(rel) + 1, res, sizeof(*res));
+}
+
+static int hostsum_thread(SceSize args, void *argp)
+{
+	if(args == sizeof(struct HostSumArgs *))
+	{
+		struct HostSumArgs *h = *(struct HostSumArgs **) argp;
+
+		h->ret = host_hash(h->path, h->type, h->len, &h->res);
+	}
+
+	sceKernelExitDeleteThread(0);
+
+	return 0;
+}
+
+static int hash_file(const char *path, int type, u8 *digest, unsigned int *len)
+{
+	HashCtx ctx;
+	SceUID block_id;
+	void *buf;
+	int fd;
+	int ret;
+
+	*len = 0;
+	fd = sceIoOpen(path, PSP_O_RDONLY, 0777);
+	if(fd < 0)
+	{
+		return fd;
+	}
+
+	block_id = sceKernelAllocPartitionMemory(4, "hostsum", PSP_SMEM_Low, HOSTSUM_BUFSIZE, NULL);
+	if(block_id < 0)
+	{
+		sceIoClose(fd);
+		return block_id;
+	}
+	buf = sceKernelGetBlockHeadAddr(block_id);
+
+	hash_init(&ctx, type);
+	while((ret = sceIoRead(fd, buf, HOSTSUM_BUFSIZE)) > 0)
+	{
+		hash_update(&ctx, buf, ret);
+		*len += ret;
+	}
+
+	sceKernelFreePartitionMemory(block_id);
+	sceIoClose(fd);
+
+	if(ret < 0)
+	{
+		return ret;
+	}
+
+	return hash_final(&ctx, digest);
+}
+
+static void print_digest(const char *name, const u8 *digest, int digestlen, unsigned int len)
+{
+	int i;
+
+	SHELL_PRINT("%-6s ", name);
+	for(i = 0; i < digestlen; i++)
+	{
+		SHELL_PRINT("%02x", digest[i]);
+	}
+	SHELL_PRINT(" (%u bytes)\n", len);
+}
+
+static int hostsum_cmd(int argc, char **argv, unsigned int *vRet)
+{
+	struct HostSumArgs host;
+	struct HostSumArgs *phost = &host;
+	char hpath[MAXPATHLEN];
+	char lpath[MAXPATHLEN];
+	u8 digest[HOSTHASH_MAXDIGEST];
+	unsigned int addr = 0;
+	unsigned int size = 0;
+	const char *rel;
+	int digestlen = 0;
+	SceUID uid;
+	int type;
+
+	type = hash_type(argv[0]);
+	if(type < 0)
+	{
+		SHELL_PRINT("Unknown hash '%s', use crc32, sha1 or xxh32\n", argv[0]);
+		return CMD_ERROR;
+	}
+
+	if((!handlepath(g_context.currdir, argv[1], hpath, TYPE_FILE, 1)) || (host_drive(hpath, &rel) < 0))
+	{
+		SHELL_PRINT("Error invalid host file '%s'\n", argv[1]);
+		return CMD_ERROR;
+	}
+
+	if(argc == 3)
+	{
+		if(!handlepath(g_context.currdir, argv[2], lpath, TYPE_FILE, 1))
+		{
+			SHELL_PRINT("Error invalid path\n");
+			return CMD_ERROR;
+		}
+	}
+	else if(argc > 3)
+	{
+		char *endp;
+		int size_left;
+
+		if(!memDecode(argv[2], &addr))
+		{
+			return CMD_ERROR;
+		}
+
+		size = strtoul(argv[3], &endp, 0);
+		if(*endp != 0)
+		{
+			SHELL_PRINT("Size parameter invalid '%s'\n", argv[3]);
+			return CMD_ERROR;
+		}
+
+		size_left = memValidate(addr, MEM_ATTRIB_READ | MEM_ATTRIB_BYTE);
+		if(size_left <= 0)
+		{
+			SHELL_PRINT("Invalid memory address 0x%08X\n", addr);
+			return CMD_ERROR;
+		}
+		size = size > size_left ? size_left : size;
+	}
+
+	memset(&host, 0, sizeof(host));
+	host.path = hpath;
+	host.type = type;
+	/* Memory is checked against the start of the file */
+	host.len = size;
+
+	/* The host hashes its copy while the local one is hashed here */
+	uid = sceKernelCreateThread("HostSumThread", hostsum_thread, 0x18, 0x1000, 0, NULL);
+	if(uid < 0)
+	{
+		SHELL_PRINT("Could not create thread 0x%08X\n", uid);
+		return CMD_ERROR;
+	}
+	sceKernelStartThread(uid, sizeof(phost), &phost);
+
+	if(argc == 3)
+	{
+		digestlen = hash_file(lpath, type, digest, &size);
+	}
+	else if(argc > 3)
+	{
+		HashCtx ctx;
+
+		hash_init(&ctx, type);
+		hash_update(&ctx, (void *) addr, size);
+		digestlen = hash_final(&ctx, digest);
+	}
+
+	sceKernelWaitThreadEnd(uid, NULL);
+
+	if(host.ret < 0)
+	{
+		SHELL_PRINT("Host could not hash %s, 0x%08X\n", hpath, host.ret);
+		return CMD_ERROR;
+	}
+	print_digest("host", host.res.digest, host.res.digestlen, (unsigned int) host.res.len);
+
+	if(argc == 2)
+	{
+		return CMD_OK;
+	}
+
+	if(digestlen < 0)
+	{
+		SHELL_PRINT("Could not hash %s, 0x%08X\n", lpath, digestlen);
+		return CMD_ERROR;
+	}
+	print_digest("local", digest, digestlen, size);
+
+	if((size != host.res.len) || (digestlen != host.res.digestlen) || (memcmp(digest, host.res.digest, digestlen) != 0))
+	{
+		SHELL_PRINT("Mismatch\n");
+		return CMD_ERROR;
+	}
+
+	SHELL_PRINT("Match\n");
+
+	return CMD_OK;
+}
+
+/* Size of each of the buffers a sync works through */
+#define SYNC_BUFSIZE (64*1024)
+/* The new copy of a file is built under this name, then renamed over the old one */
+#define SYNC_SUFFIX ".~psync"
+
+enum SyncResult
+{
+	SYNC_OK = 0,
+	/* The host stopped answering, nothing more can be done */
+	SYNC_ERR_HOST = -1,
+	/* This file couldn't be written, others might be */
+	SYNC_ERR_LOCAL = -2,
+	/* The new copy didn't hash the same as the host's */
+	SYNC_ERR_VERIFY = -3,
+};
+
+struct SyncState
+{
+	char dev[8];
+	char *list;
+	char *io;
+	char *data;
+	int updated;
+	int unchanged;
+	int failed;
+	u64 sent;
+	u64 reused;
+};
+
+static int write_all(int fd, const void *data, int len)
+{
+	int done = 0;
+
+	while(done < len)
+	{
+		int ret = sceIoWrite(fd, (const char *) data + done, len - done);
+
+		if(ret <= 0)
+		{
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+static int sync_same_time(const ScePspDateTime *a, const ScePspDateTime *b)
+{
+	/* FAT keeps the seconds in steps of two */
+	return (a->year == b->year) && (a->month == b->month) && (a->day == b->day) && (a->hour == b->hour)
+		&& (a->minute == b->minute) && ((a->second / 2) == (b->second / 2));
+}
+
+/* Hash what a sync which was cut off wrote, returns 1 if it is the start of the host file */
+static int sync_resume(struct SyncState *s, const char *hostpath, const char *temp, SceOff len, HashCtx *whole)
+{
+	struct DevctlHostHashResult res;
+	HashCtx check;
+	u8 digest[HOSTHASH_MAXDIGEST];
+	SceOff done = 0;
+	int fd;
+	int ret;
+
+	fd = sceIoOpen(temp, PSP_O_RDONLY, 0777);
+	if(fd < 0)
+	{
+		return 0;
+	}
+
+	while((ret = sceIoRead(fd, s->data, SYNC_BUFSIZE)) > 0)
+	{
+		hash_update(whole, s->data, ret);
+		done += ret;
+	}
+	sceIoClose(fd);
+
+	if((done != len) || (host_hash(hostpath, HOSTHASH_SHA1, len, &res) < 0) || (res.len != len))
+	{
+		return 0;
+	}
+
+	memcpy(&check, whole, sizeof(check));
+	hash_final(&check, digest);
+
+	return memcmp(digest, res.digest, res.digestlen) == 0;
+}
+
+/* Send the checksums of each whole block of the old copy */
+static int sync_sigs(struct SyncState *s, u32 session, int basis, int blocksize, int nblocks)
+{
+	struct DevctlSyncSigs *req = (struct DevctlSyncSigs *) s->io;
+	struct SyncSig *sig = (struct SyncSig *) (s->io + sizeof(struct DevctlSyncSigs));
+	int maxsigs = (SYNC_BUFSIZE - sizeof(struct DevctlSyncSigs)) / sizeof(struct SyncSig);
+	int block = 0;
+
+	req->session = session;
+	req->first = 0;
+	req->count = 0;
+	while(block < nblocks)
+	{
+		int want = (nblocks - block) * blocksize;
+		int ofs;
+
+		want = want > SYNC_BUFSIZE ? SYNC_BUFSIZE : want;
+		if(sceIoRead(basis, s->data, want) != want)
+		{
+			return SYNC_ERR_LOCAL;
+		}
+
+		for(ofs = 0; ofs < want; ofs += blocksize)
+		{
+			sig[req->count].weak = hash_weak(s->data + ofs, blocksize);
+			sig[req->count].strong = hash_xxh32(s->data + ofs, blocksize);
+			req->count++;
+			block++;
+
+			if((req->count == maxsigs) || (block == nblocks))
+			{
+				if(sceIoDevctl(s->dev, DEVCTL_SYNC_SIGS, s->io, sizeof(struct DevctlSyncSigs) + (req->count * sizeof(struct SyncSig)), NULL, 0) < 0)
+				{
+					return SYNC_ERR_HOST;
+				}
+				req->first += req->count;
+				req->count = 0;
+			}
+		}
+	}
+
+	return SYNC_OK;
+}
+
+/* Write out the blocks of the old copy the host says are still good */
+static int sync_copy(struct SyncState *s, int basis, int out, SceOff ofs, u32 len, HashCtx *whole)
+{
+	if(sceIoLseek(basis, ofs, PSP_SEEK_SET) != ofs)
+	{
+		return SYNC_ERR_LOCAL;
+	}
+
+	while(len > 0)
+	{
+		int want = len > SYNC_BUFSIZE ? SYNC_BUFSIZE : len;
+
+		if((sceIoRead(basis, s->data, want) != want) || (write_all(out, s->data, want) < 0))
+		{
+			return SYNC_ERR_LOCAL;
+		}
+		hash_update(whole, s->data, want);
+		s->reused += want;
+		len -= want;
+	}
+
+	return SYNC_OK;
+}
+
+/* Apply the ops the host sends until the new copy is complete */
+static int sync_apply(struct SyncState *s, u32 session, int basis, int out, int blocksize, HashCtx *whole)
+{
+	struct DevctlSyncSession req;
+	struct DevctlSyncDeltaResult *res = (struct DevctlSyncDeltaResult *) s->io;
+	int ret = SYNC_OK;
+
+	req.session = session;
+	do
+	{
+		char *p = s->io + sizeof(struct DevctlSyncDeltaResult);
+		char *end;
+
+		if(sceIoDevctl(s->dev, DEVCTL_SYNC_DELTA, &req, sizeof(req), s->io, SYNC_BUFSIZE) < 0)
+		{
+			return SYNC_ERR_HOST;
+		}
+
+		end = p + res->len;
+		while((ret == SYNC_OK) && (p < end))
+		{
+			struct SyncOp *op = (struct SyncOp *) p;
+
+			p += sizeof(struct SyncOp);
+			if(op->type == SYNCOP_COPY)
+			{
+				ret = sync_copy(s, basis, out, (SceOff) op->block * blocksize, op->len * blocksize, whole);
+			}
+			else if((op->type == SYNCOP_DATA) && ((p + op->len) <= end))
+			{
+				if(write_all(out, p, op->len) < 0)
+				{
+					ret = SYNC_ERR_LOCAL;
+				}
+				hash_update(whole, p, op->len);
+				s->sent += op->len;
+				p += op->len;
+			}
+			else
+			{
+				ret = SYNC_ERR_HOST;
+			}
+		}
+	}
+	while((ret == SYNC_OK) && (!res->done));
+
+	return ret;
+}
+
+/* Bring one local file up to date with the host's copy */
+static int sync_file(struct SyncState *s, const char *hostpath, const char *local, const struct SyncListEntry *ent, int use_old)
+{
+	char buf[sizeof(struct DevctlSyncBegin) + MAXPATHLEN];
+	struct DevctlSyncBegin *req = (struct DevctlSyncBegin *) buf;
+	struct DevctlSyncBeginResult res;
+	struct DevctlHostHashResult host;
+	struct DevctlSyncSession end;
+	char temp[MAXPATHLEN];
+	u8 digest[HOSTHASH_MAXDIGEST];
+	HashCtx whole;
+	SceIoStat st;
+	SceOff start = 0;
+	int blocksize = SYNC_MINBLOCK;
+	int nblocks = 0;
+	int basis = -1;
+	int out;
+	int ret;
+	const char *rel;
+
+	if(strlen(local) + sizeof(SYNC_SUFFIX) > MAXPATHLEN)
+	{
+		return SYNC_ERR_LOCAL;
+	}
+	sprintf(temp, "%s%s", local, SYNC_SUFFIX);
+	hash_init(&whole, HOSTHASH_SHA1);
+
+	/* A sync which was cut off left the start of the new copy behind */
+	if((sceIoGetstat(temp, &st) == 0) && (st.st_size > 0) && (st.st_size <= ent->size))
+	{
+		if(sync_resume(s, hostpath, temp, st.st_size, &whole))
+		{
+			start = st.st_size;
+		}
+		else
+		{
+			hash_init(&whole, HOSTHASH_SHA1);
+		}
+	}
+
+	if(use_old)
+	{
+		basis = sceIoOpen(local, PSP_O_RDONLY, 0777);
+	}
+
+	if(basis >= 0)
+	{
+		SceOff size = sceIoLseek(basis, 0, PSP_SEEK_END);
+
+		while(((size / blocksize) > SYNC_MAXBLOCKS) && (blocksize < SYNC_BUFSIZE))
+		{
+			blocksize <<= 1;
+		}
+		nblocks = size / blocksize;
+		nblocks = nblocks > SYNC_MAXBLOCKS ? SYNC_MAXBLOCKS : nblocks;
+		sceIoLseek(basis, 0, PSP_SEEK_SET);
+	}
+
+	out = sceIoOpen(temp, PSP_O_WRONLY | PSP_O_CREAT | (start ? PSP_O_APPEND : PSP_O_TRUNC), 0777);
+	if(out < 0)
+	{
+		SHELL_PRINT("Could not open %s for writing 0x%08X\n", temp, out);
+		if(basis >= 0)
+		{
+			sceIoClose(basis);
+		}
+		return SYNC_ERR_LOCAL;
+	}
+
+	host_drive(hostpath, &rel);
+	memset(req, 0, sizeof(*req));
+	req->blocksize = blocksize;
+	req->nblocks = nblocks;
+	req->start = start;
+	strcpy(&buf[sizeof(struct DevctlSyncBegin)], rel);
+	memset(&res, 0, sizeof(res));
+	ret = SYNC_ERR_HOST;
+	if(sceIoDevctl(s->dev, DEVCTL_SYNC_BEGIN, buf, sizeof(struct DevctlSyncBegin) + strlen(rel) + 1, &res, sizeof(res)) == 0)
+	{
+		ret = sync_sigs(s, res.session, basis, blocksize, nblocks);
+		if(ret == SYNC_OK)
+		{
+			ret = sync_apply(s, res.session, basis, out, blocksize, &whole);
+		}
+
+		end.session = res.session;
+		sceIoDevctl(s->dev, DEVCTL_SYNC_END, &end, sizeof(end), NULL, 0);
+	}
+
+	sceIoClose(out);
+	if(basis >= 0)
+	{
+		sceIoClose(basis);
+	}
+
+	if(ret != SYNC_OK)
+	{
+		/* What was written is kept, the next sync carries on from it */
+		return ret;
+	}
+
+	hash_final(&whole, digest);
+	if(host_hash(hostpath, HOSTHASH_SHA1, res.size, &host) < 0)
+	{
+		return SYNC_ERR_HOST;
+	}
+
+	if((host.len != res.size) || (memcmp(digest, host.digest, host.digestlen) != 0))
+	{
+		sceIoRemove(temp);
+		return SYNC_ERR_VERIFY;
+	}
+
+	sceIoRemove(local);
+	if(sceIoRename(temp, local) < 0)
+	{
+		SHELL_PRINT("Could not rename %s to %s\n", temp, local);
+		return SYNC_ERR_LOCAL;
+	}
+
+	/* So the next sync can tell the file is up to date without reading it */
+	if(sceIoGetstat(local, &st) == 0)
+	{
+		memcpy(&st.st_mtime, ent->mtime, sizeof(st.st_mtime));
+		sceIoChstat(local, &st, FIO_CST_MT);
+	}
+
+	return SYNC_OK;
+}
+
+static int sync_entry(struct SyncState *s, const char *hostdir, const char *localdir, const struct SyncListEntry *ent, const char *name)
+{
+	char hostpath[MAXPATHLEN];
+	char local[MAXPATHLEN];
+	ScePspDateTime mtime;
+	SceIoStat st;
+	int ret;
+
+	if((strlen(hostdir) + strlen(name) >= MAXPATHLEN) || (strlen(localdir) + strlen(name) >= MAXPATHLEN))
+	{
+		SHELL_PRINT("Path too long for %s\n", name);
+		s->failed++;
+		return SYNC_ERR_LOCAL;
+	}
+	sprintf(hostpath, "%s%s", hostdir, name);
+	sprintf(local, "%s%s", localdir, name);
+
+	if(ent->isdir)
+	{
+		if((!isdir(local)) && (sceIoMkdir(local, 0777) < 0))
+		{
+			SHELL_PRINT("Could not make directory %s\n", local);
+			s->failed++;
+			return SYNC_ERR_LOCAL;
+		}
+		return SYNC_OK;
+	}
+
+	/* Same size and time as the host's, it was synced before */
+	memcpy(&mtime, ent->mtime, sizeof(mtime));
+	if((sceIoGetstat(local, &st) == 0) && (st.st_size == ent->size) && (sync_same_time(&st.st_mtime, &mtime)))
+	{
+		s->unchanged++;
+		return SYNC_OK;
+	}
+
+	SHELL_PRINT("sync %s\n", local);
+	ret = sync_file(s, hostpath, local, ent, 1);
+	if(ret == SYNC_ERR_VERIFY)
+	{
+		/* Two blocks hashed alike, try again without the old copy */
+		ret = sync_file(s, hostpath, local, ent, 0);
+	}
+
+	if(ret == SYNC_OK)
+	{
+		s->updated++;
+	}
+	else if(ret != SYNC_ERR_HOST)
+	{
+		SHELL_PRINT("Could not sync %s\n", local);
+		s->failed++;
+	}
+
+	return ret;
+}
+
+static int sync_cmd(int argc, char **argv, unsigned int *vRet)
+{
+	char buf[sizeof(struct DevctlSyncList) + MAXPATHLEN];
+	struct DevctlSyncList *req = (struct DevctlSyncList *) buf;
+	struct DevctlSyncListResult *res;
+	struct SyncState s;
+	char hostdir[MAXPATHLEN];
+	char localdir[MAXPATHLEN];
+	const char *rel;
+	SceUID block_id;
+	u32 start = 0;
+	int ret = SYNC_OK;
+	int fs;
+
+	if(!handlepath(g_context.currdir, argv[0], hostdir, TYPE_DIR, 1) || ((fs = host_drive(hostdir, &rel)) < 0))
+	{
+		SHELL_PRINT("Error invalid host directory '%s'\n", argv[0]);
+		return CMD_ERROR;
+	}
+
+	if(!handlepath(g_context.currdir, argv[1], localdir, TYPE_DIR, 0) || (host_drive(localdir, &rel) >= 0))
+	{
+		SHELL_PRINT("Error invalid local directory '%s'\n", argv[1]);
+		return CMD_ERROR;
+	}
+
+	if(!isdir(localdir))
+	{
+		char dir[MAXPATHLEN];
+
+		strcpy(dir, localdir);
+		dir[strlen(dir) - 1] = 0;
+		if(sceIoMkdir(dir, 0777) < 0)
+		{
+			SHELL_PRINT("Could not make directory %s\n", dir);
+			return CMD_ERROR;
+		}
+	}
+
+	block_id = sceKernelAllocPartitionMemory(4, "sync", PSP_SMEM_Low, SYNC_BUFSIZE * 3, NULL);
+	if(block_id < 0)
+	{
+		SHELL_PRINT("Error could not allocate memory buffer 0x%08X\n", block_id);
+		return CMD_ERROR;
+	}
+
+	memset(&s, 0, sizeof(s));
+	sprintf(s.dev, "host%d:", fs);
+	s.list = (char *) sceKernelGetBlockHeadAddr(block_id);
+	s.io = s.list + SYNC_BUFSIZE;
+	s.data = s.io + SYNC_BUFSIZE;
+	res = (struct DevctlSyncListResult *) s.list;
+
+	host_drive(hostdir, &rel);
+	strcpy(&buf[sizeof(struct DevctlSyncList)], rel);
+	SHELL_PRINT("sync %s -> %s\n", hostdir, localdir);
+
+	/* The host walks the whole tree, and hands it over a page at a time */
+	do
+	{
+		char *p = s.list + sizeof(struct DevctlSyncListResult);
+		u32 i;
+
+		req->start = start;
+		if(sceIoDevctl(s.dev, DEVCTL_SYNC_LIST, buf, sizeof(struct DevctlSyncList) + strlen(rel) + 1, s.list, SYNC_BUFSIZE) < 0)
+		{
+			ret = SYNC_ERR_HOST;
+			break;
+		}
+
+		for(i = 0; (i < res->count) && (ret != SYNC_ERR_HOST); i++)
+		{
+			struct SyncListEntry *ent = (struct SyncListEntry *) p;
+
+			p += sizeof(struct SyncListEntry);
+			ret = sync_entry(&s, hostdir, localdir, ent, p);
+			p += ent->namelen;
+		}
+
+		start += res->count;
+	}
+	while((ret != SYNC_ERR_HOST) && (res->count > 0) && (start < res->total));
+
+	sceKernelFreePartitionMemory(block_id);
+
+	SHELL_PRINT("%d file(s) updated, %d unchanged, %d failed, %d KiB sent, %d KiB reused\n", s.updated, s.unchanged, s.failed,
+			(unsigned int) (s.sent >> 10), (unsigned int) (s.reused >> 10));
+
+	if(ret == SYNC_ERR_HOST)
+	{
+		SHELL_PRINT("Lost the host, run sync again to carry on from here\n");
+		return CMD_ERROR;
+	}
+
+	return s.failed ? CMD_ERROR : CMD_OK;
+}
+
 static int remap_cmd(int argc, char **argv, unsigned int *vRet)
 {
 	int ret;
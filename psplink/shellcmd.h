@@ -207,7 +207,14 @@ struct sh_command
 	SHELL_CAT("fileio", "Commands to handle file io") \
 	SHELL_CMD("ls",  "dir", ls_cmd,    0, "List the files in a directory", "", "[path1..pathN]") \
 	SHELL_CMD("chdir", "cd", chdir_cmd, 1, "Change the current directory", "", "path") \
-	SHELL_CMD("cp",  "copy", cp_cmd, 2, "Copy a file", "", "source destination") \
+	SHELL_CMD("cp",  "copy", cp_cmd, 2, "Copy a file, or a directory between host drives", "", "source destination") \
+	SHELL_CMD("hostsum", "hsum", hostsum_cmd, 2, "Hash a host file on the host, and compare it with a local file or memory", \
+			"The host and the PSP each hash their own copy at the same time, only the digest crosses USB. " \
+			"Memory is compared with as many bytes from the start of the host file.", \
+			"crc32|sha1|xxh32 hostfile [file | addr size]") \
+	SHELL_CMD("sync", NULL, sync_cmd, 2, "Bring a local directory up to date with a host one, sending only what changed", \
+			"Files with the same size and time as on the host are skipped. A sync which is cut off carries on from where it got to when run again.", \
+			"hostdir localdir") \
 	SHELL_CMD("mkdir", NULL, mkdir_cmd, 1, "Make a Directory", "", "dir") \
 	SHELL_CMD("rm", "del", rm_cmd, 1, "Removes a File", "", "file") \
 	SHELL_CMD("rmdir", "rd", rmdir_cmd, 1, "Removes a Directory", "", "dir") \
@@ -10,12 +10,291 @@
  */
 #include <pspkernel.h>
 #include <pspdebug.h>
+#include <pspsdk.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include "usbhostfs.h"
 
+/* Number of open directories which can have entries buffered, any others
+ * fall back to fetching one entry at a time */
+#define MAX_DIRBUFS 8
+
+/* Directory entries fetched in bulk, served to sceIoDread until used up */
+struct DirBuf
+{
+	char data[HOSTFS_MAX_BLOCK] __attribute__((aligned(64)));
+	SceUID uid;
+	int did;
+	int len;
+	int pos;
+	int eof;
+};
+
+static struct DirBuf *g_dirbufs[MAX_DIRBUFS];
+
+/* Number of small files which can be held whole after a READFILE */
+#define MAX_FILEBUFS 16
+/* Freed file buffers kept for the next open, most READFILEs free theirs */
+#define SPARE_FILEBUFS 2
+/* Largest file read whole at open */
+#define READFILE_MAX (8*1024)
+/* Held files get a fid with the top bit set, the host never gives those out */
+#define LOCAL_FID    0x80000000
+#define IS_LOCAL(fid) (((unsigned int) (fid)) & LOCAL_FID)
+
+/* Error codes for operations on held files, same as the host would return */
+#define LOCAL_EBADF  0x80010009
+#define LOCAL_EINVAL 0x80010016
+
+/* A small file read whole, reads and seeks are served from here */
+struct FileBuf
+{
+	char data[READFILE_MAX] __attribute__((aligned(64)));
+	SceUID uid;
+	int size;
+	int pos;
+};
+
+static struct FileBuf *g_filebufs[MAX_FILEBUFS];
+static struct FileBuf *g_sparebufs[SPARE_FILEBUFS];
+
+static void alloc_dirbuf(int did)
+{
+	struct DirBuf *db;
+	SceUID uid;
+	int intc;
+	int i;
+
+	uid = sceKernelAllocPartitionMemory(1, "HostFsDir", PSP_SMEM_Low, sizeof(struct DirBuf), NULL);
+	if(uid < 0)
+	{
+		MODPRINTF("Could not allocate directory buffer %08X\n", uid);
+		return;
+	}
+
+	db = (struct DirBuf *) sceKernelGetBlockHeadAddr(uid);
+	db->uid = uid;
+	db->did = did;
+	db->len = 0;
+	db->pos = 0;
+	db->eof = 0;
+
+	intc = pspSdkDisableInterrupts();
+	for(i = 0; i < MAX_DIRBUFS; i++)
+	{
+		if(g_dirbufs[i] == NULL)
+		{
+			g_dirbufs[i] = db;
+			db = NULL;
+			break;
+		}
+	}
+	pspSdkEnableInterrupts(intc);
+
+	if(db)
+	{
+		(void) sceKernelFreePartitionMemory(uid);
+	}
+}
+
+static struct DirBuf *find_dirbuf(int did)
+{
+	int i;
+
+	for(i = 0; i < MAX_DIRBUFS; i++)
+	{
+		if((g_dirbufs[i]) && (g_dirbufs[i]->did == did))
+		{
+			return g_dirbufs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void free_dirbuf(int did)
+{
+	struct DirBuf *db = NULL;
+	int intc;
+	int i;
+
+	intc = pspSdkDisableInterrupts();
+	for(i = 0; i < MAX_DIRBUFS; i++)
+	{
+		if((g_dirbufs[i]) && (g_dirbufs[i]->did == did))
+		{
+			db = g_dirbufs[i];
+			g_dirbufs[i] = NULL;
+			break;
+		}
+	}
+	pspSdkEnableInterrupts(intc);
+
+	if(db)
+	{
+		(void) sceKernelFreePartitionMemory(db->uid);
+	}
+}
+
+/* Get a free file buffer, returns its index or < 0 if none */
+static int alloc_filebuf(void)
+{
+	struct FileBuf *fb = NULL;
+	SceUID uid;
+	int intc;
+	int i;
+
+	intc = pspSdkDisableInterrupts();
+	for(i = 0; i < SPARE_FILEBUFS; i++)
+	{
+		if(g_sparebufs[i])
+		{
+			fb = g_sparebufs[i];
+			g_sparebufs[i] = NULL;
+			break;
+		}
+	}
+	pspSdkEnableInterrupts(intc);
+
+	if(fb == NULL)
+	{
+		uid = sceKernelAllocPartitionMemory(1, "HostFsFile", PSP_SMEM_Low, sizeof(struct FileBuf), NULL);
+		if(uid < 0)
+		{
+			MODPRINTF("Could not allocate file buffer %08X\n", uid);
+			return -1;
+		}
+
+		fb = (struct FileBuf *) sceKernelGetBlockHeadAddr(uid);
+		fb->uid = uid;
+	}
+	uid = fb->uid;
+	fb->size = 0;
+	fb->pos = 0;
+
+	intc = pspSdkDisableInterrupts();
+	for(i = 0; i < MAX_FILEBUFS; i++)
+	{
+		if(g_filebufs[i] == NULL)
+		{
+			g_filebufs[i] = fb;
+			break;
+		}
+	}
+	pspSdkEnableInterrupts(intc);
+
+	if(i == MAX_FILEBUFS)
+	{
+		(void) sceKernelFreePartitionMemory(uid);
+		return -1;
+	}
+
+	return i;
+}
+
+static struct FileBuf *find_filebuf(int fid)
+{
+	int i = fid & ~LOCAL_FID;
+
+	if((i >= 0) && (i < MAX_FILEBUFS))
+	{
+		return g_filebufs[i];
+	}
+
+	return NULL;
+}
+
+static void free_filebuf(int i)
+{
+	struct FileBuf *fb;
+	int intc;
+
+	intc = pspSdkDisableInterrupts();
+	fb = g_filebufs[i];
+	g_filebufs[i] = NULL;
+	for(i = 0; (fb) && (i < SPARE_FILEBUFS); i++)
+	{
+		if(g_sparebufs[i] == NULL)
+		{
+			g_sparebufs[i] = fb;
+			fb = NULL;
+		}
+	}
+	pspSdkEnableInterrupts(intc);
+
+	if(fb)
+	{
+		(void) sceKernelFreePartitionMemory(fb->uid);
+	}
+}
+
+/* Open a file with READFILE, small files are read whole and never touch the
+ * host again. Returns 1 if it couldn't be tried, so a normal open is needed */
+static int open_readfile(PspIoDrvFileArg *arg, char *file, int mode, SceMode mask)
+{
+	int ret = -1;
+	struct HostFsReadFileCmd cmd;
+	struct HostFsReadFileResp resp;
+	struct FileBuf *fb;
+	int i;
+
+	i = alloc_filebuf();
+	if(i < 0)
+	{
+		return 1;
+	}
+	fb = g_filebufs[i];
+
+	memset(&cmd, 0, sizeof(cmd));
+	memset(&resp, 0, sizeof(resp));
+	cmd.cmd.magic = HOSTFS_MAGIC;
+	cmd.cmd.command = HOSTFS_CMD_READFILE;
+	cmd.cmd.extralen = strlen(file)+1;
+	cmd.mode = mode;
+	cmd.mask = mask;
+	cmd.fsnum = arg->fs_num;
+	cmd.maxlen = sizeof(fb->data);
+
+	if(command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), file, strlen(file)+1, fb->data, sizeof(fb->data)))
+	{
+		DEBUG_PRINTF("Readfile returned res %d, flags %d, size %d\n", resp.res, resp.flags, (int) resp.size);
+		if((resp.res >= 0) && (resp.flags & HOSTFS_READFILE_WHOLE))
+		{
+			if(resp.cmd.extralen > sizeof(fb->data))
+			{
+				MODPRINTF("Readfile returned too much data %d\n", resp.cmd.extralen);
+				free_filebuf(i);
+				return -1;
+			}
+
+			fb->size = resp.cmd.extralen;
+			fb->pos = 0;
+			arg->arg = (void *) (LOCAL_FID | i);
+			return 0;
+		}
+
+		if(resp.res >= 0)
+		{
+			arg->arg = (void *) (resp.res);
+			ret = 0;
+		}
+		else
+		{
+			ret = resp.res;
+		}
+	}
+	else
+	{
+		MODPRINTF("Error in sending readfile command\n");
+	}
+
+	free_filebuf(i);
+
+	return ret;
+}
+
 static int io_init(PspIoDrvArg *arg)
 {
 	/* Nothing to do */
@@ -40,6 +319,18 @@ static int io_open(PspIoDrvFileArg *arg, char *file, int mode, SceMode mask)
 		return -1;
 	}
 
+	/* Files only being read might be small enough to fetch in one go */
+	if((usb_connected()) && (usb_host_caps() & HOSTFS_CAP_READFILE) && (mode & PSP_O_RDONLY)
+		&& ((mode & (PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC | PSP_O_APPEND)) == 0))
+	{
+		ret = open_readfile(arg, file, mode, mask);
+		if(ret <= 0)
+		{
+			return ret;
+		}
+		ret = -1;
+	}
+
 	memset(&cmd, 0, sizeof(cmd));
 	memset(&resp, 0, sizeof(resp));
 	cmd.cmd.magic = HOSTFS_MAGIC;
@@ -92,6 +383,18 @@ static int io_close(PspIoDrvFileArg *arg)
 	cmd.cmd.extralen = 0;
 	cmd.fid = (int) (arg->arg);
 
+	/* The host closed held files when it sent them */
+	if(IS_LOCAL(cmd.fid))
+	{
+		if(find_filebuf(cmd.fid) == NULL)
+		{
+			return LOCAL_EBADF;
+		}
+
+		free_filebuf(cmd.fid & ~LOCAL_FID);
+		return 0;
+	}
+
 	if(usb_connected())
 	{
 		if(command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), NULL, 0, NULL, 0))
@@ -112,10 +415,79 @@ static int io_close(PspIoDrvFileArg *arg)
 	return ret;
 }
 
+/* Read in requests of up to HOSTFS_STREAM_MAX, the host sends each one back
+ * to back instead of waiting for a command per block */
+static int usb_read_stream(int fd, void *data, int len)
+{
+	struct HostFsReadStreamCmd cmd;
+	struct HostFsReadStreamResp resp;
+	struct HostFsReadStreamEnd end;
+	int size;
+	int ret = 0;
+
+	while(len > 0)
+	{
+		size = len > usb_max_stream() ? usb_max_stream() : len;
+
+		memset(&cmd, 0, sizeof(cmd));
+		memset(&resp, 0, sizeof(resp));
+		memset(&end, 0, sizeof(end));
+		cmd.cmd.magic = HOSTFS_MAGIC;
+		cmd.cmd.command = HOSTFS_CMD_READSTREAM;
+		cmd.cmd.extralen = 0;
+		cmd.len = size;
+		cmd.fid = fd;
+
+		if(!usb_connected())
+		{
+			MODPRINTF("%s: Error PC side not connected\n", __FUNCTION__);
+			ret = -1;
+			break;
+		}
+
+		if(!command_stream(&cmd, sizeof(cmd), &resp, sizeof(resp), data, size, &end, sizeof(end)))
+		{
+			MODPRINTF("Error in sending readstream command\n");
+			ret = -1;
+			break;
+		}
+
+		DEBUG_PRINTF("Readstream: Returned result %d, end %d\n", resp.res, end.res);
+		/* The file shrank after the host promised res bytes, the rest is padding */
+		if((resp.res > 0) && (end.res < resp.res))
+		{
+			resp.res = end.res;
+		}
+
+		if(resp.res <= 0)
+		{
+			/* If we had an error straight away */
+			if((resp.res < 0) && (ret == 0))
+			{
+				ret = resp.res;
+			}
+			break;
+		}
+
+		data += resp.res;
+		ret += resp.res;
+		len -= resp.res;
+
+		/* Reached the end of the file */
+		if(resp.res < size)
+		{
+			break;
+		}
+	}
+
+	return ret;
+}
+
 int usb_read_data(int fd, void *data, int len)
 {
 	struct HostFsReadCmd cmd;
 	struct HostFsReadResp resp;
+	int maxblock = usb_max_block();
 	int blocks;
 	int residual;
 	int ret = 0;
@@ -137,8 +509,13 @@ int usb_read_data(int fd, void *data, int len)
 		return -1;
 	}
 
-	blocks = len / HOSTFS_MAX_BLOCK;
-	residual = len % HOSTFS_MAX_BLOCK;
+	if((len > maxblock) && (usb_host_caps() & HOSTFS_CAP_READSTREAM) && (usb_max_stream() > 0))
+	{
+		return usb_read_stream(fd, data, len);
+	}
+
+	blocks = len / maxblock;
+	residual = len % maxblock;
 
 	while(blocks > 0)
 	{
@@ -147,12 +524,12 @@ int usb_read_data(int fd, void *data, int len)
 		cmd.cmd.magic = HOSTFS_MAGIC;
 		cmd.cmd.command = HOSTFS_CMD_READ;
 		cmd.cmd.extralen = 0;
-		cmd.len = HOSTFS_MAX_BLOCK;
+		cmd.len = maxblock;
 		cmd.fid = fd;
 
 		if(usb_connected())
 		{
-			if(command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), NULL, 0, data, HOSTFS_MAX_BLOCK))
+			if(command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), NULL, 0, data, maxblock))
 			{
 				DEBUG_PRINTF("Read: Returned result %d\n", resp.res);
 				if(resp.res > 0)
@@ -247,6 +624,26 @@ static int io_read(PspIoDrvFileArg *arg, char *data, int len)
 {
 	DEBUG_PRINTF("read: arg %p, data %p, len %d\n", arg, data, len);
 
+	if(IS_LOCAL(arg->arg))
+	{
+		struct FileBuf *fb = find_filebuf((int) arg->arg);
+
+		if((fb == NULL) || (len < 0))
+		{
+			return LOCAL_EBADF;
+		}
+
+		if(len > (fb->size - fb->pos))
+		{
+			len = fb->pos < fb->size ? fb->size - fb->pos : 0;
+		}
+
+		memcpy(data, &fb->data[fb->pos], len);
+		fb->pos += len;
+
+		return len;
+	}
+
 	return usb_read_data((int) arg->arg, data, len);
 }
 
@@ -254,6 +651,7 @@ int usb_write_data(int fd, const void *data, int len)
 {
 	struct HostFsWriteCmd cmd;
 	struct HostFsWriteResp resp;
+	int maxblock = usb_max_block();
 	int blocks;
 	int residual;
 	int ret = 0;
@@ -276,8 +674,8 @@ int usb_write_data(int fd, const void *data, int len)
 	}
 
 
-	blocks = len / HOSTFS_MAX_BLOCK;
-	residual = len % HOSTFS_MAX_BLOCK;
+	blocks = len / maxblock;
+	residual = len % maxblock;
 
 	while(blocks > 0)
 	{
@@ -285,12 +683,12 @@ int usb_write_data(int fd, const void *data, int len)
 		memset(&resp, 0, sizeof(resp));
 		cmd.cmd.magic = HOSTFS_MAGIC;
 		cmd.cmd.command = HOSTFS_CMD_WRITE;
-		cmd.cmd.extralen = HOSTFS_MAX_BLOCK;
+		cmd.cmd.extralen = maxblock;
 		cmd.fid = fd;
 
 		if(usb_connected())
 		{
-			if(command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), data, HOSTFS_MAX_BLOCK, NULL, 0))
+			if(command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), data, maxblock, NULL, 0))
 			{
 				DEBUG_PRINTF("Write: Returned result %d\n", resp.res);
 				if(resp.res > 0)
@@ -384,6 +782,12 @@ static int io_write(PspIoDrvFileArg *arg, const char *data, int len)
 {
 	DEBUG_PRINTF("write: arg %p, data %p, len %d\n", arg, data, len);
 
+	/* Held files were only ever opened for reading */
+	if(IS_LOCAL(arg->arg))
+	{
+		return LOCAL_EBADF;
+	}
+
 	return usb_write_data((int) arg->arg, data, len);
 }
 
@@ -395,6 +799,35 @@ static SceOff io_lseek(PspIoDrvFileArg *arg, SceOff ofs, int whence)
 
 	DEBUG_PRINTF("lseek: ofs %d, whence %d\n", (int) ofs, whence);
 
+	if(IS_LOCAL(arg->arg))
+	{
+		struct FileBuf *fb = find_filebuf((int) arg->arg);
+
+		if(fb == NULL)
+		{
+			return LOCAL_EBADF;
+		}
+
+		switch(whence)
+		{
+			case PSP_SEEK_SET: break;
+			case PSP_SEEK_CUR: ofs += fb->pos;
+							   break;
+			case PSP_SEEK_END: ofs += fb->size;
+							   break;
+			default: return LOCAL_EINVAL;
+		};
+
+		/* Anything past the end reads as the end of the file */
+		if((ofs < 0) || (ofs > 0x7FFFFFFF))
+		{
+			return LOCAL_EINVAL;
+		}
+		fb->pos = (int) ofs;
+
+		return ofs;
+	}
+
 	memset(&cmd, 0, sizeof(cmd));
 	memset(&resp, 0, sizeof(resp));
 	cmd.cmd.magic = HOSTFS_MAGIC;
@@ -454,6 +887,12 @@ static int io_ioctl(PspIoDrvFileArg *arg, unsigned int cmdno, void *indata, int
 	cmd.fid = (int) (arg->arg);
 	cmd.outlen = outlen;
 
+	if(IS_LOCAL(cmd.fid))
+	{
+		MODPRINTF("ioctl %08X not supported on a held file\n", cmdno);
+		return -1;
+	}
+
 	if(usb_connected())
 	{
 		if(command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), indata, inlen, outdata, outlen))
@@ -620,6 +1059,10 @@ static int io_dopen(PspIoDrvFileArg *arg, const char *dir)
 			{
 				arg->arg = (void *) (resp.res);
 				ret = 0;
+				if(usb_host_caps() & HOSTFS_CAP_DREADBULK)
+				{
+					alloc_dirbuf(resp.res);
+				}
 			}
 			else
 			{
@@ -654,6 +1097,8 @@ static int io_dclose(PspIoDrvFileArg *arg)
 	cmd.cmd.extralen = 0;
 	cmd.did = (int) (arg->arg);
 
+	free_dirbuf(cmd.did);
+
 	if(usb_connected())
 	{
 		if(command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), NULL, 0, NULL, 0))
@@ -674,11 +1119,104 @@ static int io_dclose(PspIoDrvFileArg *arg)
 	return ret;
 }
 
+/* Fill the buffer of a directory with the next batch of entries */
+static int fill_dirbuf(struct DirBuf *db)
+{
+	int ret = -1;
+	struct HostFsDreadBulkCmd cmd;
+	struct HostFsDreadBulkResp resp;
+
+	memset(&cmd, 0, sizeof(cmd));
+	memset(&resp, 0, sizeof(resp));
+	cmd.cmd.magic = HOSTFS_MAGIC;
+	cmd.cmd.command = HOSTFS_CMD_DREADBULK;
+	cmd.cmd.extralen = 0;
+	cmd.did = db->did;
+	cmd.maxlen = sizeof(db->data);
+
+	if(usb_connected())
+	{
+		if(command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), NULL, 0, db->data, sizeof(db->data)))
+		{
+			DEBUG_PRINTF("Dreadbulk: Returned result %d, %d bytes\n", resp.res, resp.cmd.extralen);
+			ret = resp.res;
+			db->pos = 0;
+			db->len = 0;
+			if(ret > 0)
+			{
+				db->len = resp.cmd.extralen;
+			}
+			else if(ret == 0)
+			{
+				db->eof = 1;
+			}
+		}
+		else
+		{
+			MODPRINTF("Error in sending dreadbulk command\n");
+		}
+	}
+	else
+	{
+		MODPRINTF("%s: Error PC side not connected\n", __FUNCTION__);
+	}
+
+	return ret;
+}
+
+/* Serve a dread from the buffer, refilling it when it runs out */
+static int dread_buffered(struct DirBuf *db, SceIoDirent *dir)
+{
+	struct HostFsDirent *ent;
+	int ret;
+	int namelen;
+
+	if(db->pos >= db->len)
+	{
+		if(db->eof)
+		{
+			return 0;
+		}
+
+		ret = fill_dirbuf(db);
+		if(ret <= 0)
+		{
+			return ret;
+		}
+	}
+
+	ent = (struct HostFsDirent *) &db->data[db->pos];
+	if((ent->reclen < (sizeof(*ent) + sizeof(SceIoStat) + 1)) || ((db->pos + ent->reclen) > db->len))
+	{
+		MODPRINTF("Invalid directory entry at %d\n", db->pos);
+		db->pos = db->len;
+		return -1;
+	}
+
+	namelen = ent->namelen;
+	if(namelen > (ent->reclen - sizeof(*ent) - sizeof(SceIoStat) - 1))
+	{
+		namelen = ent->reclen - sizeof(*ent) - sizeof(SceIoStat) - 1;
+	}
+	if(namelen > (sizeof(dir->d_name) - 1))
+	{
+		namelen = sizeof(dir->d_name) - 1;
+	}
+
+	memcpy(&dir->d_stat, (char *) ent + sizeof(*ent), sizeof(SceIoStat));
+	memset(dir->d_name, 0, sizeof(dir->d_name));
+	memcpy(dir->d_name, (char *) ent + sizeof(*ent) + sizeof(SceIoStat), namelen);
+	db->pos += ent->reclen;
+
+	return 1;
+}
+
 static int io_dread(PspIoDrvFileArg *arg, SceIoDirent *dir)
 {
 	int ret = -1;
 	struct HostFsDreadCmd cmd;
 	struct HostFsDreadResp resp;
+	struct DirBuf *db;
 
 	if(dir == NULL)
 	{
@@ -686,6 +1224,12 @@ static int io_dread(PspIoDrvFileArg *arg, SceIoDirent *dir)
 		return -1;
 	}
 
+	db = find_dirbuf((int) (arg->arg));
+	if(db)
+	{
+		return dread_buffered(db, dir);
+	}
+
 	memset(&cmd, 0, sizeof(cmd));
 	memset(&resp, 0, sizeof(resp));
 	cmd.cmd.magic = HOSTFS_MAGIC;
@@ -14,6 +14,7 @@
 #include <pspsdk.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <pspusb.h>
 #include <pspusbbus.h>
@@ -51,6 +52,10 @@ static SceUID g_transevent = -1;
 static SceUID g_asyncevent = -1;
 /* Main USB semaphore */
 static SceUID g_mainsema   = -1;
+/* Counts the free tag slots */
+static SceUID g_tagsema    = -1;
+/* Held by the thread reading replies while tags are in use */
+static SceUID g_recvsema   = -1;
 /* Static bulkin request structure */
 static struct UsbdDeviceReq g_bulkin_req;
 /* Static bulkout request structure */
@@ -59,6 +64,28 @@ static struct UsbdDeviceReq g_bulkout_req;
 static struct UsbdDeviceReq g_async_req;
 /* Indicates we have a connection to the PC */
 static int g_connected = 0;
+/* What was agreed with the host in the HELLO */
+static struct HostFsCaps g_caps;
+/* Number of tags in use, 0 when commands go one at a time */
+static int g_ntags = 0;
+/* Tag semaphore units held back when the host agreed to fewer tags */
+static int g_tagsheld = 0;
+
+/* A command waiting for its tagged reply */
+struct TagSlot
+{
+	int busy;
+	int done;
+	int ok;
+	/* Its thread gave up waiting, the tag is not reused until the reply is read */
+	int orphaned;
+	void *incmd;
+	int incmdlen;
+	void *indata;
+	int inlen;
+};
+
+static struct TagSlot g_tags[HOSTFS_MAX_TAGS];
 /* Buffers for async data */
 static struct AsyncEndpoint *g_async_chan[MAX_ASYNC_CHANNELS];
 
@@ -346,19 +373,78 @@ int set_bulkout_req(void *data, int size)
 
 /* Read/Write buffer */
 unsigned char tx_buf[64*1024] __attribute__((aligned(64)));
+/* Tagged replies are read into this while another thread writes with tx_buf */
+unsigned char rx_buf[16*1024] __attribute__((aligned(64)));
+
+/* Read a block of data through a bounce buffer, NULL data throws it away */
+int read_data_buf(void *data, int size, unsigned char *buf, int bufsize)
+{
+	int nextsize = 0;
+	int readlen = 0;
+	int ret;
+	u32 result;
+
+	while(readlen < size)
+	{
+		nextsize = (size - readlen) > bufsize ? bufsize : (size - readlen);
+		if(set_bulkout_req(buf, nextsize) < 0)
+		{
+			return -1;
+		}
+
+		ret = sceKernelWaitEventFlag(g_transevent, USB_TRANSEVENT_BULKOUT_DONE, PSP_EVENT_WAITOR | PSP_EVENT_WAITCLEAR, &result, NULL);
+		if(ret == 0)
+		{
+			if((g_bulkout_req.retcode == 0) && (g_bulkout_req.recvsize > 0))
+			{
+				readlen += g_bulkout_req.recvsize;
+				if(data)
+				{
+					memcpy(data, buf, g_bulkout_req.recvsize);
+					data += g_bulkout_req.recvsize;
+				}
+			}
+			else
+			{
+				DEBUG_PRINTF("Error in BULKOUT request %d, %d\n", g_bulkout_req.retcode, g_bulkout_req.recvsize);
+				return -1;
+			}
+		}
+		else
+		{
+			MODPRINTF("Error waiting for BULKOUT %08X\n", ret);
+			return -1;
+		}
+	}
+
+	return readlen;
+}
 
 /* Read a block of data from the USB bus */
 int read_data(void *data, int size)
+{
+	return read_data_buf(data, size, tx_buf, sizeof(tx_buf));
+}
+
+/* Read straight into the caller's buffer, it must be 64 byte aligned and the
+ * size a whole number of high speed packets so no cache line is shared */
+int read_data_direct(void *data, int size)
 {
 	int nextsize = 0;
 	int readlen = 0;
 	int ret;
 	u32 result;
 
+	if(((u32) data & 63) || (size & 511))
+	{
+		return -1;
+	}
+
 	while(readlen < size)
 	{
+		/* Same request size as the bounce buffer, which is known to work */
 		nextsize = (size - readlen) > sizeof(tx_buf) ? sizeof(tx_buf) : (size - readlen);
-		if(set_bulkout_req(tx_buf, nextsize) < 0)
+		if(set_bulkout_req(data, nextsize) < 0)
 		{
 			return -1;
 		}
@@ -369,7 +455,6 @@ int read_data(void *data, int size)
 			if((g_bulkout_req.retcode == 0) && (g_bulkout_req.recvsize > 0))
 			{
 				readlen += g_bulkout_req.recvsize;
-				memcpy(data, tx_buf, g_bulkout_req.recvsize);
 				data += g_bulkout_req.recvsize;
 			}
 			else
@@ -488,6 +573,282 @@ int write_data_large(const void *data, int size)
 	return size;
 }
 
+/* Read one tagged reply, for whichever command it is. The first packet is
+ * the tag and the response, called with g_recvsema held. */
+int read_tagged_reply(void)
+{
+	struct HostFsTag *tag;
+	struct HostFsCmd *resp;
+	struct TagSlot *slot;
+	int direct = 0;
+	int len;
+	int ret;
+	u32 result;
+
+	if(set_bulkout_req(rx_buf, 512) < 0)
+	{
+		return -1;
+	}
+
+	ret = sceKernelWaitEventFlag(g_transevent, USB_TRANSEVENT_BULKOUT_DONE, PSP_EVENT_WAITOR | PSP_EVENT_WAITCLEAR, &result, NULL);
+	if((ret < 0) || (g_bulkout_req.retcode != 0) || (g_bulkout_req.recvsize < (sizeof(struct HostFsTag) + sizeof(struct HostFsCmd))))
+	{
+		MODPRINTF("Error reading tagged reply %08X, %d\n", ret, g_bulkout_req.retcode);
+		return -1;
+	}
+
+	tag = (struct HostFsTag *) rx_buf;
+	resp = (struct HostFsCmd *) (tag + 1);
+	if((tag->magic != HOSTFS_TAG_MAGIC) || (resp->magic != HOSTFS_MAGIC))
+	{
+		MODPRINTF("Invalid tagged reply magic: %08X, tag: %d\n", tag->magic, tag->tag);
+		return -1;
+	}
+
+	if((tag->tag >= HOSTFS_MAX_TAGS) || (!g_tags[tag->tag].busy) || (g_tags[tag->tag].orphaned))
+	{
+		/* Nobody is waiting for it, drop it and stay in step with the host */
+		len = resp->extralen;
+		if(tag->tag < HOSTFS_MAX_TAGS)
+		{
+			slot = &g_tags[tag->tag];
+			if(slot->orphaned)
+			{
+				memset(slot, 0, sizeof(*slot));
+				(void) sceKernelSignalSema(g_tagsema, 1);
+			}
+		}
+
+		if(len > 0)
+		{
+			DEBUG_PRINTF("Dropping tagged reply for %d, %d bytes\n", tag->tag, len);
+			if(read_data_buf(NULL, len, rx_buf, sizeof(rx_buf)) != len)
+			{
+				return -1;
+			}
+		}
+
+		return 0;
+	}
+
+	slot = &g_tags[tag->tag];
+	len = g_bulkout_req.recvsize - sizeof(struct HostFsTag);
+	if(len > slot->incmdlen)
+	{
+		len = slot->incmdlen;
+	}
+	memset(slot->incmd, 0, slot->incmdlen);
+	memcpy(slot->incmd, resp, len);
+	resp = (struct HostFsCmd *) slot->incmd;
+	slot->ok = (resp->magic == HOSTFS_MAGIC);
+
+	if(resp->extralen > 0)
+	{
+		/* Too much is read and dropped rather than losing our place */
+		if(resp->extralen > slot->inlen)
+		{
+			MODPRINTF("Tagged reply for %08X too large %d\n", resp->command, resp->extralen);
+			slot->ok = 0;
+			if(read_data_buf(NULL, resp->extralen, rx_buf, sizeof(rx_buf)) != resp->extralen)
+			{
+				ret = -1;
+			}
+		}
+		else
+		{
+			if(((u32) slot->indata & 63) == 0)
+			{
+				direct = resp->extralen & ~511;
+			}
+
+			if((direct > 0) && (read_data_direct(slot->indata, direct) != direct))
+			{
+				ret = -1;
+			}
+			else if((resp->extralen > direct) && (read_data_buf(slot->indata + direct, resp->extralen - direct, 
+							rx_buf, sizeof(rx_buf)) != (resp->extralen - direct)))
+			{
+				ret = -1;
+			}
+		}
+	}
+
+	/* Its reply has been read, even if not all of it, so its thread must not
+	 * wait for another */
+	if(ret < 0)
+	{
+		slot->ok = 0;
+	}
+	slot->done = 1;
+
+	return ret < 0 ? -1 : 0;
+}
+
+/* Read replies until no tag is held by an abandoned command, called with
+ * g_recvsema held */
+static int reap_orphans(void)
+{
+	int i;
+
+	for(i = 0; i < HOSTFS_MAX_TAGS; i++)
+	{
+		while(g_tags[i].orphaned)
+		{
+			if(read_tagged_reply() < 0)
+			{
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Give up waiting on a tag, whoever reads its reply drops it and frees the tag */
+static void abandon_tag(struct TagSlot *slot)
+{
+	slot->orphaned = 1;
+	slot->incmd = NULL;
+	slot->indata = NULL;
+}
+
+/* Exchange a command with a tag, while other threads have theirs in flight */
+int command_xchg_tagged(void *outcmd, int outcmdlen, void *incmd, int incmdlen, const void *outdata, 
+		int outlen, void *indata, int inlen)
+{
+	struct TagSlot *slot = NULL;
+	char pkt[512];
+	int orphan = 0;
+	int ret = 0;
+	int err = 0;
+	int i;
+
+	if(outcmdlen > (sizeof(pkt) - sizeof(struct HostFsTag)))
+	{
+		return 0;
+	}
+
+	err = sceKernelWaitSema(g_tagsema, 1, NULL);
+	if(err < 0)
+	{
+		MODPRINTF("Error waiting on tag semaphore %08X\n", err);
+		return 0;
+	}
+
+	err = sceKernelWaitSema(g_mainsema, 1, NULL);
+	if(err < 0)
+	{
+		MODPRINTF("Error waiting on xchg semaphore %08X\n", err);
+		(void) sceKernelSignalSema(g_tagsema, 1);
+		return 0;
+	}
+
+	do
+	{
+		/* Holding a unit of g_tagsema means one of these is free */
+		for(i = 0; i < HOSTFS_MAX_TAGS; i++)
+		{
+			if(!g_tags[i].busy)
+			{
+				slot = &g_tags[i];
+				break;
+			}
+		}
+
+		if(slot == NULL)
+		{
+			break;
+		}
+
+		memset(slot, 0, sizeof(*slot));
+		slot->busy = 1;
+		slot->incmd = incmd;
+		slot->incmdlen = incmdlen;
+		slot->indata = indata;
+		slot->inlen = inlen;
+
+		/* The tag and the command go in one packet */
+		((struct HostFsTag *) pkt)->magic = HOSTFS_TAG_MAGIC;
+		((struct HostFsTag *) pkt)->tag = i;
+		memcpy(pkt + sizeof(struct HostFsTag), outcmd, outcmdlen);
+
+		err = write_data(pkt, outcmdlen + sizeof(struct HostFsTag));
+		if(err != (outcmdlen + sizeof(struct HostFsTag)))
+		{
+			MODPRINTF("Error writing command %08X %d\n", ((struct HostFsCmd *) outcmd)->command, err);
+			slot->busy = 0;
+			slot = NULL;
+			break;
+		}
+
+		if(outlen > 0)
+		{
+			err = write_data(outdata, outlen);
+			if(err != outlen)
+			{
+				/* The host is waiting for the rest, nothing will come back */
+				MODPRINTF("Error writing command data %08X, %d\n", ((struct HostFsCmd *) outcmd)->command, err);
+				slot->busy = 0;
+				slot = NULL;
+				break;
+			}
+		}
+	}
+	while(0);
+
+	(void) sceKernelSignalSema(g_mainsema, 1);
+
+	/* Whoever holds g_recvsema reads the next reply, until ours has come */
+	while(slot)
+	{
+		err = sceKernelWaitSema(g_recvsema, 1, NULL);
+		if(err < 0)
+		{
+			MODPRINTF("Error waiting on receive semaphore %08X\n", err);
+			if(!slot->done)
+			{
+				abandon_tag(slot);
+				orphan = 1;
+			}
+			break;
+		}
+
+		if((!slot->done) && (read_tagged_reply() < 0) && (!slot->done))
+		{
+			/* Ours is still to come, it must not be read into incmd once we return */
+			abandon_tag(slot);
+			orphan = 1;
+		}
+
+		(void) sceKernelSignalSema(g_recvsema, 1);
+
+		if(orphan)
+		{
+			break;
+		}
+
+		if(slot->done)
+		{
+			ret = slot->ok;
+			break;
+		}
+	}
+
+	if(orphan)
+	{
+		/* The tag and its unit of g_tagsema are given back once the reply is read */
+		return 0;
+	}
+
+	if(slot)
+	{
+		slot->busy = 0;
+	}
+	(void) sceKernelSignalSema(g_tagsema, 1);
+
+	return ret;
+}
+
 /* Exchange a HOSTFS command with the PC host */
 int command_xchg(void *outcmd, int outcmdlen, void *incmd, int incmdlen, const void *outdata, 
 		int outlen, void *indata, int inlen)
@@ -497,6 +858,11 @@ int command_xchg(void *outcmd, int outcmdlen, void *incmd, int incmdlen, const v
 	int ret = 0;
 	int err = 0;
 
+	if((g_ntags > 0) && (incmdlen > 0))
+	{
+		return command_xchg_tagged(outcmd, outcmdlen, incmd, incmdlen, outdata, outlen, indata, inlen);
+	}
+
 	/* TODO: Set timeout on semaphore */
 	err = sceKernelWaitSema(g_mainsema, 1, NULL);
 	if(err < 0)
@@ -569,6 +935,143 @@ int command_xchg(void *outcmd, int outcmdlen, void *incmd, int incmdlen, const v
 	return ret;
 }
 
+/* Same as command_xchg for a command whose extra data can be large, it is
+ * received directly into indata where possible rather than through tx_buf.
+ * The last endlen bytes of the extra data go to end instead. */
+int command_stream(void *outcmd, int outcmdlen, void *incmd, int incmdlen, void *indata, int inlen, 
+		void *end, int endlen)
+{
+	struct HostFsCmd *cmd;
+	struct HostFsCmd *resp;
+	int ntags = g_ntags;
+	int datalen = 0;
+	int direct = 0;
+	int ret = 0;
+	int err = 0;
+
+	/* A stream is never tagged, it waits for every tagged command to finish */
+	if(ntags > 0)
+	{
+		/* An abandoned command holds its tag until someone reads its reply */
+		err = sceKernelWaitSema(g_recvsema, 1, NULL);
+		if(err < 0)
+		{
+			MODPRINTF("Error waiting on receive semaphore %08X\n", err);
+			return 0;
+		}
+		err = reap_orphans();
+		(void) sceKernelSignalSema(g_recvsema, 1);
+		if(err < 0)
+		{
+			return 0;
+		}
+
+		err = sceKernelWaitSema(g_tagsema, ntags, NULL);
+		if(err < 0)
+		{
+			MODPRINTF("Error waiting on tag semaphore %08X\n", err);
+			return 0;
+		}
+	}
+
+	err = sceKernelWaitSema(g_mainsema, 1, NULL);
+	if(err < 0)
+	{
+		MODPRINTF("Error waiting on xchg semaphore %08X\n", err);
+		if(ntags > 0)
+		{
+			(void) sceKernelSignalSema(g_tagsema, ntags);
+		}
+		return 0;
+	}
+
+	do
+	{
+		cmd = (struct HostFsCmd *) outcmd;
+		resp = (struct HostFsCmd *) incmd;
+
+		err = write_data(outcmd, outcmdlen);
+		if(err != outcmdlen)
+		{
+			MODPRINTF("Error writing command %08X %d\n", cmd->command, err);
+			break;
+		}
+
+		err = read_data(incmd, incmdlen);
+		if(err != incmdlen)
+		{
+			MODPRINTF("Error reading response for %08X %d\n", cmd->command, err);
+			break;
+		}
+
+		if((resp->magic != HOSTFS_MAGIC) && (resp->command != cmd->command))
+		{
+			MODPRINTF("Invalid response packet magic: %08X, command: %08X\n", resp->magic, resp->command);
+			break;
+		}
+
+		if(resp->extralen > 0)
+		{
+			datalen = resp->extralen - endlen;
+		}
+
+		if((datalen < 0) || (datalen > inlen))
+		{
+			MODPRINTF("Stream for %08X has an invalid length %d\n", cmd->command, resp->extralen);
+			break;
+		}
+
+		if(datalen > 0)
+		{
+			if(((u32) indata & 63) == 0)
+			{
+				direct = datalen & ~511;
+			}
+
+			if(direct > 0)
+			{
+				err = read_data_direct(indata, direct);
+				if(err != direct)
+				{
+					MODPRINTF("Error reading stream data %08X, %d\n", cmd->command, err);
+					break;
+				}
+			}
+
+			if(datalen > direct)
+			{
+				err = read_data(indata + direct, datalen - direct);
+				if(err != (datalen - direct))
+				{
+					MODPRINTF("Error reading stream data %08X, %d\n", cmd->command, err);
+					break;
+				}
+			}
+		}
+
+		if(resp->extralen > 0)
+		{
+			err = read_data(end, endlen);
+			if(err != endlen)
+			{
+				MODPRINTF("Error reading stream end %08X, %d\n", cmd->command, err);
+				break;
+			}
+		}
+
+		ret = 1;
+	}
+	while(0);
+
+	(void) sceKernelSignalSema(g_mainsema, 1);
+	if(ntags > 0)
+	{
+		(void) sceKernelSignalSema(g_tagsema, ntags);
+	}
+
+	return ret;
+}
+
 int usbLockBus(void)
 {
 	int k1;
@@ -633,12 +1136,77 @@ int send_hello_cmd(void)
 {
 	struct HostFsHelloCmd cmd;
 	struct HostFsHelloResp resp;
+	struct HostFsCaps caps;
+	int i;
 
 	memset(&cmd, 0, sizeof(cmd));
+	memset(&resp, 0, sizeof(resp));
+	memset(&caps, 0, sizeof(caps));
 	cmd.cmd.magic = HOSTFS_MAGIC;
 	cmd.cmd.command = HOSTFS_CMD_HELLO;
+	cmd.caps.version = HOSTFS_CAPS_VERSION;
+	cmd.caps.size = sizeof(cmd.caps);
+	cmd.caps.caps = HOSTFS_CAP_DREADBULK | HOSTFS_CAP_READSTREAM | HOSTFS_CAP_READFILE | HOSTFS_CAP_TAGGED;
+	cmd.caps.maxblock = HOSTFS_MAX_BLOCK;
+	cmd.caps.maxstream = HOSTFS_STREAM_MAX;
+	cmd.caps.maxtags = HOSTFS_MAX_TAGS;
+
+	/* Until the host says otherwise it only knows the original commands */
+	memset(&g_caps, 0, sizeof(g_caps));
+	g_caps.maxblock = HOSTFS_MAX_BLOCK;
+	g_ntags = 0;
+	/* A new host will never reply to tags abandoned on the last one */
+	for(i = 0; i < HOSTFS_MAX_TAGS; i++)
+	{
+		if(g_tags[i].orphaned)
+		{
+			memset(&g_tags[i], 0, sizeof(g_tags[i]));
+			(void) sceKernelSignalSema(g_tagsema, 1);
+		}
+	}
+	if(g_tagsheld > 0)
+	{
+		(void) sceKernelSignalSema(g_tagsema, g_tagsheld);
+		g_tagsheld = 0;
+	}
 
-	return command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), NULL, 0, NULL, 0);
+	/* The host never sends more of its block than we sent of ours */
+	if(command_xchg(&cmd, sizeof(cmd), &resp, sizeof(resp), NULL, 0, &caps, sizeof(caps)))
+	{
+		/* An older host sends no capabilities */
+		if((resp.cmd.extralen >= HOSTFS_CAPS_MINLEN) && (caps.version > 0))
+		{
+			g_caps.version = caps.version < HOSTFS_CAPS_VERSION ? caps.version : HOSTFS_CAPS_VERSION;
+			g_caps.size = resp.cmd.extralen;
+			g_caps.caps = caps.caps & cmd.caps.caps;
+			if((caps.maxblock > 0) && (caps.maxblock < g_caps.maxblock))
+			{
+				g_caps.maxblock = caps.maxblock;
+			}
+			g_caps.maxstream = caps.maxstream < cmd.caps.maxstream ? caps.maxstream : cmd.caps.maxstream;
+			g_caps.maxtags = caps.maxtags < cmd.caps.maxtags ? caps.maxtags : cmd.caps.maxtags;
+		}
+		DEBUG_PRINTF("Host capabilities %08X, block %d, stream %d, tags %d\n", g_caps.caps, g_caps.maxblock, 
+				g_caps.maxstream, g_caps.maxtags);
+
+		/* One tag is no better than none */
+		if((g_caps.caps & HOSTFS_CAP_TAGGED) && (g_caps.maxtags > 1))
+		{
+			g_tagsheld = HOSTFS_MAX_TAGS - g_caps.maxtags;
+			if((g_tagsheld > 0) && (sceKernelWaitSema(g_tagsema, g_tagsheld, NULL) < 0))
+			{
+				g_tagsheld = 0;
+			}
+			else
+			{
+				g_ntags = g_caps.maxtags;
+			}
+		}
+
+		return 1;
+	}
+
+	return 0;
 }
 
 /* Setup a async request */
@@ -676,6 +1244,24 @@ int usb_connected(void)
 	return g_connected;
 }
 
+/* Get the capabilities agreed with the host at connection */
+uint32_t usb_host_caps(void)
+{
+	return g_caps.caps;
+}
+
+/* Largest READ or WRITE the host accepts */
+int usb_max_block(void)
+{
+	return g_caps.maxblock;
+}
+
+/* Largest READSTREAM the host accepts, 0 if it has none */
+int usb_max_stream(void)
+{
+	return g_caps.maxstream;
+}
+
 char async_data[512] __attribute__((aligned(64)));
 
 void fill_async(void *async_data, int len)
@@ -1128,6 +1714,20 @@ int start_func(int size, void *p)
 		return -1;
 	}
 
+	g_tagsema = sceKernelCreateSema("USBTagSemaphore", 0, HOSTFS_MAX_TAGS, HOSTFS_MAX_TAGS, NULL);
+	if(g_tagsema < 0)
+	{
+		MODPRINTF("Couldn't create tag semaphore %08X\n", g_tagsema);
+		return -1;
+	}
+
+	g_recvsema = sceKernelCreateSema("USBRecvSemaphore", 0, 1, 1, NULL);
+	if(g_recvsema < 0)
+	{
+		MODPRINTF("Couldn't create receive semaphore %08X\n", g_recvsema);
+		return -1;
+	}
+
 	g_thid = sceKernelCreateThread("USBThread", usb_thread, 10, 0x10000, 0, NULL);
 	if(g_thid < 0)
 	{
@@ -1184,6 +1784,18 @@ int stop_func(int size, void *p)
 		g_mainsema = -1;
 	}
 
+	if(g_tagsema >= 0)
+	{
+		sceKernelDeleteSema(g_tagsema);
+		g_tagsema = -1;
+	}
+
+	if(g_recvsema >= 0)
+	{
+		sceKernelDeleteSema(g_recvsema);
+		g_recvsema = -1;
+	}
+
 	return 0;
 }
 
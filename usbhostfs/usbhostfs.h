@@ -12,6 +12,7 @@
 #define __USBHOSTFS_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define MODULE_NAME "USBHostFS"
 #define HOSTFSDRIVER_NAME "USBHostFSDriver"
@@ -21,6 +22,7 @@
 #define HOSTFS_MAGIC 0x782F0812
 #define ASYNC_MAGIC  0x782F0813
 #define BULK_MAGIC   0x782F0814
+#define HOSTFS_TAG_MAGIC 0x782F0815
 
 #define HOSTFS_PATHMAX (4096)
 
@@ -46,6 +48,168 @@ struct DevctlGetInfo
 	unsigned int sects;
 };
 
+/* Copy a file or directory tree between host paths on the PC, none of the
+ * data crosses USB. The input is a DevctlHostCopy followed by the source and
+ * destination paths relative to their drives, each nul terminated. The
+ * output, if there is room for it, is a DevctlHostCopyResult. */
+#define DEVCTL_HOST_COPY      0x02425880
+
+#define HOSTCOPY_RECURSIVE    1
+
+struct DevctlHostCopy
+{
+	uint32_t srcfs;
+	uint32_t dstfs;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct DevctlHostCopyResult
+{
+	uint64_t bytes;
+	uint32_t files;
+	uint32_t dirs;
+	/* Files shared with the source rather than copied */
+	uint32_t cloned;
+} __attribute__((packed));
+
+/* Hash a range of a host file on the PC so only the digest crosses USB. The
+ * input is a DevctlHostHash followed by the path relative to the drive the
+ * devctl was sent to, nul terminated. The output is a DevctlHostHashResult,
+ * the digest is in the canonical big endian byte order of the algorithm. */
+#define DEVCTL_HOST_HASH      0x02425881
+
+enum HostHashType
+{
+	HOSTHASH_CRC32 = 0,
+	HOSTHASH_SHA1  = 1,
+	/* 32 bit xxHash with a seed of 0, cheap on the PSP as well */
+	HOSTHASH_XXH32 = 2,
+};
+
+#define HOSTHASH_MAXDIGEST    20
+
+struct DevctlHostHash
+{
+	uint32_t type;
+	uint32_t pad;
+	uint64_t ofs;
+	/* Number of bytes to hash, 0 for up to the end of the file */
+	uint64_t len;
+} __attribute__((packed));
+
+struct DevctlHostHashResult
+{
+	/* Number of bytes hashed */
+	uint64_t len;
+	uint32_t digestlen;
+	uint8_t digest[HOSTHASH_MAXDIGEST];
+} __attribute__((packed));
+
+/* Delta sync of a host tree to the PSP, all sent to the drive of the tree.
+ * DEVCTL_SYNC_LIST walks the tree once and hands it out a page at a time.
+ * To update a file the PSP sends DEVCTL_SYNC_BEGIN with the block size it
+ * will checksum its old copy in, the checksums with DEVCTL_SYNC_SIGS, then
+ * reads SyncOps with DEVCTL_SYNC_DELTA until the host says it is done. */
+#define DEVCTL_SYNC_LIST      0x02425882
+#define DEVCTL_SYNC_BEGIN     0x02425883
+#define DEVCTL_SYNC_SIGS      0x02425884
+#define DEVCTL_SYNC_DELTA     0x02425885
+#define DEVCTL_SYNC_END       0x02425886
+
+/* Limits on the block size, the PSP doubles it until the old file is
+ * covered by no more than SYNC_MAXBLOCKS blocks */
+#define SYNC_MINBLOCK         2048
+#define SYNC_MAXBLOCK         (1024*1024)
+#define SYNC_MAXBLOCKS        16384
+
+/* Input is a DevctlSyncList followed by the directory, nul terminated */
+struct DevctlSyncList
+{
+	/* Index of the first entry wanted, 0 walks the tree again */
+	uint32_t start;
+} __attribute__((packed));
+
+/* Followed by count SyncListEntrys, each followed by its name */
+struct DevctlSyncListResult
+{
+	uint32_t total;
+	uint32_t count;
+} __attribute__((packed));
+
+struct SyncListEntry
+{
+	uint64_t size;
+	/* Laid out as a ScePspDateTime */
+	uint16_t mtime[8];
+	/* Bytes of name after the entry, including the nul and padding to 4 */
+	uint16_t namelen;
+	uint16_t isdir;
+} __attribute__((packed));
+
+/* Input is a DevctlSyncBegin followed by the file, nul terminated */
+struct DevctlSyncBegin
+{
+	uint32_t blocksize;
+	/* Number of whole blocks in the PSP's old copy */
+	uint32_t nblocks;
+	/* Offset the new copy is already correct up to */
+	uint64_t start;
+} __attribute__((packed));
+
+struct DevctlSyncBeginResult
+{
+	uint32_t session;
+	uint32_t pad;
+	/* Size of the file on the host */
+	uint64_t size;
+} __attribute__((packed));
+
+struct SyncSig
+{
+	/* Rolling checksum of the block, and its XXH32 */
+	uint32_t weak;
+	uint32_t strong;
+} __attribute__((packed));
+
+/* Followed by count SyncSigs */
+struct DevctlSyncSigs
+{
+	uint32_t session;
+	uint32_t first;
+	uint32_t count;
+} __attribute__((packed));
+
+/* Input to DEVCTL_SYNC_DELTA and DEVCTL_SYNC_END */
+struct DevctlSyncSession
+{
+	uint32_t session;
+} __attribute__((packed));
+
+/* Followed by len bytes of SyncOps */
+struct DevctlSyncDeltaResult
+{
+	uint32_t len;
+	/* Set when the last of the file is in these ops */
+	uint32_t done;
+	/* Offset in the new file reached after these ops */
+	uint64_t pos;
+} __attribute__((packed));
+
+enum SyncOpType
+{
+	/* Copy len blocks of the old file starting at block */
+	SYNCOP_COPY = 1,
+	/* The next len bytes, which follow the op */
+	SYNCOP_DATA = 2,
+};
+
+struct SyncOp
+{
+	uint32_t type;
+	uint32_t block;
+	uint32_t len;
+} __attribute__((packed));
+
 enum USB_ASYNC_CHANNELS
 {
 	ASYNC_SHELL    = 0,
@@ -76,9 +240,68 @@ enum HostFsCommands
 	HOSTFS_CMD_RENAME  = 0x8FFC000F,
 	HOSTFS_CMD_CHDIR   = 0x8FFC0010,
 	HOSTFS_CMD_IOCTL   = 0x8FFC0011,
-	HOSTFS_CMD_DEVCTL  = 0x8FFC0012
+	HOSTFS_CMD_DEVCTL  = 0x8FFC0012,
+	HOSTFS_CMD_DREADBULK = 0x8FFC0013,
+	HOSTFS_CMD_READSTREAM = 0x8FFC0014,
+	HOSTFS_CMD_READFILE = 0x8FFC0015,
 };
 
+/* Capabilities exchanged in the HELLO command. A PSP which knows about them
+ * sends a HostFsCaps block in the command, a host which knows about them
+ * replies with its own block as extra data. Either end on its own sees a
+ * plain HELLO and carries on as before. The block is the only thing HELLO
+ * carries, new fields go on the end of it rather than into another layout. */
+#define HOSTFS_CAP_DREADBULK   0x00000001
+#define HOSTFS_CAP_READSTREAM  0x00000002
+#define HOSTFS_CAP_READFILE    0x00000004
+/* Reserved for extensions neither end implements yet */
+#define HOSTFS_CAP_WRITESTREAM 0x00000008
+#define HOSTFS_CAP_COMPRESS    0x00000010
+/* Commands and replies may carry a HostFsTag, see below */
+#define HOSTFS_CAP_TAGGED      0x00000020
+
+#define HOSTFS_CAPS_VERSION 1
+
+/* Fields are only ever added to the end. Each side reads as much of the
+ * other's block as both know about, anything it is missing counts as zero */
+struct HostFsCaps
+{
+	/* HOSTFS_CAPS_VERSION of the sender */
+	uint16_t version;
+	/* Size of the block as the sender knows it */
+	uint16_t size;
+	uint32_t caps;
+	/* Largest READ or WRITE block */
+	uint32_t maxblock;
+	/* Largest streamed transfer */
+	uint32_t maxstream;
+	/* Number of tagged requests which can be in flight */
+	uint32_t maxtags;
+} __attribute__((packed));
+
+/* Anything shorter, such as a lone capability word, is a plain HELLO */
+#define HOSTFS_CAPS_MINLEN offsetof(struct HostFsCaps, maxblock)
+
+/* Largest single READSTREAM request */
+#define HOSTFS_STREAM_MAX (4*1024*1024)
+
+/* With HOSTFS_CAP_TAGGED agreed the PSP can have up to maxtags commands in
+ * flight, each sent as a HostFsTag and the command in the same packet. The
+ * host may run them in parallel and reply out of order, the first packet of
+ * each reply is the same tag followed by the response, any extra data comes
+ * after as usual. Commands on the same file or directory handle are run in
+ * the order they were sent. A command without a tag waits for everything in
+ * flight and is answered without one, as before. */
+
+/* Most tags the PSP will use */
+#define HOSTFS_MAX_TAGS 8
+
+struct HostFsTag
+{
+	uint32_t magic;
+	uint32_t tag;
+} __attribute__((packed));
+
 struct HostFsTimeStamp
 {
 	uint16_t	year;
@@ -99,6 +322,7 @@ struct HostFsCmd
 struct HostFsHelloCmd
 {
 	struct HostFsCmd cmd;
+	struct HostFsCaps caps;
 } __attribute__((packed));
 
 struct HostFsHelloResp
@@ -130,6 +354,30 @@ struct HostFsOpenResp
 	int32_t    res;
 } __attribute__((packed));
 
+/* Open a file for reading and, if it is no bigger than maxlen, return all of
+ * it and close it again in the same exchange. The path follows as extra data
+ * the same as for OPEN. */
+struct HostFsReadFileCmd
+{
+	struct HostFsCmd cmd;
+	uint32_t mode;
+	uint32_t mask;
+	uint32_t fsnum;
+	uint32_t maxlen;
+} __attribute__((packed));
+
+/* Set in flags if the contents are the whole file and the host has already
+ * closed it, otherwise res is an open fid the same as from OPEN */
+#define HOSTFS_READFILE_WHOLE 1
+
+struct HostFsReadFileResp
+{
+	struct HostFsCmd cmd;
+	int32_t res;
+	uint32_t flags;
+	int64_t size;
+} __attribute__((packed));
+
 struct HostFsCloseCmd
 {
 	struct HostFsCmd cmd;
@@ -155,6 +403,30 @@ struct HostFsReadResp
 	int32_t    res;
 } __attribute__((packed));
 
+/* Read up to HOSTFS_STREAM_MAX bytes in one exchange. The host promises res
+ * bytes in the reply and then sends them back to back, so the PSP can keep
+ * receiving without going back to the host for each block. When res > 0 they
+ * are followed by a HostFsReadStreamEnd, counted in extralen. */
+struct HostFsReadStreamCmd
+{
+	struct HostFsCmd cmd;
+	int32_t    fid;
+	int32_t    len;
+} __attribute__((packed));
+
+struct HostFsReadStreamResp
+{
+	struct HostFsCmd cmd;
+	int32_t    res;
+} __attribute__((packed));
+
+/* res is how many of the promised bytes are the file, fewer if it shrank
+ * while they were sent and the rest is padding, < 0 if none could be read */
+struct HostFsReadStreamEnd
+{
+	int32_t    res;
+} __attribute__((packed));
+
 struct HostFsWriteCmd
 {
 	struct HostFsCmd cmd;
@@ -246,6 +518,29 @@ struct HostFsDreadResp
 	int32_t res;
 } __attribute__((packed));
 
+/* Fetch as many directory entries as fit in maxlen bytes, res is the number
+ * of entries returned and 0 at the end of the directory */
+struct HostFsDreadBulkCmd
+{
+	struct HostFsCmd cmd;
+	int32_t did;
+	uint32_t maxlen;
+} __attribute__((packed));
+
+struct HostFsDreadBulkResp
+{
+	struct HostFsCmd cmd;
+	int32_t res;
+} __attribute__((packed));
+
+/* Each entry of a DREADBULK reply is this header followed by a SceIoStat and
+ * the name with its terminator, padded out to reclen which is a multiple of 4 */
+struct HostFsDirent
+{
+	uint16_t reclen;
+	uint16_t namelen;
+} __attribute__((packed));
+
 struct HostFsDcloseCmd
 {
 	struct HostFsCmd cmd;
@@ -362,8 +657,13 @@ struct BulkCommand
 #define MODPRINTF DEBUG_PRINTF
 
 int usb_connected(void);
+uint32_t usb_host_caps(void);
+int usb_max_block(void);
+int usb_max_stream(void);
 int command_xchg(void *outcmd, int outcmdlen, void *incmd, int incmdlen, const void *outdata, 
 		int outlen, void *indata, int inlen);
+int command_stream(void *outcmd, int outcmdlen, void *incmd, int incmdlen, void *indata, int inlen, 
+		void *end, int endlen);
 int hostfs_init(void);
 void hostfs_term(void);
 #endif
@@ -0,0 +1,807 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * asyncmux.c - Async channel multiplexer for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ * Output the PSP sends on an async channel goes into a ring buffer for the
+ * channel, each TCP client subscribed to the channel has its own position in
+ * the ring. The device threads only copy into the ring, all socket I/O is
+ * non-blocking and done on the multiplexer thread, so a slow client can
+ * never stall the USB side. epoll is used where there is one, poll()
+ * otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include "usbhostfs_pc.h"
+#include "asyncmux.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define AM_IN  1
+#define AM_OUT 2
+
+#define AM_MAX_EVENTS 64
+
+static struct AmChan *get_chan(struct AsyncMux *mux, int slot, int chan)
+{
+	if((slot < 0) || (slot >= mux->nslots) || (chan < 0) || (chan >= MAX_ASYNC_CHANNELS))
+	{
+		return NULL;
+	}
+
+	return &mux->chans[(slot * MAX_ASYNC_CHANNELS) + chan];
+}
+
+static void set_nonblock(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+/* Register or update a watch, events is a mask of AM_IN and AM_OUT */
+static void watch_events(struct AsyncMux *mux, struct AmWatch *watch, int events)
+{
+#ifdef __linux__
+	if(mux->epfd >= 0)
+	{
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = ((events & AM_IN) ? EPOLLIN : 0) | ((events & AM_OUT) ? EPOLLOUT : 0);
+		ev.data.ptr = watch;
+		if(watch->events < 0)
+		{
+			if(epoll_ctl(mux->epfd, EPOLL_CTL_ADD, watch->fd, &ev) < 0)
+			{
+				fprintf(stderr, "Could not watch descriptor %d (%s)\n", watch->fd, strerror(errno));
+			}
+		}
+		else if(watch->events != events)
+		{
+			epoll_ctl(mux->epfd, EPOLL_CTL_MOD, watch->fd, &ev);
+		}
+	}
+#endif
+
+	watch->events = events;
+}
+
+/* Remove a watch and close the descriptor */
+static void unwatch(struct AsyncMux *mux, struct AmWatch *watch)
+{
+#ifdef __linux__
+	/* Remove explicitly, the descriptor might have been dup'ed */
+	if((mux->epfd >= 0) && (watch->events >= 0))
+	{
+		epoll_ctl(mux->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+	}
+#endif
+
+	close(watch->fd);
+	watch->fd = -1;
+	watch->events = -1;
+}
+
+static void init_watch(struct AmWatch *watch, int fd, int kind, struct AmChan *chan)
+{
+	memset(watch, 0, sizeof(*watch));
+	watch->fd = fd;
+	watch->kind = kind;
+	watch->events = -1;
+	watch->chan = chan;
+}
+
+int am_init(struct AsyncMux *mux, int nslots, int ringsize, int policy, const struct AmCallbacks *cb)
+{
+	int i;
+
+	memset(mux, 0, sizeof(*mux));
+	mux->epfd = -1;
+	mux->nslots = nslots;
+	mux->ringsize = ringsize > 0 ? ringsize : AM_DEF_RING;
+	mux->policy = policy;
+	mux->cb = *cb;
+
+	mux->chans = (struct AmChan *) calloc(nslots * MAX_ASYNC_CHANNELS, sizeof(struct AmChan));
+	if(mux->chans == NULL)
+	{
+		fprintf(stderr, "Could not allocate async channels\n");
+		return -1;
+	}
+
+	for(i = 0; i < (nslots * MAX_ASYNC_CHANNELS); i++)
+	{
+		struct AmChan *chan = &mux->chans[i];
+		int c;
+
+		pthread_mutex_init(&chan->lock, NULL);
+		pthread_cond_init(&chan->space, NULL);
+		chan->slot = i / MAX_ASYNC_CHANNELS;
+		chan->num = i % MAX_ASYNC_CHANNELS;
+		init_watch(&chan->listen, -1, AM_WATCH_LISTEN, chan);
+		for(c = 0; c < AM_MAX_CLIENTS; c++)
+		{
+			init_watch(&chan->clients[c].watch, -1, AM_WATCH_CLIENT, chan);
+		}
+	}
+
+	for(i = 0; i < AM_MAX_WATCHES; i++)
+	{
+		init_watch(&mux->watches[i], -1, AM_WATCH_USER, NULL);
+	}
+
+	if(pipe(mux->wakefd) < 0)
+	{
+		fprintf(stderr, "Could not create wake pipe (%s)\n", strerror(errno));
+		return -1;
+	}
+	set_nonblock(mux->wakefd[0]);
+	set_nonblock(mux->wakefd[1]);
+
+#ifdef __linux__
+	mux->epfd = epoll_create(AM_MAX_EVENTS);
+	if(mux->epfd < 0)
+	{
+		fprintf(stderr, "Could not create epoll descriptor (%s), using poll\n", strerror(errno));
+	}
+	else
+	{
+		fcntl(mux->epfd, F_SETFD, FD_CLOEXEC);
+	}
+#endif
+
+	init_watch(&mux->wake, mux->wakefd[0], AM_WATCH_WAKE, NULL);
+	watch_events(mux, &mux->wake, AM_IN);
+
+	return 0;
+}
+
+static void wake_mux(struct AsyncMux *mux)
+{
+	if(!__sync_lock_test_and_set(&mux->wake_pending, 1))
+	{
+		write(mux->wakefd[1], "", 1);
+	}
+}
+
+int am_listen(struct AsyncMux *mux, int slot, int num, int fd)
+{
+	struct AmChan *chan = get_chan(mux, slot, num);
+	char *ring;
+
+	if(chan == NULL)
+	{
+		close(fd);
+		return -1;
+	}
+
+	ring = (char *) malloc(mux->ringsize);
+	if(ring == NULL)
+	{
+		fprintf(stderr, "Could not allocate async buffer\n");
+		close(fd);
+		return -1;
+	}
+
+	set_nonblock(fd);
+
+	pthread_mutex_lock(&chan->lock);
+	if(chan->listen.fd >= 0)
+	{
+		pthread_mutex_unlock(&chan->lock);
+		free(ring);
+		close(fd);
+		return -1;
+	}
+
+	chan->ring = ring;
+	chan->size = mux->ringsize;
+	chan->listen.fd = fd;
+	watch_events(mux, &chan->listen, AM_IN);
+	pthread_mutex_unlock(&chan->lock);
+
+	/* poll() builds its set from the channels, kick it so it sees the new one */
+	wake_mux(mux);
+
+	return 0;
+}
+
+int am_listening(struct AsyncMux *mux, int slot)
+{
+	struct AmChan *chan = get_chan(mux, slot, 0);
+	int ret = 0;
+	int i;
+
+	if(chan)
+	{
+		for(i = 0; i < MAX_ASYNC_CHANNELS; i++)
+		{
+			pthread_mutex_lock(&chan[i].lock);
+			if(chan[i].ring)
+			{
+				ret = 1;
+			}
+			pthread_mutex_unlock(&chan[i].lock);
+		}
+	}
+
+	return ret;
+}
+
+int am_watch(struct AsyncMux *mux, int fd, AmFdFunc func, void *arg)
+{
+	int i;
+
+	for(i = 0; i < AM_MAX_WATCHES; i++)
+	{
+		struct AmWatch *watch = &mux->watches[i];
+
+		if(watch->fd < 0)
+		{
+			watch->fd = fd;
+			watch->func = func;
+			watch->arg = arg;
+			watch_events(mux, watch, AM_IN);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Oldest position still needed by a client, must be called with the channel locked */
+static int oldest_pos(struct AmChan *chan, uint64_t *pos)
+{
+	int count = 0;
+	int i;
+
+	*pos = chan->head;
+	for(i = 0; i < AM_MAX_CLIENTS; i++)
+	{
+		struct AmClient *client = &chan->clients[i];
+
+		if((client->watch.fd >= 0) && (!client->kicked))
+		{
+			if(client->pos < *pos)
+			{
+				*pos = client->pos;
+			}
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/* Make room for len bytes, returns 0 if there are no clients left to write for */
+static int make_room(struct AsyncMux *mux, struct AmChan *chan, int len)
+{
+	uint64_t start = 0;
+	uint64_t pos;
+	int i;
+
+	while(oldest_pos(chan, &pos))
+	{
+		if((chan->head + len - pos) <= chan->size)
+		{
+			break;
+		}
+
+		if(mux->policy == AM_POLICY_BLOCK)
+		{
+			if(start == 0)
+			{
+				start = get_time_ns();
+				chan->stats.blocked++;
+			}
+			pthread_cond_wait(&chan->space, &chan->lock);
+			continue;
+		}
+
+		for(i = 0; i < AM_MAX_CLIENTS; i++)
+		{
+			struct AmClient *client = &chan->clients[i];
+			uint64_t keep = chan->head + len - chan->size;
+
+			if((client->watch.fd < 0) || (client->kicked) || (client->pos >= keep))
+			{
+				continue;
+			}
+
+			if(mux->policy == AM_POLICY_DROP)
+			{
+				client->dropped += keep - client->pos;
+				chan->stats.dropped += keep - client->pos;
+				client->pos = keep;
+			}
+			else
+			{
+				/* The multiplexer thread closes it */
+				client->kicked = 1;
+				chan->stats.kicked++;
+			}
+		}
+	}
+
+	if(start)
+	{
+		chan->stats.blocked_ns += get_time_ns() - start;
+	}
+
+	return oldest_pos(chan, &pos);
+}
+
+int am_write(struct AsyncMux *mux, int slot, int num, const void *data, int len)
+{
+	struct AmChan *chan = get_chan(mux, slot, num);
+	const char *p = (const char *) data;
+	int written = 0;
+
+	if((chan == NULL) || (len <= 0))
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&chan->lock);
+	if(chan->ring)
+	{
+		chan->stats.bytes += len;
+		while(written < len)
+		{
+			int n = len - written;
+			int ofs;
+			int first;
+
+			if(n > chan->size)
+			{
+				n = chan->size;
+			}
+
+			if(!make_room(mux, chan, n))
+			{
+				break;
+			}
+
+			ofs = (int) (chan->head % chan->size);
+			first = (chan->size - ofs) < n ? (chan->size - ofs) : n;
+			memcpy(chan->ring + ofs, p + written, first);
+			memcpy(chan->ring, p + written + first, n - first);
+			chan->head += n;
+			written += n;
+		}
+		chan->stats.discarded += len - written;
+	}
+	pthread_mutex_unlock(&chan->lock);
+
+	if(written > 0)
+	{
+		wake_mux(mux);
+	}
+
+	return written;
+}
+
+/* Must be called with the channel locked */
+static void close_client(struct AsyncMux *mux, struct AmClient *client)
+{
+	int fd = client->watch.fd;
+
+	unwatch(mux, &client->watch);
+	client->kicked = 0;
+	if(mux->cb.disconnect)
+	{
+		mux->cb.disconnect(client->watch.chan->slot, client->watch.chan->num, fd);
+	}
+}
+
+/* Send what a client hasn't had yet, must be called with the channel locked */
+static void flush_client(struct AsyncMux *mux, struct AmChan *chan, struct AmClient *client)
+{
+	while(client->pos < chan->head)
+	{
+		int ofs = (int) (client->pos % chan->size);
+		int len = chan->size - ofs;
+		int ret;
+
+		if((uint64_t) len > (chan->head - client->pos))
+		{
+			len = (int) (chan->head - client->pos);
+		}
+
+		ret = send(client->watch.fd, chan->ring + ofs, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(ret > 0)
+		{
+			client->pos += ret;
+			chan->stats.sent += ret;
+		}
+		else if((ret < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+		else if((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		{
+			break;
+		}
+		else
+		{
+			close_client(mux, client);
+			return;
+		}
+	}
+
+	watch_events(mux, &client->watch, (client->pos < chan->head) ? (AM_IN | AM_OUT) : AM_IN);
+}
+
+static void flush_chan(struct AsyncMux *mux, struct AmChan *chan)
+{
+	int i;
+
+	pthread_mutex_lock(&chan->lock);
+	if(chan->ring)
+	{
+		for(i = 0; i < AM_MAX_CLIENTS; i++)
+		{
+			struct AmClient *client = &chan->clients[i];
+
+			if(client->watch.fd < 0)
+			{
+				continue;
+			}
+
+			if(client->kicked)
+			{
+				fprintf(stderr, "Disconnecting slow async client (%d) for device %d\n", chan->num, chan->slot);
+				close_client(mux, client);
+				continue;
+			}
+
+			flush_client(mux, chan, client);
+		}
+
+		pthread_cond_broadcast(&chan->space);
+	}
+	pthread_mutex_unlock(&chan->lock);
+}
+
+static void do_accept(struct AsyncMux *mux, struct AmChan *chan)
+{
+	struct sockaddr_in addr;
+	socklen_t size = sizeof(addr);
+	struct AmClient *client = NULL;
+	int flag = 1;
+	int fd;
+	int i;
+
+	fd = accept(chan->listen.fd, (struct sockaddr *) &addr, &size);
+	if(fd < 0)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&chan->lock);
+	for(i = 0; i < AM_MAX_CLIENTS; i++)
+	{
+		if(chan->clients[i].watch.fd < 0)
+		{
+			client = &chan->clients[i];
+			break;
+		}
+	}
+
+	if(client == NULL)
+	{
+		pthread_mutex_unlock(&chan->lock);
+		fprintf(stderr, "Too many async clients (%d) for device %d, refusing %s\n", chan->num, chan->slot, inet_ntoa(addr.sin_addr));
+		close(fd);
+		return;
+	}
+
+	set_nonblock(fd);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+
+	/* New clients only see output from now on */
+	client->watch.fd = fd;
+	client->pos = chan->head;
+	client->kicked = 0;
+	client->dropped = 0;
+	watch_events(mux, &client->watch, AM_IN);
+	pthread_mutex_unlock(&chan->lock);
+
+	if(mux->cb.connect)
+	{
+		mux->cb.connect(chan->slot, chan->num, fd, inet_ntoa(addr.sin_addr));
+	}
+}
+
+static void do_input(struct AsyncMux *mux, struct AmClient *client)
+{
+	struct AmChan *chan = client->watch.chan;
+	char data[AM_MAX_INPUT];
+	int ret;
+
+	ret = read(client->watch.fd, data, sizeof(data));
+	if(ret > 0)
+	{
+		if(mux->cb.input)
+		{
+			mux->cb.input(chan->slot, chan->num, data, ret);
+		}
+	}
+	else if((ret == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+	{
+		pthread_mutex_lock(&chan->lock);
+		/* The input callback might have closed it already */
+		if(client->watch.fd >= 0)
+		{
+			close_client(mux, client);
+		}
+		pthread_cond_broadcast(&chan->space);
+		pthread_mutex_unlock(&chan->lock);
+	}
+}
+
+static void do_event(struct AsyncMux *mux, struct AmWatch *watch, int events)
+{
+	int i;
+
+	switch(watch->kind)
+	{
+		case AM_WATCH_WAKE:
+			{
+				char dummy[64];
+
+				/* Clear the flag first, a write after this wakes us again */
+				__sync_lock_release(&mux->wake_pending);
+				while(read(watch->fd, dummy, sizeof(dummy)) > 0);
+				for(i = 0; i < (mux->nslots * MAX_ASYNC_CHANNELS); i++)
+				{
+					flush_chan(mux, &mux->chans[i]);
+				}
+			}
+			break;
+		case AM_WATCH_USER:
+			watch->func(watch->fd, watch->arg);
+			break;
+		case AM_WATCH_LISTEN:
+			do_accept(mux, watch->chan);
+			break;
+		case AM_WATCH_CLIENT:
+			if(events & AM_OUT)
+			{
+				flush_chan(mux, watch->chan);
+			}
+			if((events & AM_IN) && (watch->fd >= 0))
+			{
+				do_input(mux, (struct AmClient *) watch);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+#ifdef __linux__
+static int poll_epoll(struct AsyncMux *mux, int timeout)
+{
+	struct epoll_event evs[AM_MAX_EVENTS];
+	int count;
+	int i;
+
+	count = epoll_wait(mux->epfd, evs, AM_MAX_EVENTS, timeout);
+	if(count < 0)
+	{
+		return (errno == EINTR) ? 0 : -1;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		struct AmWatch *watch = (struct AmWatch *) evs[i].data.ptr;
+		int events = 0;
+
+		if(evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		{
+			events |= AM_IN;
+		}
+		if(evs[i].events & EPOLLOUT)
+		{
+			events |= AM_OUT;
+		}
+
+		/* An earlier event in the batch may have closed it */
+		if(watch->fd >= 0)
+		{
+			do_event(mux, watch, events);
+		}
+	}
+
+	return 0;
+}
+#endif
+
+static int poll_fallback(struct AsyncMux *mux, int timeout)
+{
+	int max = 1 + AM_MAX_WATCHES + (mux->nslots * MAX_ASYNC_CHANNELS * (1 + AM_MAX_CLIENTS));
+	struct pollfd *fds;
+	struct AmWatch **watches;
+	int count = 0;
+	int ret;
+	int i;
+
+	fds = (struct pollfd *) malloc(max * sizeof(struct pollfd));
+	watches = (struct AmWatch **) malloc(max * sizeof(struct AmWatch *));
+	if((fds == NULL) || (watches == NULL))
+	{
+		free(fds);
+		free(watches);
+		return -1;
+	}
+
+#define ADD_WATCH(w) do { if(((w)->fd >= 0) && ((w)->events > 0)) { \
+		fds[count].fd = (w)->fd; fds[count].revents = 0; \
+		fds[count].events = (((w)->events & AM_IN) ? POLLIN : 0) | (((w)->events & AM_OUT) ? POLLOUT : 0); \
+		watches[count++] = (w); } } while(0)
+
+	ADD_WATCH(&mux->wake);
+	for(i = 0; i < AM_MAX_WATCHES; i++)
+	{
+		ADD_WATCH(&mux->watches[i]);
+	}
+
+	for(i = 0; i < (mux->nslots * MAX_ASYNC_CHANNELS); i++)
+	{
+		struct AmChan *chan = &mux->chans[i];
+		int c;
+
+		pthread_mutex_lock(&chan->lock);
+		ADD_WATCH(&chan->listen);
+		for(c = 0; c < AM_MAX_CLIENTS; c++)
+		{
+			ADD_WATCH(&chan->clients[c].watch);
+		}
+		pthread_mutex_unlock(&chan->lock);
+	}
+
+#undef ADD_WATCH
+
+	ret = poll(fds, count, timeout);
+	if(ret > 0)
+	{
+		for(i = 0; i < count; i++)
+		{
+			int events = 0;
+
+			if(fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				events |= AM_IN;
+			}
+			if(fds[i].revents & POLLOUT)
+			{
+				events |= AM_OUT;
+			}
+
+			if((events) && (watches[i]->fd == fds[i].fd))
+			{
+				do_event(mux, watches[i], events);
+			}
+		}
+	}
+
+	free(fds);
+	free(watches);
+
+	return ((ret < 0) && (errno != EINTR)) ? -1 : 0;
+}
+
+int am_poll(struct AsyncMux *mux, int timeout)
+{
+#ifdef __linux__
+	if(mux->epfd >= 0)
+	{
+		return poll_epoll(mux, timeout);
+	}
+#endif
+
+	return poll_fallback(mux, timeout);
+}
+
+void am_shutdown(struct AsyncMux *mux)
+{
+	int i;
+
+	for(i = 0; i < (mux->nslots * MAX_ASYNC_CHANNELS); i++)
+	{
+		struct AmChan *chan = &mux->chans[i];
+		int c;
+
+		for(c = 0; c < AM_MAX_CLIENTS; c++)
+		{
+			if(chan->clients[c].watch.fd >= 0)
+			{
+				close(chan->clients[c].watch.fd);
+				chan->clients[c].watch.fd = -1;
+			}
+		}
+
+		if(chan->listen.fd >= 0)
+		{
+			close(chan->listen.fd);
+			chan->listen.fd = -1;
+		}
+	}
+}
+
+int am_get_stats(struct AsyncMux *mux, int slot, int num, struct AmStats *stats)
+{
+	struct AmChan *chan = get_chan(mux, slot, num);
+	int ret = -1;
+	int i;
+
+	if(chan == NULL)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&chan->lock);
+	if(chan->ring)
+	{
+		memcpy(stats, &chan->stats, sizeof(*stats));
+		stats->clients = 0;
+		for(i = 0; i < AM_MAX_CLIENTS; i++)
+		{
+			if(chan->clients[i].watch.fd >= 0)
+			{
+				stats->clients++;
+			}
+		}
+		ret = 0;
+	}
+	pthread_mutex_unlock(&chan->lock);
+
+	return ret;
+}
+
+static const char *g_policies[] = { "block", "drop", "disconnect" };
+
+int am_parse_policy(const char *name)
+{
+	int i;
+
+	for(i = 0; i < (sizeof(g_policies) / sizeof(g_policies[0])); i++)
+	{
+		if(strcmp(name, g_policies[i]) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+const char *am_policy_name(int policy)
+{
+	if((policy < 0) || (policy >= (sizeof(g_policies) / sizeof(g_policies[0]))))
+	{
+		return "unknown";
+	}
+
+	return g_policies[policy];
+}
@@ -0,0 +1,204 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * asyncmux.h - Async channel multiplexer for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __ASYNCMUX_H__
+#define __ASYNCMUX_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <usbhostfs.h>
+
+#define AM_DEF_RING     (64*1024)
+#define AM_MAX_CLIENTS  8
+#define AM_MAX_WATCHES  4
+/* Largest block of client input passed on in one go */
+#define AM_MAX_INPUT    (512-sizeof(struct AsyncCommand))
+
+/* What to do when a client can't keep up with the PSP */
+enum AmPolicy
+{
+	/* Make the PSP side wait until there is room */
+	AM_POLICY_BLOCK = 0,
+	/* Overwrite the oldest data, the slow client skips it */
+	AM_POLICY_DROP,
+	/* Disconnect the slow client */
+	AM_POLICY_DISCONNECT,
+};
+
+enum AmWatchKind
+{
+	AM_WATCH_WAKE,
+	AM_WATCH_USER,
+	AM_WATCH_LISTEN,
+	AM_WATCH_CLIENT,
+};
+
+struct AmChan;
+
+typedef void (*AmFdFunc)(int fd, void *arg);
+
+struct AmWatch
+{
+	int fd;
+	int kind;
+	/* Events currently asked for */
+	int events;
+	struct AmChan *chan;
+	AmFdFunc func;
+	void *arg;
+};
+
+struct AmClient
+{
+	struct AmWatch watch;
+	/* Stream offset of the next byte to send */
+	uint64_t pos;
+	/* Set by the writer when the client is to be disconnected */
+	int kicked;
+	uint64_t dropped;
+};
+
+struct AmStats
+{
+	/* Bytes written by the PSP, and how many were sent on to clients */
+	uint64_t bytes;
+	uint64_t sent;
+	/* Bytes thrown away with nobody listening */
+	uint64_t discarded;
+	/* Bytes slow clients missed */
+	uint64_t dropped;
+	/* Clients disconnected for being slow */
+	uint64_t kicked;
+	/* Number of times the writer waited for room, and for how long */
+	uint64_t blocked;
+	uint64_t blocked_ns;
+	int clients;
+};
+
+struct AmChan
+{
+	pthread_mutex_t lock;
+	/* Signalled when clients catch up */
+	pthread_cond_t space;
+	int slot;
+	int num;
+	struct AmWatch listen;
+	/* Output from the PSP, head is the stream offset of the next byte */
+	char *ring;
+	int size;
+	uint64_t head;
+	struct AmClient clients[AM_MAX_CLIENTS];
+	struct AmStats stats;
+};
+
+/* Callbacks run on the multiplexer thread */
+struct AmCallbacks
+{
+	/* Data from a client for the PSP */
+	void (*input)(int slot, int chan, char *data, int len);
+	void (*connect)(int slot, int chan, int fd, const char *addr);
+	void (*disconnect)(int slot, int chan, int fd);
+};
+
+struct AsyncMux
+{
+	/* epoll descriptor, -1 when poll() is used */
+	int epfd;
+	int wakefd[2];
+	volatile int wake_pending;
+	int policy;
+	int ringsize;
+	int nslots;
+	struct AmChan *chans;
+	struct AmWatch wake;
+	struct AmWatch watches[AM_MAX_WATCHES];
+	struct AmCallbacks cb;
+};
+
+/**
+ * Initialise the multiplexer
+ *
+ * @param mux - The multiplexer
+ * @param nslots - Number of devices, each has MAX_ASYNC_CHANNELS channels
+ * @param ringsize - Bytes of output buffered per channel
+ * @param policy - One of AmPolicy
+ * @param cb - Callbacks, copied
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  am_init(struct AsyncMux *mux, int nslots, int ringsize, int policy, const struct AmCallbacks *cb);
+
+/**
+ * Start accepting clients for a channel, can be called from any thread
+ *
+ * @param mux - The multiplexer
+ * @param slot - The device slot
+ * @param chan - The channel number
+ * @param fd - A listening socket, owned by the multiplexer from now on
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  am_listen(struct AsyncMux *mux, int slot, int chan, int fd);
+
+/**
+ * Check if a slot's channels are listening
+ */
+int  am_listening(struct AsyncMux *mux, int slot);
+
+/**
+ * Watch another descriptor for input, func is called on the multiplexer thread
+ *
+ * @return 0 on success, < 0 if there are too many watches
+ */
+int  am_watch(struct AsyncMux *mux, int fd, AmFdFunc func, void *arg);
+
+/**
+ * Queue output from the PSP for the clients of a channel, never blocks on a
+ * socket. With AM_POLICY_BLOCK it waits until the clients have made room.
+ *
+ * @return Number of bytes queued, 0 if nobody is listening
+ */
+int  am_write(struct AsyncMux *mux, int slot, int chan, const void *data, int len);
+
+/**
+ * Wait for and handle events
+ *
+ * @param mux - The multiplexer
+ * @param timeout - Timeout in ms, -1 to wait forever
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  am_poll(struct AsyncMux *mux, int timeout);
+
+/**
+ * Close every socket, for use on exit
+ */
+void am_shutdown(struct AsyncMux *mux);
+
+/**
+ * Get a snapshot of a channel's statistics
+ *
+ * @return 0 on success, < 0 if the channel isn't listening
+ */
+int  am_get_stats(struct AsyncMux *mux, int slot, int chan, struct AmStats *stats);
+
+/**
+ * Parse a policy name
+ *
+ * @return The policy, < 0 if the name isn't valid
+ */
+int  am_parse_policy(const char *name);
+
+/**
+ * Get the name of a policy
+ */
+const char *am_policy_name(int policy);
+
+#endif
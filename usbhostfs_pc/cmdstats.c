@@ -0,0 +1,227 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * cmdstats.c - Per command counters and latency histograms for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ * Latencies go into log-linear buckets, the same idea as an HDR histogram
+ * with a fixed precision. Recording a call is a handful of relaxed atomic
+ * adds, cheap enough to leave on all the time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "usbhostfs_pc.h"
+#include "cmdstats.h"
+
+static const char *g_cmdnames[] =
+{
+	"hello", "bye", "open", "close", "read", "write", "lseek", "remove",
+	"mkdir", "rmdir", "dopen", "dread", "dclose", "getstat", "chstat",
+	"rename", "chdir", "ioctl", "devctl", "dreadbulk",
+	"readstream", "readfile",
+};
+
+static void add(uint64_t *p, uint64_t val)
+{
+	__atomic_fetch_add(p, val, __ATOMIC_RELAXED);
+}
+
+static uint64_t get(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static int bucket_index(uint64_t ns)
+{
+	int msb;
+
+	if(ns < CS_SUB)
+	{
+		return (int) ns;
+	}
+
+	msb = 63 - __builtin_clzll(ns);
+
+	return ((msb - CS_SUB_BITS + 1) * CS_SUB) + (int) ((ns >> (msb - CS_SUB_BITS)) & (CS_SUB - 1));
+}
+
+/* Largest value which lands in a bucket */
+static uint64_t bucket_upper(int idx)
+{
+	int group = idx / CS_SUB;
+	int sub = idx % CS_SUB;
+	int shift;
+
+	if(group == 0)
+	{
+		return sub;
+	}
+
+	shift = group - 1;
+
+	return (((uint64_t) (CS_SUB + sub)) << shift) + ((1ULL << shift) - 1);
+}
+
+void cs_reset(struct CmdStats *cs)
+{
+	memset(cs, 0, sizeof(*cs));
+	cs->start = get_time_ns();
+}
+
+struct CsCounter *cs_command(struct CmdStats *cs, uint32_t command)
+{
+	uint32_t num = command - HOSTFS_CMD_HELLO;
+
+	if(num < CS_MAX_CMDS)
+	{
+		return &cs->cmds[num];
+	}
+
+	return &cs->unknown;
+}
+
+void cs_record(struct CsCounter *c, uint64_t ns, uint64_t in, uint64_t out, int error)
+{
+	uint64_t max;
+
+	add(&c->calls, 1);
+	if(error)
+	{
+		add(&c->errors, 1);
+	}
+	if(in)
+	{
+		add(&c->bytes_in, in);
+	}
+	if(out)
+	{
+		add(&c->bytes_out, out);
+	}
+	add(&c->total_ns, ns);
+	add(&c->buckets[bucket_index(ns)], 1);
+
+	max = get(&c->max_ns);
+	while((ns > max) && (!__atomic_compare_exchange_n(&c->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+	{
+	}
+}
+
+void cs_add_out(struct CsCounter *c, uint64_t out)
+{
+	add(&c->bytes_out, out);
+}
+
+uint64_t cs_percentile(struct CsCounter *c, double pct)
+{
+	uint64_t total = 0;
+	uint64_t target;
+	uint64_t seen = 0;
+	uint64_t max = get(&c->max_ns);
+	int i;
+
+	for(i = 0; i < CS_BUCKETS; i++)
+	{
+		total += get(&c->buckets[i]);
+	}
+
+	if(total == 0)
+	{
+		return 0;
+	}
+
+	target = (uint64_t) (total * pct / 100.0 + 0.5);
+	if(target < 1)
+	{
+		target = 1;
+	}
+
+	for(i = 0; i < CS_BUCKETS; i++)
+	{
+		seen += get(&c->buckets[i]);
+		if(seen >= target)
+		{
+			uint64_t upper = bucket_upper(i);
+
+			return upper < max ? upper : max;
+		}
+	}
+
+	return max;
+}
+
+static void print_counter(FILE *fp, const char *name, struct CsCounter *c)
+{
+	uint64_t calls = get(&c->calls);
+
+	if((calls == 0) && (get(&c->bytes_out) == 0))
+	{
+		return;
+	}
+
+	fprintf(fp, "%-12s %10" PRIu64 " %7" PRIu64 " %11" PRIu64 " %11" PRIu64 " %9.1f %9.1f %9.1f %10.1f\n",
+			name, calls, get(&c->errors), get(&c->bytes_in) / 1024, get(&c->bytes_out) / 1024,
+			calls ? get(&c->total_ns) / 1e3 / calls : 0.0, cs_percentile(c, 50) / 1e3, cs_percentile(c, 99) / 1e3,
+			get(&c->max_ns) / 1e3);
+}
+
+void cs_print(struct CmdStats *cs, FILE *fp, const char **channames)
+{
+	char name[32];
+	uint64_t calls = 0;
+	double secs;
+	int i;
+
+	secs = (get_time_ns() - cs->start) / 1e9;
+	for(i = 0; i < CS_MAX_CMDS; i++)
+	{
+		calls += get(&cs->cmds[i].calls);
+	}
+
+	fprintf(fp, "HostFS commands : %" PRIu64 " in %.1fs (%.1f/s)\n", calls, secs, secs > 0 ? calls / secs : 0.0);
+	fprintf(fp, "%-12s %10s %7s %11s %11s %9s %9s %9s %10s\n", "command", "calls", "errors", "KiB in", "KiB out",
+			"avg us", "p50 us", "p99 us", "max us");
+
+	for(i = 0; i < CS_MAX_CMDS; i++)
+	{
+		if(i < (sizeof(g_cmdnames) / sizeof(g_cmdnames[0])))
+		{
+			print_counter(fp, g_cmdnames[i], &cs->cmds[i]);
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "cmd%08X", HOSTFS_CMD_HELLO + i);
+			print_counter(fp, name, &cs->cmds[i]);
+		}
+	}
+	print_counter(fp, "unknown", &cs->unknown);
+
+	for(i = 0; i < MAX_ASYNC_CHANNELS; i++)
+	{
+		const char *chan = (channames) && (channames[i]) ? channames[i] : NULL;
+
+		if(chan)
+		{
+			snprintf(name, sizeof(name), "async %s", chan);
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "async %d", i);
+		}
+		print_counter(fp, name, &cs->async[i]);
+
+		if(chan)
+		{
+			snprintf(name, sizeof(name), "bulk %s", chan);
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "bulk %d", i);
+		}
+		print_counter(fp, name, &cs->bulk[i]);
+	}
+}
@@ -0,0 +1,96 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * cmdstats.h - Per command counters and latency histograms for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __CMDSTATS_H__
+#define __CMDSTATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <usbhostfs.h>
+
+/* Histogram buckets are powers of two split into 2^CS_SUB_BITS linear steps,
+ * so any latency is recorded to within 12.5% */
+#define CS_SUB_BITS   3
+#define CS_SUB        (1 << CS_SUB_BITS)
+#define CS_BUCKETS    ((64 - CS_SUB_BITS + 1) * CS_SUB)
+/* Commands are HOSTFS_CMD_HELLO plus a small number */
+#define CS_MAX_CMDS   32
+
+struct CsCounter
+{
+	uint64_t calls;
+	/* Handler failed to read the command or send the reply */
+	uint64_t errors;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[CS_BUCKETS];
+};
+
+/* Everything is updated with relaxed atomics, any number of threads can record
+ * at once and a reader sees a slightly out of date but usable picture */
+struct CmdStats
+{
+	uint64_t start;
+	struct CsCounter cmds[CS_MAX_CMDS];
+	/* Commands with an unknown number */
+	struct CsCounter unknown;
+	/* Async and bulk packets per channel */
+	struct CsCounter async[MAX_ASYNC_CHANNELS];
+	struct CsCounter bulk[MAX_ASYNC_CHANNELS];
+};
+
+/**
+ * Clear the statistics
+ */
+void cs_reset(struct CmdStats *cs);
+
+/**
+ * Get the counter for a HostFS command
+ */
+struct CsCounter *cs_command(struct CmdStats *cs, uint32_t command);
+
+/**
+ * Record one call
+ *
+ * @param c - The counter
+ * @param ns - How long it took
+ * @param in - Bytes received from the PSP
+ * @param out - Bytes sent to the PSP
+ * @param error - Non-zero if it failed
+ */
+void cs_record(struct CsCounter *c, uint64_t ns, uint64_t in, uint64_t out, int error);
+
+/**
+ * Count bytes without a call, for data which isn't a reply
+ */
+void cs_add_out(struct CsCounter *c, uint64_t out);
+
+/**
+ * Get a latency percentile
+ *
+ * @param c - The counter
+ * @param pct - Percentile, 0 to 100
+ *
+ * @return The latency in ns, an upper bound within the bucket precision
+ */
+uint64_t cs_percentile(struct CsCounter *c, double pct);
+
+/**
+ * Print a table of everything which has been used
+ *
+ * @param cs - The statistics
+ * @param fp - Where to print
+ * @param channames - Names of the async channels, entries can be NULL
+ */
+void cs_print(struct CmdStats *cs, FILE *fp, const char **channames);
+
+#endif
@@ -0,0 +1,453 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * dircache.c - Directory snapshot cache for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ * Keeps the SceIoDirent array built for a HOSTFS_CMD_DOPEN so opening the
+ * same directory again does not need another scandir and stat of every
+ * entry. Each cached directory has an inotify watch, any change to the
+ * directory or the attributes of its entries throws the snapshot away.
+ * Open directory handles hold a reference so a snapshot stays valid until
+ * it is closed, even if the directory has changed since.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "usbhostfs_pc.h"
+#include "dircache.h"
+
+#ifdef __linux__
+#define DC_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB \
+		| IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+int dc_init(struct DirCache *dc, int max)
+{
+	memset(dc, 0, sizeof(*dc));
+	pthread_mutex_init(&dc->lock, NULL);
+	dc->ifd = -1;
+
+	if(max <= 0)
+	{
+		return 0;
+	}
+
+#ifdef __linux__
+	dc->ifd = inotify_init();
+	if(dc->ifd < 0)
+	{
+		fprintf(stderr, "Could not create inotify descriptor (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	fcntl(dc->ifd, F_SETFL, fcntl(dc->ifd, F_GETFL) | O_NONBLOCK);
+	fcntl(dc->ifd, F_SETFD, FD_CLOEXEC);
+	dc->max = max;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static void free_snap(struct DirSnap *snap)
+{
+	free(snap->ents);
+	free(snap);
+}
+
+/* Find the record of a watch, must be called with the lock held */
+static struct DcWatch *find_watch(struct DirCache *dc, int wd)
+{
+	struct DcWatch *w;
+
+	for(w = dc->watches; w; w = w->next)
+	{
+		if(w->wd == wd)
+		{
+			break;
+		}
+	}
+
+	return w;
+}
+
+/* Remove a watch if no cached snapshot or scan in progress uses it, must be
+ * called with the lock held */
+static void release_wd(struct DirCache *dc, int wd)
+{
+#ifdef __linux__
+	struct DcWatch **pp;
+	struct DirSnap *s;
+
+	for(s = dc->head; s; s = s->next)
+	{
+		if(s->wd == wd)
+		{
+			return;
+		}
+	}
+
+	for(pp = &dc->watches; *pp; pp = &(*pp)->next)
+	{
+		if((*pp)->wd == wd)
+		{
+			struct DcWatch *w = *pp;
+
+			if(w->scans > 0)
+			{
+				return;
+			}
+			*pp = w->next;
+			free(w);
+			break;
+		}
+	}
+
+	inotify_rm_watch(dc->ifd, wd);
+#endif
+}
+
+/* Take a snapshot out of the cache, must be called with the lock held */
+static void unlink_snap(struct DirCache *dc, struct DirSnap *snap)
+{
+	struct DirSnap **pp;
+
+	for(pp = &dc->head; *pp; pp = &(*pp)->next)
+	{
+		if(*pp == snap)
+		{
+			*pp = snap->next;
+			break;
+		}
+	}
+
+	snap->next = NULL;
+	snap->cached = 0;
+	dc->count--;
+
+	if(snap->wd >= 0)
+	{
+		/* Paths which resolve to the same directory share a watch */
+		release_wd(dc, snap->wd);
+	}
+	snap->wd = -1;
+
+	if(snap->refs == 0)
+	{
+		free_snap(snap);
+	}
+}
+
+/* Throw away snapshots for a watch descriptor, must be called with the lock held */
+static void invalidate_wd(struct DirCache *dc, int wd)
+{
+	struct DirSnap *snap;
+	struct DirSnap *next;
+
+	for(snap = dc->head; snap; snap = next)
+	{
+		next = snap->next;
+		if(snap->wd == wd)
+		{
+			V_PRINTF(2, "Directory %s changed, dropping snapshot\n", snap->path);
+			unlink_snap(dc, snap);
+			dc->stats.invalidated++;
+		}
+	}
+}
+
+/* Read any pending change events, must be called with the lock held. Every
+ * event is counted on its watch, so a scan running on another thread can
+ * tell its directory changed even though the event was read here. */
+static void drain_events(struct DirCache *dc)
+{
+#ifdef __linux__
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while(1)
+	{
+		ssize_t len;
+		char *p;
+
+		len = read(dc->ifd, buf, sizeof(buf));
+		if(len <= 0)
+		{
+			if((len < 0) && (errno == EINTR))
+			{
+				continue;
+			}
+			break;
+		}
+
+		for(p = buf; p < buf + len; )
+		{
+			struct inotify_event *ev = (struct inotify_event *) p;
+
+			if(ev->mask & IN_Q_OVERFLOW)
+			{
+				struct DcWatch *w;
+
+				/* Lost track of what changed, start again */
+				for(w = dc->watches; w; w = w->next)
+				{
+					w->changes++;
+				}
+				while(dc->head)
+				{
+					dc->stats.invalidated++;
+					unlink_snap(dc, dc->head);
+				}
+			}
+			else
+			{
+				struct DcWatch *w = find_watch(dc, ev->wd);
+
+				if(w)
+				{
+					w->changes++;
+				}
+
+				if(!(ev->mask & IN_IGNORED))
+				{
+					invalidate_wd(dc, ev->wd);
+				}
+			}
+
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+#endif
+}
+
+/* Make room for a new snapshot, must be called with the lock held */
+static void evict(struct DirCache *dc)
+{
+	while(dc->count >= dc->max)
+	{
+		struct DirSnap *snap;
+		struct DirSnap *old = NULL;
+
+		for(snap = dc->head; snap; snap = snap->next)
+		{
+			if((old == NULL) || (snap->last_used < old->last_used))
+			{
+				old = snap;
+			}
+		}
+
+		if(old == NULL)
+		{
+			break;
+		}
+
+		unlink_snap(dc, old);
+		dc->stats.evicted++;
+	}
+}
+
+int dc_get(struct DirCache *dc, const char *path, DcScanFunc scan, struct DirSnap **snap)
+{
+	struct DirSnap *p;
+	struct DcWatch *w = NULL;
+	uint64_t changes = 0;
+	int wd = -1;
+	int ret;
+
+	*snap = NULL;
+
+	pthread_mutex_lock(&dc->lock);
+	dc->stats.lookups++;
+	if(dc->ifd >= 0)
+	{
+		drain_events(dc);
+		for(p = dc->head; p; p = p->next)
+		{
+			if(strcmp(p->path, path) == 0)
+			{
+				p->refs++;
+				p->last_used = get_time_ns();
+				dc->stats.hits++;
+				pthread_mutex_unlock(&dc->lock);
+				V_PRINTF(2, "Using cached snapshot of %s\n", path);
+				*snap = p;
+				return 0;
+			}
+		}
+
+#ifdef __linux__
+		/* Watch before scanning so a change during the scan is not missed */
+		wd = inotify_add_watch(dc->ifd, path, DC_EVENTS | IN_ONLYDIR);
+		if(wd < 0)
+		{
+			V_PRINTF(1, "Could not watch directory %s (%s)\n", path, strerror(errno));
+		}
+		else
+		{
+			/* Paths which resolve to the same directory get the same wd */
+			w = find_watch(dc, wd);
+			if(w == NULL)
+			{
+				w = (struct DcWatch *) malloc(sizeof(struct DcWatch));
+				if(w == NULL)
+				{
+					inotify_rm_watch(dc->ifd, wd);
+					wd = -1;
+				}
+				else
+				{
+					memset(w, 0, sizeof(*w));
+					w->wd = wd;
+					w->next = dc->watches;
+					dc->watches = w;
+				}
+			}
+
+			if(w)
+			{
+				w->scans++;
+				changes = w->changes;
+			}
+		}
+#endif
+	}
+	dc->stats.misses++;
+	pthread_mutex_unlock(&dc->lock);
+
+	p = (struct DirSnap *) malloc(sizeof(struct DirSnap));
+	if(p != NULL)
+	{
+		memset(p, 0, sizeof(*p));
+		strncpy(p->path, path, PATH_MAX - 1);
+		p->wd = -1;
+		p->refs = 1;
+		ret = scan(path, &p->ents);
+	}
+	else
+	{
+		fprintf(stderr, "Could not allocate memory for directory snapshot\n");
+		ret = GETERROR(ENOMEM);
+	}
+
+	if(ret < 0)
+	{
+		free(p);
+		if(wd >= 0)
+		{
+			pthread_mutex_lock(&dc->lock);
+			w->scans--;
+			release_wd(dc, wd);
+			pthread_mutex_unlock(&dc->lock);
+		}
+		return ret;
+	}
+	p->count = ret;
+
+	pthread_mutex_lock(&dc->lock);
+	if(wd >= 0)
+	{
+		struct DirSnap *s;
+		int valid;
+
+		/* Don't cache it if anything changed while scanning, even if
+		 * another thread read the event */
+		drain_events(dc);
+		valid = (w->changes == changes);
+		w->scans--;
+
+		for(s = dc->head; s; s = s->next)
+		{
+			if(strcmp(s->path, path) == 0)
+			{
+				/* Someone else got there first, keep theirs */
+				valid = 0;
+			}
+		}
+
+		if(valid)
+		{
+			evict(dc);
+			p->wd = wd;
+			p->cached = 1;
+			p->last_used = get_time_ns();
+			p->next = dc->head;
+			dc->head = p;
+			dc->count++;
+		}
+		else
+		{
+			release_wd(dc, wd);
+		}
+	}
+	pthread_mutex_unlock(&dc->lock);
+
+	*snap = p;
+
+	return 0;
+}
+
+void dc_put(struct DirCache *dc, struct DirSnap *snap)
+{
+	if(snap == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&dc->lock);
+	snap->refs--;
+	if((snap->refs == 0) && (!snap->cached))
+	{
+		free_snap(snap);
+	}
+	pthread_mutex_unlock(&dc->lock);
+}
+
+void dc_flush(struct DirCache *dc)
+{
+	pthread_mutex_lock(&dc->lock);
+	while(dc->head)
+	{
+		unlink_snap(dc, dc->head);
+	}
+	pthread_mutex_unlock(&dc->lock);
+}
+
+void dc_destroy(struct DirCache *dc)
+{
+	dc_flush(dc);
+	while(dc->watches)
+	{
+		struct DcWatch *w = dc->watches;
+
+		dc->watches = w->next;
+		free(w);
+	}
+	if(dc->ifd >= 0)
+	{
+		close(dc->ifd);
+		dc->ifd = -1;
+	}
+	pthread_mutex_destroy(&dc->lock);
+}
+
+void dc_get_stats(struct DirCache *dc, struct DcStats *stats, int *count)
+{
+	pthread_mutex_lock(&dc->lock);
+	memcpy(stats, &dc->stats, sizeof(*stats));
+	if(count)
+	{
+		*count = dc->count;
+	}
+	pthread_mutex_unlock(&dc->lock);
+}
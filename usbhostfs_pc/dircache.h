@@ -0,0 +1,128 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * dircache.h - Directory snapshot cache for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __DIRCACHE_H__
+#define __DIRCACHE_H__
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include "psp_fileio.h"
+
+#define DC_DEF_MAX  64
+
+struct DirSnap
+{
+	struct DirSnap *next;
+	char path[PATH_MAX];
+	/* inotify watch descriptor, -1 if the directory is not watched */
+	int wd;
+	/* Number of open directory handles using the snapshot */
+	int refs;
+	/* Set while the snapshot is in the cache list */
+	int cached;
+	uint64_t last_used;
+	int count;
+	SceIoDirent *ents;
+};
+
+/* An inotify watch shared by the snapshots and scans of a directory */
+struct DcWatch
+{
+	struct DcWatch *next;
+	int wd;
+	/* Bumped for every event on the watch, a scan is only cached if this
+	 * didn't move while it ran */
+	uint64_t changes;
+	/* Number of scans in progress which rely on the watch */
+	int scans;
+};
+
+struct DcStats
+{
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t misses;
+	/* Snapshots thrown away because the directory changed */
+	uint64_t invalidated;
+	/* Snapshots thrown away to make room */
+	uint64_t evicted;
+};
+
+struct DirCache
+{
+	pthread_mutex_t lock;
+	/* inotify descriptor, -1 if snapshots can't be cached */
+	int ifd;
+	int max;
+	int count;
+	struct DirSnap *head;
+	struct DcWatch *watches;
+	struct DcStats stats;
+};
+
+/**
+ * Build the entries of a directory
+ *
+ * @param path - The host directory
+ * @param ents - Receives a malloc'ed array of entries
+ *
+ * @return Number of entries, < 0 (GETERROR) on error
+ */
+typedef int (*DcScanFunc)(const char *path, SceIoDirent **ents);
+
+/**
+ * Initialise the directory cache
+ *
+ * @param dc - The cache
+ * @param max - Maximum number of snapshots to keep, 0 disables caching
+ *
+ * @return 0 on success, < 0 if caching is not available
+ */
+int  dc_init(struct DirCache *dc, int max);
+
+/**
+ * Get a snapshot of a directory, scanning it if there is no valid one cached
+ *
+ * @param dc - The cache
+ * @param path - The resolved host directory
+ * @param scan - Function to build the entries on a miss
+ * @param snap - Receives the snapshot, release it with dc_put
+ *
+ * @return 0 on success, < 0 (GETERROR) on error
+ */
+int  dc_get(struct DirCache *dc, const char *path, DcScanFunc scan, struct DirSnap **snap);
+
+/**
+ * Release a snapshot returned by dc_get
+ */
+void dc_put(struct DirCache *dc, struct DirSnap *snap);
+
+/**
+ * Throw away all cached snapshots
+ */
+void dc_flush(struct DirCache *dc);
+
+/**
+ * Throw away the cache and close the inotify descriptor, all snapshots
+ * must have been released
+ */
+void dc_destroy(struct DirCache *dc);
+
+/**
+ * Get a snapshot of the cache statistics
+ *
+ * @param dc - The cache
+ * @param stats - Receives the statistics
+ * @param count - Receives the number of cached snapshots, can be NULL
+ */
+void dc_get_stats(struct DirCache *dc, struct DcStats *stats, int *count);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * fakepsp.c - Socket helpers for tools playing the PSP side of HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "usbhostfs_pc.h"
+#include "transport.h"
+#include "fakepsp.h"
+
+uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined BUILD_BIGENDIAN || defined _BIG_ENDIAN
+uint16_t swap16(uint16_t i)
+{
+	uint8_t *p = (uint8_t *) &i;
+
+	return (p[1] << 8) | p[0];
+}
+
+uint32_t swap32(uint32_t i)
+{
+	uint8_t *p = (uint8_t *) &i;
+
+	return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+uint64_t swap64(uint64_t i)
+{
+	return ((uint64_t) swap32(i) << 32) | swap32(i >> 32);
+}
+#endif
+
+int fake_connect(const char *addr)
+{
+	const char *colon;
+	int fd;
+
+	colon = strrchr(addr, ':');
+	if((addr[0] != '/') && ((colon) || (strspn(addr, "0123456789") == strlen(addr))))
+	{
+		struct sockaddr_in name;
+		char host[128] = "127.0.0.1";
+		int on = 1;
+
+		if(colon)
+		{
+			snprintf(host, sizeof(host), "%.*s", (int) (colon - addr), addr);
+			addr = colon + 1;
+		}
+
+		memset(&name, 0, sizeof(name));
+		name.sin_family = AF_INET;
+		name.sin_port = htons(atoi(addr));
+		if(host[0])
+		{
+			struct hostent *ent = gethostbyname(host);
+
+			if((ent == NULL) || (ent->h_addrtype != AF_INET))
+			{
+				fprintf(stderr, "Could not resolve %s\n", host);
+				return -1;
+			}
+			memcpy(&name.sin_addr, ent->h_addr_list[0], sizeof(name.sin_addr));
+		}
+
+		fd = socket(PF_INET, SOCK_STREAM, 0);
+		if(fd < 0)
+		{
+			perror("socket");
+			return -1;
+		}
+
+		if(connect(fd, (struct sockaddr *) &name, sizeof(name)) < 0)
+		{
+			perror("connect");
+			close(fd);
+			return -1;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	else
+	{
+		struct sockaddr_un name;
+
+		memset(&name, 0, sizeof(name));
+		name.sun_family = AF_UNIX;
+		snprintf(name.sun_path, sizeof(name.sun_path), "%s", addr);
+
+		fd = socket(PF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0)
+		{
+			perror("socket");
+			return -1;
+		}
+
+		if(connect(fd, (struct sockaddr *) &name, sizeof(name)) < 0)
+		{
+			perror("connect");
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+int fake_read_all(int fd, void *data, int len)
+{
+	char *p = (char *) data;
+	int readlen = 0;
+
+	while(readlen < len)
+	{
+		int ret = recv(fd, p + readlen, len - readlen, 0);
+
+		if(ret <= 0)
+		{
+			if((ret < 0) && (errno == EINTR))
+			{
+				continue;
+			}
+			return -1;
+		}
+		readlen += ret;
+	}
+
+	return len;
+}
+
+int fake_write_all(int fd, const void *data, int len)
+{
+	const char *p = (const char *) data;
+	int written = 0;
+
+	while(written < len)
+	{
+		int ret = send(fd, p + written, len - written, MSG_NOSIGNAL);
+
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		written += ret;
+	}
+
+	return len;
+}
+
+int fake_send(int fd, const void *data, int len)
+{
+	struct TransFrame frame;
+
+	frame.size = LE32(len);
+	frame.ep = LE32(TRANS_EP_IN);
+
+	if((fake_write_all(fd, &frame, sizeof(frame)) < 0) || (fake_write_all(fd, data, len) < 0))
+	{
+		fprintf(stderr, "Error sending to server (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return len;
+}
@@ -0,0 +1,44 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * fakepsp.h - Socket helpers for tools playing the PSP side of HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __FAKEPSP_H__
+#define __FAKEPSP_H__
+
+/**
+ * Connect to a server started with -l
+ *
+ * @param addr - [host:]port for TCP, otherwise the path of a Unix socket
+ *
+ * @return The socket, < 0 on error
+ */
+int fake_connect(const char *addr);
+
+/**
+ * Read exactly len bytes
+ *
+ * @return len on success, < 0 on error or if the server closed the socket
+ */
+int fake_read_all(int fd, void *data, int len);
+
+/**
+ * Write exactly len bytes
+ *
+ * @return len on success, < 0 on error
+ */
+int fake_write_all(int fd, const void *data, int len);
+
+/**
+ * Send one USB transfer worth of data, as the PSP would on its IN endpoint
+ *
+ * @return len on success, < 0 on error
+ */
+int fake_send(int fd, const void *data, int len);
+
+#endif
@@ -0,0 +1,1053 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * filecache.c - Per file read-ahead cache for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ * Once a file is being read sequentially the blocks following the last
+ * read are queued to a background I/O thread, so the next HOSTFS_CMD_READ
+ * can be answered from memory while the disk works on the one after. All
+ * file access goes through pread/pwrite on a position we track ourselves,
+ * so the I/O thread never disturbs the descriptor's offset.
+ *
+ * Where the kernel has io_uring the queued blocks are all submitted to a
+ * ring at once and a reaper thread completes them, so a slow disk or NFS
+ * mount has the whole read-ahead in flight rather than one block at a
+ * time. Otherwise a few threads take blocks off the queue.
+ *
+ * Small writes are merged into a per file write-behind buffer and
+ * acknowledged at once. The buffer is written out when it fills, when a
+ * write is not adjacent to it, on read, seek or close, or by the I/O thread
+ * once it has been dirty for FC_WB_DELAY_MS. A failed flush is held and
+ * returned by the next operation on the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include "usbhostfs_pc.h"
+#include "filecache.h"
+#include "iouring.h"
+
+static int fc_pread(int fd, char *data, int len, int64_t ofs)
+{
+	int bytesread = 0;
+
+	while(bytesread < len)
+	{
+		ssize_t ret;
+
+		ret = pread(fd, data + bytesread, len - bytesread, ofs + bytesread);
+		if(ret < 0)
+		{
+			if(errno != EINTR)
+			{
+				return GETERROR(errno);
+			}
+		}
+		else if(ret == 0)
+		{
+			break;
+		}
+		else
+		{
+			bytesread += ret;
+		}
+	}
+
+	return bytesread;
+}
+
+static int file_pread(struct FileCache *f, char *data, int len, int64_t ofs)
+{
+	if(f->source)
+	{
+		return f->source(f->source_arg, data, len, ofs);
+	}
+
+	return fc_pread(f->fd, data, len, ofs);
+}
+
+/* Write out a file's write-behind buffer, must be called with the pool lock held */
+static void wb_flush(struct FileCache *f, int timed)
+{
+	struct FcPool *pool = f->pool;
+	struct FileCache **pp;
+	int byteswrite = 0;
+
+	if(f->wb_dirty)
+	{
+		for(pp = &pool->dirty; *pp; pp = &(*pp)->wb_next)
+		{
+			if(*pp == f)
+			{
+				*pp = f->wb_next;
+				break;
+			}
+		}
+		f->wb_next = NULL;
+		f->wb_dirty = 0;
+	}
+
+	if(f->wb_len == 0)
+	{
+		return;
+	}
+
+	V_PRINTF(2, "Flushing %d bytes at offset %" PRId64 " on fd %d\n", f->wb_len, f->wb_ofs, f->fd);
+
+	while(byteswrite < f->wb_len)
+	{
+		ssize_t ret;
+
+		if(f->append)
+		{
+			ret = write(f->fd, f->wb + byteswrite, f->wb_len - byteswrite);
+		}
+		else
+		{
+			ret = pwrite(f->fd, f->wb + byteswrite, f->wb_len - byteswrite, f->wb_ofs + byteswrite);
+		}
+
+		if(ret < 0)
+		{
+			if(errno != EINTR)
+			{
+				fprintf(stderr, "Error writing to file (%s)\n", strerror(errno));
+				f->wb_error = GETERROR(errno);
+				break;
+			}
+		}
+		else if(ret == 0)
+		{
+			f->wb_error = GETERROR(EIO);
+			break;
+		}
+		else
+		{
+			byteswrite += ret;
+		}
+	}
+
+	if(f->wb_error)
+	{
+		pool->stats.wb_errors++;
+	}
+
+	if(f->append)
+	{
+		off_t ofs = lseek(f->fd, 0, SEEK_CUR);
+
+		if(ofs >= 0)
+		{
+			f->pos = ofs;
+			f->last_end = ofs;
+		}
+	}
+
+	f->wb_len = 0;
+	pool->stats.wb_flushes++;
+	if(timed)
+	{
+		pool->stats.wb_timed++;
+	}
+}
+
+/* Return and clear any held write error, must be called with the pool lock held */
+static int wb_take_error(struct FileCache *f)
+{
+	int ret = f->wb_error;
+
+	f->wb_error = 0;
+
+	return ret;
+}
+
+/* Finish a read-ahead block, must be called with the pool lock held */
+static void block_done(struct FcPool *pool, struct FcBlock *blk, int res)
+{
+	blk->busy = 0;
+	blk->res = res;
+	blk->state = FC_BLOCK_READY;
+	blk->file->pending--;
+	if(blk->dropped)
+	{
+		blk->file = NULL;
+		blk->next = pool->free;
+		pool->free = blk;
+	}
+	pthread_cond_broadcast(&pool->done);
+}
+
+/* Send everything queued to the ring, must be called with the pool lock held.
+ * Anything which doesn't fit stays queued for the I/O thread. */
+static void ring_submit(struct FcPool *pool)
+{
+	struct FcBlock *blk;
+	int count = 0;
+
+	while((blk = pool->qhead) != NULL)
+	{
+		/* Files without a descriptor are left to the I/O thread */
+		if((blk->file->source) || (ur_prep_read(&pool->ring, blk->file->fd, blk->data, blk->len, blk->ofs, (uint64_t) (uintptr_t) blk) < 0))
+		{
+			break;
+		}
+
+		pool->qhead = blk->qnext;
+		if(pool->qhead == NULL)
+		{
+			pool->qtail = NULL;
+		}
+		blk->qnext = NULL;
+		blk->busy = 1;
+		count++;
+	}
+
+	/* On failure they stay in the ring and go with the next submit */
+	if(count > 0)
+	{
+		ur_submit(&pool->ring);
+	}
+}
+
+static void *fc_reaper(void *arg)
+{
+	struct FcPool *pool = (struct FcPool *) arg;
+
+	while(1)
+	{
+		struct FcBlock *blk;
+		uint64_t user;
+		int res;
+
+		if(ur_wait(&pool->ring, &user, &res) < 0)
+		{
+			break;
+		}
+
+		if(user == 0)
+		{
+			/* Woken to stop */
+			break;
+		}
+
+		blk = (struct FcBlock *) (uintptr_t) user;
+		if(res < 0)
+		{
+			res = GETERROR(-res);
+		}
+		else if((res > 0) && (res < blk->len))
+		{
+			/* Short of the end of the file, the rest is read here. The file
+			 * can't be closed while the block is busy. */
+			int more = fc_pread(blk->file->fd, blk->data + res, blk->len - res, blk->ofs + res);
+
+			res = more < 0 ? more : res + more;
+			pthread_mutex_lock(&pool->lock);
+			pool->stats.ring_short++;
+			pthread_mutex_unlock(&pool->lock);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		pool->stats.ring_reads++;
+		block_done(pool, blk, res);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+static void *fc_thread(void *arg)
+{
+	struct FcPool *pool = (struct FcPool *) arg;
+	uint64_t delay = (uint64_t) FC_WB_DELAY_MS * 1000000ULL;
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->running)
+	{
+		struct FcBlock *blk;
+		int res;
+
+		blk = pool->qhead;
+		if(blk == NULL)
+		{
+			if(pool->dirty)
+			{
+				uint64_t now = get_time_ns();
+				uint64_t due = pool->dirty->wb_time + delay;
+
+				if(now >= due)
+				{
+					wb_flush(pool->dirty, 1);
+				}
+				else
+				{
+					struct timespec ts;
+
+					ts.tv_sec = due / 1000000000ULL;
+					ts.tv_nsec = due % 1000000000ULL;
+					pthread_cond_timedwait(&pool->work, &pool->lock, &ts);
+				}
+			}
+			else
+			{
+				pthread_cond_wait(&pool->work, &pool->lock);
+			}
+			continue;
+		}
+
+		pool->qhead = blk->qnext;
+		if(pool->qhead == NULL)
+		{
+			pool->qtail = NULL;
+		}
+		blk->qnext = NULL;
+		blk->busy = 1;
+		pthread_mutex_unlock(&pool->lock);
+
+		res = file_pread(blk->file, blk->data, blk->len, blk->ofs);
+
+		pthread_mutex_lock(&pool->lock);
+		block_done(pool, blk, res);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+int fc_pool_init(struct FcPool *pool, int nblocks, int depth, int wbsize, int threads)
+{
+	pthread_condattr_t attr;
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	/* The write-behind timer runs off the monotonic clock, same as get_time_ns */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->work, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&pool->done, NULL);
+
+	if((depth > 0) && (nblocks > 0))
+	{
+		pool->mem = malloc((size_t) nblocks * FC_BLOCK_SIZE);
+		pool->blocks = calloc(nblocks, sizeof(struct FcBlock));
+		if((pool->mem == NULL) || (pool->blocks == NULL))
+		{
+			fprintf(stderr, "Could not allocate read-ahead pool of %d blocks\n", nblocks);
+			free(pool->mem);
+			free(pool->blocks);
+			pool->mem = NULL;
+			pool->blocks = NULL;
+			return -1;
+		}
+
+		for(i = 0; i < nblocks; i++)
+		{
+			pool->blocks[i].data = pool->mem + (size_t) i * FC_BLOCK_SIZE;
+			pool->blocks[i].next = pool->free;
+			pool->free = &pool->blocks[i];
+		}
+
+		pool->nblocks = nblocks;
+		pool->depth = depth < nblocks ? depth : nblocks;
+	}
+
+	if(wbsize > 0)
+	{
+		pool->wbsize = wbsize;
+	}
+
+	if((pool->depth == 0) && (pool->wbsize == 0))
+	{
+		/* Nothing to do in the background, reads and writes go straight through */
+		return 0;
+	}
+
+	/* One more entry than blocks so the wake up always fits */
+	if((pool->depth > 0) && (threads == 0) && (ur_init(&pool->ring, pool->nblocks + 1) == 0))
+	{
+		if(pthread_create(&pool->reaper, NULL, fc_reaper, pool))
+		{
+			fprintf(stderr, "Could not create file cache reaper thread\n");
+			ur_exit(&pool->ring);
+		}
+		else
+		{
+			pool->uring = 1;
+		}
+	}
+
+	/* With the ring the I/O thread only runs the write-behind timer */
+	if(threads <= 0)
+	{
+		threads = pool->uring ? 1 : FC_DEF_THREADS;
+	}
+	if(threads > FC_MAX_THREADS)
+	{
+		threads = FC_MAX_THREADS;
+	}
+
+	V_PRINTF(1, "File cache using %s with %d thread(s)\n", pool->uring ? "io_uring" : "pread", threads);
+
+	pool->running = 1;
+	for(i = 0; i < threads; i++)
+	{
+		if(pthread_create(&pool->thids[i], NULL, fc_thread, pool))
+		{
+			break;
+		}
+		pool->nthreads++;
+	}
+
+	if(pool->nthreads == 0)
+	{
+		fprintf(stderr, "Could not create file cache thread\n");
+		pool->running = 0;
+		pool->depth = 0;
+		pool->wbsize = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void fc_pool_destroy(struct FcPool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->running = 0;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(i = 0; i < pool->nthreads; i++)
+	{
+		pthread_join(pool->thids[i], NULL);
+	}
+	pool->nthreads = 0;
+
+	/* Every file is closed so nothing is in flight, just wake the reaper */
+	if(pool->uring)
+	{
+		int ret;
+
+		pthread_mutex_lock(&pool->lock);
+		ret = ur_prep_nop(&pool->ring);
+		if(ret == 0)
+		{
+			ret = ur_submit(&pool->ring);
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		if(ret > 0)
+		{
+			pthread_join(pool->reaper, NULL);
+		}
+		else
+		{
+			pthread_detach(pool->reaper);
+		}
+		ur_exit(&pool->ring);
+		pool->uring = 0;
+	}
+
+	free(pool->mem);
+	free(pool->blocks);
+	pool->mem = NULL;
+	pool->blocks = NULL;
+	pool->free = NULL;
+	pool->depth = 0;
+	pool->wbsize = 0;
+
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+void fc_get_stats(struct FcPool *pool, struct FcStats *stats)
+{
+	pthread_mutex_lock(&pool->lock);
+	memcpy(stats, &pool->stats, sizeof(*stats));
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Remove a block from its file, must be called with the pool lock held */
+static void drop_block(struct FileCache *f, struct FcBlock *blk)
+{
+	struct FcPool *pool = f->pool;
+	struct FcBlock **pp;
+
+	for(pp = &f->head; *pp; pp = &(*pp)->next)
+	{
+		if(*pp == blk)
+		{
+			*pp = blk->next;
+			break;
+		}
+	}
+
+	if(f->tail == blk)
+	{
+		struct FcBlock *p;
+
+		f->tail = NULL;
+		for(p = f->head; p; p = p->next)
+		{
+			f->tail = p;
+		}
+	}
+
+	blk->next = NULL;
+	if(!blk->used)
+	{
+		pool->stats.wasted++;
+	}
+
+	if(blk->busy)
+	{
+		/* The I/O thread will free it when the read completes */
+		blk->dropped = 1;
+		return;
+	}
+
+	if(blk->state == FC_BLOCK_PENDING)
+	{
+		/* Still queued, pull it out before the I/O thread gets to it */
+		for(pp = &pool->qhead; *pp; pp = &(*pp)->qnext)
+		{
+			if(*pp == blk)
+			{
+				*pp = blk->qnext;
+				break;
+			}
+		}
+
+		pool->qtail = NULL;
+		for(pp = &pool->qhead; *pp; pp = &(*pp)->qnext)
+		{
+			pool->qtail = *pp;
+		}
+
+		blk->qnext = NULL;
+		f->pending--;
+	}
+
+	blk->file = NULL;
+	blk->next = pool->free;
+	pool->free = blk;
+}
+
+static void drop_all(struct FileCache *f)
+{
+	while(f->head)
+	{
+		drop_block(f, f->head);
+	}
+	f->seq = 0;
+}
+
+/* Queue up blocks following the last cached one, must be called with the pool lock held */
+static void schedule(struct FileCache *f, int blocksize)
+{
+	struct FcPool *pool = f->pool;
+	struct FcBlock *blk;
+	int64_t next;
+	int count = 0;
+
+	for(blk = f->head; blk; blk = blk->next)
+	{
+		count++;
+	}
+
+	if(f->tail)
+	{
+		if((f->tail->state == FC_BLOCK_READY) && (f->tail->res < f->tail->len))
+		{
+			/* Already hit the end of the file */
+			return;
+		}
+		next = f->tail->ofs + f->tail->len;
+	}
+	else
+	{
+		next = f->pos;
+	}
+
+	while((count < pool->depth) && (pool->free) && (next < f->size))
+	{
+		blk = pool->free;
+		pool->free = blk->next;
+
+		blk->next = NULL;
+		blk->qnext = NULL;
+		blk->file = f;
+		blk->ofs = next;
+		blk->len = blocksize;
+		blk->res = 0;
+		blk->state = FC_BLOCK_PENDING;
+		blk->busy = 0;
+		blk->dropped = 0;
+		blk->used = 0;
+
+		if(f->tail)
+		{
+			f->tail->next = blk;
+		}
+		else
+		{
+			f->head = blk;
+		}
+		f->tail = blk;
+
+		if(pool->qtail)
+		{
+			pool->qtail->qnext = blk;
+		}
+		else
+		{
+			pool->qhead = blk;
+		}
+		pool->qtail = blk;
+
+		f->pending++;
+		pool->stats.prefetched++;
+		next += blocksize;
+		count++;
+	}
+
+	if(pool->uring)
+	{
+		ring_submit(pool);
+	}
+
+	pthread_cond_signal(&pool->work);
+}
+
+void fc_open(struct FcPool *pool, struct FileCache *f, int fd, int append)
+{
+	struct stat st;
+
+	memset(f, 0, sizeof(*f));
+	f->pool = pool;
+	f->fd = fd;
+	f->append = append;
+	if(fstat(fd, &st) == 0)
+	{
+		f->size = st.st_size;
+	}
+}
+
+void fc_open_source(struct FcPool *pool, struct FileCache *f, FcSource source, void *arg, int64_t size)
+{
+	memset(f, 0, sizeof(*f));
+	f->pool = pool;
+	f->fd = -1;
+	f->source = source;
+	f->source_arg = arg;
+	f->size = size;
+}
+
+int fc_close(struct FileCache *f)
+{
+	struct FcPool *pool = f->pool;
+	int ret;
+
+	if(pool == NULL)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	drop_all(f);
+	wb_flush(f, 0);
+	while(f->pending > 0)
+	{
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	ret = wb_take_error(f);
+	pthread_mutex_unlock(&pool->lock);
+
+	free(f->wb);
+	f->wb = NULL;
+	f->pool = NULL;
+
+	return ret;
+}
+
+void fc_flush(struct FileCache *f)
+{
+	struct FcPool *pool = f->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	wb_flush(f, 0);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void fc_invalidate(struct FileCache *f)
+{
+	struct FcPool *pool = f->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	wb_flush(f, 0);
+	drop_all(f);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int64_t fc_remaining(struct FileCache *f)
+{
+	struct FcPool *pool = f->pool;
+	struct stat st;
+	int64_t ret = -1;
+
+	pthread_mutex_lock(&pool->lock);
+	wb_flush(f, 0);
+	if(f->wb_error)
+	{
+		ret = wb_take_error(f);
+	}
+	else if(f->source)
+	{
+		ret = f->size > f->pos ? f->size - f->pos : 0;
+	}
+	else if((fstat(f->fd, &st) == 0) && (S_ISREG(st.st_mode)))
+	{
+		f->size = st.st_size;
+		ret = f->size > f->pos ? f->size - f->pos : 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+int fc_read(struct FileCache *f, void *data, int len)
+{
+	struct FcPool *pool = f->pool;
+	char *p = (char *) data;
+	int cached = 0;
+	int copied = 0;
+	int eof = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	wb_flush(f, 0);
+	if(f->wb_error)
+	{
+		int ret = wb_take_error(f);
+
+		pthread_mutex_unlock(&pool->lock);
+		return ret;
+	}
+
+	pool->stats.reads++;
+	if(f->pos == f->last_end)
+	{
+		f->seq++;
+	}
+	else
+	{
+		drop_all(f);
+	}
+
+	while(copied < len)
+	{
+		struct FcBlock *blk;
+		int64_t avail;
+		int n;
+
+		/* Throw away anything wholly before the current position */
+		while((f->head) && (f->head->ofs + f->head->len <= f->pos))
+		{
+			drop_block(f, f->head);
+		}
+
+		blk = f->head;
+		if((blk == NULL) || (blk->ofs > f->pos))
+		{
+			break;
+		}
+
+		if(blk->state == FC_BLOCK_PENDING)
+		{
+			pool->stats.waits++;
+			while(blk->state == FC_BLOCK_PENDING)
+			{
+				pthread_cond_wait(&pool->done, &pool->lock);
+			}
+		}
+
+		if(blk->res < 0)
+		{
+			/* Let the direct read report the error */
+			drop_block(f, blk);
+			break;
+		}
+
+		avail = blk->ofs + blk->res - f->pos;
+		if(avail <= 0)
+		{
+			eof = 1;
+			break;
+		}
+
+		n = (avail < (len - copied)) ? (int) avail : (len - copied);
+		memcpy(p + copied, blk->data + (f->pos - blk->ofs), n);
+		blk->used = 1;
+		copied += n;
+		f->pos += n;
+
+		if(f->pos >= blk->ofs + blk->res)
+		{
+			if(blk->res < blk->len)
+			{
+				eof = 1;
+			}
+			drop_block(f, blk);
+		}
+
+		if(eof)
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	cached = copied;
+	if((copied < len) && (!eof))
+	{
+		int ret;
+
+		ret = file_pread(f, p + copied, len - copied, f->pos);
+		if(ret < 0)
+		{
+			if(copied == 0)
+			{
+				return ret;
+			}
+		}
+		else
+		{
+			if(ret < (len - copied))
+			{
+				eof = 1;
+			}
+			copied += ret;
+			f->pos += ret;
+		}
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if(cached == copied)
+	{
+		pool->stats.hits++;
+	}
+	else if(cached > 0)
+	{
+		pool->stats.partial++;
+	}
+	else
+	{
+		pool->stats.misses++;
+	}
+	pool->stats.hit_bytes += cached;
+	pool->stats.miss_bytes += copied - cached;
+
+	f->last_end = f->pos;
+	if(f->pos > f->size)
+	{
+		f->size = f->pos;
+	}
+
+	if((!eof) && (f->seq > 0) && (pool->depth > 0))
+	{
+		schedule(f, len < FC_BLOCK_SIZE ? len : FC_BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	V_PRINTF(2, "Cached read fd %d len %d returned %d (%d cached)\n", f->fd, len, copied, cached);
+
+	return copied;
+}
+
+int fc_write(struct FileCache *f, const void *data, int len)
+{
+	struct FcPool *pool = f->pool;
+	const char *p = (const char *) data;
+	int byteswrite = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	/* Anything cached could now be stale */
+	drop_all(f);
+
+	if((f->wb_len > 0) && ((f->wb_len + len > pool->wbsize) || ((!f->append) && (f->wb_ofs + f->wb_len != f->pos))))
+	{
+		wb_flush(f, 0);
+	}
+
+	if(f->wb_error)
+	{
+		byteswrite = wb_take_error(f);
+		pthread_mutex_unlock(&pool->lock);
+		return byteswrite;
+	}
+
+	if((len < pool->wbsize) && (f->wb == NULL))
+	{
+		f->wb = malloc(pool->wbsize);
+	}
+
+	if((len < pool->wbsize) && (f->wb != NULL))
+	{
+		if(f->wb_len == 0)
+		{
+			struct FileCache **pp;
+
+			f->wb_ofs = f->pos;
+			f->wb_time = get_time_ns();
+			for(pp = &pool->dirty; *pp; pp = &(*pp)->wb_next);
+			*pp = f;
+			f->wb_next = NULL;
+			f->wb_dirty = 1;
+			pthread_cond_signal(&pool->work);
+		}
+		else
+		{
+			pool->stats.wb_merged++;
+		}
+
+		memcpy(f->wb + f->wb_len, p, len);
+		f->wb_len += len;
+		f->pos += len;
+		f->last_end = f->pos;
+		if(f->pos > f->size)
+		{
+			f->size = f->pos;
+		}
+		pool->stats.wb_writes++;
+
+		if(f->wb_len >= pool->wbsize)
+		{
+			wb_flush(f, 0);
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		return len;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	while(byteswrite < len)
+	{
+		ssize_t ret;
+
+		if(f->append)
+		{
+			ret = write(f->fd, p + byteswrite, len - byteswrite);
+		}
+		else
+		{
+			ret = pwrite(f->fd, p + byteswrite, len - byteswrite, f->pos + byteswrite);
+		}
+
+		if(ret < 0)
+		{
+			if(errno != EINTR)
+			{
+				fprintf(stderr, "Error writing to file (%s)\n", strerror(errno));
+				byteswrite = GETERROR(errno);
+				break;
+			}
+		}
+		else if(ret == 0)
+		{
+			break;
+		}
+		else
+		{
+			byteswrite += ret;
+		}
+	}
+
+	if(f->append)
+	{
+		off_t ofs = lseek(f->fd, 0, SEEK_CUR);
+
+		if(ofs >= 0)
+		{
+			f->pos = ofs;
+		}
+	}
+	else if(byteswrite > 0)
+	{
+		f->pos += byteswrite;
+	}
+
+	if(f->pos > f->size)
+	{
+		f->size = f->pos;
+	}
+	f->last_end = f->pos;
+
+	return byteswrite;
+}
+
+int64_t fc_seek(struct FileCache *f, int64_t ofs, int whence)
+{
+	int64_t newpos;
+	int ret;
+
+	pthread_mutex_lock(&f->pool->lock);
+	wb_flush(f, 0);
+	ret = wb_take_error(f);
+	pthread_mutex_unlock(&f->pool->lock);
+	if(ret < 0)
+	{
+		return ret;
+	}
+
+	switch(whence)
+	{
+		case SEEK_SET: newpos = ofs;
+					   break;
+		case SEEK_CUR: newpos = f->pos + ofs;
+					   break;
+		case SEEK_END: if(f->source)
+					   {
+						   newpos = f->size + ofs;
+						   break;
+					   }
+					   newpos = lseek(f->fd, (off_t) ofs, SEEK_END);
+					   if(newpos < 0)
+					   {
+						   return -1;
+					   }
+					   break;
+		default: errno = EINVAL;
+				 return -1;
+	};
+
+	if(newpos < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(newpos != f->pos)
+	{
+		pthread_mutex_lock(&f->pool->lock);
+		drop_all(f);
+		pthread_mutex_unlock(&f->pool->lock);
+		f->pos = newpos;
+	}
+
+	return newpos;
+}
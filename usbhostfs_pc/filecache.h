@@ -0,0 +1,250 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * filecache.h - Per file read-ahead cache for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __FILECACHE_H__
+#define __FILECACHE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "iouring.h"
+
+#define FC_BLOCK_SIZE   (64*1024)
+#define FC_DEF_BLOCKS   64
+#define FC_DEF_DEPTH    4
+/* Write-behind buffer size per file, and how long dirty data may sit in it */
+#define FC_DEF_WBSIZE   (64*1024)
+#define FC_WB_DELAY_MS  200
+/* Read-ahead I/O threads used when io_uring is not */
+#define FC_DEF_THREADS  2
+#define FC_MAX_THREADS  16
+
+enum FcBlockState
+{
+	FC_BLOCK_PENDING = 0,
+	FC_BLOCK_READY   = 1,
+};
+
+struct FileCache;
+
+/* Reads a file with no descriptor, such as one inside a disc image.
+ * Returns the number of bytes read, < 0 (GETERROR) on error. */
+typedef int (*FcSource)(void *arg, char *data, int len, int64_t ofs);
+
+struct FcBlock
+{
+	/* Link in the file's block list, or the free list */
+	struct FcBlock *next;
+	/* Link in the I/O thread queue */
+	struct FcBlock *qnext;
+	struct FileCache *file;
+	int64_t ofs;
+	int len;
+	/* Bytes read, or an error code */
+	int res;
+	int state;
+	/* Set while the I/O thread is reading into the block */
+	int busy;
+	/* Set if the block was thrown away while busy */
+	int dropped;
+	/* Set once any of the block has been returned to the PSP */
+	int used;
+	char *data;
+};
+
+struct FcStats
+{
+	uint64_t reads;
+	/* Reads served entirely from the cache */
+	uint64_t hits;
+	/* Reads partly served from the cache */
+	uint64_t partial;
+	/* Reads which went straight to the file */
+	uint64_t misses;
+	/* Reads which had to wait on a prefetch in progress */
+	uint64_t waits;
+	uint64_t hit_bytes;
+	uint64_t miss_bytes;
+	/* Blocks prefetched, and the number thrown away unused */
+	uint64_t prefetched;
+	uint64_t wasted;
+	/* Writes accepted into a write-behind buffer, and those merged with earlier data */
+	uint64_t wb_writes;
+	uint64_t wb_merged;
+	/* Buffer flushes, and those forced by the timer */
+	uint64_t wb_flushes;
+	uint64_t wb_timed;
+	/* Write errors held back for the next operation */
+	uint64_t wb_errors;
+	/* Blocks read through io_uring, and those it returned short */
+	uint64_t ring_reads;
+	uint64_t ring_short;
+};
+
+struct FcPool
+{
+	pthread_mutex_t lock;
+	/* Signalled when a block is queued or a file becomes dirty */
+	pthread_cond_t work;
+	/* Signalled when a block has been read */
+	pthread_cond_t done;
+	pthread_t thids[FC_MAX_THREADS];
+	int nthreads;
+	int running;
+	/* Set if read-ahead goes through the ring rather than the threads */
+	int uring;
+	struct IoRing ring;
+	pthread_t reaper;
+	/* Number of blocks to read ahead per file, 0 disables */
+	int depth;
+	int nblocks;
+	char *mem;
+	struct FcBlock *blocks;
+	struct FcBlock *free;
+	struct FcBlock *qhead;
+	struct FcBlock *qtail;
+	/* Size of each file's write-behind buffer, 0 disables */
+	int wbsize;
+	/* Files with unflushed write-behind data, oldest first */
+	struct FileCache *dirty;
+	struct FcStats stats;
+};
+
+struct FileCache
+{
+	struct FcPool *pool;
+	int fd;
+	/* Used in place of fd if set, the file is read-only and its size fixed */
+	FcSource source;
+	void *source_arg;
+	int append;
+	/* Current file position, all reads and writes are positional */
+	int64_t pos;
+	/* End of the last read, used to detect sequential access */
+	int64_t last_end;
+	/* Number of sequential reads in a row */
+	int seq;
+	/* Size of the file when last checked, no point reading past it */
+	int64_t size;
+	/* Number of blocks queued or being read by the I/O thread */
+	int pending;
+	struct FcBlock *head;
+	struct FcBlock *tail;
+	/* Write-behind buffer, allocated on the first small write */
+	char *wb;
+	/* File offset and length of the buffered data */
+	int64_t wb_ofs;
+	int wb_len;
+	/* Time the buffer first became dirty */
+	uint64_t wb_time;
+	/* Link in the pool's dirty list */
+	struct FileCache *wb_next;
+	int wb_dirty;
+	/* Error from a write-behind flush, returned by the next operation */
+	int wb_error;
+};
+
+/**
+ * Initialise a read-ahead pool and start its I/O threads
+ *
+ * @param pool - The pool
+ * @param nblocks - Number of FC_BLOCK_SIZE blocks shared by all files
+ * @param depth - Number of blocks to read ahead of a sequential reader
+ * @param wbsize - Size of the per file write-behind buffer, 0 to write through
+ * @param threads - Number of read-ahead threads, 0 to use io_uring where
+ * the kernel has it and FC_DEF_THREADS where it doesn't
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  fc_pool_init(struct FcPool *pool, int nblocks, int depth, int wbsize, int threads);
+
+/**
+ * Stop the I/O thread and free the pool, all files must have been closed
+ */
+void fc_pool_destroy(struct FcPool *pool);
+
+/**
+ * Get a snapshot of the pool statistics
+ */
+void fc_get_stats(struct FcPool *pool, struct FcStats *stats);
+
+/**
+ * Attach the cache to a newly opened file
+ *
+ * @param pool - The pool to take blocks from
+ * @param f - The file cache
+ * @param fd - The opened file descriptor
+ * @param append - Non-zero if the file was opened for append
+ */
+void fc_open(struct FcPool *pool, struct FileCache *f, int fd, int append);
+
+/**
+ * Attach the cache to a read-only file which has no descriptor
+ *
+ * @param pool - The pool to take blocks from
+ * @param f - The file cache
+ * @param source - Called to read the file
+ * @param arg - Passed to source
+ * @param size - Size of the file
+ */
+void fc_open_source(struct FcPool *pool, struct FileCache *f, FcSource source, void *arg, int64_t size);
+
+/**
+ * Detach the cache from a file, flushes any buffered writes and waits for
+ * any reads in progress so the file descriptor can be closed safely
+ *
+ * @return 0 on success, < 0 (GETERROR) if a buffered write failed
+ */
+int  fc_close(struct FileCache *f);
+
+/**
+ * Write out any buffered data for the file, an error is held for the next
+ * operation on the file
+ */
+void fc_flush(struct FileCache *f);
+
+/**
+ * Write out any buffered data and throw away what was read ahead, for when
+ * the file has been changed behind the cache's back
+ */
+void fc_invalidate(struct FileCache *f);
+
+/**
+ * Read from the current position
+ *
+ * @return Number of bytes read, < 0 (GETERROR) on error
+ */
+int  fc_read(struct FileCache *f, void *data, int len);
+
+/**
+ * Find how much of a regular file is left to read from the current position,
+ * so it can be promised before the data is read
+ *
+ * @return Number of bytes, < 0 (GETERROR) if a buffered write failed, -1 if
+ * the file is not a regular file
+ */
+int64_t fc_remaining(struct FileCache *f);
+
+/**
+ * Write at the current position, throws away any cached data. Small writes
+ * are merged in the write-behind buffer and acknowledged straight away, a
+ * failure is returned by the next operation on the file.
+ *
+ * @return Number of bytes written, < 0 (GETERROR) on error
+ */
+int  fc_write(struct FileCache *f, const void *data, int len);
+
+/**
+ * Move the current position
+ *
+ * @return The new position, < 0 on error
+ */
+int64_t fc_seek(struct FileCache *f, int64_t ofs, int whence);
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * handle.c - Handle table for USB HostFS files and directories
+ *
+ * Copyright (c) pspdev
+ *
+ * Free slots are kept on a list so allocation and lookup are both O(1),
+ * the table doubles in size when it runs out of slots. Objects are held by
+ * pointer so they never move when the table grows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "usbhostfs_pc.h"
+#include "handle.h"
+
+static int ht_grow(struct HandleTable *ht, int size)
+{
+	struct HtSlot *slots;
+	int i;
+
+	if(size > HT_MAX_SLOTS)
+	{
+		size = HT_MAX_SLOTS;
+	}
+
+	if(size <= ht->size)
+	{
+		return -1;
+	}
+
+	slots = (struct HtSlot *) realloc(ht->slots, sizeof(struct HtSlot) * size);
+	if(slots == NULL)
+	{
+		return -1;
+	}
+
+	/* Chain the new slots in index order onto the front of the free list */
+	for(i = size - 1; i >= ht->size; i--)
+	{
+		slots[i].obj = NULL;
+		slots[i].gen = 1;
+		slots[i].next_free = ht->free_head;
+		ht->free_head = i;
+	}
+
+	ht->slots = slots;
+	ht->size = size;
+
+	return 0;
+}
+
+int ht_init(struct HandleTable *ht, int size)
+{
+	memset(ht, 0, sizeof(*ht));
+	pthread_mutex_init(&ht->lock, NULL);
+	ht->free_head = -1;
+
+	if(size <= 0)
+	{
+		size = HT_DEF_SLOTS;
+	}
+
+	return ht_grow(ht, size);
+}
+
+void ht_destroy(struct HandleTable *ht)
+{
+	free(ht->slots);
+	pthread_mutex_destroy(&ht->lock);
+	memset(ht, 0, sizeof(*ht));
+	ht->free_head = -1;
+}
+
+void ht_lock(struct HandleTable *ht)
+{
+	pthread_mutex_lock(&ht->lock);
+}
+
+void ht_unlock(struct HandleTable *ht)
+{
+	pthread_mutex_unlock(&ht->lock);
+}
+
+int ht_alloc(struct HandleTable *ht, void *obj)
+{
+	struct HtSlot *slot;
+	int index;
+
+	pthread_mutex_lock(&ht->lock);
+	if(ht->free_head < 0)
+	{
+		if(ht_grow(ht, ht->size ? ht->size * 2 : HT_DEF_SLOTS) < 0)
+		{
+			fprintf(stderr, "Could not grow handle table beyond %d entries\n", ht->size);
+			pthread_mutex_unlock(&ht->lock);
+			return GETERROR(EMFILE);
+		}
+	}
+
+	index = ht->free_head;
+	slot = &ht->slots[index];
+	ht->free_head = slot->next_free;
+	slot->next_free = -1;
+	slot->obj = obj;
+
+	ht->used++;
+	if(ht->used > ht->used_max)
+	{
+		ht->used_max = ht->used;
+	}
+	index |= slot->gen << HT_INDEX_BITS;
+	pthread_mutex_unlock(&ht->lock);
+
+	return index;
+}
+
+/* Find the object of a handle, must be called with the lock held */
+static void *ht_find(struct HandleTable *ht, int handle)
+{
+	struct HtSlot *slot;
+	int index;
+
+	if(handle < 0)
+	{
+		return NULL;
+	}
+
+	index = handle & HT_INDEX_MASK;
+	if(index >= ht->size)
+	{
+		return NULL;
+	}
+
+	slot = &ht->slots[index];
+	if((slot->obj == NULL) || (slot->gen != ((uint32_t) handle >> HT_INDEX_BITS)))
+	{
+		return NULL;
+	}
+
+	return slot->obj;
+}
+
+void *ht_lookup(struct HandleTable *ht, int handle)
+{
+	void *obj;
+
+	pthread_mutex_lock(&ht->lock);
+	obj = ht_find(ht, handle);
+	pthread_mutex_unlock(&ht->lock);
+
+	return obj;
+}
+
+void *ht_free(struct HandleTable *ht, int handle)
+{
+	struct HtSlot *slot;
+	void *obj;
+
+	pthread_mutex_lock(&ht->lock);
+	obj = ht_find(ht, handle);
+	if(obj == NULL)
+	{
+		pthread_mutex_unlock(&ht->lock);
+		return NULL;
+	}
+
+	slot = &ht->slots[handle & HT_INDEX_MASK];
+	slot->obj = NULL;
+	slot->gen = (slot->gen + 1) & HT_GEN_MASK;
+	if(slot->gen == 0)
+	{
+		slot->gen = 1;
+	}
+	slot->next_free = ht->free_head;
+	ht->free_head = handle & HT_INDEX_MASK;
+	ht->used--;
+	pthread_mutex_unlock(&ht->lock);
+
+	return obj;
+}
+
+void *ht_next(struct HandleTable *ht, int *iter, int *handle)
+{
+	while(*iter < ht->size)
+	{
+		struct HtSlot *slot = &ht->slots[*iter];
+		int index = (*iter)++;
+
+		if(slot->obj)
+		{
+			if(handle)
+			{
+				*handle = (int) ((slot->gen << HT_INDEX_BITS) | index);
+			}
+			return slot->obj;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,106 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * handle.h - Handle table for USB HostFS files and directories
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __HANDLE_H__
+#define __HANDLE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* A handle is the slot index in the low bits with a generation count above
+ * it, so a handle which has been closed and its slot reused is detected */
+#define HT_INDEX_BITS  20
+#define HT_INDEX_MASK  ((1 << HT_INDEX_BITS) - 1)
+#define HT_GEN_MASK    0x7FF
+#define HT_MAX_SLOTS   (1 << HT_INDEX_BITS)
+#define HT_DEF_SLOTS   64
+
+struct HtSlot
+{
+	/* The object, NULL if the slot is free */
+	void *obj;
+	/* Generation of the current or next handle to use the slot, never 0 */
+	uint32_t gen;
+	/* Next free slot, -1 for the end of the list */
+	int next_free;
+};
+
+struct HandleTable
+{
+	/* Taken by the calls below, tagged requests use the table from several threads */
+	pthread_mutex_t lock;
+	struct HtSlot *slots;
+	int size;
+	int free_head;
+	/* Number of handles currently open, and the peak */
+	int used;
+	int used_max;
+};
+
+/**
+ * Initialise a handle table
+ *
+ * @param ht - The table
+ * @param size - Initial number of slots, the table grows as needed
+ *
+ * @return 0 on success, < 0 on error
+ */
+int   ht_init(struct HandleTable *ht, int size);
+
+/**
+ * Free the table, the objects must already have been released
+ */
+void  ht_destroy(struct HandleTable *ht);
+
+/**
+ * Allocate a handle for an object
+ *
+ * @param ht - The table
+ * @param obj - The object, must not be NULL
+ *
+ * @return The handle (>= 0), < 0 (GETERROR) on error
+ */
+int   ht_alloc(struct HandleTable *ht, void *obj);
+
+/**
+ * Look up a handle
+ *
+ * @return The object, NULL if the handle is invalid or has been freed
+ */
+void *ht_lookup(struct HandleTable *ht, int handle);
+
+/**
+ * Free a handle, the slot is reused with a new generation
+ *
+ * @return The object the handle referred to, NULL if the handle was invalid
+ */
+void *ht_free(struct HandleTable *ht, int handle);
+
+/**
+ * Lock the table against the other calls, for iterating it while other
+ * threads are using it
+ */
+void  ht_lock(struct HandleTable *ht);
+
+void  ht_unlock(struct HandleTable *ht);
+
+/**
+ * Iterate the open handles, the table is not locked so the caller must
+ * hold ht_lock if other threads can be using it
+ *
+ * @param ht - The table
+ * @param iter - Iterator, set to 0 to start
+ * @param handle - Receives the handle, can be NULL
+ *
+ * @return The next object, NULL when there are no more
+ */
+void *ht_next(struct HandleTable *ht, int *iter, int *handle);
+
+#endif
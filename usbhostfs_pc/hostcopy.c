@@ -0,0 +1,292 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hostcopy.c - Copies made on the host for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ * A PSP copying from one host path to another would otherwise read every
+ * byte over USB and write it back again. Here the copy is done by the host,
+ * as a reflink where the filesystem can share the blocks, with
+ * copy_file_range where the kernel has it, and with a plain read and write
+ * loop everywhere else.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "usbhostfs_pc.h"
+#include "hostwalk.h"
+#include "hostcopy.h"
+
+#ifdef HAVE_COPY_RANGE
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+struct CopyWalk
+{
+	const char *dst;
+	struct HcStats *stats;
+};
+
+static int copy_rw(int in, int out, struct HcStats *stats)
+{
+	char *buf;
+	int ret = 0;
+
+	buf = (char *) malloc(HC_BUFSIZE);
+	if(buf == NULL)
+	{
+		return GETERROR(ENOMEM);
+	}
+
+	while(1)
+	{
+		ssize_t len = read(in, buf, HC_BUFSIZE);
+		ssize_t done = 0;
+
+		if(len < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			ret = GETERROR(errno);
+			break;
+		}
+
+		if(len == 0)
+		{
+			break;
+		}
+
+		while(done < len)
+		{
+			ssize_t n = write(out, buf + done, len - done);
+
+			if(n < 0)
+			{
+				if(errno == EINTR)
+				{
+					continue;
+				}
+				ret = GETERROR(errno);
+				break;
+			}
+			done += n;
+		}
+
+		if(ret < 0)
+		{
+			break;
+		}
+		stats->bytes += len;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+static int copy_data(int in, int out, int64_t size, struct HcStats *stats)
+{
+#ifdef HAVE_COPY_RANGE
+#ifdef FICLONE
+	if(ioctl(out, FICLONE, in) == 0)
+	{
+		stats->cloned++;
+		stats->bytes += size;
+		return 0;
+	}
+#endif
+
+#ifdef __NR_copy_file_range
+	while(1)
+	{
+		long n = syscall(__NR_copy_file_range, in, NULL, out, NULL, (size_t) (1 << 30), 0);
+
+		if(n > 0)
+		{
+			stats->bytes += n;
+			continue;
+		}
+
+		if(n == 0)
+		{
+			return 0;
+		}
+
+		if(errno == EINTR)
+		{
+			continue;
+		}
+
+		if((errno != ENOSYS) && (errno != EXDEV) && (errno != EINVAL) && (errno != EOPNOTSUPP))
+		{
+			return GETERROR(errno);
+		}
+
+		/* Not for these files, the file positions are where it got to */
+		V_PRINTF(2, "copy_file_range not usable (%s)\n", strerror(errno));
+		break;
+	}
+#endif
+#endif
+
+	return copy_rw(in, out, stats);
+}
+
+static int copy_file(const char *src, const char *dst, const struct stat *st, struct HcStats *stats)
+{
+	int in, out;
+	int ret;
+
+	in = open(src, O_RDONLY);
+	if(in < 0)
+	{
+		fprintf(stderr, "Could not open %s (%s)\n", src, strerror(errno));
+		return GETERROR(errno);
+	}
+
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 0777);
+	if(out < 0)
+	{
+		fprintf(stderr, "Could not create %s (%s)\n", dst, strerror(errno));
+		ret = GETERROR(errno);
+		close(in);
+		return ret;
+	}
+
+	ret = copy_data(in, out, st->st_size, stats);
+	if((close(out) < 0) && (ret == 0))
+	{
+		ret = GETERROR(errno);
+	}
+	close(in);
+
+	if(ret == 0)
+	{
+		stats->files++;
+	}
+	else
+	{
+		fprintf(stderr, "Error copying %s to %s\n", src, dst);
+	}
+
+	return ret;
+}
+
+static int copy_dir(const char *dst, const struct stat *st, struct HcStats *stats)
+{
+	if((mkdir(dst, st->st_mode & 0777) < 0) && (errno != EEXIST))
+	{
+		fprintf(stderr, "Could not create directory %s (%s)\n", dst, strerror(errno));
+		return GETERROR(errno);
+	}
+	stats->dirs++;
+
+	return 0;
+}
+
+/* Called by hw_walk for each entry under the source */
+static int copy_entry(void *arg, const char *path, const char *rel, const struct stat *st)
+{
+	struct CopyWalk *cw = (struct CopyWalk *) arg;
+	char dstpath[PATH_MAX];
+
+	if(snprintf(dstpath, PATH_MAX, "%s/%s", cw->dst, rel) >= PATH_MAX)
+	{
+		return GETERROR(ENAMETOOLONG);
+	}
+
+	if(S_ISDIR(st->st_mode))
+	{
+		return copy_dir(dstpath, st, cw->stats);
+	}
+
+	return copy_file(path, dstpath, st, cw->stats);
+}
+
+static int copy_tree(const char *src, const char *dst, const struct stat *st, struct HcStats *stats)
+{
+	struct CopyWalk cw;
+	int ret;
+
+	ret = copy_dir(dst, st, stats);
+	if(ret < 0)
+	{
+		return ret;
+	}
+
+	cw.dst = dst;
+	cw.stats = stats;
+
+	return hw_walk(src, copy_entry, &cw);
+}
+
+int hc_copy(const char *src, const char *dst, int recursive, struct HcStats *stats)
+{
+	char target[PATH_MAX];
+	struct stat st, dst_st;
+	size_t srclen = strlen(src);
+
+	memset(stats, 0, sizeof(*stats));
+	if(stat(src, &st) < 0)
+	{
+		return GETERROR(errno);
+	}
+
+	snprintf(target, PATH_MAX, "%s", dst);
+	if((stat(dst, &dst_st) == 0) && (S_ISDIR(dst_st.st_mode)))
+	{
+		const char *base = strrchr(src, '/');
+
+		base = base ? base + 1 : src;
+		if((*base == 0) || (snprintf(target, PATH_MAX, "%s/%s", dst, base) >= PATH_MAX))
+		{
+			return GETERROR(EINVAL);
+		}
+	}
+
+	if((stat(target, &dst_st) == 0) && (dst_st.st_dev == st.st_dev) && (dst_st.st_ino == st.st_ino))
+	{
+		fprintf(stderr, "%s and %s are the same file\n", src, target);
+		return GETERROR(EINVAL);
+	}
+
+	V_PRINTF(1, "Host copy %s -> %s\n", src, target);
+
+	if(S_ISDIR(st.st_mode))
+	{
+		if(!recursive)
+		{
+			return GETERROR(EISDIR);
+		}
+
+		/* Copying a tree into itself would never end */
+		if((strncmp(target, src, srclen) == 0) && (target[srclen] == '/'))
+		{
+			fprintf(stderr, "Can't copy %s into itself\n", src);
+			return GETERROR(EINVAL);
+		}
+
+		return copy_tree(src, target, &st, stats);
+	}
+
+	if(!S_ISREG(st.st_mode))
+	{
+		return GETERROR(EINVAL);
+	}
+
+	return copy_file(src, target, &st, stats);
+}
@@ -0,0 +1,45 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hostcopy.h - Copies made on the host for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __HOSTCOPY_H__
+#define __HOSTCOPY_H__
+
+#include <stdint.h>
+
+#if defined(__linux__) && !defined(NO_COPY_RANGE)
+#define HAVE_COPY_RANGE
+#endif
+
+/* Size of the buffer used where the kernel can't copy for us */
+#define HC_BUFSIZE  (256*1024)
+
+struct HcStats
+{
+	uint64_t bytes;
+	uint32_t files;
+	uint32_t dirs;
+	/* Files shared with the source by a reflink rather than copied */
+	uint32_t cloned;
+};
+
+/**
+ * Copy a file or directory tree, a destination which is an existing
+ * directory gets a copy of the source inside it
+ *
+ * @param src - Host path of the source
+ * @param dst - Host path of the destination
+ * @param recursive - Non-zero to allow copying a directory
+ * @param stats - Filled in with what was copied, including on error
+ *
+ * @return 0 on success, < 0 (GETERROR) on error
+ */
+int hc_copy(const char *src, const char *dst, int recursive, struct HcStats *stats);
+
+#endif
@@ -0,0 +1,1764 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hostfs_bench.c - Fake PSP driving usbhostfs_pc for benchmarking
+ *
+ * Copyright (c) pspdev
+ *
+ * Plays the PSP side of the HostFS protocol over the socket transport and
+ * times scripted workloads against the real server. Start the server with
+ * something like
+ *
+ *   usbhostfs_pc -l /tmp/hostfs.sock /tmp/benchroot
+ *   hostfs_bench /tmp/hostfs.sock
+ *
+ * Each workload prints one JSON object per line on stdout so the results
+ * can be collected and compared between releases.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <usbhostfs.h>
+#include "psp_fileio.h"
+#include "usbhostfs_pc.h"
+#include "transport.h"
+#include "fakepsp.h"
+#include "hostsum.h"
+
+#define BENCH_DEF_SECONDS  2
+#define BENCH_DEF_SIZE     (16*1024*1024)
+#define BENCH_DEF_FILES    64
+#define BENCH_SMALL_SIZE   4096
+#define BENCH_DEF_BLOCKS   "4096,16384,65536"
+#define BENCH_DEF_WORKLOADS "write,seqread,randread,streamread,smallfiles,readfile,dirscan,dirbulk,getstat,taggetstat,sync"
+#define BENCH_MAX_BLOCKS   16
+
+int g_verbose = 0;
+
+struct Bench
+{
+	int fd;
+	/* Bytes of the current reply frame not yet read */
+	int rxleft;
+	const char *dir;
+	int seconds;
+	int64_t size;
+	int nfiles;
+	int blocks[BENCH_MAX_BLOCKS];
+	int nblocks;
+	/* Set to send a plain HELLO, as a PSP from before capabilities */
+	int legacy;
+	/* Capabilities agreed with the server in the HELLO */
+	uint32_t caps;
+	/* Fail unless these are the capabilities agreed, -1 for any */
+	int64_t expect;
+	/* Tagged commands which may be in flight at once */
+	int maxtags;
+	/* Local path of the server's root, set to read with a cold page cache */
+	const char *coldroot;
+	char buf[HOSTFS_MAX_BLOCK];
+};
+
+/* Latencies of one run */
+struct Samples
+{
+	uint64_t *ns;
+	int count;
+	int max;
+	uint64_t bytes;
+	uint64_t start;
+	uint64_t end;
+};
+
+/* Read reply data from the server, async channel output is skipped */
+int bench_recv(struct Bench *b, void *data, int len)
+{
+	char *p = (char *) data;
+	int readlen = 0;
+
+	while(readlen < len)
+	{
+		int size;
+
+		if(b->rxleft == 0)
+		{
+			struct TransFrame frame;
+
+			if(fake_read_all(b->fd, &frame, sizeof(frame)) < 0)
+			{
+				fprintf(stderr, "Server closed the connection\n");
+				return -1;
+			}
+
+			if(LE32(frame.ep) == TRANS_EP_ASYNC)
+			{
+				char skip[512];
+				int left = LE32(frame.size);
+
+				while(left > 0)
+				{
+					size = left < sizeof(skip) ? left : sizeof(skip);
+					if(fake_read_all(b->fd, skip, size) < 0)
+					{
+						return -1;
+					}
+					left -= size;
+				}
+				continue;
+			}
+
+			b->rxleft = LE32(frame.size);
+			continue;
+		}
+
+		size = len - readlen;
+		if(size > b->rxleft)
+		{
+			size = b->rxleft;
+		}
+
+		if(fake_read_all(b->fd, p + readlen, size) < 0)
+		{
+			return -1;
+		}
+		b->rxleft -= size;
+		readlen += size;
+	}
+
+	return len;
+}
+
+void init_cmd(struct HostFsCmd *cmd, uint32_t command, int extralen)
+{
+	cmd->magic = LE32(HOSTFS_MAGIC);
+	cmd->command = LE32(command);
+	cmd->extralen = LE32(extralen);
+}
+
+/* Send a command and any extra data, then read the fixed part of the reply */
+int bench_cmd(struct Bench *b, void *cmd, int cmdlen, const void *extra, int extralen, void *resp, int resplen)
+{
+	if(fake_send(b->fd, cmd, cmdlen) < 0)
+	{
+		return -1;
+	}
+
+	if((extralen > 0) && (fake_send(b->fd, extra, extralen) < 0))
+	{
+		return -1;
+	}
+
+	if(bench_recv(b, resp, resplen) < 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Read the extra data following a reply */
+int bench_extra(struct Bench *b, struct HostFsCmd *resp, void *data, int max)
+{
+	int len = LE32(resp->extralen);
+
+	if(len > max)
+	{
+		fprintf(stderr, "Reply extra data too large (%d)\n", len);
+		return -1;
+	}
+
+	if(len > 0)
+	{
+		return bench_recv(b, data, len);
+	}
+
+	return 0;
+}
+
+int bench_hello(struct Bench *b)
+{
+	struct HostFsHelloCmd cmd;
+	struct HostFsHelloResp resp;
+	struct HostFsCaps caps;
+	uint32_t magic;
+
+	/* The server opens with the magic, the same as over USB */
+	if(bench_recv(b, &magic, sizeof(magic)) < 0)
+	{
+		return -1;
+	}
+
+	if(LE32(magic) != HOSTFS_MAGIC)
+	{
+		fprintf(stderr, "Invalid magic from server %08X\n", LE32(magic));
+		return -1;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_HELLO, 0);
+	cmd.caps.version = LE16(HOSTFS_CAPS_VERSION);
+	cmd.caps.size = LE16(sizeof(cmd.caps));
+	cmd.caps.caps = LE32(HOSTFS_CAP_DREADBULK | HOSTFS_CAP_READSTREAM | HOSTFS_CAP_READFILE | HOSTFS_CAP_TAGGED);
+	cmd.caps.maxblock = LE32(HOSTFS_MAX_BLOCK);
+	cmd.caps.maxstream = LE32(HOSTFS_STREAM_MAX);
+	cmd.caps.maxtags = LE32(HOSTFS_MAX_TAGS);
+
+	b->caps = 0;
+	b->maxtags = 0;
+	memset(&caps, 0, sizeof(caps));
+	if((bench_cmd(b, &cmd, b->legacy ? sizeof(cmd.cmd) : sizeof(cmd), NULL, 0, &resp, sizeof(resp)) < 0)
+		|| (bench_extra(b, &resp.cmd, &caps, sizeof(caps)) < 0))
+	{
+		return -1;
+	}
+
+	if(LE32(resp.cmd.extralen) >= HOSTFS_CAPS_MINLEN)
+	{
+		b->caps = LE32(caps.caps) & LE32(cmd.caps.caps);
+		if(b->caps & HOSTFS_CAP_TAGGED)
+		{
+			b->maxtags = LE32(caps.maxtags) < HOSTFS_MAX_TAGS ? LE32(caps.maxtags) : HOSTFS_MAX_TAGS;
+		}
+		fprintf(stderr, "Server capabilities version %d, caps %08X, block %d, stream %d, tags %d\n", LE16(caps.version),
+				LE32(caps.caps), LE32(caps.maxblock), LE32(caps.maxstream), LE32(caps.maxtags));
+	}
+	else
+	{
+		fprintf(stderr, "Server did not send any capabilities\n");
+	}
+
+	return 0;
+}
+
+int hfs_open(struct Bench *b, const char *path, int mode)
+{
+	struct HostFsOpenCmd cmd;
+	struct HostFsOpenResp resp;
+	int len = strlen(path) + 1;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_OPEN, len);
+	cmd.mode = LE32(mode);
+	cmd.mask = LE32(0644);
+	cmd.fsnum = LE32(0);
+
+	if(bench_cmd(b, &cmd, sizeof(cmd), path, len, &resp, sizeof(resp)) < 0)
+	{
+		return -1;
+	}
+
+	return LE32(resp.res);
+}
+
+int hfs_close(struct Bench *b, int fid)
+{
+	struct HostFsCloseCmd cmd;
+	struct HostFsCloseResp resp;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_CLOSE, 0);
+	cmd.fid = LE32(fid);
+
+	if(bench_cmd(b, &cmd, sizeof(cmd), NULL, 0, &resp, sizeof(resp)) < 0)
+	{
+		return -1;
+	}
+
+	return LE32(resp.res);
+}
+
+int hfs_read(struct Bench *b, int fid, void *data, int len)
+{
+	struct HostFsReadCmd cmd;
+	struct HostFsReadResp resp;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_READ, 0);
+	cmd.fid = LE32(fid);
+	cmd.len = LE32(len);
+
+	if((bench_cmd(b, &cmd, sizeof(cmd), NULL, 0, &resp, sizeof(resp)) < 0)
+		|| (bench_extra(b, &resp.cmd, data, len) < 0))
+	{
+		return -1;
+	}
+
+	return LE32(resp.res);
+}
+
+int hfs_readstream(struct Bench *b, int fid, void *data, int len)
+{
+	struct HostFsReadStreamCmd cmd;
+	struct HostFsReadStreamResp resp;
+	struct HostFsReadStreamEnd end;
+	int extra;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_READSTREAM, 0);
+	cmd.fid = LE32(fid);
+	cmd.len = LE32(len);
+
+	if(bench_cmd(b, &cmd, sizeof(cmd), NULL, 0, &resp, sizeof(resp)) < 0)
+	{
+		return -1;
+	}
+
+	extra = LE32(resp.cmd.extralen);
+	if(extra == 0)
+	{
+		return LE32(resp.res);
+	}
+
+	if((extra < sizeof(end)) || ((extra - sizeof(end)) > len))
+	{
+		fprintf(stderr, "Invalid readstream length (%d)\n", extra);
+		return -1;
+	}
+
+	if((bench_recv(b, data, extra - sizeof(end)) < 0) || (bench_recv(b, &end, sizeof(end)) < 0))
+	{
+		return -1;
+	}
+
+	/* Fewer than promised if the file shrank */
+	return LE32(end.res) < LE32(resp.res) ? LE32(end.res) : LE32(resp.res);
+}
+
+/* Returns the open result, *whole is set if the data was sent and the file closed */
+int hfs_readfile(struct Bench *b, const char *path, void *data, int max, int *whole, int *got)
+{
+	struct HostFsReadFileCmd cmd;
+	struct HostFsReadFileResp resp;
+	int len = strlen(path) + 1;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_READFILE, len);
+	cmd.mode = LE32(PSP_O_RDONLY);
+	cmd.mask = LE32(0644);
+	cmd.fsnum = LE32(0);
+	cmd.maxlen = LE32(max);
+
+	if((bench_cmd(b, &cmd, sizeof(cmd), path, len, &resp, sizeof(resp)) < 0)
+		|| (bench_extra(b, &resp.cmd, data, max) < 0))
+	{
+		return -1;
+	}
+
+	*whole = (LE32(resp.flags) & HOSTFS_READFILE_WHOLE) ? 1 : 0;
+	*got = LE32(resp.cmd.extralen);
+
+	return LE32(resp.res);
+}
+
+int hfs_write(struct Bench *b, int fid, const void *data, int len)
+{
+	struct HostFsWriteCmd cmd;
+	struct HostFsWriteResp resp;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_WRITE, len);
+	cmd.fid = LE32(fid);
+
+	if(bench_cmd(b, &cmd, sizeof(cmd), data, len, &resp, sizeof(resp)) < 0)
+	{
+		return -1;
+	}
+
+	return LE32(resp.res);
+}
+
+int64_t hfs_lseek(struct Bench *b, int fid, int64_t ofs, int whence)
+{
+	struct HostFsLseekCmd cmd;
+	struct HostFsLseekResp resp;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_LSEEK, 0);
+	cmd.fid = LE32(fid);
+	cmd.ofs = LE64(ofs);
+	cmd.whence = LE32(whence);
+
+	if(bench_cmd(b, &cmd, sizeof(cmd), NULL, 0, &resp, sizeof(resp)) < 0)
+	{
+		return -1;
+	}
+
+	if(LE32(resp.res) < 0)
+	{
+		return LE32(resp.res);
+	}
+
+	return LE64(resp.ofs);
+}
+
+int hfs_getstat(struct Bench *b, const char *path, SceIoStat *st)
+{
+	struct HostFsGetstatCmd cmd;
+	struct HostFsGetstatResp resp;
+	int len = strlen(path) + 1;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_GETSTAT, len);
+	cmd.fsnum = LE32(0);
+
+	if((bench_cmd(b, &cmd, sizeof(cmd), path, len, &resp, sizeof(resp)) < 0)
+		|| (bench_extra(b, &resp.cmd, st, sizeof(*st)) < 0))
+	{
+		return -1;
+	}
+
+	return LE32(resp.res);
+}
+
+/* Send a getstat with a tag, the reply is collected by hfs_tagged_getstat_reply */
+int hfs_tagged_getstat(struct Bench *b, uint32_t tag, const char *path)
+{
+	struct
+	{
+		struct HostFsTag tag;
+		struct HostFsGetstatCmd cmd;
+	} __attribute__((packed)) pkt;
+	int len = strlen(path) + 1;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.tag.magic = LE32(HOSTFS_TAG_MAGIC);
+	pkt.tag.tag = LE32(tag);
+	init_cmd(&pkt.cmd.cmd, HOSTFS_CMD_GETSTAT, len);
+	pkt.cmd.fsnum = LE32(0);
+
+	if((fake_send(b->fd, &pkt, sizeof(pkt)) < 0) || (fake_send(b->fd, path, len) < 0))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Read the next tagged getstat reply, whichever it is, returns its tag */
+int hfs_tagged_getstat_reply(struct Bench *b, SceIoStat *st, int *res)
+{
+	struct HostFsTag tag;
+	struct HostFsGetstatResp resp;
+
+	if((bench_recv(b, &tag, sizeof(tag)) < 0) || (bench_recv(b, &resp, sizeof(resp)) < 0)
+		|| (bench_extra(b, &resp.cmd, st, sizeof(*st)) < 0))
+	{
+		return -1;
+	}
+
+	if(LE32(tag.magic) != HOSTFS_TAG_MAGIC)
+	{
+		fprintf(stderr, "Invalid tag magic in reply %08X\n", LE32(tag.magic));
+		return -1;
+	}
+
+	*res = LE32(resp.res);
+
+	return LE32(tag.tag);
+}
+
+/* Commands which just take a path, DOPEN, REMOVE, RMDIR and MKDIR */
+int hfs_path_cmd(struct Bench *b, uint32_t command, const char *path)
+{
+	union
+	{
+		struct HostFsRemoveCmd remove;
+		struct HostFsMkdirCmd mkdir;
+	} cmd;
+	struct HostFsRemoveResp resp;
+	int len = strlen(path) + 1;
+	int cmdlen;
+
+	memset(&cmd, 0, sizeof(cmd));
+	if(command == HOSTFS_CMD_MKDIR)
+	{
+		init_cmd(&cmd.mkdir.cmd, command, len);
+		cmd.mkdir.mode = LE32(0755);
+		cmd.mkdir.fsnum = LE32(0);
+		cmdlen = sizeof(cmd.mkdir);
+	}
+	else
+	{
+		/* Dopen and rmdir commands are laid out the same as remove */
+		init_cmd(&cmd.remove.cmd, command, len);
+		cmd.remove.fsnum = LE32(0);
+		cmdlen = sizeof(cmd.remove);
+	}
+
+	if(bench_cmd(b, &cmd, cmdlen, path, len, &resp, sizeof(resp)) < 0)
+	{
+		return -1;
+	}
+
+	return LE32(resp.res);
+}
+
+int hfs_dopen(struct Bench *b, const char *path)
+{
+	return hfs_path_cmd(b, HOSTFS_CMD_DOPEN, path);
+}
+
+/* Returns > 0 for an entry, 0 at the end of the directory */
+int hfs_dread(struct Bench *b, int did, SceIoDirent *dir)
+{
+	struct HostFsDreadCmd cmd;
+	struct HostFsDreadResp resp;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_DREAD, 0);
+	cmd.did = LE32(did);
+
+	if((bench_cmd(b, &cmd, sizeof(cmd), NULL, 0, &resp, sizeof(resp)) < 0)
+		|| (bench_extra(b, &resp.cmd, dir, sizeof(*dir)) < 0))
+	{
+		return -1;
+	}
+
+	return LE32(resp.res);
+}
+
+/* Returns the number of entries packed into data, 0 at the end of the directory */
+int hfs_dreadbulk(struct Bench *b, int did, void *data, int max)
+{
+	struct HostFsDreadBulkCmd cmd;
+	struct HostFsDreadBulkResp resp;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_DREADBULK, 0);
+	cmd.did = LE32(did);
+	cmd.maxlen = LE32(max);
+
+	if((bench_cmd(b, &cmd, sizeof(cmd), NULL, 0, &resp, sizeof(resp)) < 0)
+		|| (bench_extra(b, &resp.cmd, data, max) < 0))
+	{
+		return -1;
+	}
+
+	return LE32(resp.res);
+}
+
+int hfs_dclose(struct Bench *b, int did)
+{
+	struct HostFsDcloseCmd cmd;
+	struct HostFsDcloseResp resp;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_DCLOSE, 0);
+	cmd.did = LE32(did);
+
+	if(bench_cmd(b, &cmd, sizeof(cmd), NULL, 0, &resp, sizeof(resp)) < 0)
+	{
+		return -1;
+	}
+
+	return LE32(resp.res);
+}
+
+/* Returns the result of the devctl, any output is read into out */
+int hfs_devctl(struct Bench *b, uint32_t cmdno, const void *in, int inlen, void *out, int outlen)
+{
+	struct HostFsDevctlCmd cmd;
+	struct HostFsDevctlResp resp;
+
+	memset(&cmd, 0, sizeof(cmd));
+	init_cmd(&cmd.cmd, HOSTFS_CMD_DEVCTL, inlen);
+	cmd.cmdno = LE32(cmdno);
+	cmd.fsnum = LE32(0);
+	cmd.outlen = LE32(outlen);
+
+	if((bench_cmd(b, &cmd, sizeof(cmd), in, inlen, &resp, sizeof(resp)) < 0)
+		|| (bench_extra(b, &resp.cmd, out, outlen) < 0))
+	{
+		return -1;
+	}
+
+	return LE32(resp.res);
+}
+
+void samples_start(struct Samples *s)
+{
+	s->count = 0;
+	s->bytes = 0;
+	s->start = get_time_ns();
+	s->end = s->start;
+}
+
+int samples_add(struct Samples *s, uint64_t start, int bytes)
+{
+	uint64_t now = get_time_ns();
+
+	if(s->count == s->max)
+	{
+		int max = s->max ? s->max * 2 : 4096;
+		uint64_t *ns = (uint64_t *) realloc(s->ns, max * sizeof(uint64_t));
+
+		if(ns == NULL)
+		{
+			fprintf(stderr, "Could not allocate memory for samples\n");
+			return -1;
+		}
+		s->ns = ns;
+		s->max = max;
+	}
+
+	s->ns[s->count++] = now - start;
+	s->bytes += bytes;
+	s->end = now;
+
+	return 0;
+}
+
+int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return x < y ? -1 : (x > y);
+}
+
+double percentile_us(struct Samples *s, int pct)
+{
+	int idx;
+
+	if(s->count == 0)
+	{
+		return 0.0;
+	}
+
+	idx = (int) (((int64_t) s->count * pct + 99) / 100) - 1;
+	if(idx < 0)
+	{
+		idx = 0;
+	}
+
+	return s->ns[idx] / 1e3;
+}
+
+void samples_report(struct Samples *s, const char *name, int block)
+{
+	double secs = (s->end - s->start) / 1e9;
+
+	if(secs <= 0.0)
+	{
+		secs = 1e-9;
+	}
+
+	qsort(s->ns, s->count, sizeof(uint64_t), cmp_u64);
+
+	printf("{\"workload\":\"%s\",\"block\":%d,\"ops\":%d,\"bytes\":%" PRIu64 ",\"seconds\":%.3f,"
+			"\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+			name, block, s->count, s->bytes, secs, s->count / secs, s->bytes / secs / (1024.0 * 1024.0),
+			percentile_us(s, 50), percentile_us(s, 99), s->count ? s->ns[s->count - 1] / 1e3 : 0.0);
+	fflush(stdout);
+}
+
+/* Keep going until the time is up, always do at least one op */
+int time_left(struct Bench *b, struct Samples *s)
+{
+	return (s->count == 0) || ((get_time_ns() - s->start) < (uint64_t) b->seconds * 1000000000ULL);
+}
+
+void big_path(struct Bench *b, char *path, int len)
+{
+	snprintf(path, len, "%s/big.bin", b->dir);
+}
+
+void sync_path(struct Bench *b, char *path, int len)
+{
+	snprintf(path, len, "%s/sync.bin", b->dir);
+}
+
+void small_path(struct Bench *b, char *path, int len, int num)
+{
+	snprintf(path, len, "%s/small/f%04d.bin", b->dir, num);
+}
+
+/* Throw the file out of the host's page cache, when running cold. Only works
+ * when the server is on this machine, for a remote one drop the cache there. */
+void drop_cache(struct Bench *b, const char *path)
+{
+	char local[1024];
+	int fd;
+
+	if(b->coldroot == NULL)
+	{
+		return;
+	}
+
+	snprintf(local, sizeof(local), "%s%s", b->coldroot, path);
+	fd = open(local, O_RDONLY);
+	if(fd < 0)
+	{
+		fprintf(stderr, "Could not open %s to drop its cache (%s)\n", local, strerror(errno));
+		b->coldroot = NULL;
+		return;
+	}
+
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+/* Writes the big file, sequentially in blocks, starting over when it is full */
+int run_write(struct Bench *b, struct Samples *s, int block)
+{
+	char path[256];
+	int64_t pos = 0;
+	int fid;
+
+	big_path(b, path, sizeof(path));
+	fid = hfs_open(b, path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC);
+	if(fid < 0)
+	{
+		fprintf(stderr, "Could not create %s (%08X)\n", path, fid);
+		return -1;
+	}
+
+	samples_start(s);
+	while((pos < b->size) || (time_left(b, s)))
+	{
+		uint64_t start;
+		int ret;
+
+		if(pos >= b->size)
+		{
+			hfs_close(b, fid);
+			fid = hfs_open(b, path, PSP_O_WRONLY | PSP_O_TRUNC);
+			if(fid < 0)
+			{
+				return -1;
+			}
+			pos = 0;
+		}
+
+		start = get_time_ns();
+		ret = hfs_write(b, fid, b->buf, block);
+		if(ret != block)
+		{
+			fprintf(stderr, "Write failed (%08X)\n", ret);
+			hfs_close(b, fid);
+			return -1;
+		}
+		if(samples_add(s, start, block) < 0)
+		{
+			break;
+		}
+		pos += block;
+	}
+
+	/* Count the final flush of any write-behind data */
+	hfs_close(b, fid);
+	s->end = get_time_ns();
+
+	return 0;
+}
+
+int run_seqread(struct Bench *b, struct Samples *s, int block)
+{
+	char path[256];
+	int fid;
+
+	big_path(b, path, sizeof(path));
+	fid = hfs_open(b, path, PSP_O_RDONLY);
+	if(fid < 0)
+	{
+		fprintf(stderr, "Could not open %s (%08X)\n", path, fid);
+		return -1;
+	}
+
+	drop_cache(b, path);
+	samples_start(s);
+	while(time_left(b, s))
+	{
+		uint64_t start = get_time_ns();
+		int ret;
+
+		ret = hfs_read(b, fid, b->buf, block);
+		if(ret < 0)
+		{
+			fprintf(stderr, "Read failed (%08X)\n", ret);
+			hfs_close(b, fid);
+			return -1;
+		}
+
+		if(ret == 0)
+		{
+			/* Wrap around at the end of the file */
+			hfs_lseek(b, fid, 0, PSP_SEEK_SET);
+			drop_cache(b, path);
+			continue;
+		}
+
+		if(samples_add(s, start, ret) < 0)
+		{
+			break;
+		}
+	}
+
+	hfs_close(b, fid);
+
+	return 0;
+}
+
+/* Sequential reads of HOSTFS_STREAM_MAX at a time, in one exchange each */
+int run_streamread(struct Bench *b, struct Samples *s, int block)
+{
+	static char *buf = NULL;
+	char path[256];
+	int fid;
+
+	if(!(b->caps & HOSTFS_CAP_READSTREAM))
+	{
+		fprintf(stderr, "Server does not support streaming reads, skipping\n");
+		return 1;
+	}
+
+	if(buf == NULL)
+	{
+		buf = (char *) malloc(HOSTFS_STREAM_MAX);
+		if(buf == NULL)
+		{
+			fprintf(stderr, "Could not allocate memory for stream reads\n");
+			return -1;
+		}
+	}
+
+	big_path(b, path, sizeof(path));
+	fid = hfs_open(b, path, PSP_O_RDONLY);
+	if(fid < 0)
+	{
+		fprintf(stderr, "Could not open %s (%08X)\n", path, fid);
+		return -1;
+	}
+
+	drop_cache(b, path);
+	samples_start(s);
+	while(time_left(b, s))
+	{
+		uint64_t start = get_time_ns();
+		int ret;
+
+		ret = hfs_readstream(b, fid, buf, HOSTFS_STREAM_MAX);
+		if(ret < 0)
+		{
+			fprintf(stderr, "Read failed (%08X)\n", ret);
+			hfs_close(b, fid);
+			return -1;
+		}
+
+		if(ret == 0)
+		{
+			/* Wrap around at the end of the file */
+			hfs_lseek(b, fid, 0, PSP_SEEK_SET);
+			drop_cache(b, path);
+			continue;
+		}
+
+		if(samples_add(s, start, ret) < 0)
+		{
+			break;
+		}
+	}
+
+	hfs_close(b, fid);
+
+	return 0;
+}
+
+/* Each op is a seek to a random block followed by the read */
+int run_randread(struct Bench *b, struct Samples *s, int block)
+{
+	char path[256];
+	int64_t nblocks = b->size / block;
+	int fid;
+
+	big_path(b, path, sizeof(path));
+	fid = hfs_open(b, path, PSP_O_RDONLY);
+	if(fid < 0)
+	{
+		fprintf(stderr, "Could not open %s (%08X)\n", path, fid);
+		return -1;
+	}
+
+	if(nblocks <= 0)
+	{
+		nblocks = 1;
+	}
+
+	srand(1);
+	samples_start(s);
+	while(time_left(b, s))
+	{
+		uint64_t start;
+		int64_t ofs = ((int64_t) rand() % nblocks) * block;
+		int ret;
+
+		drop_cache(b, path);
+		start = get_time_ns();
+
+		if(hfs_lseek(b, fid, ofs, PSP_SEEK_SET) != ofs)
+		{
+			fprintf(stderr, "Seek to %" PRId64 " failed\n", ofs);
+			hfs_close(b, fid);
+			return -1;
+		}
+
+		ret = hfs_read(b, fid, b->buf, block);
+		if(ret < 0)
+		{
+			fprintf(stderr, "Read failed (%08X)\n", ret);
+			hfs_close(b, fid);
+			return -1;
+		}
+
+		if(samples_add(s, start, ret) < 0)
+		{
+			break;
+		}
+	}
+
+	hfs_close(b, fid);
+
+	return 0;
+}
+
+/* Each op is an open, a read of the whole file and a close */
+int run_smallfiles(struct Bench *b, struct Samples *s, int block)
+{
+	int num = 0;
+
+	samples_start(s);
+	while(time_left(b, s))
+	{
+		uint64_t start;
+		char path[256];
+		int total = 0;
+		int fid;
+		int ret;
+
+		small_path(b, path, sizeof(path), num);
+		num = (num + 1) % b->nfiles;
+		drop_cache(b, path);
+		start = get_time_ns();
+
+		fid = hfs_open(b, path, PSP_O_RDONLY);
+		if(fid < 0)
+		{
+			fprintf(stderr, "Could not open %s (%08X)\n", path, fid);
+			return -1;
+		}
+
+		do
+		{
+			ret = hfs_read(b, fid, b->buf, BENCH_SMALL_SIZE);
+			if(ret > 0)
+			{
+				total += ret;
+			}
+		}
+		while(ret > 0);
+
+		hfs_close(b, fid);
+
+		if(samples_add(s, start, total) < 0)
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Same as smallfiles, with the open, read and close done by one READFILE */
+int run_readfile(struct Bench *b, struct Samples *s, int block)
+{
+	int num = 0;
+
+	if(!(b->caps & HOSTFS_CAP_READFILE))
+	{
+		fprintf(stderr, "Server does not support whole file reads, skipping\n");
+		return 1;
+	}
+
+	samples_start(s);
+	while(time_left(b, s))
+	{
+		uint64_t start;
+		char path[256];
+		int whole = 0;
+		int total = 0;
+		int fid;
+
+		small_path(b, path, sizeof(path), num);
+		num = (num + 1) % b->nfiles;
+		drop_cache(b, path);
+		start = get_time_ns();
+
+		fid = hfs_readfile(b, path, b->buf, BENCH_SMALL_SIZE, &whole, &total);
+		if(fid < 0)
+		{
+			fprintf(stderr, "Could not read %s (%08X)\n", path, fid);
+			return -1;
+		}
+
+		if(!whole)
+		{
+			fprintf(stderr, "Server did not send all of %s\n", path);
+			hfs_close(b, fid);
+			return -1;
+		}
+
+		if(samples_add(s, start, total) < 0)
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Each op lists the whole directory of small files */
+int run_dirscan(struct Bench *b, struct Samples *s, int block)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/small", b->dir);
+
+	samples_start(s);
+	while(time_left(b, s))
+	{
+		uint64_t start = get_time_ns();
+		SceIoDirent dir;
+		int count = 0;
+		int did;
+		int ret;
+
+		did = hfs_dopen(b, path);
+		if(did < 0)
+		{
+			fprintf(stderr, "Could not open directory %s (%08X)\n", path, did);
+			return -1;
+		}
+
+		while((ret = hfs_dread(b, did, &dir)) > 0)
+		{
+			count++;
+		}
+
+		hfs_dclose(b, did);
+
+		if(ret < 0)
+		{
+			return -1;
+		}
+
+		if(samples_add(s, start, count * sizeof(SceIoDirent)) < 0)
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Same as dirscan, fetching as many entries per command as fit in 64KiB */
+int run_dirbulk(struct Bench *b, struct Samples *s, int block)
+{
+	char path[256];
+
+	if(!(b->caps & HOSTFS_CAP_DREADBULK))
+	{
+		fprintf(stderr, "Server does not support bulk directory reads, skipping\n");
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/small", b->dir);
+
+	samples_start(s);
+	while(time_left(b, s))
+	{
+		uint64_t start = get_time_ns();
+		int count = 0;
+		int did;
+		int ret;
+
+		did = hfs_dopen(b, path);
+		if(did < 0)
+		{
+			fprintf(stderr, "Could not open directory %s (%08X)\n", path, did);
+			return -1;
+		}
+
+		while((ret = hfs_dreadbulk(b, did, b->buf, sizeof(b->buf))) > 0)
+		{
+			count += ret;
+		}
+
+		hfs_dclose(b, did);
+
+		if(ret < 0)
+		{
+			return -1;
+		}
+
+		if(samples_add(s, start, count * sizeof(SceIoDirent)) < 0)
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int run_getstat(struct Bench *b, struct Samples *s, int block)
+{
+	int num = 0;
+
+	samples_start(s);
+	while(time_left(b, s))
+	{
+		uint64_t start = get_time_ns();
+		char path[256];
+		SceIoStat st;
+		int ret;
+
+		small_path(b, path, sizeof(path), num);
+		num = (num + 1) % b->nfiles;
+
+		ret = hfs_getstat(b, path, &st);
+		if(ret < 0)
+		{
+			fprintf(stderr, "Getstat of %s failed (%08X)\n", path, ret);
+			return -1;
+		}
+
+		if(samples_add(s, start, 0) < 0)
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Same as getstat, keeping as many tagged commands in flight as the server agreed */
+int run_taggetstat(struct Bench *b, struct Samples *s, int block)
+{
+	uint64_t started[HOSTFS_MAX_TAGS];
+	int inflight = 0;
+	int num = 0;
+	int ret = 0;
+	int i;
+
+	if(b->maxtags < 2)
+	{
+		fprintf(stderr, "Server does not support tagged commands, skipping\n");
+		return 1;
+	}
+
+	memset(started, 0, sizeof(started));
+	samples_start(s);
+	while(1)
+	{
+		char path[256];
+		SceIoStat st;
+		int res;
+		int tag;
+
+		/* Keep the pipe full until the time is up, then empty it */
+		if(time_left(b, s))
+		{
+			for(i = 0; (inflight < b->maxtags) && (i < b->maxtags); i++)
+			{
+				if(started[i] == 0)
+				{
+					small_path(b, path, sizeof(path), num);
+					num = (num + 1) % b->nfiles;
+
+					started[i] = get_time_ns();
+					if(hfs_tagged_getstat(b, i, path) < 0)
+					{
+						return -1;
+					}
+					inflight++;
+				}
+			}
+		}
+
+		if(inflight == 0)
+		{
+			break;
+		}
+
+		tag = hfs_tagged_getstat_reply(b, &st, &res);
+		if((tag < 0) || (tag >= b->maxtags) || (started[tag] == 0))
+		{
+			fprintf(stderr, "Invalid tag in reply %d\n", tag);
+			return -1;
+		}
+
+		if(res < 0)
+		{
+			fprintf(stderr, "Tagged getstat failed (%08X)\n", res);
+			ret = -1;
+		}
+
+		samples_add(s, started[tag], 0);
+		started[tag] = 0;
+		inflight--;
+	}
+
+	return ret;
+}
+
+/* The weak checksum the PSP sends for each block of its old copy */
+uint32_t sync_weak(const uint8_t *data, int len)
+{
+	uint32_t s1 = 0, s2 = 0;
+	int i;
+
+	for(i = 0; i < len; i++)
+	{
+		s1 += data[i];
+		s2 += (len - i) * data[i];
+	}
+
+	return (s1 & 0xFFFF) | (s2 << 16);
+}
+
+/* The contents of the sync file, different in every block */
+void sync_fill(uint8_t *data, int64_t ofs, int len)
+{
+	int i;
+
+	for(i = 0; i < len; i++)
+	{
+		int64_t pos = ofs + i;
+
+		data[i] = (uint8_t) (pos ^ (pos >> 8) ^ (pos >> 16));
+	}
+}
+
+/* Run one delta of the file against old, checking the result */
+int sync_one(struct Bench *b, const char *path, const uint8_t *old, int blocksize, int nblocks, int64_t size, uint8_t *out, uint8_t *buf, int buflen)
+{
+	struct DevctlSyncBegin *begin = (struct DevctlSyncBegin *) buf;
+	struct DevctlSyncBeginResult bres;
+	struct DevctlSyncSession sess;
+	int64_t pos = 0;
+	int done = 0;
+	int ret;
+	int i;
+
+	memset(begin, 0, sizeof(*begin));
+	begin->blocksize = LE32(blocksize);
+	begin->nblocks = LE32(nblocks);
+	begin->start = LE64(0);
+	strcpy((char *) buf + sizeof(*begin), path);
+	ret = hfs_devctl(b, DEVCTL_SYNC_BEGIN, buf, sizeof(*begin) + strlen(path) + 1, &bres, sizeof(bres));
+	if(ret < 0)
+	{
+		fprintf(stderr, "Sync begin of %s failed (%08X)\n", path, ret);
+		return -1;
+	}
+
+	if(LE64(bres.size) != (uint64_t) size)
+	{
+		fprintf(stderr, "Sync size %" PRIu64 " expected %" PRId64 "\n", (uint64_t) LE64(bres.size), size);
+		return -1;
+	}
+	sess.session = bres.session;
+
+	for(i = 0; i < nblocks; )
+	{
+		struct DevctlSyncSigs *req = (struct DevctlSyncSigs *) buf;
+		struct SyncSig *sig = (struct SyncSig *) (buf + sizeof(*req));
+		int count = (buflen - (int) sizeof(*req)) / (int) sizeof(struct SyncSig);
+		int j;
+
+		count = count > (nblocks - i) ? (nblocks - i) : count;
+		req->session = bres.session;
+		req->first = LE32(i);
+		req->count = LE32(count);
+		for(j = 0; j < count; j++)
+		{
+			const uint8_t *p = old + (int64_t) (i + j) * blocksize;
+
+			sig[j].weak = LE32(sync_weak(p, blocksize));
+			sig[j].strong = LE32(hs_xxh32(p, blocksize));
+		}
+
+		ret = hfs_devctl(b, DEVCTL_SYNC_SIGS, buf, sizeof(*req) + count * sizeof(struct SyncSig), NULL, 0);
+		if(ret < 0)
+		{
+			fprintf(stderr, "Sync sigs failed (%08X)\n", ret);
+			return -1;
+		}
+		i += count;
+	}
+
+	while(!done)
+	{
+		struct DevctlSyncDeltaResult *res = (struct DevctlSyncDeltaResult *) buf;
+		uint8_t *p = buf + sizeof(*res);
+		uint8_t *end;
+
+		ret = hfs_devctl(b, DEVCTL_SYNC_DELTA, &sess, sizeof(sess), buf, buflen);
+		if(ret < 0)
+		{
+			fprintf(stderr, "Sync delta failed (%08X)\n", ret);
+			return -1;
+		}
+
+		end = p + LE32(res->len);
+		while(p + sizeof(struct SyncOp) <= end)
+		{
+			struct SyncOp op;
+			int64_t len;
+
+			memcpy(&op, p, sizeof(op));
+			p += sizeof(op);
+			if(LE32(op.type) == SYNCOP_COPY)
+			{
+				len = (int64_t) LE32(op.len) * blocksize;
+				if((LE32(op.block) + LE32(op.len) > (uint32_t) nblocks) || (pos + len > size))
+				{
+					fprintf(stderr, "Sync copy op out of range\n");
+					return -1;
+				}
+				memcpy(out + pos, old + (int64_t) LE32(op.block) * blocksize, len);
+			}
+			else
+			{
+				len = LE32(op.len);
+				if((LE32(op.type) != SYNCOP_DATA) || (p + len > end) || (pos + len > size))
+				{
+					fprintf(stderr, "Sync data op invalid\n");
+					return -1;
+				}
+				memcpy(out + pos, p, len);
+				p += len;
+			}
+			pos += len;
+		}
+
+		if((uint64_t) pos != LE64(res->pos))
+		{
+			fprintf(stderr, "Sync position %" PRId64 " host says %" PRIu64 "\n", pos, (uint64_t) LE64(res->pos));
+			return -1;
+		}
+		done = LE32(res->done);
+	}
+
+	hfs_devctl(b, DEVCTL_SYNC_END, &sess, sizeof(sess), NULL, 0);
+
+	if(pos != size)
+	{
+		fprintf(stderr, "Sync gave %" PRId64 " bytes of %" PRId64 "\n", pos, size);
+		return -1;
+	}
+
+	for(pos = 0; pos < size; pos += buflen)
+	{
+		int len = (size - pos) < buflen ? (int) (size - pos) : buflen;
+
+		sync_fill(buf, pos, len);
+		if(memcmp(out + pos, buf, len) != 0)
+		{
+			fprintf(stderr, "Sync result differs at block %d\n", (int) (pos / blocksize));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Delta syncs a file against an old copy in turn the same, with nothing in
+ * common, and with every other block changed. The file is a whole number of
+ * blocks, so the last window with nothing in common is block aligned. */
+int run_sync(struct Bench *b, struct Samples *s, int block)
+{
+	char path[256];
+	uint8_t *old = NULL;
+	uint8_t *out = NULL;
+	uint8_t *buf = NULL;
+	int blocksize = SYNC_MINBLOCK;
+	int64_t size;
+	int64_t pos;
+	int nblocks;
+	int len = 0;
+	int ret = -1;
+	int fid;
+	int i;
+
+	while((b->size / blocksize) > SYNC_MAXBLOCKS)
+	{
+		blocksize *= 2;
+	}
+	nblocks = b->size / blocksize;
+	nblocks = nblocks > 0 ? nblocks : 1;
+	size = (int64_t) nblocks * blocksize;
+
+	sync_path(b, path, sizeof(path));
+	do
+	{
+		old = (uint8_t *) malloc(size);
+		out = (uint8_t *) malloc(size);
+		buf = (uint8_t *) malloc(HOSTFS_MAX_BLOCK);
+		if((old == NULL) || (out == NULL) || (buf == NULL))
+		{
+			fprintf(stderr, "Could not allocate sync buffers\n");
+			break;
+		}
+
+		fid = hfs_open(b, path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC);
+		if(fid < 0)
+		{
+			fprintf(stderr, "Could not create %s (%08X)\n", path, fid);
+			break;
+		}
+
+		for(pos = 0; pos < size; pos += len)
+		{
+			len = (size - pos) < HOSTFS_MAX_BLOCK ? (int) (size - pos) : HOSTFS_MAX_BLOCK;
+			sync_fill(buf, pos, len);
+			if(hfs_write(b, fid, buf, len) != len)
+			{
+				break;
+			}
+		}
+		hfs_close(b, fid);
+		if(pos < size)
+		{
+			fprintf(stderr, "Could not fill %s\n", path);
+			break;
+		}
+
+		ret = 0;
+		samples_start(s);
+		while((ret == 0) && (time_left(b, s)))
+		{
+			uint64_t start;
+			int mode = s->count % 3;
+
+			for(i = 0; i < nblocks; i++)
+			{
+				uint8_t *p = old + (int64_t) i * blocksize;
+
+				if((mode == 0) || ((mode == 2) && (i & 1)))
+				{
+					sync_fill(p, (int64_t) i * blocksize, blocksize);
+				}
+				else
+				{
+					memset(p, 0xA5 + i, blocksize);
+				}
+			}
+
+			start = get_time_ns();
+			ret = sync_one(b, path, old, blocksize, nblocks, size, out, buf, HOSTFS_MAX_BLOCK);
+			if(ret == 0)
+			{
+				samples_add(s, start, size);
+			}
+		}
+	}
+	while(0);
+
+	free(old);
+	free(out);
+	free(buf);
+
+	return ret;
+}
+
+struct Workload
+{
+	const char *name;
+	/* Set if the workload is run once per block size */
+	int blocks;
+	/* Returns < 0 on failure, > 0 if skipped */
+	int (*run)(struct Bench *b, struct Samples *s, int block);
+};
+
+static const struct Workload g_workloads[] =
+{
+	{ "write", 1, run_write },
+	{ "seqread", 1, run_seqread },
+	{ "randread", 1, run_randread },
+	{ "streamread", 0, run_streamread },
+	{ "smallfiles", 0, run_smallfiles },
+	{ "readfile", 0, run_readfile },
+	{ "dirscan", 0, run_dirscan },
+	{ "dirbulk", 0, run_dirbulk },
+	{ "getstat", 0, run_getstat },
+	{ "taggetstat", 0, run_taggetstat },
+	{ "sync", 0, run_sync },
+	{ NULL, 0, NULL },
+};
+
+/* Create the files the read workloads use */
+int setup_files(struct Bench *b)
+{
+	char path[256];
+	int64_t pos;
+	int fid;
+	int i;
+
+	hfs_path_cmd(b, HOSTFS_CMD_MKDIR, b->dir);
+	snprintf(path, sizeof(path), "%s/small", b->dir);
+	hfs_path_cmd(b, HOSTFS_CMD_MKDIR, path);
+
+	for(i = 0; i < b->nfiles; i++)
+	{
+		small_path(b, path, sizeof(path), i);
+		fid = hfs_open(b, path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC);
+		if(fid < 0)
+		{
+			fprintf(stderr, "Could not create %s (%08X)\n", path, fid);
+			return -1;
+		}
+		hfs_write(b, fid, b->buf, BENCH_SMALL_SIZE);
+		hfs_close(b, fid);
+	}
+
+	big_path(b, path, sizeof(path));
+	fid = hfs_open(b, path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC);
+	if(fid < 0)
+	{
+		fprintf(stderr, "Could not create %s (%08X)\n", path, fid);
+		return -1;
+	}
+
+	for(pos = 0; pos < b->size; pos += HOSTFS_MAX_BLOCK)
+	{
+		int len = (b->size - pos) < HOSTFS_MAX_BLOCK ? (int) (b->size - pos) : HOSTFS_MAX_BLOCK;
+
+		if(hfs_write(b, fid, b->buf, len) != len)
+		{
+			fprintf(stderr, "Could not fill %s\n", path);
+			hfs_close(b, fid);
+			return -1;
+		}
+	}
+
+	hfs_close(b, fid);
+
+	return 0;
+}
+
+void cleanup_files(struct Bench *b)
+{
+	char path[256];
+	int i;
+
+	for(i = 0; i < b->nfiles; i++)
+	{
+		small_path(b, path, sizeof(path), i);
+		hfs_path_cmd(b, HOSTFS_CMD_REMOVE, path);
+	}
+
+	snprintf(path, sizeof(path), "%s/small", b->dir);
+	hfs_path_cmd(b, HOSTFS_CMD_RMDIR, path);
+	big_path(b, path, sizeof(path));
+	hfs_path_cmd(b, HOSTFS_CMD_REMOVE, path);
+	sync_path(b, path, sizeof(path));
+	hfs_path_cmd(b, HOSTFS_CMD_REMOVE, path);
+	hfs_path_cmd(b, HOSTFS_CMD_RMDIR, b->dir);
+}
+
+int parse_blocks(struct Bench *b, const char *list)
+{
+	char *copy = strdup(list);
+	char *tok;
+	char *save;
+
+	b->nblocks = 0;
+	for(tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+	{
+		int size = atoi(tok);
+
+		if((size <= 0) || (size > HOSTFS_MAX_BLOCK) || (b->nblocks == BENCH_MAX_BLOCKS))
+		{
+			fprintf(stderr, "Invalid block size '%s', must be 1 to %d\n", tok, HOSTFS_MAX_BLOCK);
+			free(copy);
+			return -1;
+		}
+		b->blocks[b->nblocks++] = size;
+	}
+	free(copy);
+
+	return b->nblocks > 0 ? 0 : -1;
+}
+
+int selected(const char *list, const char *name)
+{
+	int len = strlen(name);
+	const char *p = list;
+
+	while((p = strstr(p, name)) != NULL)
+	{
+		if(((p == list) || (p[-1] == ',')) && ((p[len] == 0) || (p[len] == ',')))
+		{
+			return 1;
+		}
+		p += len;
+	}
+
+	return 0;
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: hostfs_bench [options] address\n");
+	fprintf(stderr, "address is what usbhostfs_pc was given with -l, [host:]port or a Unix socket path\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "-w list           : Workloads to run (default %s)\n", BENCH_DEF_WORKLOADS);
+	fprintf(stderr, "-b list           : Block sizes for write, seqread and randread (default %s)\n", BENCH_DEF_BLOCKS);
+	fprintf(stderr, "-t seconds        : Time to run each workload for (default %d)\n", BENCH_DEF_SECONDS);
+	fprintf(stderr, "-S size           : Size in KiB of the file used for reads and writes (default %d)\n", BENCH_DEF_SIZE / 1024);
+	fprintf(stderr, "-n num            : Number of small files (default %d)\n", BENCH_DEF_FILES);
+	fprintf(stderr, "-d dir            : Directory on host0: to work in (default /hostfs_bench)\n");
+	fprintf(stderr, "-k                : Keep the files afterwards\n");
+	fprintf(stderr, "-L                : Send a plain HELLO, like a PSP without capabilities\n");
+	fprintf(stderr, "-E caps           : Fail unless exactly these capabilities are agreed\n");
+	fprintf(stderr, "-c root           : Server root on this machine, reads start with a cold page cache\n");
+	fprintf(stderr, "-h                : Print this help\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct Bench b;
+	struct Samples s;
+	const char *workloads = BENCH_DEF_WORKLOADS;
+	const char *blocks = BENCH_DEF_BLOCKS;
+	int keep = 0;
+	int ret = 0;
+	int i;
+
+	memset(&s, 0, sizeof(s));
+	b.dir = "/hostfs_bench";
+	b.seconds = BENCH_DEF_SECONDS;
+	b.size = BENCH_DEF_SIZE;
+	b.nfiles = BENCH_DEF_FILES;
+	b.expect = -1;
+
+	while(1)
+	{
+		int ch;
+
+		ch = getopt(argc, argv, "hkLw:b:t:S:n:d:c:E:");
+		if(ch == -1)
+		{
+			break;
+		}
+
+		switch(ch)
+		{
+			case 'w': workloads = optarg;
+					  break;
+			case 'b': blocks = optarg;
+					  break;
+			case 't': b.seconds = atoi(optarg);
+					  break;
+			case 'S': b.size = (int64_t) atoi(optarg) * 1024;
+					  break;
+			case 'n': b.nfiles = atoi(optarg);
+					  break;
+			case 'd': b.dir = optarg;
+					  break;
+			case 'k': keep = 1;
+					  break;
+			case 'L': b.legacy = 1;
+					  break;
+			case 'E': b.expect = strtoul(optarg, NULL, 0);
+					  break;
+			case 'c': b.coldroot = optarg;
+					  break;
+			default:  print_help();
+					  return 1;
+		};
+	}
+
+	if((optind >= argc) || (parse_blocks(&b, blocks) < 0) || (b.nfiles <= 0) || (b.size <= 0))
+	{
+		print_help();
+		return 1;
+	}
+
+	for(i = 0; i < sizeof(b.buf); i++)
+	{
+		b.buf[i] = (char) i;
+	}
+
+	b.fd = fake_connect(argv[optind]);
+	if(b.fd < 0)
+	{
+		return 1;
+	}
+
+	if((bench_hello(&b) < 0) || (setup_files(&b) < 0))
+	{
+		close(b.fd);
+		return 1;
+	}
+
+	if((b.expect >= 0) && (b.caps != (uint32_t) b.expect))
+	{
+		fprintf(stderr, "Agreed capabilities %08X, expected %08X\n", b.caps, (uint32_t) b.expect);
+		cleanup_files(&b);
+		close(b.fd);
+		return 1;
+	}
+
+	for(i = 0; (g_workloads[i].name) && (ret == 0); i++)
+	{
+		const struct Workload *wl = &g_workloads[i];
+		int j;
+
+		if(!selected(workloads, wl->name))
+		{
+			continue;
+		}
+
+		for(j = 0; j < (wl->blocks ? b.nblocks : 1); j++)
+		{
+			int block = wl->blocks ? b.blocks[j] : 0;
+
+			int res = wl->run(&b, &s, block);
+
+			if(res < 0)
+			{
+				fprintf(stderr, "Workload %s failed\n", wl->name);
+				ret = 1;
+				break;
+			}
+
+			/* Skipped as the server can't do it */
+			if(res > 0)
+			{
+				break;
+			}
+			samples_report(&s, wl->name, block);
+		}
+	}
+
+	if(!keep)
+	{
+		cleanup_files(&b);
+	}
+
+	close(b.fd);
+	free(s.ns);
+
+	return ret;
+}
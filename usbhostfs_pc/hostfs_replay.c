@@ -0,0 +1,539 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hostfs_replay.c - Replay a captured HostFS session against usbhostfs_pc
+ *
+ * Copyright (c) pspdev
+ *
+ * Capture a real session with usbhostfs_pc -T, then play it back through
+ * the handlers of a server listening on a socket, either keeping the
+ * original gaps between commands or as fast as the server will go:
+ *
+ *   usbhostfs_pc -T game.trace /games/foo
+ *   usbhostfs_pc -l /tmp/hostfs.sock /games/foo
+ *   hostfs_replay game.trace /tmp/hostfs.sock
+ *
+ * Handles the server gives out are mapped to the ones in the trace, and any
+ * reply whose result differs from the capture is counted as a mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <usbhostfs.h>
+#include "usbhostfs_pc.h"
+#include "transport.h"
+#include "trace.h"
+#include "cmdstats.h"
+#include "fakepsp.h"
+
+#define REPLAY_MAX_HANDLES 256
+
+int g_verbose = 0;
+
+struct HandleMap
+{
+	int32_t trace;
+	int32_t live;
+};
+
+struct Replay
+{
+	int fd;
+	const char *addr;
+	/* 0 for as fast as possible, otherwise a multiple of the original speed */
+	double speed;
+	int slot;
+	/* The HostFS command waiting for its reply */
+	uint32_t command;
+	uint64_t sent;
+	/* Handles from OPEN and DOPEN */
+	struct HandleMap handles[REPLAY_MAX_HANDLES];
+	int nhandles;
+	/* Totals for the whole replay */
+	int sessions;
+	uint64_t commands;
+	uint64_t mismatches;
+	uint64_t trace_ns;
+	struct CmdStats stats;
+	char data[TRANS_MAX_FRAME];
+	char reply[HOSTFS_MAX_BLOCK];
+};
+
+uint32_t get_u32(const void *p)
+{
+	uint32_t val;
+
+	memcpy(&val, p, sizeof(val));
+
+	return LE32(val);
+}
+
+void put_u32(void *p, uint32_t val)
+{
+	val = LE32(val);
+	memcpy(p, &val, sizeof(val));
+}
+
+/* Read one reply frame, async channel output is skipped */
+int replay_frame(struct Replay *r, void *data, int max)
+{
+	struct TransFrame frame;
+	char skip[512];
+	int size;
+	int left;
+
+	while(1)
+	{
+		if(fake_read_all(r->fd, &frame, sizeof(frame)) < 0)
+		{
+			fprintf(stderr, "Server closed the connection\n");
+			return -1;
+		}
+
+		left = LE32(frame.size);
+		if(LE32(frame.ep) != TRANS_EP_ASYNC)
+		{
+			break;
+		}
+
+		while(left > 0)
+		{
+			size = left < sizeof(skip) ? left : sizeof(skip);
+			if(fake_read_all(r->fd, skip, size) < 0)
+			{
+				return -1;
+			}
+			left -= size;
+		}
+	}
+
+	size = left < max ? left : max;
+	if(fake_read_all(r->fd, data, size) < 0)
+	{
+		return -1;
+	}
+	left -= size;
+
+	while(left > 0)
+	{
+		int len = left < sizeof(skip) ? left : sizeof(skip);
+
+		if(fake_read_all(r->fd, skip, len) < 0)
+		{
+			return -1;
+		}
+		left -= len;
+	}
+
+	return size;
+}
+
+/* Read a whole reply, the header frame then the extra data */
+int replay_reply(struct Replay *r)
+{
+	int len;
+	int extra;
+
+	len = replay_frame(r, r->reply, sizeof(r->reply));
+	if(len < sizeof(struct HostFsCmd))
+	{
+		fprintf(stderr, "Short reply from server (%d)\n", len);
+		return -1;
+	}
+
+	extra = get_u32(r->reply + 8);
+	while(extra > 0)
+	{
+		char buf[HOSTFS_MAX_BLOCK];
+		int ret;
+
+		ret = replay_frame(r, buf, sizeof(buf));
+		if(ret <= 0)
+		{
+			return -1;
+		}
+		extra -= ret;
+	}
+
+	return len;
+}
+
+int32_t map_handle(struct Replay *r, int32_t fid)
+{
+	int i;
+
+	for(i = 0; i < r->nhandles; i++)
+	{
+		if(r->handles[i].trace == fid)
+		{
+			return r->handles[i].live;
+		}
+	}
+
+	return fid;
+}
+
+void add_handle(struct Replay *r, int32_t trace, int32_t live)
+{
+	int i;
+
+	for(i = 0; i < r->nhandles; i++)
+	{
+		if(r->handles[i].trace == trace)
+		{
+			r->handles[i].live = live;
+			return;
+		}
+	}
+
+	if(r->nhandles < REPLAY_MAX_HANDLES)
+	{
+		r->handles[r->nhandles].trace = trace;
+		r->handles[r->nhandles].live = live;
+		r->nhandles++;
+	}
+}
+
+/* Commands which carry a file or directory handle straight after the header */
+int has_handle(uint32_t command)
+{
+	switch(command)
+	{
+		case HOSTFS_CMD_CLOSE:
+		case HOSTFS_CMD_READ:
+		case HOSTFS_CMD_READSTREAM:
+		case HOSTFS_CMD_WRITE:
+		case HOSTFS_CMD_LSEEK:
+		case HOSTFS_CMD_IOCTL:
+		case HOSTFS_CMD_DREAD:
+		case HOSTFS_CMD_DREADBULK:
+		case HOSTFS_CMD_DCLOSE:
+			return 1;
+		default:
+			return 0;
+	};
+}
+
+/* Wait until the command is due, relative to the start of the session */
+void replay_wait(struct Replay *r, uint64_t trace_ns, uint64_t start)
+{
+	uint64_t due;
+	uint64_t now;
+
+	if(r->speed <= 0.0)
+	{
+		return;
+	}
+
+	due = start + (uint64_t) (trace_ns / r->speed);
+	now = get_time_ns();
+	if(due > now)
+	{
+		struct timespec ts;
+
+		ts.tv_sec = (due - now) / 1000000000ULL;
+		ts.tv_nsec = (due - now) % 1000000000ULL;
+		nanosleep(&ts, NULL);
+	}
+}
+
+int replay_cmd(struct Replay *r, char *data, int len)
+{
+	uint32_t magic = get_u32(data);
+
+	r->command = 0;
+	if((magic == HOSTFS_MAGIC) && (len >= sizeof(struct HostFsCmd) + sizeof(int32_t)))
+	{
+		if(has_handle(get_u32(data + 4)))
+		{
+			put_u32(data + 12, map_handle(r, get_u32(data + 12)));
+		}
+	}
+
+	r->sent = get_time_ns();
+	if(fake_send(r->fd, data, len) < 0)
+	{
+		return -1;
+	}
+
+	if(magic == HOSTFS_MAGIC)
+	{
+		r->command = get_u32(data + 4);
+	}
+	else if(magic == ASYNC_MAGIC)
+	{
+		cs_record(&r->stats.async[get_u32(data + 4) % MAX_ASYNC_CHANNELS], get_time_ns() - r->sent, len, 0, 0);
+	}
+
+	return 0;
+}
+
+/* Check the live reply against the one in the trace */
+int replay_check(struct Replay *r, const char *trace, int tracelen)
+{
+	int len;
+	int error = 0;
+
+	len = replay_reply(r);
+	if(len < 0)
+	{
+		return -1;
+	}
+
+	if((len >= 16) && (tracelen >= 16))
+	{
+		int32_t want = get_u32(trace + 12);
+		int32_t got = get_u32(r->reply + 12);
+
+		if(((r->command == HOSTFS_CMD_OPEN) || (r->command == HOSTFS_CMD_DOPEN) || (r->command == HOSTFS_CMD_READFILE))
+			&& (want >= 0) && (got >= 0))
+		{
+			add_handle(r, want, got);
+		}
+		else if(want != got)
+		{
+			V_PRINTF(1, "Command %08X returned %08X, trace has %08X\n", r->command, got, want);
+			r->mismatches++;
+			error = 1;
+		}
+	}
+
+	cs_record(cs_command(&r->stats, r->command), get_time_ns() - r->sent, 0, len, error);
+	r->commands++;
+	r->command = 0;
+
+	return 0;
+}
+
+int replay_connect(struct Replay *r)
+{
+	int len;
+
+	r->fd = fake_connect(r->addr);
+	if(r->fd < 0)
+	{
+		return -1;
+	}
+
+	/* The server opens with the magic, the same as over USB */
+	len = replay_frame(r, r->reply, sizeof(r->reply));
+	if((len != sizeof(uint32_t)) || (get_u32(r->reply) != HOSTFS_MAGIC))
+	{
+		fprintf(stderr, "Invalid magic from server\n");
+		close(r->fd);
+		r->fd = -1;
+		return -1;
+	}
+
+	r->nhandles = 0;
+	r->command = 0;
+	r->sessions++;
+
+	return 0;
+}
+
+int replay(struct Replay *r, FILE *fp)
+{
+	struct TraceRec rec;
+	uint64_t trace_start = 0;
+	uint64_t start = 0;
+	int ret;
+
+	r->fd = -1;
+	while((ret = trace_read_rec(fp, &rec, r->data, sizeof(r->data))) > 0)
+	{
+		if(r->slot < 0)
+		{
+			r->slot = rec.slot;
+		}
+
+		if(rec.slot != r->slot)
+		{
+			continue;
+		}
+
+		if(rec.type == TRACE_CONNECT)
+		{
+			if(r->fd >= 0)
+			{
+				close(r->fd);
+			}
+
+			if(replay_connect(r) < 0)
+			{
+				return -1;
+			}
+			trace_start = rec.time_ns;
+			start = get_time_ns();
+			V_PRINTF(1, "Replaying session %d of slot %d (%.*s)\n", r->sessions, r->slot,
+					(int) (rec.len < sizeof(r->data) ? rec.len : sizeof(r->data)), r->data);
+			continue;
+		}
+
+		if(r->fd < 0)
+		{
+			/* The capture started in the middle of a session */
+			continue;
+		}
+
+		switch(rec.type)
+		{
+			case TRACE_CMD:
+				replay_wait(r, rec.time_ns - trace_start, start);
+				if(rec.len > sizeof(r->data))
+				{
+					fprintf(stderr, "Command too large in trace (%u)\n", rec.len);
+					return -1;
+				}
+				if(replay_cmd(r, r->data, rec.len) < 0)
+				{
+					return -1;
+				}
+				break;
+
+			case TRACE_DATA:
+				/* Data which wasn't kept is sent as zeros of the same size */
+				if(!(rec.flags & TRACE_REC_DATA))
+				{
+					memset(r->data, 0, rec.len < sizeof(r->data) ? rec.len : sizeof(r->data));
+				}
+				if(rec.len > sizeof(r->data))
+				{
+					fprintf(stderr, "Data too large in trace (%u)\n", rec.len);
+					return -1;
+				}
+				if(fake_send(r->fd, r->data, rec.len) < 0)
+				{
+					return -1;
+				}
+				break;
+
+			case TRACE_REPLY:
+				if(replay_check(r, r->data, rec.len) < 0)
+				{
+					return -1;
+				}
+				break;
+
+			case TRACE_DISCONNECT:
+				r->trace_ns += rec.time_ns - trace_start;
+				close(r->fd);
+				r->fd = -1;
+				break;
+
+			default:
+				fprintf(stderr, "Unknown record type %d in trace\n", rec.type);
+				return -1;
+		};
+	}
+
+	if(r->fd >= 0)
+	{
+		r->trace_ns += rec.time_ns - trace_start;
+		close(r->fd);
+		r->fd = -1;
+	}
+
+	if(ret < 0)
+	{
+		fprintf(stderr, "Error reading trace\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: hostfs_replay [options] trace address\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "-x speed          : Multiple of the original speed, 0 for as fast as possible (default 0)\n");
+	fprintf(stderr, "-s slot           : Device slot to replay (default the first in the trace)\n");
+	fprintf(stderr, "-v                : Print mismatches and a table of the commands\n");
+	fprintf(stderr, "-h                : Print this help\n");
+	fprintf(stderr, "The address is [host:]port for TCP, otherwise the path of a Unix socket\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct Replay r;
+	struct TraceHeader hdr;
+	uint64_t start;
+	double secs;
+	FILE *fp;
+	int ret;
+
+	r.slot = -1;
+
+	while(1)
+	{
+		int ch;
+
+		ch = getopt(argc, argv, "hvx:s:");
+		if(ch == -1)
+		{
+			break;
+		}
+
+		switch(ch)
+		{
+			case 'x': r.speed = atof(optarg);
+					  break;
+			case 's': r.slot = atoi(optarg);
+					  break;
+			case 'v': g_verbose++;
+					  break;
+			default:  print_help();
+					  return 1;
+		};
+	}
+
+	if((optind + 2) > argc)
+	{
+		print_help();
+		return 1;
+	}
+
+	r.addr = argv[optind + 1];
+	fp = fopen(argv[optind], "rb");
+	if(fp == NULL)
+	{
+		fprintf(stderr, "Could not open trace %s\n", argv[optind]);
+		return 1;
+	}
+
+	if(trace_read_header(fp, &hdr) < 0)
+	{
+		fclose(fp);
+		return 1;
+	}
+
+	cs_reset(&r.stats);
+	start = get_time_ns();
+	ret = replay(&r, fp);
+	secs = (get_time_ns() - start) / 1e9;
+	fclose(fp);
+
+	if(secs <= 0.0)
+	{
+		secs = 1e-9;
+	}
+
+	printf("{\"trace\":\"%s\",\"sessions\":%d,\"commands\":%" PRIu64 ",\"mismatches\":%" PRIu64 ",\"payloads\":%d,"
+			"\"seconds\":%.3f,\"trace_seconds\":%.3f,\"ops_per_sec\":%.1f}\n",
+			argv[optind], r.sessions, r.commands, r.mismatches, (LE32(hdr.flags) & TRACE_FLAG_PAYLOADS) ? 1 : 0,
+			secs, r.trace_ns / 1e9, r.commands / secs);
+
+	if(g_verbose)
+	{
+		cs_print(&r.stats, stderr, NULL);
+	}
+
+	return ret < 0 ? 1 : 0;
+}
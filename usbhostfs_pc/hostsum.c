@@ -0,0 +1,407 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hostsum.c - File hashes computed on the host for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ * Checking a file on the host against one on the PSP used to mean reading
+ * it back over USB. Here the host hashes its copy while the PSP hashes its
+ * own, and only the digests cross. CRC32 comes from zlib, which already
+ * has the fastest version the platform supports, SHA-1 and XXH32 are small
+ * portable versions, either is far faster than USB could feed the PSP.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zlib.h>
+#include <usbhostfs.h>
+#include "usbhostfs_pc.h"
+#include "hostsum.h"
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define XXH_PRIME1  0x9E3779B1U
+#define XXH_PRIME2  0x85EBCA77U
+#define XXH_PRIME3  0xC2B2AE3DU
+#define XXH_PRIME4  0x27D4EB2FU
+#define XXH_PRIME5  0x165667B1U
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[1] << 8) | p[0];
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void sha1_block(uint32_t *h, const uint8_t *data)
+{
+	uint32_t w[80];
+	uint32_t a, b, c, d, e, t;
+	int i;
+
+	for(i = 0; i < 16; i++)
+	{
+		w[i] = get_be32(data + (i * 4));
+	}
+
+	for(i = 16; i < 80; i++)
+	{
+		t = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+		w[i] = ROL32(t, 1);
+	}
+
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+
+	for(i = 0; i < 80; i++)
+	{
+		uint32_t f, k;
+
+		if(i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if(i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if(i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		t = ROL32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL32(b, 30);
+		b = a;
+		a = t;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+static void sha1_update(struct HsSha1 *s, const uint8_t *data, size_t len)
+{
+	s->total += len;
+
+	if(s->used > 0)
+	{
+		size_t n = 64 - s->used;
+
+		n = n > len ? len : n;
+		memcpy(s->buf + s->used, data, n);
+		s->used += n;
+		data += n;
+		len -= n;
+		if(s->used < 64)
+		{
+			return;
+		}
+		sha1_block(s->h, s->buf);
+		s->used = 0;
+	}
+
+	while(len >= 64)
+	{
+		sha1_block(s->h, data);
+		data += 64;
+		len -= 64;
+	}
+
+	memcpy(s->buf, data, len);
+	s->used = len;
+}
+
+static void sha1_final(struct HsSha1 *s, uint8_t *digest)
+{
+	uint64_t bits = s->total * 8;
+	uint8_t pad[72];
+	int padlen;
+	int i;
+
+	/* A 1 bit, zeros up to 56 mod 64, then the length in bits */
+	padlen = s->used < 56 ? 56 - s->used : 120 - s->used;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	put_be32(pad + padlen, bits >> 32);
+	put_be32(pad + padlen + 4, bits);
+	sha1_update(s, pad, padlen + 8);
+
+	for(i = 0; i < 5; i++)
+	{
+		put_be32(digest + (i * 4), s->h[i]);
+	}
+}
+
+static uint32_t xxh32_round(uint32_t acc, uint32_t input)
+{
+	acc += input * XXH_PRIME2;
+	acc = ROL32(acc, 13);
+
+	return acc * XXH_PRIME1;
+}
+
+static void xxh32_update(struct HsXxh32 *x, const uint8_t *data, size_t len)
+{
+	x->total += len;
+
+	if(x->used > 0)
+	{
+		size_t n = 16 - x->used;
+
+		n = n > len ? len : n;
+		memcpy(x->buf + x->used, data, n);
+		x->used += n;
+		data += n;
+		len -= n;
+		if(x->used < 16)
+		{
+			return;
+		}
+		x->v[0] = xxh32_round(x->v[0], get_le32(x->buf));
+		x->v[1] = xxh32_round(x->v[1], get_le32(x->buf + 4));
+		x->v[2] = xxh32_round(x->v[2], get_le32(x->buf + 8));
+		x->v[3] = xxh32_round(x->v[3], get_le32(x->buf + 12));
+		x->used = 0;
+	}
+
+	/* The four lanes are independent, which keeps the pipeline full */
+	while(len >= 16)
+	{
+		x->v[0] = xxh32_round(x->v[0], get_le32(data));
+		x->v[1] = xxh32_round(x->v[1], get_le32(data + 4));
+		x->v[2] = xxh32_round(x->v[2], get_le32(data + 8));
+		x->v[3] = xxh32_round(x->v[3], get_le32(data + 12));
+		data += 16;
+		len -= 16;
+	}
+
+	memcpy(x->buf, data, len);
+	x->used = len;
+}
+
+static uint32_t xxh32_final(struct HsXxh32 *x)
+{
+	const uint8_t *p = x->buf;
+	int left = x->used;
+	uint32_t h;
+
+	if(x->total >= 16)
+	{
+		h = ROL32(x->v[0], 1) + ROL32(x->v[1], 7) + ROL32(x->v[2], 12) + ROL32(x->v[3], 18);
+	}
+	else
+	{
+		h = x->v[2] + XXH_PRIME5;
+	}
+	h += (uint32_t) x->total;
+
+	while(left >= 4)
+	{
+		h += get_le32(p) * XXH_PRIME3;
+		h = ROL32(h, 17) * XXH_PRIME4;
+		p += 4;
+		left -= 4;
+	}
+
+	while(left > 0)
+	{
+		h += *p * XXH_PRIME5;
+		h = ROL32(h, 11) * XXH_PRIME1;
+		p++;
+		left--;
+	}
+
+	h ^= h >> 15;
+	h *= XXH_PRIME2;
+	h ^= h >> 13;
+	h *= XXH_PRIME3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+uint32_t hs_xxh32(const void *data, size_t len)
+{
+	struct HsXxh32 x;
+
+	memset(&x, 0, sizeof(x));
+	x.v[0] = XXH_PRIME1 + XXH_PRIME2;
+	x.v[1] = XXH_PRIME2;
+	x.v[3] = 0 - XXH_PRIME1;
+	xxh32_update(&x, (const uint8_t *) data, len);
+
+	return xxh32_final(&x);
+}
+
+int hs_init(struct HsCtx *ctx, int type)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->type = type;
+
+	switch(type)
+	{
+		case HOSTHASH_CRC32: ctx->crc = crc32(0, NULL, 0);
+							 break;
+		case HOSTHASH_SHA1: ctx->sha1.h[0] = 0x67452301;
+							ctx->sha1.h[1] = 0xEFCDAB89;
+							ctx->sha1.h[2] = 0x98BADCFE;
+							ctx->sha1.h[3] = 0x10325476;
+							ctx->sha1.h[4] = 0xC3D2E1F0;
+							break;
+		case HOSTHASH_XXH32: ctx->xxh32.v[0] = XXH_PRIME1 + XXH_PRIME2;
+							 ctx->xxh32.v[1] = XXH_PRIME2;
+							 ctx->xxh32.v[2] = 0;
+							 ctx->xxh32.v[3] = 0 - XXH_PRIME1;
+							 break;
+		default: return GETERROR(EINVAL);
+	};
+
+	return 0;
+}
+
+void hs_update(struct HsCtx *ctx, const void *data, size_t len)
+{
+	switch(ctx->type)
+	{
+		case HOSTHASH_CRC32: while(len > 0)
+							 {
+								 /* zlib takes the length as an unsigned int */
+								 uInt n = len > (1U << 30) ? (1U << 30) : len;
+
+								 ctx->crc = crc32(ctx->crc, (const Bytef *) data, n);
+								 data = (const char *) data + n;
+								 len -= n;
+							 }
+							 break;
+		case HOSTHASH_SHA1: sha1_update(&ctx->sha1, (const uint8_t *) data, len);
+							break;
+		case HOSTHASH_XXH32: xxh32_update(&ctx->xxh32, (const uint8_t *) data, len);
+							 break;
+		default: break;
+	};
+}
+
+int hs_final(struct HsCtx *ctx, uint8_t *digest)
+{
+	memset(digest, 0, HOSTHASH_MAXDIGEST);
+
+	switch(ctx->type)
+	{
+		case HOSTHASH_CRC32: put_be32(digest, ctx->crc);
+							 return 4;
+		case HOSTHASH_SHA1: sha1_final(&ctx->sha1, digest);
+							return 20;
+		case HOSTHASH_XXH32: put_be32(digest, xxh32_final(&ctx->xxh32));
+							 return 4;
+		default: break;
+	};
+
+	return 0;
+}
+
+int hs_file(const char *path, int type, int64_t ofs, int64_t len, uint8_t *digest, int64_t *hashed)
+{
+	struct HsCtx ctx;
+	char *buf;
+	int fd;
+	int ret;
+
+	*hashed = 0;
+	ret = hs_init(&ctx, type);
+	if(ret < 0)
+	{
+		return ret;
+	}
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		return GETERROR(errno);
+	}
+
+	buf = (char *) malloc(HS_BUFSIZE);
+	if(buf == NULL)
+	{
+		close(fd);
+		return GETERROR(ENOMEM);
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, ofs, len, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	while((len == 0) || (*hashed < len))
+	{
+		size_t want = HS_BUFSIZE;
+		ssize_t n;
+
+		if((len > 0) && ((int64_t) want > (len - *hashed)))
+		{
+			want = len - *hashed;
+		}
+
+		n = pread(fd, buf, want, ofs + *hashed);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			ret = GETERROR(errno);
+			break;
+		}
+
+		if(n == 0)
+		{
+			break;
+		}
+
+		hs_update(&ctx, buf, n);
+		*hashed += n;
+	}
+
+	free(buf);
+	close(fd);
+
+	if(ret < 0)
+	{
+		return ret;
+	}
+
+	return hs_final(&ctx, digest);
+}
@@ -0,0 +1,90 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hostsum.h - File hashes computed on the host for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __HOSTSUM_H__
+#define __HOSTSUM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Size of the reads made while hashing a file */
+#define HS_BUFSIZE  (1024*1024)
+
+struct HsSha1
+{
+	uint32_t h[5];
+	uint64_t total;
+	uint8_t buf[64];
+	int used;
+};
+
+struct HsXxh32
+{
+	uint32_t v[4];
+	uint64_t total;
+	uint8_t buf[16];
+	int used;
+};
+
+struct HsCtx
+{
+	/* One of HOSTHASH_* */
+	int type;
+	uint32_t crc;
+	struct HsSha1 sha1;
+	struct HsXxh32 xxh32;
+};
+
+/**
+ * Start a hash
+ *
+ * @param ctx - The hash state
+ * @param type - One of HOSTHASH_*
+ *
+ * @return 0 on success, < 0 (GETERROR) if the type is unknown
+ */
+int hs_init(struct HsCtx *ctx, int type);
+
+/**
+ * Add data to a hash
+ */
+void hs_update(struct HsCtx *ctx, const void *data, size_t len);
+
+/**
+ * Finish a hash
+ *
+ * @param ctx - The hash state
+ * @param digest - Filled in with the digest in big endian byte order,
+ * HOSTHASH_MAXDIGEST bytes long
+ *
+ * @return The length of the digest
+ */
+int hs_final(struct HsCtx *ctx, uint8_t *digest);
+
+/**
+ * XXH32 of a buffer with a seed of 0
+ */
+uint32_t hs_xxh32(const void *data, size_t len);
+
+/**
+ * Hash a range of a file
+ *
+ * @param path - Host path of the file
+ * @param type - One of HOSTHASH_*
+ * @param ofs - Offset to start at
+ * @param len - Number of bytes to hash, 0 for up to the end of the file
+ * @param digest - Filled in with the digest
+ * @param hashed - Filled in with the number of bytes hashed
+ *
+ * @return The length of the digest, < 0 (GETERROR) on error
+ */
+int hs_file(const char *path, int type, int64_t ofs, int64_t len, uint8_t *digest, int64_t *hashed);
+
+#endif
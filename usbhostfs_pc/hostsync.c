@@ -0,0 +1,519 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hostsync.c - Delta sync of host trees to the PSP for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ * Redeploying a build with cp rewrites every byte on the memory stick. For
+ * a sync the PSP sends a weak rolling checksum and an XXH32 of each block of
+ * its old copy of a file. The new file on the host is scanned a byte at a
+ * time in the manner of rsync, a block which matches one the PSP already has
+ * goes back as a copy op and everything else as literal data. The whole tree
+ * is walked here once and handed out in pages rather than a directory at a
+ * time over USB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <usbhostfs.h>
+#include "usbhostfs_pc.h"
+#include "hostsum.h"
+#include "hostwalk.h"
+#include "hostsync.h"
+
+static int add_entry(struct HyList *list, const char *name, const struct stat *st)
+{
+	struct HyEntry *ent;
+
+	if(list->count == list->max)
+	{
+		int max = list->max ? list->max * 2 : 256;
+
+		ent = (struct HyEntry *) realloc(list->ents, max * sizeof(struct HyEntry));
+		if(ent == NULL)
+		{
+			return GETERROR(ENOMEM);
+		}
+		list->ents = ent;
+		list->max = max;
+	}
+
+	ent = &list->ents[list->count];
+	ent->name = strdup(name);
+	if(ent->name == NULL)
+	{
+		return GETERROR(ENOMEM);
+	}
+	ent->isdir = S_ISDIR(st->st_mode);
+	ent->size = ent->isdir ? 0 : st->st_size;
+	ent->mtime = st->st_mtime;
+	list->count++;
+
+	return 0;
+}
+
+/* Called by hw_walk for each entry */
+static int list_entry(void *arg, const char *path, const char *rel, const struct stat *st)
+{
+	return add_entry((struct HyList *) arg, rel, st);
+}
+
+void hy_list_free(struct HyList *list)
+{
+	int i;
+
+	for(i = 0; i < list->count; i++)
+	{
+		free(list->ents[i].name);
+	}
+	free(list->ents);
+	free(list->root);
+	memset(list, 0, sizeof(*list));
+}
+
+int hy_walk(const char *root, struct HyList *list)
+{
+	struct stat st;
+	int ret;
+
+	memset(list, 0, sizeof(*list));
+	if(stat(root, &st) < 0)
+	{
+		return GETERROR(errno);
+	}
+
+	if(!S_ISDIR(st.st_mode))
+	{
+		return GETERROR(ENOTDIR);
+	}
+
+	ret = hw_walk(root, list_entry, list);
+	if(ret < 0)
+	{
+		hy_list_free(list);
+	}
+	else
+	{
+		V_PRINTF(1, "Sync walk of %s found %d entries\n", root, list->count);
+	}
+
+	return ret;
+}
+
+/* The rsync weak checksum, two 16 bit sums of the bytes which can be rolled on a byte */
+static void weak_sum(const uint8_t *data, int len, uint32_t *s1, uint32_t *s2)
+{
+	uint32_t a = 0, b = 0;
+	int i;
+
+	for(i = 0; i < len; i++)
+	{
+		a += data[i];
+		b += (len - i) * data[i];
+	}
+
+	*s1 = a & 0xFFFF;
+	*s2 = b & 0xFFFF;
+}
+
+static unsigned int weak_hash(struct HySession *s, uint32_t weak)
+{
+	return (weak ^ (weak >> 16)) & s->hashmask;
+}
+
+static int build_hash(struct HySession *s)
+{
+	unsigned int size = 16;
+	int i;
+
+	while(size < (unsigned int) (s->nblocks * 2))
+	{
+		size <<= 1;
+	}
+
+	free(s->head);
+	s->head = (int *) malloc(size * sizeof(int));
+	if(s->head == NULL)
+	{
+		return GETERROR(ENOMEM);
+	}
+	s->hashmask = size - 1;
+
+	for(i = 0; i < (int) size; i++)
+	{
+		s->head[i] = -1;
+	}
+
+	/* Backwards so the lowest numbered block is found first */
+	for(i = s->nblocks - 1; i >= 0; i--)
+	{
+		unsigned int h = weak_hash(s, s->weak[i]);
+
+		s->chain[i] = s->head[h];
+		s->head[h] = i;
+	}
+	s->built = 1;
+
+	return 0;
+}
+
+/* Find an old block matching the one at pos, -1 if there isn't one */
+static int find_block(struct HySession *s)
+{
+	const uint8_t *p = s->map + s->pos;
+	uint32_t weak;
+	uint32_t strong = 0;
+	int have_strong = 0;
+	int i;
+
+	if(!s->rolling)
+	{
+		weak_sum(p, s->blocksize, &s->s1, &s->s2);
+		s->rolling = 1;
+	}
+	weak = s->s1 | (s->s2 << 16);
+
+	for(i = s->head[weak_hash(s, weak)]; i >= 0; i = s->chain[i])
+	{
+		if(s->weak[i] != weak)
+		{
+			continue;
+		}
+
+		if(!have_strong)
+		{
+			strong = hs_xxh32(p, s->blocksize);
+			have_strong = 1;
+		}
+
+		if(s->strong[i] == strong)
+		{
+			int next = s->copy_block + s->copy_count;
+
+			/* Carrying on a run of blocks is the most likely */
+			if((s->copy_count > 0) && (next < s->nblocks) && (s->weak[next] == weak) && (s->strong[next] == strong))
+			{
+				return next;
+			}
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void roll(struct HySession *s)
+{
+	uint32_t out = s->map[s->pos];
+	uint32_t in = s->map[s->pos + s->blocksize];
+
+	s->s1 = (s->s1 - out + in) & 0xFFFF;
+	s->s2 = (s->s2 - (s->blocksize * out) + s->s1) & 0xFFFF;
+	s->pos++;
+}
+
+static int put_copy(struct HySession *s, uint8_t *out, int room)
+{
+	struct SyncOp op;
+
+	if(s->copy_count == 0)
+	{
+		return 0;
+	}
+
+	if(room < (int) sizeof(op))
+	{
+		return -1;
+	}
+
+	op.type = LE32(SYNCOP_COPY);
+	op.block = LE32(s->copy_block);
+	op.len = LE32(s->copy_count);
+	memcpy(out, &op, sizeof(op));
+	s->copy_count = 0;
+
+	return sizeof(op);
+}
+
+/* Send as much of the literal data up to pos as there is room for */
+static int put_data(struct HySession *s, uint8_t *out, int room)
+{
+	struct SyncOp op;
+	int len;
+
+	if(s->lit == s->pos)
+	{
+		return 0;
+	}
+
+	len = room - (int) sizeof(op);
+	if(len <= 0)
+	{
+		return -1;
+	}
+
+	if(len > (s->pos - s->lit))
+	{
+		len = s->pos - s->lit;
+	}
+
+	op.type = LE32(SYNCOP_DATA);
+	op.block = 0;
+	op.len = LE32(len);
+	memcpy(out, &op, sizeof(op));
+	memcpy(out + sizeof(op), s->map + s->lit, len);
+	s->lit += len;
+
+	return sizeof(op) + len;
+}
+
+/* Send the pending copy then the literal data, -1 if they didn't all fit */
+static int flush_ops(struct HySession *s, uint8_t *out, int outlen, int *used)
+{
+	int n;
+
+	if(s->lit < s->pos)
+	{
+		n = put_copy(s, out + *used, outlen - *used);
+		if(n < 0)
+		{
+			return -1;
+		}
+		*used += n;
+
+		n = put_data(s, out + *used, outlen - *used);
+		if(n < 0)
+		{
+			return -1;
+		}
+		*used += n;
+
+		if(s->lit < s->pos)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int hy_delta(struct HySession *s, uint8_t *out, int outlen, int *done)
+{
+	int used = 0;
+
+	*done = 0;
+	if((!s->built) && (s->nblocks > 0) && (build_hash(s) < 0))
+	{
+		return GETERROR(ENOMEM);
+	}
+
+	while(1)
+	{
+		int block;
+
+		if((s->nblocks == 0) || ((s->pos + s->blocksize) > s->size))
+		{
+			/* No whole block left to match, the rest is literal */
+			s->pos = s->size;
+			if(flush_ops(s, out, outlen, &used) < 0)
+			{
+				break;
+			}
+
+			if(s->copy_count > 0)
+			{
+				int n = put_copy(s, out + used, outlen - used);
+
+				if(n < 0)
+				{
+					break;
+				}
+				used += n;
+			}
+
+			*done = 1;
+			break;
+		}
+
+		if((s->pos - s->lit) >= HY_MAX_LITERAL)
+		{
+			if(flush_ops(s, out, outlen, &used) < 0)
+			{
+				break;
+			}
+		}
+
+		block = find_block(s);
+		if(block >= 0)
+		{
+			if(flush_ops(s, out, outlen, &used) < 0)
+			{
+				break;
+			}
+
+			if((s->copy_count > 0) && (block != (s->copy_block + s->copy_count)))
+			{
+				int n = put_copy(s, out + used, outlen - used);
+
+				if(n < 0)
+				{
+					break;
+				}
+				used += n;
+			}
+
+			if(s->copy_count == 0)
+			{
+				s->copy_block = block;
+			}
+			s->copy_count++;
+			s->pos += s->blocksize;
+			s->lit = s->pos;
+			s->rolling = 0;
+		}
+		else if((s->pos + s->blocksize) < s->size)
+		{
+			roll(s);
+		}
+		else
+		{
+			/* The last window didn't match and there is no byte left to
+			 * roll in, the rest goes as literal data */
+			s->pos = s->size;
+			s->rolling = 0;
+		}
+	}
+
+	return used;
+}
+
+int hy_sigs(struct HySession *s, int first, const void *sigs, int count)
+{
+	const struct SyncSig *sig = (const struct SyncSig *) sigs;
+	int i;
+
+	if((first < 0) || (count < 0) || ((first + count) > s->nblocks))
+	{
+		return GETERROR(EINVAL);
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		s->weak[first + i] = LE32(sig[i].weak);
+		s->strong[first + i] = LE32(sig[i].strong);
+	}
+	s->built = 0;
+
+	return 0;
+}
+
+void hy_end(struct HySession *s)
+{
+	if(s == NULL)
+	{
+		return;
+	}
+
+	if(s->map)
+	{
+		munmap((void *) s->map, s->size);
+	}
+
+	if(s->fd >= 0)
+	{
+		close(s->fd);
+	}
+
+	free(s->weak);
+	free(s->strong);
+	free(s->head);
+	free(s->chain);
+	free(s);
+}
+
+struct HySession *hy_begin(const char *path, int blocksize, int nblocks, int64_t start)
+{
+	struct HySession *s;
+	struct stat st;
+	int err;
+
+	if((blocksize < SYNC_MINBLOCK) || (blocksize > SYNC_MAXBLOCK) || (blocksize & (blocksize - 1))
+			|| (nblocks < 0) || (nblocks > SYNC_MAXBLOCKS) || (start < 0))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	s = (struct HySession *) calloc(1, sizeof(struct HySession));
+	if(s == NULL)
+	{
+		return NULL;
+	}
+	s->fd = open(path, O_RDONLY);
+
+	do
+	{
+		if((s->fd < 0) || (fstat(s->fd, &st) < 0))
+		{
+			break;
+		}
+
+		if(!S_ISREG(st.st_mode))
+		{
+			errno = EISDIR;
+			break;
+		}
+
+		if(start > st.st_size)
+		{
+			errno = EINVAL;
+			break;
+		}
+
+		s->size = st.st_size;
+		if(s->size > 0)
+		{
+			s->map = (const uint8_t *) mmap(NULL, s->size, PROT_READ, MAP_SHARED, s->fd, 0);
+			if(s->map == MAP_FAILED)
+			{
+				s->map = NULL;
+				break;
+			}
+			madvise((void *) s->map, s->size, MADV_SEQUENTIAL);
+		}
+
+		s->blocksize = blocksize;
+		s->nblocks = nblocks;
+		s->weak = (uint32_t *) calloc(nblocks + 1, sizeof(uint32_t));
+		s->strong = (uint32_t *) calloc(nblocks + 1, sizeof(uint32_t));
+		s->chain = (int *) calloc(nblocks + 1, sizeof(int));
+		if((s->weak == NULL) || (s->strong == NULL) || (s->chain == NULL))
+		{
+			errno = ENOMEM;
+			break;
+		}
+
+		s->pos = start;
+		s->lit = start;
+
+		return s;
+	}
+	while(0);
+
+	err = errno;
+	hy_end(s);
+	errno = err;
+
+	return NULL;
+}
@@ -0,0 +1,124 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hostsync.h - Delta sync of host trees to the PSP for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __HOSTSYNC_H__
+#define __HOSTSYNC_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/* Delta syncs one PSP can have in progress at once */
+#define HY_MAX_SESSIONS  4
+/* Literal data is sent once this much is waiting, so ops keep coming */
+#define HY_MAX_LITERAL   (32*1024)
+
+struct HyEntry
+{
+	/* Path relative to the root of the walk, without a leading slash */
+	char *name;
+	int isdir;
+	int64_t size;
+	time_t mtime;
+};
+
+struct HyList
+{
+	/* Drive and directory walked, the entries are in the order to create them */
+	unsigned int drive;
+	char *root;
+	struct HyEntry *ents;
+	int count;
+	int max;
+};
+
+struct HySession
+{
+	uint32_t id;
+	int fd;
+	const uint8_t *map;
+	int64_t size;
+	int blocksize;
+	int nblocks;
+	/* Checksums of the PSP's old copy, looked up by the weak one */
+	uint32_t *weak;
+	uint32_t *strong;
+	int *head;
+	int *chain;
+	unsigned int hashmask;
+	int built;
+	/* Where the scan is, and the start of the literal data not yet sent */
+	int64_t pos;
+	int64_t lit;
+	/* Rolling checksum of the block at pos, if rolling is set */
+	uint32_t s1;
+	uint32_t s2;
+	int rolling;
+	/* Run of blocks matched but not yet sent */
+	int copy_block;
+	int copy_count;
+};
+
+/**
+ * Walk a directory tree, parents come before what is in them
+ *
+ * @param root - Host path of the directory
+ * @param list - Filled in with the entries, free with hy_list_free
+ *
+ * @return 0 on success, < 0 (GETERROR) on error
+ */
+int hy_walk(const char *root, struct HyList *list);
+
+/**
+ * Free the entries of a walk
+ */
+void hy_list_free(struct HyList *list);
+
+/**
+ * Start a delta of a host file against the PSP's old copy
+ *
+ * @param path - Host path of the new file
+ * @param blocksize - Size of the blocks the PSP checksums
+ * @param nblocks - Number of blocks it will send checksums for
+ * @param start - Offset the PSP's new copy is already correct up to
+ *
+ * @return The session, NULL on error with errno set
+ */
+struct HySession *hy_begin(const char *path, int blocksize, int nblocks, int64_t start);
+
+/**
+ * Add checksums of the old copy, in the byte order they came from the PSP
+ *
+ * @param s - The session
+ * @param first - Index of the first block
+ * @param sigs - Array of SyncSig
+ * @param count - Number of checksums
+ *
+ * @return 0 on success, < 0 (GETERROR) on error
+ */
+int hy_sigs(struct HySession *s, int first, const void *sigs, int count);
+
+/**
+ * Make the next ops of the delta
+ *
+ * @param s - The session
+ * @param out - Buffer for the SyncOps
+ * @param outlen - Size of the buffer
+ * @param done - Set to 1 once the ops reach the end of the file
+ *
+ * @return Number of bytes of ops made
+ */
+int hy_delta(struct HySession *s, uint8_t *out, int outlen, int *done);
+
+/**
+ * Finish with a session
+ */
+void hy_end(struct HySession *s);
+
+#endif
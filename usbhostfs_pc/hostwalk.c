@@ -0,0 +1,83 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hostwalk.c - Host directory tree walker for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ * Walks a tree on the host for the commands which work on a whole tree at
+ * once, so host copies and syncs see the same entries in the same order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "usbhostfs_pc.h"
+#include "hostwalk.h"
+
+static int walk_dir(const char *root, const char *rel, HwFunc func, void *arg, int depth)
+{
+	char path[PATH_MAX];
+	char name[PATH_MAX];
+	struct dirent **names;
+	int count;
+	int ret = 0;
+	int i;
+
+	if(depth > HW_MAX_DEPTH)
+	{
+		return GETERROR(ELOOP);
+	}
+
+	snprintf(path, PATH_MAX, "%s%s%s", root, *rel ? "/" : "", rel);
+	/* Sorted so a walk is the same every time */
+	count = scandir(path, &names, NULL, alphasort);
+	if(count < 0)
+	{
+		fprintf(stderr, "Could not open directory %s (%s)\n", path, strerror(errno));
+		return GETERROR(errno);
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		struct stat st;
+
+		if((ret == 0) && (strcmp(names[i]->d_name, ".") != 0) && (strcmp(names[i]->d_name, "..") != 0))
+		{
+			if((snprintf(name, PATH_MAX, "%s%s%s", rel, *rel ? "/" : "", names[i]->d_name) >= PATH_MAX)
+					|| (snprintf(path, PATH_MAX, "%s/%s", root, name) >= PATH_MAX))
+			{
+				ret = GETERROR(ENAMETOOLONG);
+			}
+			else if(stat(path, &st) < 0)
+			{
+				/* Dangling symlink or gone already */
+				V_PRINTF(1, "Skipping %s (%s)\n", path, strerror(errno));
+			}
+			else if((S_ISDIR(st.st_mode)) || (S_ISREG(st.st_mode)))
+			{
+				ret = func(arg, path, name, &st);
+				if((ret == 0) && (S_ISDIR(st.st_mode)))
+				{
+					ret = walk_dir(root, name, func, arg, depth + 1);
+				}
+			}
+		}
+		free(names[i]);
+	}
+	free(names);
+
+	return ret;
+}
+
+int hw_walk(const char *root, HwFunc func, void *arg)
+{
+	return walk_dir(root, "", func, arg, 0);
+}
@@ -0,0 +1,44 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * hostwalk.h - Host directory tree walker for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __HOSTWALK_H__
+#define __HOSTWALK_H__
+
+#include <sys/stat.h>
+
+/* Deeper than any sane tree, stops a symlinked loop */
+#define HW_MAX_DEPTH  64
+
+/**
+ * Called for each directory and regular file in a walk
+ *
+ * @param arg - The argument passed to hw_walk
+ * @param path - Host path of the entry
+ * @param rel - Path relative to the root of the walk, without a leading slash
+ * @param st - stat of the entry, symlinks are followed
+ *
+ * @return 0 to carry on, < 0 (GETERROR) to stop the walk with that error
+ */
+typedef int (*HwFunc)(void *arg, const char *path, const char *rel, const struct stat *st);
+
+/**
+ * Walk the tree under a directory, not including the directory itself. The
+ * entries of each directory are visited in name order and a directory is
+ * visited before what is in it. Anything which can't be stat'd is skipped.
+ *
+ * @param root - Host path of the directory
+ * @param func - Called for each entry
+ * @param arg - Passed to func
+ *
+ * @return 0 on success, < 0 (GETERROR) on error or what func returned
+ */
+int hw_walk(const char *root, HwFunc func, void *arg);
+
+#endif
@@ -0,0 +1,1267 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * imagefs.c - Read-only disc images and archives served as USB HostFS drives
+ *
+ * Copyright (c) pspdev
+ *
+ * An ISO9660 image, a CSO compressed one or a ZIP archive is mapped into
+ * memory and its directory tree is read once into an index. Lookups hash
+ * the parent entry and the lower case name so a path costs one probe per
+ * component. Reads of an ISO or a stored ZIP entry are copied straight out
+ * of the mapping, CSO blocks are inflated into a small cache shared by
+ * everyone reading the image. Deflated ZIP entries are inflated whole into
+ * a cache bounded by IMFS_ZIP_CACHE, or as they are read if they are large.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "usbhostfs_pc.h"
+#include "imagefs.h"
+
+/* Deeper than ISO9660 allows, stops a corrupt image looping forever */
+#define IMFS_MAX_DEPTH  32
+/* Far bigger than any real directory extent, the size is read from the image */
+#define IMFS_MAX_DIRLEN (16*1024*1024)
+
+struct CsoHeader
+{
+	char magic[4];
+	uint32_t header_size;
+	uint64_t total_bytes;
+	uint32_t block_size;
+	uint8_t ver;
+	uint8_t align;
+	uint8_t rsvd[2];
+} __attribute__((packed));
+
+#define ZIP_LOCAL_SIG    0x04034b50
+#define ZIP_CENTRAL_SIG  0x02014b50
+#define ZIP_END_SIG      0x06054b50
+#define ZIP64_END_SIG    0x06064b50
+#define ZIP64_LOC_SIG    0x07064b50
+
+static pthread_mutex_t g_imfsmtx = PTHREAD_MUTEX_INITIALIZER;
+static struct ImageFs *g_images = NULL;
+
+static uint16_t rd16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t rd32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t rd64(const unsigned char *p)
+{
+	return rd32(p) | ((uint64_t) rd32(p + 4) << 32);
+}
+
+static unsigned int name_hash(int parent, const char *name)
+{
+	unsigned int hash = 2166136261U ^ (unsigned int) parent;
+
+	while(*name)
+	{
+		hash ^= (unsigned char) tolower((unsigned char) *name++);
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Get a decompressed CSO block, must be called with the image lock held */
+static const char *cso_block(struct ImageFs *img, int64_t num)
+{
+	z_stream *zs = (z_stream *) img->zstream;
+	struct ImfsBlock *slot = NULL;
+	uint32_t idx, idxnext;
+	size_t pos, end;
+	int i;
+
+	for(i = 0; i < IMFS_CSO_CACHE; i++)
+	{
+		if(img->cache[i].num == num)
+		{
+			img->cache[i].last_used = ++img->tick;
+			return img->cache[i].data;
+		}
+
+		if((slot == NULL) || (img->cache[i].last_used < slot->last_used))
+		{
+			slot = &img->cache[i];
+		}
+	}
+
+	if(slot->data == NULL)
+	{
+		slot->data = malloc(img->blocksize);
+		if(slot->data == NULL)
+		{
+			return NULL;
+		}
+	}
+	slot->num = -1;
+
+	idx = LE32(img->index[num]);
+	idxnext = LE32(img->index[num + 1]);
+	pos = (size_t) (idx & 0x7FFFFFFF) << img->align;
+	end = (size_t) (idxnext & 0x7FFFFFFF) << img->align;
+	if((end < pos) || (end > img->maplen))
+	{
+		fprintf(stderr, "Corrupt CSO index at block %" PRId64 " in %s\n", num, img->path);
+		return NULL;
+	}
+
+	if(idx & 0x80000000)
+	{
+		/* Stored uncompressed */
+		size_t len = end - pos < (size_t) img->blocksize ? end - pos : (size_t) img->blocksize;
+
+		memcpy(slot->data, img->map + pos, len);
+		memset(slot->data + len, 0, img->blocksize - len);
+	}
+	else
+	{
+		int ret;
+
+		inflateReset(zs);
+		zs->next_in = (Bytef *) (img->map + pos);
+		zs->avail_in = end - pos;
+		zs->next_out = (Bytef *) slot->data;
+		zs->avail_out = img->blocksize;
+		ret = inflate(zs, Z_FINISH);
+		if((ret != Z_STREAM_END) && (zs->avail_out != 0))
+		{
+			fprintf(stderr, "Could not inflate block %" PRId64 " of %s (%d)\n", num, img->path, ret);
+			return NULL;
+		}
+	}
+
+	slot->num = num;
+	slot->last_used = ++img->tick;
+
+	return slot->data;
+}
+
+/* Read from the uncompressed image */
+static int image_pread(struct ImageFs *img, char *data, int len, int64_t ofs)
+{
+	int copied = 0;
+
+	if(ofs >= img->size)
+	{
+		return 0;
+	}
+
+	if(len > img->size - ofs)
+	{
+		len = (int) (img->size - ofs);
+	}
+
+	if(img->type == IMFS_TYPE_ISO)
+	{
+		memcpy(data, img->map + ofs, len);
+		return len;
+	}
+
+	pthread_mutex_lock(&img->lock);
+	while(copied < len)
+	{
+		int64_t num = (ofs + copied) / img->blocksize;
+		int blkofs = (int) ((ofs + copied) % img->blocksize);
+		int n = img->blocksize - blkofs;
+		const char *blk;
+
+		blk = cso_block(img, num);
+		if(blk == NULL)
+		{
+			break;
+		}
+
+		if(n > len - copied)
+		{
+			n = len - copied;
+		}
+		memcpy(data + copied, blk + blkofs, n);
+		copied += n;
+	}
+	pthread_mutex_unlock(&img->lock);
+
+	if(copied == 0)
+	{
+		return GETERROR(EIO);
+	}
+
+	return copied;
+}
+
+static int cso_init(struct ImageFs *img)
+{
+	const struct CsoHeader *hdr = (const struct CsoHeader *) img->map;
+	z_stream *zs;
+	size_t indexlen;
+	int i;
+
+	if(img->maplen < sizeof(struct CsoHeader))
+	{
+		return -1;
+	}
+
+	img->size = LE64(hdr->total_bytes);
+	img->blocksize = LE32(hdr->block_size);
+	img->align = hdr->align;
+	if((hdr->ver > 1) || (img->blocksize < IMFS_SECTOR_SIZE) || (img->blocksize > 0x100000) || (img->align > 31) || (img->size <= 0))
+	{
+		fprintf(stderr, "Unsupported CSO header in %s\n", img->path);
+		return -1;
+	}
+
+	img->nblocks = (img->size + img->blocksize - 1) / img->blocksize;
+	indexlen = (size_t) (img->nblocks + 1) * sizeof(uint32_t);
+	if(sizeof(struct CsoHeader) + indexlen > img->maplen)
+	{
+		fprintf(stderr, "CSO index of %s is truncated\n", img->path);
+		return -1;
+	}
+	img->index = (const uint32_t *) (img->map + sizeof(struct CsoHeader));
+
+	zs = (z_stream *) calloc(1, sizeof(z_stream));
+	if((zs == NULL) || (inflateInit2(zs, -15) != Z_OK))
+	{
+		fprintf(stderr, "Could not initialise zlib\n");
+		free(zs);
+		return -1;
+	}
+	img->zstream = zs;
+
+	for(i = 0; i < IMFS_CSO_CACHE; i++)
+	{
+		img->cache[i].num = -1;
+	}
+	img->type = IMFS_TYPE_CSO;
+
+	return 0;
+}
+
+static void hash_entry(struct ImageFs *img, int ent)
+{
+	unsigned int h = name_hash(img->ents[ent].parent, img->ents[ent].name) & img->hashmask;
+
+	img->ents[ent].hnext = img->hash[h];
+	img->hash[h] = ent;
+}
+
+/* Double the hash table, keeping it at least twice the number of entries */
+static int grow_hash(struct ImageFs *img)
+{
+	unsigned int size = img->hash ? (img->hashmask + 1) * 2 : 256;
+	int *hash;
+	int i;
+
+	hash = (int *) realloc(img->hash, size * sizeof(int));
+	if(hash == NULL)
+	{
+		return -1;
+	}
+	memset(hash, 0xFF, size * sizeof(int));
+	img->hash = hash;
+	img->hashmask = size - 1;
+
+	for(i = 0; i < img->count; i++)
+	{
+		if(img->ents[i].parent >= 0)
+		{
+			hash_entry(img, i);
+		}
+	}
+
+	return 0;
+}
+
+static int find_child(struct ImageFs *img, int parent, const char *name)
+{
+	int i;
+
+	for(i = img->hash[name_hash(parent, name) & img->hashmask]; i >= 0; i = img->ents[i].hnext)
+	{
+		if((img->ents[i].parent == parent) && (strcasecmp(img->ents[i].name, name) == 0))
+		{
+			break;
+		}
+	}
+
+	return i;
+}
+
+/* Add an entry to the end of its directory, parent is -1 for the root */
+static int add_entry(struct ImageFs *img, const char *name, int parent, int isdir, int64_t ofs, int64_t size, time_t mtime)
+{
+	struct ImfsEntry *ent;
+	int num;
+
+	if(img->count == img->max)
+	{
+		int max = img->max ? img->max * 2 : 256;
+		struct ImfsEntry *ents;
+
+		ents = (struct ImfsEntry *) realloc(img->ents, max * sizeof(struct ImfsEntry));
+		if(ents == NULL)
+		{
+			return -1;
+		}
+		img->ents = ents;
+		img->max = max;
+	}
+
+	ent = &img->ents[img->count];
+	memset(ent, 0, sizeof(*ent));
+	ent->name = strdup(name);
+	if(ent->name == NULL)
+	{
+		return -1;
+	}
+	ent->parent = parent;
+	ent->child = -1;
+	ent->tail = -1;
+	ent->next = -1;
+	ent->hnext = -1;
+	ent->isdir = isdir;
+	ent->ofs = ofs;
+	ent->size = size;
+	ent->mtime = mtime;
+	ent->method = IMFS_METHOD_STORED;
+	ent->csize = size;
+	num = img->count++;
+
+	if(parent >= 0)
+	{
+		if(img->ents[parent].tail < 0)
+		{
+			img->ents[parent].child = num;
+		}
+		else
+		{
+			img->ents[img->ents[parent].tail].next = num;
+		}
+		img->ents[parent].tail = num;
+	}
+
+	if((img->hash == NULL) || ((unsigned int) img->count * 2 > img->hashmask + 1))
+	{
+		if(grow_hash(img) < 0)
+		{
+			return -1;
+		}
+	}
+	else if(parent >= 0)
+	{
+		hash_entry(img, num);
+	}
+
+	return num;
+}
+
+/* Convert the 7 byte recording date of a directory record */
+static time_t iso_time(const unsigned char *d)
+{
+	struct tm tm;
+	time_t t;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = d[0];
+	tm.tm_mon = d[1] > 0 ? d[1] - 1 : 0;
+	tm.tm_mday = d[2] > 0 ? d[2] : 1;
+	tm.tm_hour = d[3];
+	tm.tm_min = d[4];
+	tm.tm_sec = d[5];
+	t = timegm(&tm);
+
+	/* Offset from GMT in 15 minute steps */
+	return t - (time_t) ((signed char) d[6]) * 15 * 60;
+}
+
+static int iso_scan_dir(struct ImageFs *img, int dir, int blksize, int depth)
+{
+	unsigned char *buf;
+	int64_t size = img->ents[dir].size;
+	int64_t pos = 0;
+	int child;
+	int ret = 0;
+
+	if(depth > IMFS_MAX_DEPTH)
+	{
+		fprintf(stderr, "Directories nested too deeply in %s\n", img->path);
+		return -1;
+	}
+
+	if(size == 0)
+	{
+		return 0;
+	}
+
+	if((size > IMFS_MAX_DIRLEN) || (img->ents[dir].ofs < 0) || (img->ents[dir].ofs + size > img->size))
+	{
+		fprintf(stderr, "Directory %s in %s has an invalid extent\n", img->ents[dir].name, img->path);
+		return -1;
+	}
+
+	buf = (unsigned char *) malloc(size);
+	if(buf == NULL)
+	{
+		return -1;
+	}
+
+	if(image_pread(img, (char *) buf, (int) size, img->ents[dir].ofs) != size)
+	{
+		fprintf(stderr, "Could not read directory %s in %s\n", img->ents[dir].name, img->path);
+		free(buf);
+		return -1;
+	}
+
+	while(pos < size)
+	{
+		const unsigned char *rec = buf + pos;
+		char name[256];
+		int reclen = rec[0];
+		int namelen;
+		int isdir;
+
+		if(reclen == 0)
+		{
+			/* Records don't cross sectors, the rest of this one is padding */
+			pos = (pos / blksize + 1) * blksize;
+			continue;
+		}
+
+		if((reclen < 34) || (pos + reclen > size) || (33 + rec[32] > reclen))
+		{
+			fprintf(stderr, "Corrupt directory record in %s\n", img->path);
+			ret = -1;
+			break;
+		}
+		pos += reclen;
+
+		namelen = rec[32];
+		if((namelen == 1) && ((rec[33] == 0) || (rec[33] == 1)))
+		{
+			/* . and .. */
+			continue;
+		}
+
+		memcpy(name, rec + 33, namelen);
+		name[namelen] = 0;
+		isdir = (rec[25] & 2) ? 1 : 0;
+		if(!isdir)
+		{
+			char *p = strchr(name, ';');
+
+			if(p)
+			{
+				*p = 0;
+			}
+
+			namelen = strlen(name);
+			if((namelen > 1) && (name[namelen-1] == '.'))
+			{
+				name[namelen-1] = 0;
+			}
+		}
+
+		if(add_entry(img, name, dir, isdir, (int64_t) rd32(rec + 2) * blksize, rd32(rec + 10), iso_time(rec + 18)) < 0)
+		{
+			ret = -1;
+			break;
+		}
+	}
+	free(buf);
+
+	for(child = img->ents[dir].child; (ret == 0) && (child >= 0); child = img->ents[child].next)
+	{
+		if(img->ents[child].isdir)
+		{
+			ret = iso_scan_dir(img, child, blksize, depth + 1);
+		}
+	}
+
+	return ret;
+}
+
+static int iso_scan(struct ImageFs *img)
+{
+	unsigned char pvd[IMFS_SECTOR_SIZE];
+	int blksize;
+
+	if((image_pread(img, (char *) pvd, sizeof(pvd), 16 * IMFS_SECTOR_SIZE) != sizeof(pvd)) || (pvd[0] != 1) || (memcmp(pvd + 1, "CD001", 5)))
+	{
+		fprintf(stderr, "%s is not an ISO9660 image\n", img->path);
+		return -1;
+	}
+
+	blksize = rd16(pvd + 128);
+	if((blksize == 0) || (blksize > IMFS_SECTOR_SIZE))
+	{
+		blksize = IMFS_SECTOR_SIZE;
+	}
+
+	/* The root directory record is in the volume descriptor */
+	if(add_entry(img, "", -1, 1, (int64_t) rd32(pvd + 156 + 2) * blksize, rd32(pvd + 156 + 10), iso_time(pvd + 156 + 18)) < 0)
+	{
+		return -1;
+	}
+
+	return iso_scan_dir(img, 0, blksize, 0);
+}
+
+/* Convert an MS-DOS date and time, kept in local time */
+static time_t dos_time(uint16_t date, uint16_t time)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = ((date >> 9) & 0x7F) + 80;
+	tm.tm_mon = ((date >> 5) & 0xF) > 0 ? ((date >> 5) & 0xF) - 1 : 0;
+	tm.tm_mday = (date & 0x1F) > 0 ? (date & 0x1F) : 1;
+	tm.tm_hour = (time >> 11) & 0x1F;
+	tm.tm_min = (time >> 5) & 0x3F;
+	tm.tm_sec = (time & 0x1F) * 2;
+	tm.tm_isdst = -1;
+
+	return mktime(&tm);
+}
+
+/* Add an archive member, making any directories it is in */
+static int zip_add(struct ImageFs *img, char *name, int isdir, int method, int64_t csize, int64_t size, int64_t lho, time_t mtime)
+{
+	char *tok;
+	char *save;
+	int cur = 0;
+
+	for(tok = strtok_r(name, "/", &save); tok; tok = strtok_r(NULL, "/", &save))
+	{
+		int last = (save == NULL) || (*save == 0);
+		int ent;
+
+		if(strcmp(tok, ".") == 0)
+		{
+			continue;
+		}
+
+		if(strcmp(tok, "..") == 0)
+		{
+			V_PRINTF(1, "Skipping member outside the archive root in %s\n", img->path);
+			return 0;
+		}
+
+		ent = find_child(img, cur, tok);
+		if((last) && (!isdir))
+		{
+			if(ent >= 0)
+			{
+				V_PRINTF(1, "Skipping duplicate member %s in %s\n", tok, img->path);
+				return 0;
+			}
+
+			ent = add_entry(img, tok, cur, 0, lho, size, mtime);
+			if(ent < 0)
+			{
+				return -1;
+			}
+			img->ents[ent].method = method;
+			img->ents[ent].csize = csize;
+
+			return 0;
+		}
+
+		if(ent < 0)
+		{
+			ent = add_entry(img, tok, cur, 1, 0, 0, mtime);
+			if(ent < 0)
+			{
+				return -1;
+			}
+		}
+		else if(!img->ents[ent].isdir)
+		{
+			V_PRINTF(1, "Skipping member under file %s in %s\n", tok, img->path);
+			return 0;
+		}
+		cur = ent;
+	}
+
+	return 0;
+}
+
+static int zip_scan(struct ImageFs *img)
+{
+	const unsigned char *end = NULL;
+	uint64_t count, cdsize, cdofs;
+	uint64_t pos;
+	uint64_t i;
+	int64_t p;
+
+	/* The end record is followed by a comment of up to 64K */
+	for(p = (int64_t) img->maplen - 22; (p >= 0) && (p >= (int64_t) img->maplen - 22 - 0xFFFF); p--)
+	{
+		if(rd32(img->map + p) == ZIP_END_SIG)
+		{
+			end = img->map + p;
+			break;
+		}
+	}
+
+	if(end == NULL)
+	{
+		fprintf(stderr, "Could not find the central directory of %s\n", img->path);
+		return -1;
+	}
+
+	count = rd16(end + 10);
+	cdsize = rd32(end + 12);
+	cdofs = rd32(end + 16);
+	if(((count == 0xFFFF) || (cdsize == 0xFFFFFFFF) || (cdofs == 0xFFFFFFFF)) && (p >= 20) && (rd32(end - 20) == ZIP64_LOC_SIG))
+	{
+		uint64_t z64 = rd64(end - 20 + 8);
+
+		if((z64 + 56 > img->maplen) || (rd32(img->map + z64) != ZIP64_END_SIG))
+		{
+			fprintf(stderr, "Corrupt ZIP64 end record in %s\n", img->path);
+			return -1;
+		}
+		count = rd64(img->map + z64 + 32);
+		cdsize = rd64(img->map + z64 + 40);
+		cdofs = rd64(img->map + z64 + 48);
+	}
+
+	if((cdofs > img->maplen) || (cdsize > img->maplen - cdofs))
+	{
+		fprintf(stderr, "Central directory of %s is out of range\n", img->path);
+		return -1;
+	}
+
+	if(add_entry(img, "", -1, 1, 0, 0, img->mtime) < 0)
+	{
+		return -1;
+	}
+
+	pos = cdofs;
+	for(i = 0; i < count; i++)
+	{
+		const unsigned char *rec = img->map + pos;
+		char name[PATH_MAX];
+		uint64_t csize, size, lho;
+		int namelen, extralen, commentlen;
+		int method;
+		int j;
+
+		if((pos + 46 > cdofs + cdsize) || (rd32(rec) != ZIP_CENTRAL_SIG))
+		{
+			fprintf(stderr, "Corrupt central directory in %s\n", img->path);
+			return -1;
+		}
+
+		namelen = rd16(rec + 28);
+		extralen = rd16(rec + 30);
+		commentlen = rd16(rec + 32);
+		if(pos + 46 + namelen + extralen + commentlen > cdofs + cdsize)
+		{
+			fprintf(stderr, "Corrupt central directory in %s\n", img->path);
+			return -1;
+		}
+		pos += 46 + namelen + extralen + commentlen;
+
+		if(namelen >= PATH_MAX)
+		{
+			continue;
+		}
+
+		method = rd16(rec + 10);
+		if((rd16(rec + 8) & 1) || ((method != IMFS_METHOD_STORED) && (method != IMFS_METHOD_DEFLATE)))
+		{
+			/* Listed, but reads of it fail */
+			method = IMFS_METHOD_UNKNOWN;
+		}
+		csize = rd32(rec + 20);
+		size = rd32(rec + 24);
+		lho = rd32(rec + 42);
+
+		/* The ZIP64 extra field has the 64 bit values of those which don't fit */
+		for(j = 0; j + 4 <= extralen; )
+		{
+			const unsigned char *ex = rec + 46 + namelen + j;
+			int id = rd16(ex);
+			int len = rd16(ex + 2);
+			int k = 4;
+
+			if(j + 4 + len > extralen)
+			{
+				break;
+			}
+
+			if(id == 0x0001)
+			{
+				if((size == 0xFFFFFFFF) && (k + 8 <= 4 + len))
+				{
+					size = rd64(ex + k);
+					k += 8;
+				}
+				if((csize == 0xFFFFFFFF) && (k + 8 <= 4 + len))
+				{
+					csize = rd64(ex + k);
+					k += 8;
+				}
+				if((lho == 0xFFFFFFFF) && (k + 8 <= 4 + len))
+				{
+					lho = rd64(ex + k);
+				}
+			}
+			j += 4 + len;
+		}
+
+		memcpy(name, rec + 46, namelen);
+		name[namelen] = 0;
+		for(j = 0; j < namelen; j++)
+		{
+			if(name[j] == '\\')
+			{
+				name[j] = '/';
+			}
+		}
+
+		if(zip_add(img, name, (namelen > 0) && (name[namelen-1] == '/'), method, csize, size, lho, dos_time(rd16(rec + 14), rd16(rec + 12))) < 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Find where a member's data starts, < 0 if it is out of range */
+static int64_t zip_data(struct ImageFs *img, struct ImfsEntry *e)
+{
+	const unsigned char *hdr = img->map + e->ofs;
+	int64_t ofs;
+
+	if((e->ofs < 0) || (e->ofs + 30 > (int64_t) img->maplen) || (rd32(hdr) != ZIP_LOCAL_SIG))
+	{
+		return -1;
+	}
+
+	ofs = e->ofs + 30 + rd16(hdr + 26) + rd16(hdr + 28);
+	if((ofs + e->csize > (int64_t) img->maplen) || ((e->method == IMFS_METHOD_STORED) && (e->csize < e->size)))
+	{
+		return -1;
+	}
+
+	return ofs;
+}
+
+/* Inflate up to len bytes, returns the number produced, < 0 on error */
+static int zip_inflate(z_stream *zs, char *data, int len)
+{
+	zs->next_out = (Bytef *) data;
+	zs->avail_out = len;
+	while(zs->avail_out > 0)
+	{
+		int ret = inflate(zs, Z_NO_FLUSH);
+
+		if(ret == Z_STREAM_END)
+		{
+			break;
+		}
+
+		if(ret != Z_OK)
+		{
+			if((ret == Z_BUF_ERROR) && (zs->avail_in == 0))
+			{
+				/* Truncated */
+				break;
+			}
+			return -1;
+		}
+	}
+
+	return len - zs->avail_out;
+}
+
+/* Start inflating a member from the beginning */
+static void zip_start(z_stream *zs, struct ImageFs *img, struct ImfsEntry *e, int64_t data)
+{
+	inflateReset(zs);
+	zs->next_in = (Bytef *) (img->map + data);
+	zs->avail_in = e->csize;
+}
+
+/* Get a small member inflated whole, must be called with the image lock held */
+static const char *zip_whole(struct ImageFs *img, int ent, int64_t data)
+{
+	struct ImfsEntry *e = &img->ents[ent];
+	struct ImfsInflated *slot = NULL;
+	int i;
+
+	for(i = 0; i < IMFS_ZIP_FILES; i++)
+	{
+		if(img->zcache[i].ent == ent)
+		{
+			img->zcache[i].last_used = ++img->tick;
+			return img->zcache[i].data;
+		}
+	}
+
+	/* Throw away the least recently used until it fits */
+	while(1)
+	{
+		struct ImfsInflated *lru = NULL;
+
+		slot = NULL;
+		for(i = 0; i < IMFS_ZIP_FILES; i++)
+		{
+			if(img->zcache[i].ent < 0)
+			{
+				slot = &img->zcache[i];
+			}
+			else if((lru == NULL) || (img->zcache[i].last_used < lru->last_used))
+			{
+				lru = &img->zcache[i];
+			}
+		}
+
+		if(((slot) && (img->zbytes + e->size <= IMFS_ZIP_CACHE)) || (lru == NULL))
+		{
+			break;
+		}
+
+		img->zbytes -= img->ents[lru->ent].size;
+		free(lru->data);
+		lru->data = NULL;
+		lru->ent = -1;
+	}
+
+	slot->data = malloc(e->size > 0 ? e->size : 1);
+	if(slot->data == NULL)
+	{
+		return NULL;
+	}
+
+	zip_start((z_stream *) img->zstream, img, e, data);
+	if(zip_inflate((z_stream *) img->zstream, slot->data, (int) e->size) != e->size)
+	{
+		fprintf(stderr, "Could not inflate %s in %s\n", e->name, img->path);
+		free(slot->data);
+		slot->data = NULL;
+		return NULL;
+	}
+
+	slot->ent = ent;
+	slot->last_used = ++img->tick;
+	img->zbytes += e->size;
+
+	return slot->data;
+}
+
+/* Read a large member by carrying on from where the last read of it
+ * stopped, must be called with the image lock held */
+static int zip_stream(struct ImageFs *img, int ent, int64_t data, char *buf, int len, int64_t ofs)
+{
+	struct ImfsStream *st = NULL;
+	char skip[16384];
+	int i;
+
+	for(i = 0; i < IMFS_ZIP_STREAMS; i++)
+	{
+		struct ImfsStream *s = &img->streams[i];
+
+		if((s->zstream) && (s->ent == ent) && (s->pos <= ofs))
+		{
+			if((st == NULL) || (s->pos > st->pos))
+			{
+				st = s;
+			}
+		}
+	}
+
+	if(st == NULL)
+	{
+		for(i = 0; i < IMFS_ZIP_STREAMS; i++)
+		{
+			if((st == NULL) || (img->streams[i].last_used < st->last_used))
+			{
+				st = &img->streams[i];
+			}
+		}
+
+		if(st->zstream == NULL)
+		{
+			z_stream *zs = (z_stream *) calloc(1, sizeof(z_stream));
+
+			if((zs == NULL) || (inflateInit2(zs, -15) != Z_OK))
+			{
+				free(zs);
+				return GETERROR(ENOMEM);
+			}
+			st->zstream = zs;
+		}
+
+		zip_start((z_stream *) st->zstream, img, &img->ents[ent], data);
+		st->ent = ent;
+		st->pos = 0;
+	}
+	st->last_used = ++img->tick;
+
+	while(st->pos < ofs)
+	{
+		int n = ofs - st->pos < (int64_t) sizeof(skip) ? (int) (ofs - st->pos) : (int) sizeof(skip);
+		int ret = zip_inflate((z_stream *) st->zstream, skip, n);
+
+		if(ret <= 0)
+		{
+			st->ent = -1;
+			return GETERROR(EIO);
+		}
+		st->pos += ret;
+	}
+
+	len = zip_inflate((z_stream *) st->zstream, buf, len);
+	if(len <= 0)
+	{
+		st->ent = -1;
+		return GETERROR(EIO);
+	}
+	st->pos += len;
+
+	return len;
+}
+
+static int zip_read(struct ImageFs *img, int ent, char *buf, int len, int64_t ofs)
+{
+	struct ImfsEntry *e = &img->ents[ent];
+	int64_t data;
+	int ret = len;
+
+	if(e->method == IMFS_METHOD_UNKNOWN)
+	{
+		return GETERROR(EOPNOTSUPP);
+	}
+
+	data = zip_data(img, e);
+	if(data < 0)
+	{
+		fprintf(stderr, "Corrupt member %s in %s\n", e->name, img->path);
+		return GETERROR(EIO);
+	}
+
+	if(e->method == IMFS_METHOD_STORED)
+	{
+		memcpy(buf, img->map + data + ofs, len);
+		return len;
+	}
+
+	pthread_mutex_lock(&img->lock);
+	if(e->size <= IMFS_ZIP_WHOLE)
+	{
+		const char *whole = zip_whole(img, ent, data);
+
+		if(whole)
+		{
+			memcpy(buf, whole + ofs, len);
+		}
+		else
+		{
+			ret = GETERROR(EIO);
+		}
+	}
+	else
+	{
+		ret = zip_stream(img, ent, data, buf, len, ofs);
+	}
+	pthread_mutex_unlock(&img->lock);
+
+	return ret;
+}
+
+static int zip_init(struct ImageFs *img)
+{
+	z_stream *zs;
+	int i;
+
+	zs = (z_stream *) calloc(1, sizeof(z_stream));
+	if((zs == NULL) || (inflateInit2(zs, -15) != Z_OK))
+	{
+		fprintf(stderr, "Could not initialise zlib\n");
+		free(zs);
+		return -1;
+	}
+	img->zstream = zs;
+
+	for(i = 0; i < IMFS_ZIP_FILES; i++)
+	{
+		img->zcache[i].ent = -1;
+	}
+
+	for(i = 0; i < IMFS_ZIP_STREAMS; i++)
+	{
+		img->streams[i].ent = -1;
+	}
+	img->type = IMFS_TYPE_ZIP;
+
+	return zip_scan(img);
+}
+
+static void imfs_free(struct ImageFs *img)
+{
+	int i;
+
+	for(i = 0; i < img->count; i++)
+	{
+		free(img->ents[i].name);
+	}
+	free(img->ents);
+	free(img->hash);
+
+	for(i = 0; i < IMFS_CSO_CACHE; i++)
+	{
+		free(img->cache[i].data);
+	}
+
+	for(i = 0; i < IMFS_ZIP_FILES; i++)
+	{
+		free(img->zcache[i].data);
+	}
+
+	for(i = 0; i < IMFS_ZIP_STREAMS; i++)
+	{
+		if(img->streams[i].zstream)
+		{
+			inflateEnd((z_stream *) img->streams[i].zstream);
+			free(img->streams[i].zstream);
+		}
+	}
+
+	if(img->zstream)
+	{
+		inflateEnd((z_stream *) img->zstream);
+		free(img->zstream);
+	}
+
+	if(img->map)
+	{
+		munmap((void *) img->map, img->maplen);
+	}
+
+	if(img->fd >= 0)
+	{
+		close(img->fd);
+	}
+
+	pthread_mutex_destroy(&img->lock);
+	free(img);
+}
+
+static struct ImageFs *imfs_load(const char *path, const struct stat *st)
+{
+	struct ImageFs *img;
+	void *map;
+
+	img = (struct ImageFs *) calloc(1, sizeof(struct ImageFs));
+	if(img == NULL)
+	{
+		return NULL;
+	}
+
+	snprintf(img->path, sizeof(img->path), "%s", path);
+	img->dev = st->st_dev;
+	img->ino = st->st_ino;
+	img->mtime = st->st_mtime;
+	img->refs = 1;
+	pthread_mutex_init(&img->lock, NULL);
+
+	do
+	{
+		img->fd = open(path, O_RDONLY);
+		if(img->fd < 0)
+		{
+			fprintf(stderr, "Could not open image %s (%s)\n", path, strerror(errno));
+			break;
+		}
+
+		if(st->st_size <= 0)
+		{
+			fprintf(stderr, "Image %s is empty\n", path);
+			break;
+		}
+
+		map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, img->fd, 0);
+		if(map == MAP_FAILED)
+		{
+			fprintf(stderr, "Could not map image %s (%s)\n", path, strerror(errno));
+			break;
+		}
+		img->map = (const unsigned char *) map;
+		img->maplen = st->st_size;
+		img->size = st->st_size;
+		img->type = IMFS_TYPE_ISO;
+
+		if((img->maplen >= 4) && ((memcmp(img->map, "PK\3\4", 4) == 0) || (memcmp(img->map, "PK\5\6", 4) == 0)))
+		{
+			if(zip_init(img) < 0)
+			{
+				break;
+			}
+		}
+		else
+		{
+			if((img->maplen >= 4) && (memcmp(img->map, "CISO", 4) == 0) && (cso_init(img) < 0))
+			{
+				break;
+			}
+
+			if(iso_scan(img) < 0)
+			{
+				break;
+			}
+		}
+
+		V_PRINTF(1, "Indexed %d entries in %s image %s\n", img->count, img->type == IMFS_TYPE_ZIP ? "ZIP" : (img->type == IMFS_TYPE_CSO ? "CSO" : "ISO"), path);
+
+		return img;
+	}
+	while(0);
+
+	imfs_free(img);
+
+	return NULL;
+}
+
+struct ImageFs *imfs_open(const char *path)
+{
+	struct ImageFs *img;
+	struct stat st;
+
+	if(stat(path, &st) < 0)
+	{
+		fprintf(stderr, "Could not stat image %s (%s)\n", path, strerror(errno));
+		return NULL;
+	}
+
+	pthread_mutex_lock(&g_imfsmtx);
+	for(img = g_images; img; img = img->next)
+	{
+		if((img->dev == st.st_dev) && (img->ino == st.st_ino) && (img->mtime == st.st_mtime) && (img->maplen == (size_t) st.st_size))
+		{
+			img->refs++;
+			break;
+		}
+	}
+
+	if(img == NULL)
+	{
+		img = imfs_load(path, &st);
+		if(img)
+		{
+			img->next = g_images;
+			g_images = img;
+		}
+	}
+	pthread_mutex_unlock(&g_imfsmtx);
+
+	return img;
+}
+
+void imfs_get(struct ImageFs *img)
+{
+	pthread_mutex_lock(&g_imfsmtx);
+	img->refs++;
+	pthread_mutex_unlock(&g_imfsmtx);
+}
+
+void imfs_put(struct ImageFs *img)
+{
+	struct ImageFs **pp;
+
+	if(img == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&g_imfsmtx);
+	if(--img->refs > 0)
+	{
+		pthread_mutex_unlock(&g_imfsmtx);
+		return;
+	}
+
+	for(pp = &g_images; *pp; pp = &(*pp)->next)
+	{
+		if(*pp == img)
+		{
+			*pp = img->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_imfsmtx);
+
+	V_PRINTF(1, "Closing image %s\n", img->path);
+	imfs_free(img);
+}
+
+int imfs_lookup(struct ImageFs *img, const char *path)
+{
+	char name[PATH_MAX];
+	char *tok;
+	char *save;
+	int cur = 0;
+
+	snprintf(name, sizeof(name), "%s", path);
+	for(tok = strtok_r(name, "/", &save); tok; tok = strtok_r(NULL, "/", &save))
+	{
+		cur = find_child(img, cur, tok);
+		if(cur < 0)
+		{
+			return -1;
+		}
+	}
+
+	return cur;
+}
+
+int imfs_read(struct ImageFs *img, int ent, char *data, int len, int64_t ofs)
+{
+	struct ImfsEntry *e = &img->ents[ent];
+
+	if(e->isdir)
+	{
+		return GETERROR(EISDIR);
+	}
+
+	if((ofs < 0) || (ofs >= e->size) || (len <= 0))
+	{
+		return 0;
+	}
+
+	if(len > e->size - ofs)
+	{
+		len = (int) (e->size - ofs);
+	}
+
+	if(img->type == IMFS_TYPE_ZIP)
+	{
+		return zip_read(img, ent, data, len, ofs);
+	}
+
+	return image_pread(img, data, len, e->ofs + ofs);
+}
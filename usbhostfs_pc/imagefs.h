@@ -0,0 +1,172 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * imagefs.h - Read-only disc images and archives served as USB HostFS drives
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __IMAGEFS_H__
+#define __IMAGEFS_H__
+
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define IMFS_SECTOR_SIZE  2048
+/* Decompressed CSO blocks kept per image */
+#define IMFS_CSO_CACHE    32
+/* Bytes of inflated ZIP entries kept per archive, and the most of them */
+#define IMFS_ZIP_CACHE    (32*1024*1024)
+#define IMFS_ZIP_FILES    256
+/* Larger entries are inflated as they are read rather than kept whole */
+#define IMFS_ZIP_WHOLE    (4*1024*1024)
+#define IMFS_ZIP_STREAMS  4
+
+enum ImfsType
+{
+	IMFS_TYPE_ISO = 0,
+	IMFS_TYPE_CSO = 1,
+	IMFS_TYPE_ZIP = 2,
+};
+
+enum ImfsMethod
+{
+	IMFS_METHOD_STORED  = 0,
+	IMFS_METHOD_DEFLATE = 8,
+	/* Encrypted, or compressed some other way */
+	IMFS_METHOD_UNKNOWN = -1,
+};
+
+struct ImfsEntry
+{
+	char *name;
+	int parent;
+	/* First and last child of a directory, and the next entry in the same directory */
+	int child;
+	int tail;
+	int next;
+	/* Next entry in the same hash chain */
+	int hnext;
+	int isdir;
+	/* Byte offset and size of the data in the image, for a ZIP entry the
+	 * offset of its local header and the size once inflated */
+	int64_t ofs;
+	int64_t size;
+	time_t mtime;
+	int method;
+	int64_t csize;
+};
+
+struct ImfsBlock
+{
+	/* Block number, -1 if the slot is unused */
+	int64_t num;
+	uint64_t last_used;
+	char *data;
+};
+
+/* A ZIP entry inflated whole */
+struct ImfsInflated
+{
+	/* Entry number, -1 if the slot is unused */
+	int ent;
+	uint64_t last_used;
+	char *data;
+};
+
+/* A large ZIP entry part way through being inflated */
+struct ImfsStream
+{
+	int ent;
+	/* Bytes inflated so far */
+	int64_t pos;
+	uint64_t last_used;
+	void *zstream;
+};
+
+struct ImageFs
+{
+	/* Link in the list of open images */
+	struct ImageFs *next;
+	char path[PATH_MAX];
+	/* Identity of the file when it was opened, a changed image is reopened */
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	int refs;
+	int type;
+	int fd;
+	const unsigned char *map;
+	size_t maplen;
+	/* Size of the uncompressed image */
+	int64_t size;
+	/* Entry 0 is the root directory */
+	struct ImfsEntry *ents;
+	int count;
+	int max;
+	int *hash;
+	unsigned int hashmask;
+	/* CSO block index, and the cache of decompressed blocks */
+	const uint32_t *index;
+	int blocksize;
+	int align;
+	int64_t nblocks;
+	pthread_mutex_t lock;
+	struct ImfsBlock cache[IMFS_CSO_CACHE];
+	uint64_t tick;
+	void *zstream;
+	/* Inflated ZIP entries, zbytes in all, and the streams of larger ones */
+	struct ImfsInflated zcache[IMFS_ZIP_FILES];
+	int64_t zbytes;
+	struct ImfsStream streams[IMFS_ZIP_STREAMS];
+};
+
+/**
+ * Open an image and index its directory tree, if the same file is already
+ * open it is shared
+ *
+ * @param path - Path to the .iso, .cso or .zip file
+ *
+ * @return The image, NULL on error
+ */
+struct ImageFs *imfs_open(const char *path);
+
+/**
+ * Take another reference to an open image
+ */
+void imfs_get(struct ImageFs *img);
+
+/**
+ * Drop a reference, the image is closed when the last one goes
+ */
+void imfs_put(struct ImageFs *img);
+
+/**
+ * Find an entry, names are matched ignoring case
+ *
+ * @param img - The image
+ * @param path - Absolute path inside the image, already free of . and ..
+ *
+ * @return The entry number, < 0 if not found
+ */
+int  imfs_lookup(struct ImageFs *img, const char *path);
+
+/**
+ * Read from a file in the image
+ *
+ * @param img - The image
+ * @param ent - The entry number
+ * @param data - Buffer to read into
+ * @param len - Number of bytes to read
+ * @param ofs - Offset in the file
+ *
+ * @return Number of bytes read, 0 at the end of the file, < 0 (GETERROR) on error
+ */
+int  imfs_read(struct ImageFs *img, int ent, char *data, int len, int64_t ofs);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * iouring.c - Minimal io_uring wrapper for the USB HostFS file cache
+ *
+ * Copyright (c) pspdev
+ *
+ * Just enough of io_uring to queue positional reads and reap them, made
+ * with the raw system calls so there is no dependency on liburing. One
+ * thread prepares and submits, another waits for completions. Built
+ * everywhere, ur_init fails where there is no io_uring and the caller
+ * falls back to threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "usbhostfs_pc.h"
+#include "iouring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int submit, unsigned int complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+int ur_init(struct IoRing *r, int entries)
+{
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_setup(entries, &p);
+	if(r->fd < 0)
+	{
+		V_PRINTF(1, "io_uring not available (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	r->entries = p.sq_entries;
+	r->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(r->cqlen > r->sqlen)
+		{
+			r->sqlen = r->cqlen;
+		}
+		r->cqlen = r->sqlen;
+	}
+
+	r->sqmem = mmap(NULL, r->sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sqmem == MAP_FAILED)
+	{
+		r->sqmem = NULL;
+		ur_exit(r);
+		return -1;
+	}
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		r->cqmem = r->sqmem;
+	}
+	else
+	{
+		r->cqmem = mmap(NULL, r->cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(r->cqmem == MAP_FAILED)
+		{
+			r->cqmem = NULL;
+			ur_exit(r);
+			return -1;
+		}
+	}
+
+	r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED)
+	{
+		r->sqes = NULL;
+		ur_exit(r);
+		return -1;
+	}
+
+	r->sqhead = (unsigned int *) ((char *) r->sqmem + p.sq_off.head);
+	r->sqtail = (unsigned int *) ((char *) r->sqmem + p.sq_off.tail);
+	r->sqmask = (unsigned int *) ((char *) r->sqmem + p.sq_off.ring_mask);
+	r->sqarray = (unsigned int *) ((char *) r->sqmem + p.sq_off.array);
+	r->cqhead = (unsigned int *) ((char *) r->cqmem + p.cq_off.head);
+	r->cqtail = (unsigned int *) ((char *) r->cqmem + p.cq_off.tail);
+	r->cqmask = (unsigned int *) ((char *) r->cqmem + p.cq_off.ring_mask);
+	r->cqes = (char *) r->cqmem + p.cq_off.cqes;
+
+	return 0;
+}
+
+void ur_exit(struct IoRing *r)
+{
+	if(r->sqes)
+	{
+		munmap(r->sqes, r->sqeslen);
+	}
+
+	if((r->cqmem) && (r->cqmem != r->sqmem))
+	{
+		munmap(r->cqmem, r->cqlen);
+	}
+
+	if(r->sqmem)
+	{
+		munmap(r->sqmem, r->sqlen);
+	}
+
+	if(r->fd >= 0)
+	{
+		close(r->fd);
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+/* Get the next free submission entry, NULL if the ring is full */
+static struct io_uring_sqe *get_sqe(struct IoRing *r)
+{
+	unsigned int head = __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+	unsigned int tail = *r->sqtail + r->queued;
+	struct io_uring_sqe *sqe;
+
+	if((tail - head) >= r->entries)
+	{
+		return NULL;
+	}
+
+	sqe = &((struct io_uring_sqe *) r->sqes)[tail & *r->sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sqarray[tail & *r->sqmask] = tail & *r->sqmask;
+	r->queued++;
+
+	return sqe;
+}
+
+int ur_prep_read(struct IoRing *r, int fd, void *data, int len, int64_t ofs, uint64_t user)
+{
+	struct io_uring_sqe *sqe = get_sqe(r);
+
+	if(sqe == NULL)
+	{
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) data;
+	sqe->len = len;
+	sqe->off = ofs;
+	sqe->user_data = user;
+
+	return 0;
+}
+
+int ur_prep_nop(struct IoRing *r)
+{
+	struct io_uring_sqe *sqe = get_sqe(r);
+
+	if(sqe == NULL)
+	{
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = 0;
+
+	return 0;
+}
+
+int ur_submit(struct IoRing *r)
+{
+	unsigned int count;
+	int ret;
+
+	__atomic_store_n(r->sqtail, *r->sqtail + r->queued, __ATOMIC_RELEASE);
+	r->queued = 0;
+
+	/* Includes anything a failed submit left in the ring */
+	count = *r->sqtail - __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+	if(count == 0)
+	{
+		return 0;
+	}
+
+	do
+	{
+		ret = sys_enter(r->fd, count, 0, 0);
+	}
+	while((ret < 0) && (errno == EINTR));
+
+	if(ret < 0)
+	{
+		fprintf(stderr, "Error submitting to io_uring (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return ret;
+}
+
+int ur_wait(struct IoRing *r, uint64_t *user, int *res)
+{
+	while(1)
+	{
+		unsigned int head = *r->cqhead;
+		unsigned int tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+
+		if(head != tail)
+		{
+			struct io_uring_cqe *cqe = &((struct io_uring_cqe *) r->cqes)[head & *r->cqmask];
+
+			*user = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(r->cqhead, head + 1, __ATOMIC_RELEASE);
+
+			return 0;
+		}
+
+		if((sys_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) && (errno != EINTR))
+		{
+			fprintf(stderr, "Error waiting on io_uring (%s)\n", strerror(errno));
+			return -1;
+		}
+	}
+}
+
+#else
+
+int ur_init(struct IoRing *r, int entries)
+{
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+
+	return -1;
+}
+
+void ur_exit(struct IoRing *r)
+{
+}
+
+int ur_prep_read(struct IoRing *r, int fd, void *data, int len, int64_t ofs, uint64_t user)
+{
+	return -1;
+}
+
+int ur_prep_nop(struct IoRing *r)
+{
+	return -1;
+}
+
+int ur_submit(struct IoRing *r)
+{
+	return -1;
+}
+
+int ur_wait(struct IoRing *r, uint64_t *user, int *res)
+{
+	return -1;
+}
+
+#endif
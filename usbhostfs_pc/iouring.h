@@ -0,0 +1,99 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * iouring.h - Minimal io_uring wrapper for the USB HostFS file cache
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __IOURING_H__
+#define __IOURING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__linux__) && !defined(NO_IO_URING)
+#define HAVE_IO_URING
+#endif
+
+struct IoRing
+{
+	int fd;
+	unsigned int entries;
+	/* Submission ring, shared with the kernel */
+	void *sqmem;
+	size_t sqlen;
+	unsigned int *sqhead;
+	unsigned int *sqtail;
+	unsigned int *sqmask;
+	unsigned int *sqarray;
+	void *sqes;
+	size_t sqeslen;
+	/* Completion ring, may share the submission ring's mapping */
+	void *cqmem;
+	size_t cqlen;
+	unsigned int *cqhead;
+	unsigned int *cqtail;
+	unsigned int *cqmask;
+	void *cqes;
+	/* Prepared but not yet submitted */
+	unsigned int queued;
+};
+
+/**
+ * Set up a ring
+ *
+ * @param r - The ring
+ * @param entries - Most requests in flight at once
+ *
+ * @return 0 on success, < 0 if io_uring is not available
+ */
+int  ur_init(struct IoRing *r, int entries);
+
+/**
+ * Tear down a ring, nothing must be in flight
+ */
+void ur_exit(struct IoRing *r);
+
+/**
+ * Prepare a positional read, sent by the next ur_submit
+ *
+ * @param r - The ring
+ * @param fd - File to read from
+ * @param data - Buffer to read into
+ * @param len - Number of bytes to read
+ * @param ofs - File offset
+ * @param user - Returned with the completion, 0 is kept for ur_prep_nop
+ *
+ * @return 0 on success, < 0 if the ring is full
+ */
+int  ur_prep_read(struct IoRing *r, int fd, void *data, int len, int64_t ofs, uint64_t user);
+
+/**
+ * Prepare a request which completes at once with user set to 0, used to wake
+ * a thread waiting in ur_wait
+ */
+int  ur_prep_nop(struct IoRing *r);
+
+/**
+ * Send the prepared requests to the kernel, if it fails they are kept and
+ * sent with the next call
+ *
+ * @return Number sent, < 0 on error
+ */
+int  ur_submit(struct IoRing *r);
+
+/**
+ * Take the next completion, waiting for one if none are ready
+ *
+ * @param r - The ring
+ * @param user - Set to the request's user value
+ * @param res - Set to its result, bytes read or -errno
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  ur_wait(struct IoRing *r, uint64_t *user, int *res);
+
+#endif
@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <inttypes.h>
@@ -24,7 +25,6 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/stat.h>
-#include <sys/select.h>
 #include <utime.h>
 #include <signal.h>
 #include <pthread.h>
@@ -47,9 +47,23 @@
 #endif
 
 #include "psp_fileio.h"
+#include "usbhostfs_pc.h"
+#include "usbxfer.h"
+#include "transport.h"
+#include "filecache.h"
+#include "dircache.h"
+#include "nocase.h"
+#include "pathcache.h"
+#include "handle.h"
+#include "asyncmux.h"
+#include "cmdstats.h"
+#include "trace.h"
+#include "reqpool.h"
+#include "imagefs.h"
+#include "hostcopy.h"
+#include "hostsum.h"
+#include "hostsync.h"
 
-#define MAX_FILES 256
-#define MAX_DIRS  256
 #define MAX_TOKENS 256
 
 #define BASE_PORT 10000
@@ -64,45 +78,162 @@
 
 #define MAX_HOSTDRIVES 8
 
-#ifndef SOL_TCP
-#define SOL_TCP getprotobyname("TCP")->p_proto
-#endif
-
 /* Contains the paths for a single hist drive */
 struct HostDrive
 {
 	char rootdir[PATH_MAX];
 	char currdir[PATH_MAX];
+	/* Set if rootdir is a disc image rather than a directory, holds a reference */
+	struct ImageFs *image;
 };
 
 struct FileHandle
 {
-	int opened;
+	int fd;
 	int mode;
 	char *name;
+	/* Set for a file inside a disc image, fd is -1 */
+	struct ImageFs *image;
+	int entry;
+	struct FileCache cache;
 };
 
 struct DirHandle
 {
-	int opened;
 	/* Current count of entries left */
 	int count;
 	/* Current position in the directory entries */
 	int pos;
-	/* Head of list, each entry will be freed when read */
+	/* Entries of the directory, owned by the snapshot if there is one */
 	SceIoDirent *pDir;
+	struct DirSnap *snap;
+};
+
+/* Everything one PSP's requests work on. Each worker has its own so the
+ * request path never takes a lock another PSP could be holding, the drive
+ * mutex is only shared with the shell */
+struct HostFsCtx
+{
+	pthread_mutex_t drivemtx;
+	struct HostDrive drives[MAX_HOSTDRIVES];
+	/* Resolved paths, protected by drivemtx */
+	struct PathCache pathcache;
+	/* Name index generation the cached paths were resolved against */
+	uint32_t pathgen;
+	/* Set if a case insensitive lookup had to fall back to scanning the directory */
+	int nocase_scanned;
+	struct NcIndex ncindex;
+	struct DirCache dircache;
+	struct FcPool fcpool;
+	/* Open files and directories, the handles are passed to the PSP */
+	struct HandleTable files;
+	struct HandleTable dirs;
+	/* Delta syncs in progress and the last tree walked for one, protected by syncmtx */
+	pthread_mutex_t syncmtx;
+	struct HySession *syncs[HY_MAX_SESSIONS];
+	uint32_t syncid;
+	struct HyList synclist;
 };
 
-struct FileHandle open_files[MAX_FILES];
-struct DirHandle  open_dirs[MAX_DIRS];
+/* One thread serving one attached PSP */
+struct Worker
+{
+	/* Slot number, selects the block of async ports */
+	int slot;
+	uint8_t bus;
+	uint8_t addr;
+	pthread_t thid;
+	/* Set while the device can be written to, protected by g_workermtx */
+	int online;
+	/* Set by the thread when it has finished with the device */
+	volatile int done;
+	/* When the device was found */
+	uint64_t found_time;
+	struct Transport trans;
+	/* Shared with the lanes running tagged requests */
+	struct HostFsCtx *ctx;
+	/* What was agreed with the PSP in the HELLO, all zero for an old one */
+	struct HostFsCaps caps;
+	/* Lanes running tagged requests, started when tags are agreed */
+	struct ReqPool *pool;
+	char block[HOSTFS_MAX_BLOCK];
+	char inbuf[64*1024];
+	char outbuf[64*1024];
+	char bulk[HOSTFS_BULK_MAXWRITE];
+};
 
-static libusb_context *usbctx = NULL;
-static libusb_device_handle *usbhdr = NULL;
+#define MAX_WORKERS    16
+#define MAX_PORT_DEPTH 8
+
+/* Each slot owns g_baseport + slot * MAX_ASYNC_CHANNELS onwards. A PSP which
+ * comes back on the same USB port gets the same slot, and so the same ports */
+struct WorkerSlot
+{
+	struct Worker *w;
+	/* Topology of the last device served from the slot */
+	int used;
+	uint8_t bus;
+	int nports;
+	uint8_t ports[MAX_PORT_DEPTH];
+	/* When the last device served from the slot went away, 0 if it hasn't */
+	uint64_t gone_time;
+};
+
+/* How quickly devices are picked up, protected by g_workermtx */
+struct ConnStats
+{
+	int hotplug;
+	uint64_t arrivals;
+	uint64_t scans;
+	/* Devices served, and the time from finding them to serving them */
+	uint64_t connects;
+	uint64_t ready_ns;
+	uint64_t ready_max;
+	/* Devices which came back on a slot, and the time since the last one went */
+	uint64_t reconnects;
+	uint64_t gap_ns;
+	uint64_t gap_max;
+};
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+#define HAVE_HOTPLUG
+#endif
 
-static int g_servsocks[MAX_ASYNC_CHANNELS];
-static int g_clientsocks[MAX_ASYNC_CHANNELS];
+#define MAX_ARRIVALS 16
+
+static libusb_context *usbctx = NULL;
+/* Protects the slot table and the online flag of the workers */
+static pthread_mutex_t g_workermtx = PTHREAD_MUTEX_INITIALIZER;
+static struct WorkerSlot g_slots[MAX_WORKERS];
+/* Async channel clients of all the slots */
+static struct AsyncMux g_mux;
+static struct ConnStats g_connstats;
+static struct CmdStats g_cmdstats;
+/* Capture of every session, when enabled with -T */
+static struct Trace g_trace;
+static const char *g_tracefile = NULL;
+static int g_tracepayloads = 0;
+/* Capabilities offered to the PSP, limited with -C */
+#define HOST_CAPS (HOSTFS_CAP_DREADBULK | HOSTFS_CAP_READSTREAM | HOSTFS_CAP_READFILE | HOSTFS_CAP_TAGGED)
+static uint32_t g_capmask = HOST_CAPS;
+/* Threads per PSP running tagged requests, 0 disables tags */
+static int g_lanes = RP_DEF_LANES;
+/* Written by the SIGUSR1 handler to get the async thread to dump the stats */
+static int g_dumppipe[2] = { -1, -1 };
+/* Devices reported by the hotplug callback and not yet served */
+static pthread_mutex_t g_hotplugmtx = PTHREAD_MUTEX_INITIALIZER;
+static libusb_device *g_arrivals[MAX_ARRIVALS];
+static uint64_t g_arrival_times[MAX_ARRIVALS];
+static int g_narrivals;
+static int g_hotplug_lost;
+/* Set by the callback, wakes the main thread out of libusb event handling */
+static int g_hotplug_event;
 static const char *g_mapfile = NULL;
+static const char *g_listenaddr = NULL;
+/* Serialises starting and reaping workers between USB and socket connections */
+static pthread_mutex_t g_startmtx = PTHREAD_MUTEX_INITIALIZER;
 
+/* The drive mappings new workers start with, protected by g_drivemtx */
 pthread_mutex_t g_drivemtx = PTHREAD_MUTEX_INITIALIZER;
 struct HostDrive g_drives[MAX_HOSTDRIVES];
 char g_rootdir[PATH_MAX];
@@ -115,10 +246,16 @@ int  g_pid = HOSTFSDRIVER_PID;
 int  g_timeout = USB_TIMEOUT;
 int  g_globalbind = 0;
 int  g_daemon = 0;
+int  g_xferdepth = XFER_DEF_DEPTH;
+int  g_radepth = FC_DEF_DEPTH;
+int  g_wbsize = FC_DEF_WBSIZE;
+int  g_fcthreads = 0;
+int  g_dirsnaps = DC_DEF_MAX;
+int  g_pathcache_size = PC_DEF_MAX;
+int  g_asyncbuf = AM_DEF_RING;
+int  g_asyncpolicy = AM_POLICY_DROP;
 unsigned short g_baseport = BASE_PORT;
 
-#define V_PRINTF(level, fmt, ...) { if(g_verbose >= level) { fprintf(stderr, fmt, ## __VA_ARGS__); } }
-
 #if defined BUILD_BIGENDIAN || defined _BIG_ENDIAN
 uint16_t swap16(uint16_t i)
 {
@@ -150,16 +287,16 @@ uint64_t swap64(uint64_t i)
 
 	return ret;
 }
-#define LE16(x) swap16(x)
-#define LE32(x) swap32(x)
-#define LE64(x) swap64(x)
-#else
-#define LE16(x) (x)
-#define LE32(x) (x)
-#define LE64(x) (x)
 #endif
 
-#define GETERROR(x) (0x80010000 | (x))
+uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 void print_gdbdebug(int dir, const uint8_t *data, int len)
 {
@@ -205,40 +342,6 @@ int is_dir(const char *path)
 	return ret;
 }
 
-/* Define wrappers for the usb functions we use which can set euid */
-int euid_usb_bulk_write(libusb_device_handle *dev, int ep, char *bytes, int size,
-	int timeout)
-{
-	int wrbytes;
-
-	V_PRINTF(2, "Bulk Write dev %p, ep 0x%x, bytes %p, size %d, timeout %d\n",
-			dev, ep, bytes, size, timeout);
-
-	int ret = libusb_bulk_transfer(dev, ep, (unsigned char*)bytes, size, &wrbytes, timeout);
-	if (!ret)
-		ret = wrbytes;
-
-	V_PRINTF(2, "Bulk Write returned %d\n", ret);
-
-	return ret;
-}
-
-int euid_usb_bulk_read(libusb_device_handle *dev, int ep, char *bytes, int size,
-	int timeout)
-{
-	int rdbytes;
-
-	V_PRINTF(2, "Bulk Read dev %p, ep 0x%x, bytes %p, size %d, timeout %d\n",
-			dev, ep, bytes, size, timeout);
-	int ret = libusb_bulk_transfer(usbhdr, ep, (unsigned char*)bytes, size, &rdbytes, timeout);
-	if (!ret)
-		ret = rdbytes;
-
-	V_PRINTF(2, "Bulk Read returned %d\n", ret);
-
-	return ret;
-}
-
 int configure_usb(libusb_device_handle *devh) {
 	int cfgn;
 	int r = libusb_get_configuration(devh, &cfgn);
@@ -309,16 +412,6 @@ libusb_device_handle *open_device(libusb_device *usbdev)
 	return ret;
 }
 
-void close_device(libusb_device_handle *dev)
-{
-	if(dev)
-	{
-		libusb_release_interface(dev, 0);
-		libusb_reset_device(dev);
-		libusb_close(dev);
-	}
-}
-
 int gen_path(char *path, int dir)
 {
 	char abspath[PATH_MAX];
@@ -371,25 +464,8 @@ int gen_path(char *path, int dir)
 	return 1;
 }
 
-int calc_rating(const char *str1, const char *str2)
-{
-	int rating = 0;
-
-	while((*str1) && (*str2))
-	{
-		if(*str1 == *str2)
-		{
-			rating++;
-		}
-		str1++;
-		str2++;
-	}
-
-	return rating;
-}
-
 /* Scan the directory, return the first name which matches case insensitive */
-int find_nocase(const char *rootdir, const char *relpath, char *token)
+int find_nocase(struct HostFsCtx *ctx, const char *rootdir, const char *relpath, char *token)
 {
 	DIR *dir;
 	struct dirent *ent;
@@ -407,6 +483,14 @@ int find_nocase(const char *rootdir, const char *relpath, char *token)
 		return 0;
 	}
 
+	ret = nc_lookup(&ctx->ncindex, abspath, token);
+	if(ret >= 0)
+	{
+		return ret;
+	}
+	ret = 0;
+	ctx->nocase_scanned = 1;
+
 	V_PRINTF(2, "Checking %s\n", abspath);
 	dir = opendir(abspath);
 	if(dir != NULL)
@@ -447,7 +531,7 @@ int find_nocase(const char *rootdir, const char *relpath, char *token)
 }
 
 /* Make a relative path case insensitive, if we fail then leave the path as is, just in case */
-void make_nocase(const char *rootdir, char *path, int dir)
+void make_nocase(struct HostFsCtx *ctx, const char *rootdir, char *path, int dir)
 {
 	char abspath[PATH_MAX];
 	char retpath[PATH_MAX];
@@ -466,7 +550,7 @@ void make_nocase(const char *rootdir, char *path, int dir)
 	strcpy(retpath, "/");
 	for(token = 0; token < count; token++)
 	{
-		if(!find_nocase(rootdir, retpath, tokens[token]))
+		if(!find_nocase(ctx, rootdir, retpath, tokens[token]))
 		{
 			/* Might only be an error if this is not the last token, otherwise we could be
 			 * trying to create a new directory or file, if we are not then the rest of the code
@@ -490,28 +574,16 @@ void make_nocase(const char *rootdir, char *path, int dir)
 	}
 }
 
-int make_path(unsigned int drive, const char *path, char *retpath, int dir)
+/* Resolve a PSP path to a host path, must be called with the drive mutex held */
+int resolve_path(struct HostFsCtx *ctx, unsigned int drive, const char *path, char *retpath, int dir)
 {
 	char hostpath[PATH_MAX];
 	int len;
 	int ret = -1;
 
-	if(drive >= MAX_HOSTDRIVES)
-	{
-		fprintf(stderr, "Host drive number is too large (%d)\n", drive);
-		return -1;
-	}
-
-	if(pthread_mutex_lock(&g_drivemtx))
-	{
-		fprintf(stderr, "Could not lock mutex (%s)\n", strerror(errno));
-		return -1;
-	}
-
 	do
 	{
-
-		len = snprintf(hostpath, PATH_MAX, "%s%s", g_drives[drive].currdir, path);
+		len = snprintf(hostpath, PATH_MAX, "%s%s", ctx->drives[drive].currdir, path);
 		if((len < 0) || (len >= PATH_MAX))
 		{
 			fprintf(stderr, "Path length too big (%d)\n", len);
@@ -539,10 +611,10 @@ int make_path(unsigned int drive, const char *path, char *retpath, int dir)
 		/* Make the relative path case insensitive if needed */
 		if(g_nocase)
 		{
-			make_nocase(g_drives[drive].rootdir, hostpath, dir);
+			make_nocase(ctx, ctx->drives[drive].rootdir, hostpath, dir);
 		}
 
-		len = snprintf(retpath, PATH_MAX, "%s/%s", g_drives[drive].rootdir, hostpath);
+		len = snprintf(retpath, PATH_MAX, "%s/%s", ctx->drives[drive].rootdir, hostpath);
 		if((len < 0) || (len >= PATH_MAX))
 		{
 			fprintf(stderr, "Path length too big (%d)\n", len);
@@ -558,18 +630,192 @@ int make_path(unsigned int drive, const char *path, char *retpath, int dir)
 	}
 	while(0);
 
-	pthread_mutex_unlock(&g_drivemtx);
+	return ret;
+}
+
+/* Forget all resolved paths, must be called with the drive mutex held whenever the drive state changes */
+void invalidate_paths(struct HostFsCtx *ctx)
+{
+	pc_flush(&ctx->pathcache);
+}
+
+int make_path(struct HostFsCtx *ctx, unsigned int drive, const char *path, char *retpath, int dir)
+{
+	int ret = -1;
+
+	if(drive >= MAX_HOSTDRIVES)
+	{
+		fprintf(stderr, "Host drive number is too large (%d)\n", drive);
+		return -1;
+	}
+
+	if(pthread_mutex_lock(&ctx->drivemtx))
+	{
+		fprintf(stderr, "Could not lock mutex (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	if(ctx->drives[drive].image)
+	{
+		/* Nothing on the host to change, image drives are read-only */
+		V_PRINTF(1, "host%d: is a read-only image\n", drive);
+		pthread_mutex_unlock(&ctx->drivemtx);
+		return -1;
+	}
+
+	if(g_nocase)
+	{
+		/* Case insensitive results depend on the directory contents */
+		uint32_t gen = nc_generation(&ctx->ncindex);
+
+		if(gen != ctx->pathgen)
+		{
+			pc_flush(&ctx->pathcache);
+			ctx->pathgen = gen;
+		}
+	}
+
+	if(pc_lookup(&ctx->pathcache, drive, ctx->drives[drive].currdir, path, dir, retpath))
+	{
+		ret = 0;
+	}
+	else
+	{
+		ctx->nocase_scanned = 0;
+		ret = resolve_path(ctx, drive, path, retpath, dir);
+		/* Don't keep a case insensitive result the name index can't invalidate */
+		if((ret == 0) && ((!g_nocase) || ((ctx->ncindex.ifd >= 0) && (!ctx->nocase_scanned))))
+		{
+			pc_insert(&ctx->pathcache, drive, ctx->drives[drive].currdir, path, dir, retpath);
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->drivemtx);
+
+	return ret;
+}
+
+/* Resolve a PSP path on a disc image drive to a path inside the image.
+ * Returns 1 and a reference to the image if the drive is one, 0 if not. */
+int image_path(struct HostFsCtx *ctx, unsigned int drive, const char *path, char *retpath, struct ImageFs **image)
+{
+	int ret = 0;
+	int len;
+
+	if(drive >= MAX_HOSTDRIVES)
+	{
+		/* Left for make_path to report */
+		return 0;
+	}
+
+	pthread_mutex_lock(&ctx->drivemtx);
+	if(ctx->drives[drive].image)
+	{
+		len = snprintf(retpath, PATH_MAX, "%s%s", ctx->drives[drive].currdir, path);
+		if((len < 0) || (len >= PATH_MAX))
+		{
+			fprintf(stderr, "Path length too big (%d)\n", len);
+			ret = -1;
+		}
+		else
+		{
+			if(g_msslash)
+			{
+				int i;
+
+				for(i = 0; i < len; i++)
+				{
+					if(retpath[i] == '\\')
+					{
+						retpath[i] = '/';
+					}
+				}
+			}
+
+			gen_path(retpath, 0);
+			imfs_get(ctx->drives[drive].image);
+			*image = ctx->drives[drive].image;
+			ret = 1;
+		}
+	}
+	pthread_mutex_unlock(&ctx->drivemtx);
 
 	return ret;
 }
 
-int open_file(int drive, const char *path, unsigned int mode, unsigned int mask)
+int image_source(void *arg, char *data, int len, int64_t ofs)
+{
+	struct FileHandle *file = (struct FileHandle *) arg;
+
+	return imfs_read(file->image, file->entry, data, len, ofs);
+}
+
+/* Open a file inside a disc image, takes over the reference to the image */
+int open_image_file(struct HostFsCtx *ctx, struct ImageFs *image, const char *path, unsigned int mode)
+{
+	struct FileHandle *file;
+	int entry;
+	int fid;
+
+	V_PRINTF(1, "Opening file %s in image %s\n", path, image->path);
+
+	if(mode & (PSP_O_WRONLY | PSP_O_APPEND | PSP_O_CREAT | PSP_O_TRUNC))
+	{
+		imfs_put(image);
+		return GETERROR(EROFS);
+	}
+
+	entry = imfs_lookup(image, path);
+	if((entry < 0) || (image->ents[entry].isdir))
+	{
+		V_PRINTF(1, "Could not open file %s\n", path);
+		imfs_put(image);
+		return GETERROR(ENOENT);
+	}
+
+	file = (struct FileHandle *) malloc(sizeof(struct FileHandle));
+	if(file == NULL)
+	{
+		imfs_put(image);
+		return GETERROR(ENOMEM);
+	}
+
+	memset(file, 0, sizeof(*file));
+	file->fd = -1;
+	file->mode = mode;
+	file->image = image;
+	file->entry = entry;
+	fid = ht_alloc(&ctx->files, file);
+	if(fid < 0)
+	{
+		fprintf(stderr, "Error could not allocate file handle\n");
+		imfs_put(image);
+		free(file);
+		return fid;
+	}
+	fc_open_source(&ctx->fcpool, &file->cache, image_source, file, image->ents[entry].size);
+
+	return fid;
+}
+
+int open_file(struct HostFsCtx *ctx, int drive, const char *path, unsigned int mode, unsigned int mask)
 {
 	char fullpath[PATH_MAX];
+	struct ImageFs *image;
 	unsigned int real_mode = 0;
 	int fd = -1;
-	
-	if(make_path(drive, path, fullpath, 0) < 0)
+
+	fd = image_path(ctx, drive, path, fullpath, &image);
+	if(fd < 0)
+	{
+		return GETERROR(ENAMETOOLONG);
+	}
+	else if(fd > 0)
+	{
+		return open_image_file(ctx, image, fullpath, mode);
+	}
+
+	if(make_path(ctx, drive, path, fullpath, 0) < 0)
 	{
 		V_PRINTF(1, "Invalid file path %s\n", path);
 		return GETERROR(ENOENT);
@@ -627,18 +873,34 @@ int open_file(int drive, const char *path, unsigned int mode, unsigned int mask)
 		fd = open(fullpath, real_mode, mask & ~0111);
 		if(fd >= 0)
 		{
-			if(fd < MAX_FILES)
+			struct FileHandle *file;
+			int fid = GETERROR(ENOMEM);
+
+			file = (struct FileHandle *) malloc(sizeof(struct FileHandle));
+			if(file != NULL)
 			{
-				open_files[fd].opened = 1;
-				open_files[fd].mode = mode;
-				open_files[fd].name = strdup(fullpath);
+				memset(file, 0, sizeof(*file));
+				file->fd = fd;
+				file->mode = mode;
+				file->name = strdup(fullpath);
+				fid = ht_alloc(&ctx->files, file);
+				if(fid >= 0)
+				{
+					fc_open(&ctx->fcpool, &file->cache, fd, (real_mode & O_APPEND) ? 1 : 0);
+				}
+				else
+				{
+					free(file->name);
+					free(file);
+				}
 			}
-			else
+
+			if(fid < 0)
 			{
 				close(fd);
-				fprintf(stderr, "Error filedescriptor out of range\n");
-				fd = GETERROR(EMFILE);
+				fprintf(stderr, "Error could not allocate file handle\n");
 			}
+			fd = fid;
 		}
 		else
 		{
@@ -654,6 +916,50 @@ int open_file(int drive, const char *path, unsigned int mode, unsigned int mask)
 	return fd;
 }
 
+/* Write out any buffered data for open files with this path, so stat sees it */
+void flush_path(struct HostFsCtx *ctx, const char *fullpath)
+{
+	struct FileHandle *file;
+	int iter = 0;
+
+	/* Tagged requests could be closing the files from other threads */
+	ht_lock(&ctx->files);
+	while((file = (struct FileHandle *) ht_next(&ctx->files, &iter, NULL)))
+	{
+		if((file->name) && (strcmp(file->name, fullpath) == 0))
+		{
+			fc_flush(&file->cache);
+		}
+	}
+	ht_unlock(&ctx->files);
+}
+
+/* Write out what the PSP wrote to any open file at or under fullpath, with
+ * drop set also throw away what was read ahead as the files are about to change */
+void flush_tree(struct HostFsCtx *ctx, const char *fullpath, int drop)
+{
+	struct FileHandle *file;
+	int len = strlen(fullpath);
+	int iter = 0;
+
+	ht_lock(&ctx->files);
+	while((file = (struct FileHandle *) ht_next(&ctx->files, &iter, NULL)))
+	{
+		if((file->name) && (strncmp(file->name, fullpath, len) == 0) && ((file->name[len] == 0) || (file->name[len] == '/')))
+		{
+			if(drop)
+			{
+				fc_invalidate(&file->cache);
+			}
+			else
+			{
+				fc_flush(&file->cache);
+			}
+		}
+	}
+	ht_unlock(&ctx->files);
+}
+
 void fill_time(time_t t, ScePspDateTime *scetime)
 {
 	struct tm *filetime;
@@ -730,92 +1036,205 @@ int fill_stat(const char *dirname, const char *name, SceIoStat *scestat)
 	return 0;
 }
 
-int dir_open(int drive, const char *dirname)
+void fill_image_stat(struct ImageFs *image, int entry, SceIoStat *scestat)
+{
+	struct ImfsEntry *ent = &image->ents[entry];
+
+	memset(scestat, 0, sizeof(*scestat));
+	scestat->size = LE64(ent->size);
+	if(ent->isdir)
+	{
+		scestat->attr = LE32(FIO_SO_IFDIR);
+		scestat->mode = LE32(FIO_S_IFDIR | 0555);
+	}
+	else
+	{
+		scestat->attr = LE32(FIO_SO_IFREG);
+		scestat->mode = LE32(FIO_S_IFREG | 0444);
+	}
+
+	fill_time(ent->mtime, &scestat->ctime);
+	fill_time(ent->mtime, &scestat->atime);
+	fill_time(ent->mtime, &scestat->mtime);
+}
+
+/* Build the entries of a directory in a disc image, the same way scan_dir does */
+int scan_image_dir(struct ImageFs *image, int entry, SceIoDirent **ents)
+{
+	SceIoDirent *pDir;
+	int dirnum = 2;
+	int child;
+	int i;
+
+	for(child = image->ents[entry].child; child >= 0; child = image->ents[child].next)
+	{
+		dirnum++;
+	}
+
+	pDir = malloc(sizeof(SceIoDirent) * dirnum);
+	if(pDir == NULL)
+	{
+		fprintf(stderr, "Could not allocate memory for directories\n");
+		return GETERROR(ENOMEM);
+	}
+
+	memset(pDir, 0, sizeof(SceIoDirent) * dirnum);
+	strcpy(pDir[0].name, ".");
+	fill_image_stat(image, entry, &pDir[0].stat);
+	strcpy(pDir[1].name, "..");
+	fill_image_stat(image, entry > 0 ? image->ents[entry].parent : 0, &pDir[1].stat);
+
+	i = 2;
+	for(child = image->ents[entry].child; child >= 0; child = image->ents[child].next)
+	{
+		snprintf(pDir[i].name, sizeof(pDir[i].name), "%s", image->ents[child].name);
+		fill_image_stat(image, child, &pDir[i].stat);
+		i++;
+	}
+
+	*ents = pDir;
+
+	return dirnum;
+}
+
+int scan_dir(const char *fulldir, SceIoDirent **ents)
 {
-	char fulldir[PATH_MAX];
 	struct dirent **entries;
+	SceIoDirent *pDir;
 	int ret = -1;
 	int i;
-	int did;
 	int dirnum;
 
-	do
+	dirnum = scandir(fulldir, &entries, NULL, alphasort);
+	if(dirnum <= 0)
+	{
+		fprintf(stderr, "Could not scan directory %s (%s)\n", fulldir, strerror(errno));
+		return GETERROR(errno);
+	}
+
+	V_PRINTF(2, "Number of dir entries %d\n", dirnum);
+
+	pDir = malloc(sizeof(SceIoDirent) * dirnum);
+	if(pDir != NULL)
 	{
-		for(did = 0; did < MAX_DIRS; did++)
+		memset(pDir, 0, sizeof(SceIoDirent) * dirnum);
+		for(i = 0; i < dirnum; i++)
 		{
-			if(!open_dirs[did].opened)
+			strcpy(pDir[i].name, entries[i]->d_name);
+			V_PRINTF(2, "Dirent %d: %s\n", i, entries[i]->d_name);
+			if(fill_stat(fulldir, entries[i]->d_name, &pDir[i].stat) < 0)
 			{
+				fprintf(stderr, "Error filling in directory structure\n");
 				break;
 			}
 		}
 
-		if(did == MAX_DIRS)
+		if(i == dirnum)
 		{
-			fprintf(stderr, "Could not find free directory handle\n");
-			ret = GETERROR(EMFILE);
-			break;
+			*ents = pDir;
+			ret = dirnum;
 		}
-
-		if(make_path(drive, dirname, fulldir, 1) < 0)
+		else
 		{
-			ret = GETERROR(ENOENT);
-			break;
+			free(pDir);
 		}
+	}
+	else
+	{
+		fprintf(stderr, "Could not allocate memory for directories\n");
+	}
 
-		V_PRINTF(2, "dopen: %s, fsnum %d\n", fulldir, drive);
-		V_PRINTF(1, "Opening directory %s\n", fulldir);
-
-		memset(&open_dirs[did], 0, sizeof(open_dirs[did]));
+	for(i = 0; i < dirnum; i++)
+	{
+		free(entries[i]);
+	}
+	free(entries);
 
-		dirnum = scandir(fulldir, &entries, NULL, alphasort);
-		if(dirnum <= 0)
-		{
-			fprintf(stderr, "Could not scan directory %s (%s)\n", fulldir, strerror(errno));
-			ret = GETERROR(errno);
-			break;
-		}
+	return ret;
+}
 
-		V_PRINTF(2, "Number of dir entries %d\n", dirnum);
+int dir_open(struct HostFsCtx *ctx, int drive, const char *dirname)
+{
+	char fulldir[PATH_MAX];
+	struct ImageFs *image;
+	struct DirSnap *snap = NULL;
+	struct DirHandle *dir;
+	SceIoDirent *ents;
+	int count;
+	int ret = -1;
 
-		open_dirs[did].pDir = malloc(sizeof(SceIoDirent) * dirnum);
-		if(open_dirs[did].pDir != NULL)
+	do
+	{
+		ret = image_path(ctx, drive, dirname, fulldir, &image);
+		if(ret > 0)
 		{
-			memset(open_dirs[did].pDir, 0, sizeof(SceIoDirent) * dirnum);
-			for(i = 0; i < dirnum; i++)
-			{
-				strcpy(open_dirs[did].pDir[i].name, entries[i]->d_name);
-				V_PRINTF(2, "Dirent %d: %s\n", i, entries[i]->d_name);
-				if(fill_stat(fulldir, entries[i]->d_name, &open_dirs[did].pDir[i].stat) < 0)
-				{
-					fprintf(stderr, "Error filling in directory structure\n");
-					break;
-				}
-			}
+			int entry = imfs_lookup(image, fulldir);
 
-			if(i == dirnum)
+			V_PRINTF(1, "Opening directory %s in image %s\n", fulldir, image->path);
+			if((entry < 0) || (!image->ents[entry].isdir))
 			{
-				ret = did;
-				open_dirs[did].pos = 0;
-				open_dirs[did].count = dirnum;
-				open_dirs[did].opened = 1;
+				ret = GETERROR(entry < 0 ? ENOENT : ENOTDIR);
 			}
 			else
 			{
-				free(open_dirs[did].pDir);
+				ret = scan_image_dir(image, entry, &ents);
+			}
+			imfs_put(image);
+			if(ret < 0)
+			{
+				break;
 			}
+			count = ret;
 		}
 		else
 		{
-			fprintf(stderr, "Could not allocate memory for directories\n");
+			if((ret < 0) || (make_path(ctx, drive, dirname, fulldir, 1) < 0))
+			{
+				ret = GETERROR(ENOENT);
+				break;
+			}
+
+			V_PRINTF(2, "dopen: %s, fsnum %d\n", fulldir, drive);
+			V_PRINTF(1, "Opening directory %s\n", fulldir);
+
+			ret = dc_get(&ctx->dircache, fulldir, scan_dir, &snap);
+			if(ret < 0)
+			{
+				break;
+			}
+			ents = snap->ents;
+			count = snap->count;
 		}
 
-		if(ret < 0)
+		dir = (struct DirHandle *) malloc(sizeof(struct DirHandle));
+		if(dir == NULL)
+		{
+			ret = GETERROR(ENOMEM);
+		}
+		else
 		{
-			for(i = 0; i < dirnum; i++)
+			memset(dir, 0, sizeof(*dir));
+			dir->snap = snap;
+			dir->pDir = ents;
+			dir->pos = 0;
+			dir->count = count;
+
+			ret = ht_alloc(&ctx->dirs, dir);
+			if(ret >= 0)
 			{
-				free(entries[i]);
+				break;
 			}
-			free(entries);
+			fprintf(stderr, "Could not allocate directory handle\n");
+			free(dir);
+		}
+
+		if(snap)
+		{
+			dc_put(&ctx->dircache, snap);
+		}
+		else
+		{
+			free(ents);
 		}
 	}
 	while(0);
@@ -823,42 +1242,221 @@ int dir_open(int drive, const char *dirname)
 	return ret;
 }
 
-int dir_close(int did)
+int dir_close(struct HostFsCtx *ctx, int did)
 {
+	struct DirHandle *dir;
 	int ret = -1;
-	if((did >= 0) && (did < MAX_DIRS))
+
+	dir = (struct DirHandle *) ht_free(&ctx->dirs, did);
+	if(dir)
 	{
-		if(open_dirs[did].opened)
+		if(dir->snap)
 		{
-			if(open_dirs[did].pDir)
-			{
-				free(open_dirs[did].pDir);
-			}
+			dc_put(&ctx->dircache, dir->snap);
+		}
+		else
+		{
+			free(dir->pDir);
+		}
+		free(dir);
+
+		ret = 0;
+	}
 
-			open_dirs[did].opened = 0;
-			open_dirs[did].count = 0;
-			open_dirs[did].pos = 0;
-			open_dirs[did].pDir = NULL;
+	return ret;
+}
 
-			ret = 0;
+/* The lanes run requests through it, and it starts them on a HELLO */
+void do_hostfs(struct Worker *w, struct HostFsCmd *cmd, int readlen);
+
+/* Run a tagged request on one of the lanes */
+void run_tagged(void *arg, struct RpReq *req)
+{
+	struct Worker *w = (struct Worker *) arg;
+	struct HostFsCmd *cmd = (struct HostFsCmd *) req->cmd;
+
+	trans_tag_begin(&w->trans, req->tag, req->extra, req->extralen);
+	do_hostfs(w, cmd, req->cmdlen);
+
+	/* The PSP waits for a reply to every tag, every response starts with a result */
+	if(!w->trans.tag_sent)
+	{
+		struct HostFsCloseResp resp;
+
+		memset(&resp, 0, sizeof(resp));
+		resp.cmd.magic = LE32(HOSTFS_MAGIC);
+		resp.cmd.command = cmd->command;
+		resp.res = LE32(-1);
+		trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
+	}
+
+	trans_tag_end(&w->trans);
+}
+
+/* Start the lanes, each gets a worker of its own sharing the open files */
+int start_lanes(struct Worker *w)
+{
+	void *args[RP_MAX_LANES];
+	int nlanes = g_lanes < RP_MAX_LANES ? g_lanes : RP_MAX_LANES;
+	int i;
+
+	if(w->pool)
+	{
+		return 0;
+	}
+
+	w->pool = (struct ReqPool *) malloc(sizeof(struct ReqPool));
+	if(w->pool == NULL)
+	{
+		return -1;
+	}
+
+	memset(args, 0, sizeof(args));
+	for(i = 0; i < nlanes; i++)
+	{
+		/* Most of a worker is never touched by a lane, calloc leaves it unmapped */
+		struct Worker *lw = (struct Worker *) calloc(1, sizeof(struct Worker));
+
+		if(lw == NULL)
+		{
+			break;
 		}
+
+		lw->slot = w->slot;
+		lw->ctx = w->ctx;
+		trans_init_tagged(&lw->trans, &w->trans, &w->pool->reply_lock);
+		args[i] = lw;
 	}
 
-	return ret;
+	if((i < nlanes) || (rp_start(w->pool, nlanes, run_tagged, args) < 0))
+	{
+		fprintf(stderr, "Could not start the lanes for tagged requests\n");
+		for(i = 0; i < nlanes; i++)
+		{
+			free(args[i]);
+		}
+		free(w->pool);
+		w->pool = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void stop_lanes(struct Worker *w)
+{
+	int i;
+
+	if(w->pool == NULL)
+	{
+		return;
+	}
+
+	rp_stop(w->pool);
+	V_PRINTF(1, "Device %d ran %" PRIu64 " tagged requests, at most %d in flight\n", w->slot,
+			w->pool->stats.reqs, w->pool->stats.inflight_max);
+
+	for(i = 0; i < w->pool->nlanes; i++)
+	{
+		free(w->pool->lanes[i].arg);
+	}
+	free(w->pool);
+	w->pool = NULL;
 }
 
-int handle_hello(libusb_device_handle *dev)
+int handle_hello(struct Worker *w, struct HostFsHelloCmd *cmd, int cmdlen)
 {
 	struct HostFsHelloResp resp;
+	struct HostFsCaps theirs;
+	struct HostFsCaps ours;
+	uint32_t offer;
+	int len;
+	int ret;
+	int i;
 
 	memset(&resp, 0, sizeof(resp));
 	resp.cmd.magic = LE32(HOSTFS_MAGIC);
 	resp.cmd.command = LE32(HOSTFS_CMD_HELLO);
+	memset(&w->caps, 0, sizeof(w->caps));
+
+	/* A trace has one reply at a time, so no tags while capturing */
+	offer = HOST_CAPS & g_capmask;
+	if((g_lanes <= 0) || (g_tracefile))
+	{
+		offer &= ~HOSTFS_CAP_TAGGED;
+	}
+
+	/* Anything the PSP didn't send, or we don't know about, stays zero */
+	len = cmdlen - (int) sizeof(struct HostFsCmd);
+	if((len >= (int) offsetof(struct HostFsCaps, caps)) && (len > LE16(cmd->caps.size)))
+	{
+		len = LE16(cmd->caps.size);
+	}
+	if(len > (int) sizeof(theirs))
+	{
+		len = sizeof(theirs);
+	}
+
+	/* Only a PSP which sent its capabilities expects ours back */
+	if((len < (int) HOSTFS_CAPS_MINLEN) || (LE16(cmd->caps.version) == 0))
+	{
+		V_PRINTF(1, "Device %d did not send any capabilities\n", w->slot);
+		return trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
+	}
+
+	memset(&theirs, 0, sizeof(theirs));
+	memcpy(&theirs, &cmd->caps, len);
+	/* An unset block size means the original one */
+	if(theirs.maxblock == 0)
+	{
+		theirs.maxblock = LE32(HOSTFS_MAX_BLOCK);
+	}
+
+	/* Tags are no use unless the PSP can have a few in flight */
+	if((LE32(theirs.caps) & offer & HOSTFS_CAP_TAGGED) && ((LE32(theirs.maxtags) < 2) || (start_lanes(w) < 0)))
+	{
+		offer &= ~HOSTFS_CAP_TAGGED;
+	}
+
+	w->caps.version = LE16(theirs.version) < HOSTFS_CAPS_VERSION ? LE16(theirs.version) : HOSTFS_CAPS_VERSION;
+	w->caps.size = len;
+	w->caps.caps = LE32(theirs.caps) & offer;
+	w->caps.maxblock = LE32(theirs.maxblock) < sizeof(w->block) ? LE32(theirs.maxblock) : sizeof(w->block);
+	w->caps.maxstream = LE32(theirs.maxstream) < HOSTFS_STREAM_MAX ? LE32(theirs.maxstream) : HOSTFS_STREAM_MAX;
+	if(w->caps.caps & HOSTFS_CAP_TAGGED)
+	{
+		w->caps.maxtags = LE32(theirs.maxtags) < RP_MAX_QUEUED ? LE32(theirs.maxtags) : RP_MAX_QUEUED;
+	}
+	V_PRINTF(1, "Device %d capabilities version %d, caps %08X, using %08X, block %d, stream %d, tags %d\n", w->slot,
+			LE16(theirs.version), LE32(theirs.caps), w->caps.caps, w->caps.maxblock, w->caps.maxstream, w->caps.maxtags);
 
-	return euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+	/* Nothing tagged is in flight during a HELLO, so the lanes can be updated */
+	for(i = 0; (w->pool) && (i < w->pool->nlanes); i++)
+	{
+		((struct Worker *) w->pool->lanes[i].arg)->caps = w->caps;
+	}
+
+	memset(&ours, 0, sizeof(ours));
+	ours.version = LE16(HOSTFS_CAPS_VERSION);
+	ours.size = LE16(sizeof(ours));
+	ours.caps = LE32(offer);
+	ours.maxblock = LE32(sizeof(w->block));
+	ours.maxstream = LE32(HOSTFS_STREAM_MAX);
+	ours.maxtags = LE32(offer & HOSTFS_CAP_TAGGED ? RP_MAX_QUEUED : 0);
+
+	/* Never send more of the block than the PSP knows about */
+	resp.cmd.extralen = LE32(len);
+
+	ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
+	if(ret < 0)
+	{
+		return ret;
+	}
+
+	return trans_write(&w->trans, (char *) &ours, len, 10000);
 }
 
-int handle_open(libusb_device_handle *dev, struct HostFsOpenCmd *cmd, int cmdlen)
+int handle_open(struct Worker *w, struct HostFsOpenCmd *cmd, int cmdlen)
 {
 	struct HostFsOpenResp resp;
 	int  ret = -1;
@@ -883,26 +1481,31 @@ int handle_open(libusb_device_handle *dev, struct HostFsOpenCmd *cmd, int cmdlen
 			break;
 		}
 
-		/* TODO: Should check that length is within a valid range */
+		if(LE32(cmd->cmd.extralen) > sizeof(path))
+		{
+			fprintf(stderr, "Error, filename too long with open command (%d)\n", LE32(cmd->cmd.extralen));
+			break;
+		}
 
-		ret = euid_usb_bulk_read(dev, 0x81, path, LE32(cmd->cmd.extralen), 10000);
+		ret = trans_read(&w->trans, path, LE32(cmd->cmd.extralen), 10000);
 		if(ret != LE32(cmd->cmd.extralen))
 		{
 			fprintf(stderr, "Error reading open data cmd->extralen %ud, ret %d\n", LE32(cmd->cmd.extralen), ret);
 			break;
 		}
+		path[sizeof(path) - 1] = 0;
 
 		V_PRINTF(2, "Open command mode %08X mask %08X name %s\n", LE32(cmd->mode), LE32(cmd->mask), path);
-		resp.res = LE32(open_file(LE32(cmd->fsnum), path, LE32(cmd->mode), LE32(cmd->mask)));
+		resp.res = LE32(open_file(w->ctx, LE32(cmd->fsnum), path, LE32(cmd->mode), LE32(cmd->mask)));
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 	}
 	while(0);
 
 	return ret;
 }
 
-int handle_dopen(libusb_device_handle *dev, struct HostFsDopenCmd *cmd, int cmdlen)
+int handle_dopen(struct Worker *w, struct HostFsDopenCmd *cmd, int cmdlen)
 {
 	struct HostFsDopenResp resp;
 	int  ret = -1;
@@ -927,19 +1530,24 @@ int handle_dopen(libusb_device_handle *dev, struct HostFsDopenCmd *cmd, int cmdl
 			break;
 		}
 
-		/* TODO: Should check that length is within a valid range */
+		if(LE32(cmd->cmd.extralen) > sizeof(path))
+		{
+			fprintf(stderr, "Error, dirname too long with dopen command (%d)\n", LE32(cmd->cmd.extralen));
+			break;
+		}
 
-		ret = euid_usb_bulk_read(dev, 0x81, path, LE32(cmd->cmd.extralen), 10000);
+		ret = trans_read(&w->trans, path, LE32(cmd->cmd.extralen), 10000);
 		if(ret != LE32(cmd->cmd.extralen))
 		{
 			fprintf(stderr, "Error reading open data cmd->extralen %d, ret %d\n", LE32(cmd->cmd.extralen), ret);
 			break;
 		}
+		path[sizeof(path) - 1] = 0;
 
 		V_PRINTF(2, "Dopen command name %s\n", path);
-		resp.res = LE32(dir_open(LE32(cmd->fsnum), path));
+		resp.res = LE32(dir_open(w->ctx, LE32(cmd->fsnum), path));
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 	}
 	while(0);
 
@@ -976,11 +1584,11 @@ int fixed_write(int fd, const void *data, int len)
 	return byteswrite;
 }
 
-int handle_write(libusb_device_handle *dev, struct HostFsWriteCmd *cmd, int cmdlen)
+int handle_write(struct Worker *w, struct HostFsWriteCmd *cmd, int cmdlen)
 {
-	static char write_block[HOSTFS_MAX_BLOCK];
 	struct HostFsWriteResp resp;
 	int  fid;
+	struct FileHandle *file;
 	int  ret = -1;
 
 	memset(&resp, 0, sizeof(resp));
@@ -996,16 +1604,13 @@ int handle_write(libusb_device_handle *dev, struct HostFsWriteCmd *cmd, int cmdl
 			break;
 		}
 
-		/* TODO: Check upper bound */
-		if(LE32(cmd->cmd.extralen) <= 0)
+		if((LE32(cmd->cmd.extralen) <= 0) || (LE32(cmd->cmd.extralen) > sizeof(w->block)))
 		{
 			fprintf(stderr, "Error extralen invalid (%d)\n", LE32(cmd->cmd.extralen));
 			break;
 		}
 
-		/* TODO: Should check that length is within a valid range */
-
-		ret = euid_usb_bulk_read(dev, 0x81, write_block, LE32(cmd->cmd.extralen), 10000);
+		ret = trans_read(&w->trans, w->block, LE32(cmd->cmd.extralen), 10000);
 		if(ret != LE32(cmd->cmd.extralen))
 		{
 			fprintf(stderr, "Error reading write data cmd->extralen %d, ret %d\n", LE32(cmd->cmd.extralen), ret);
@@ -1016,23 +1621,17 @@ int handle_write(libusb_device_handle *dev, struct HostFsWriteCmd *cmd, int cmdl
 
 		V_PRINTF(2, "Write command fid: %d, length: %d\n", fid, LE32(cmd->cmd.extralen));
 
-		if((fid >= 0) && (fid < MAX_FILES))
+		file = (struct FileHandle *) ht_lookup(&w->ctx->files, fid);
+		if(file)
 		{
-			if(open_files[fid].opened)
-			{
-				resp.res = LE32(fixed_write(fid, write_block, LE32(cmd->cmd.extralen)));
-			}
-			else
-			{
-				fprintf(stderr, "Error fid not open %d\n", fid);
-			}
+			resp.res = LE32(fc_write(&file->cache, w->block, LE32(cmd->cmd.extralen)));
 		}
 		else
 		{
 			fprintf(stderr, "Error invalid fid %d\n", fid);
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 	}
 	while(0);
 
@@ -1070,11 +1669,11 @@ int fixed_read(int fd, void *data, int len)
 	return bytesread;
 }
 
-int handle_read(libusb_device_handle *dev, struct HostFsReadCmd *cmd, int cmdlen)
+int handle_read(struct Worker *w, struct HostFsReadCmd *cmd, int cmdlen)
 {
-	static char read_block[HOSTFS_MAX_BLOCK];
 	struct HostFsReadResp resp;
 	int  fid;
+	struct FileHandle *file;
 	int  ret = -1;
 
 	memset(&resp, 0, sizeof(resp));
@@ -1090,8 +1689,7 @@ int handle_read(libusb_device_handle *dev, struct HostFsReadCmd *cmd, int cmdlen
 			break;
 		}
 
-		/* TODO: Check upper bound */
-		if(LE32(cmd->len) <= 0)
+		if((LE32(cmd->len) <= 0) || (LE32(cmd->len) > sizeof(w->block)))
 		{
 			fprintf(stderr, "Error extralen invalid (%d)\n", LE32(cmd->len));
 			break;
@@ -1100,19 +1698,13 @@ int handle_read(libusb_device_handle *dev, struct HostFsReadCmd *cmd, int cmdlen
 		fid = LE32(cmd->fid);
 		V_PRINTF(2, "Read command fid: %d, length: %d\n", fid, LE32(cmd->len));
 
-		if((fid >= 0) && (fid < MAX_FILES))
+		file = (struct FileHandle *) ht_lookup(&w->ctx->files, fid);
+		if(file)
 		{
-			if(open_files[fid].opened)
-			{
-				resp.res = LE32(fixed_read(fid, read_block, LE32(cmd->len)));
-				if(LE32(resp.res) >= 0)
-				{
-					resp.cmd.extralen = resp.res;
-				}
-			}
-			else
+			resp.res = LE32(fc_read(&file->cache, w->block, LE32(cmd->len)));
+			if(LE32(resp.res) >= 0)
 			{
-				fprintf(stderr, "Error fid not open %d\n", fid);
+				resp.cmd.extralen = resp.res;
 			}
 		}
 		else
@@ -1120,7 +1712,7 @@ int handle_read(libusb_device_handle *dev, struct HostFsReadCmd *cmd, int cmdlen
 			fprintf(stderr, "Error invalid fid %d\n", fid);
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 		if(ret < 0)
 		{
 			fprintf(stderr, "Error writing read response (%d)\n", ret);
@@ -1129,7 +1721,7 @@ int handle_read(libusb_device_handle *dev, struct HostFsReadCmd *cmd, int cmdlen
 
 		if(LE32(resp.cmd.extralen) > 0)
 		{
-			ret = euid_usb_bulk_write(dev, 0x2, read_block, LE32(resp.cmd.extralen), 10000);
+			ret = trans_write(&w->trans, w->block, LE32(resp.cmd.extralen), 10000);
 		}
 	}
 	while(0);
@@ -1137,146 +1729,262 @@ int handle_read(libusb_device_handle *dev, struct HostFsReadCmd *cmd, int cmdlen
 	return ret;
 }
 
-int handle_close(libusb_device_handle *dev, struct HostFsCloseCmd *cmd, int cmdlen)
+int handle_readstream(struct Worker *w, struct HostFsReadStreamCmd *cmd, int cmdlen)
 {
-	struct HostFsCloseResp resp;
-	int  ret = -1;
+	struct HostFsReadStreamResp resp;
+	struct HostFsReadStreamEnd end;
+	struct FileHandle *file = NULL;
+	int64_t avail;
 	int  fid;
+	int  len;
+	int  have = 0;
+	int  sent = 0;
+	int  valid;
+	int  ret = -1;
 
 	memset(&resp, 0, sizeof(resp));
 	resp.cmd.magic = LE32(HOSTFS_MAGIC);
-	resp.cmd.command = LE32(HOSTFS_CMD_CLOSE);
+	resp.cmd.command = LE32(HOSTFS_CMD_READSTREAM);
 	resp.res = LE32(-1);
 
 	do
 	{
-		if(cmdlen != sizeof(struct HostFsCloseCmd)) 
+		if(cmdlen != sizeof(struct HostFsReadStreamCmd)) 
 		{
-			fprintf(stderr, "Error, invalid close command size %d\n", cmdlen);
+			fprintf(stderr, "Error, invalid readstream command size %d\n", cmdlen);
+			break;
+		}
+
+		len = LE32(cmd->len);
+		if((len <= 0) || (len > HOSTFS_STREAM_MAX))
+		{
+			fprintf(stderr, "Error readstream length invalid (%d)\n", len);
 			break;
 		}
 
 		fid = LE32(cmd->fid);
-		V_PRINTF(2, "Close command fid: %d\n", fid);
-		if((fid > STDERR_FILENO) && (fid < MAX_FILES) && (open_files[fid].opened))
+		V_PRINTF(2, "Readstream command fid: %d, length: %d\n", fid, len);
+
+		file = (struct FileHandle *) ht_lookup(&w->ctx->files, fid);
+		if(file)
 		{
-			if(close(fid) < 0)
+			avail = fc_remaining(&file->cache);
+			if(avail >= 0)
 			{
-				resp.res = LE32(GETERROR(errno));
+				resp.res = LE32(avail < len ? (int) avail : len);
+			}
+			else if(avail == -1)
+			{
+				/* Can't tell how much a pipe or device has, send what one read gives */
+				have = fc_read(&file->cache, w->block, len < sizeof(w->block) ? len : sizeof(w->block));
+				resp.res = LE32(have);
 			}
 			else
 			{
-				resp.res = LE32(0);
+				resp.res = LE32((int) avail);
 			}
 
-			open_files[fid].opened = 0;
-			if(open_files[fid].name)
+			if(LE32(resp.res) > 0)
 			{
-				free(open_files[fid].name);
-				open_files[fid].name = NULL;
+				resp.cmd.extralen = LE32(LE32(resp.res) + sizeof(end));
 			}
 		}
 		else
 		{
-			fprintf(stderr, "Error invalid file id in close command (%d)\n", fid);
+			fprintf(stderr, "Error invalid fid %d\n", fid);
+		}
+
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
+		if(ret < 0)
+		{
+			fprintf(stderr, "Error writing readstream response (%d)\n", ret);
+			break;
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		len = LE32(resp.res);
+		if(len <= 0)
+		{
+			break;
+		}
+
+		/* Everything promised is sent, but if the file shrank the end says
+		 * how much of it is the file */
+		valid = len;
+		while(sent < len)
+		{
+			int size = (len - sent) < sizeof(w->block) ? (len - sent) : sizeof(w->block);
+
+			if(have == 0)
+			{
+				if(valid == len)
+				{
+					have = fc_read(&file->cache, w->block, size);
+					if(have < size)
+					{
+						fprintf(stderr, "Error file %d shrank during a readstream (%d)\n", fid, have);
+						valid = have < 0 ? (sent > 0 ? sent : have) : sent + have;
+					}
+				}
+
+				if(have < size)
+				{
+					memset(&w->block[have > 0 ? have : 0], 0, size - (have > 0 ? have : 0));
+				}
+			}
+
+			ret = trans_write(&w->trans, w->block, size, 10000);
+			if(ret < 0)
+			{
+				fprintf(stderr, "Error writing readstream data (%d)\n", ret);
+				break;
+			}
+			sent += size;
+			have = 0;
+		}
+
+		if(ret < 0)
+		{
+			break;
+		}
+
+		end.res = LE32(valid);
+		ret = trans_write(&w->trans, (char *) &end, sizeof(end), 10000);
+		if(ret < 0)
+		{
+			fprintf(stderr, "Error writing readstream end (%d)\n", ret);
+		}
 	}
 	while(0);
 
 	return ret;
 }
 
-int handle_dclose(libusb_device_handle *dev, struct HostFsDcloseCmd *cmd, int cmdlen)
+/* Close a file handle, returns the result for the PSP or -1 if it was invalid */
+int close_file(struct HostFsCtx *ctx, int fid)
 {
-	struct HostFsDcloseResp resp;
-	int  ret = -1;
-	int  did;
+	struct FileHandle *file;
+	int res = -1;
 
-	memset(&resp, 0, sizeof(resp));
-	resp.cmd.magic = LE32(HOSTFS_MAGIC);
-	resp.cmd.command = LE32(HOSTFS_CMD_DCLOSE);
-	resp.res = LE32(-1);
-
-	do
+	file = (struct FileHandle *) ht_free(&ctx->files, fid);
+	if(file)
 	{
-		if(cmdlen != sizeof(struct HostFsDcloseCmd)) 
+		int err = fc_close(&file->cache);
+
+		if(file->image)
 		{
-			fprintf(stderr, "Error, invalid close command size %d\n", cmdlen);
-			break;
+			imfs_put(file->image);
+			res = err;
+		}
+		else if(close(file->fd) < 0)
+		{
+			res = GETERROR(errno);
+		}
+		else
+		{
+			/* Report a failed buffered write if nothing else went wrong */
+			res = err;
 		}
 
-		did = LE32(cmd->did);
-		V_PRINTF(2, "Dclose command did: %d\n", did);
-		resp.res = dir_close(did);
-
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		free(file->name);
+		free(file);
 	}
-	while(0);
-
 
-	return ret;
+	return res;
 }
 
-int handle_dread(libusb_device_handle *dev, struct HostFsDreadCmd *cmd, int cmdlen)
+int handle_readfile(struct Worker *w, struct HostFsReadFileCmd *cmd, int cmdlen)
 {
-	struct HostFsDreadResp resp;
-	SceIoDirent *dir = NULL;
+	struct HostFsReadFileResp resp;
+	struct FileHandle *file;
+	char path[HOSTFS_PATHMAX];
+	int64_t size = -1;
+	int  maxlen;
+	int  len = 0;
+	int  fid;
 	int  ret = -1;
-	int  did;
 
 	memset(&resp, 0, sizeof(resp));
 	resp.cmd.magic = LE32(HOSTFS_MAGIC);
-	resp.cmd.command = LE32(HOSTFS_CMD_READ);
+	resp.cmd.command = LE32(HOSTFS_CMD_READFILE);
 	resp.res = LE32(-1);
 
 	do
 	{
-		if(cmdlen != sizeof(struct HostFsDreadCmd)) 
+		if(cmdlen != sizeof(struct HostFsReadFileCmd)) 
 		{
-			fprintf(stderr, "Error, invalid dread command size %d\n", cmdlen);
+			fprintf(stderr, "Error, invalid readfile command size %d\n", cmdlen);
 			break;
 		}
 
-		did = LE32(cmd->did);
-		V_PRINTF(2, "Dread command did: %d\n", did);
+		if((LE32(cmd->cmd.extralen) == 0) || (LE32(cmd->cmd.extralen) > sizeof(path)))
+		{
+			fprintf(stderr, "Error, invalid filename length with readfile command\n");
+			break;
+		}
+
+		ret = trans_read(&w->trans, path, LE32(cmd->cmd.extralen), 10000);
+		if(ret != LE32(cmd->cmd.extralen))
+		{
+			fprintf(stderr, "Error reading readfile data cmd->extralen %ud, ret %d\n", LE32(cmd->cmd.extralen), ret);
+			break;
+		}
+		path[sizeof(path) - 1] = 0;
 
-		if((did >= 0) && (did < MAX_FILES))
+		maxlen = LE32(cmd->maxlen);
+		if(maxlen > sizeof(w->block))
 		{
-			if(open_dirs[did].opened)
+			maxlen = sizeof(w->block);
+		}
+
+		V_PRINTF(2, "Readfile command mode %08X mask %08X maxlen %d name %s\n", LE32(cmd->mode), LE32(cmd->mask), maxlen, path);
+		fid = open_file(w->ctx, LE32(cmd->fsnum), path, LE32(cmd->mode), LE32(cmd->mask));
+		resp.res = LE32(fid);
+
+		file = fid >= 0 ? (struct FileHandle *) ht_lookup(&w->ctx->files, fid) : NULL;
+		if(file)
+		{
+			size = fc_remaining(&file->cache);
+			resp.size = LE64(size);
+		}
+
+		/* Small enough to send it all, the PSP won't need the handle */
+		if((size >= 0) && (size <= maxlen))
+		{
+			while(len < size)
 			{
-				if(open_dirs[did].pos < open_dirs[did].count)
-				{
-					dir = &open_dirs[did].pDir[open_dirs[did].pos++];
-					resp.cmd.extralen = LE32(sizeof(SceIoDirent));
-					resp.res = LE32(open_dirs[did].count - open_dirs[did].pos + 1);
-				}
-				else
+				int got = fc_read(&file->cache, &w->block[len], size - len);
+
+				if(got <= 0)
 				{
-					resp.res = LE32(0);
+					break;
 				}
+				len += got;
+			}
+
+			if(len == size)
+			{
+				resp.res = LE32(close_file(w->ctx, fid));
+				resp.flags = LE32(HOSTFS_READFILE_WHOLE);
+				resp.cmd.extralen = LE32(len);
 			}
 			else
 			{
-				fprintf(stderr, "Error did not open %d\n", did);
+				/* Changed under us, let the PSP read it the normal way */
+				fc_seek(&file->cache, 0, SEEK_SET);
+				len = 0;
 			}
 		}
-		else
-		{
-			fprintf(stderr, "Error invalid did %d\n", did);
-		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 		if(ret < 0)
 		{
-			fprintf(stderr, "Error writing dread response (%d)\n", ret);
+			fprintf(stderr, "Error writing readfile response (%d)\n", ret);
 			break;
 		}
 
-		if(LE32(resp.cmd.extralen) > 0)
+		if(len > 0)
 		{
-			ret = euid_usb_bulk_write(dev, 0x2, (char *) dir, LE32(resp.cmd.extralen), 10000);
+			ret = trans_write(&w->trans, w->block, len, 10000);
 		}
 	}
 	while(0);
@@ -1284,9 +1992,228 @@ int handle_dread(libusb_device_handle *dev, struct HostFsDreadCmd *cmd, int cmdl
 	return ret;
 }
 
-int handle_lseek(libusb_device_handle *dev, struct HostFsLseekCmd *cmd, int cmdlen)
+int handle_close(struct Worker *w, struct HostFsCloseCmd *cmd, int cmdlen)
 {
-	struct HostFsLseekResp resp;
+	struct HostFsCloseResp resp;
+	int  ret = -1;
+	int  fid;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.cmd.magic = LE32(HOSTFS_MAGIC);
+	resp.cmd.command = LE32(HOSTFS_CMD_CLOSE);
+	resp.res = LE32(-1);
+
+	do
+	{
+		if(cmdlen != sizeof(struct HostFsCloseCmd)) 
+		{
+			fprintf(stderr, "Error, invalid close command size %d\n", cmdlen);
+			break;
+		}
+
+		fid = LE32(cmd->fid);
+		V_PRINTF(2, "Close command fid: %d\n", fid);
+		if(ht_lookup(&w->ctx->files, fid))
+		{
+			resp.res = LE32(close_file(w->ctx, fid));
+		}
+		else
+		{
+			fprintf(stderr, "Error invalid file id in close command (%d)\n", fid);
+		}
+
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
+	}
+	while(0);
+
+	return ret;
+}
+
+int handle_dclose(struct Worker *w, struct HostFsDcloseCmd *cmd, int cmdlen)
+{
+	struct HostFsDcloseResp resp;
+	int  ret = -1;
+	int  did;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.cmd.magic = LE32(HOSTFS_MAGIC);
+	resp.cmd.command = LE32(HOSTFS_CMD_DCLOSE);
+	resp.res = LE32(-1);
+
+	do
+	{
+		if(cmdlen != sizeof(struct HostFsDcloseCmd)) 
+		{
+			fprintf(stderr, "Error, invalid close command size %d\n", cmdlen);
+			break;
+		}
+
+		did = LE32(cmd->did);
+		V_PRINTF(2, "Dclose command did: %d\n", did);
+		resp.res = dir_close(w->ctx, did);
+
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
+	}
+	while(0);
+
+
+	return ret;
+}
+
+int handle_dread(struct Worker *w, struct HostFsDreadCmd *cmd, int cmdlen)
+{
+	struct HostFsDreadResp resp;
+	SceIoDirent *dir = NULL;
+	struct DirHandle *dh;
+	int  ret = -1;
+	int  did;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.cmd.magic = LE32(HOSTFS_MAGIC);
+	resp.cmd.command = LE32(HOSTFS_CMD_READ);
+	resp.res = LE32(-1);
+
+	do
+	{
+		if(cmdlen != sizeof(struct HostFsDreadCmd)) 
+		{
+			fprintf(stderr, "Error, invalid dread command size %d\n", cmdlen);
+			break;
+		}
+
+		did = LE32(cmd->did);
+		V_PRINTF(2, "Dread command did: %d\n", did);
+
+		dh = (struct DirHandle *) ht_lookup(&w->ctx->dirs, did);
+		if(dh)
+		{
+			if(dh->pos < dh->count)
+			{
+				dir = &dh->pDir[dh->pos++];
+				resp.cmd.extralen = LE32(sizeof(SceIoDirent));
+				resp.res = LE32(dh->count - dh->pos + 1);
+			}
+			else
+			{
+				resp.res = LE32(0);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Error invalid did %d\n", did);
+		}
+
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
+		if(ret < 0)
+		{
+			fprintf(stderr, "Error writing dread response (%d)\n", ret);
+			break;
+		}
+
+		if(LE32(resp.cmd.extralen) > 0)
+		{
+			ret = trans_write(&w->trans, (char *) dir, LE32(resp.cmd.extralen), 10000);
+		}
+	}
+	while(0);
+
+	return ret;
+}
+
+int handle_dreadbulk(struct Worker *w, struct HostFsDreadBulkCmd *cmd, int cmdlen)
+{
+	struct HostFsDreadBulkResp resp;
+	struct DirHandle *dh;
+	int  ret = -1;
+	int  did;
+	int  maxlen;
+	int  len = 0;
+	int  count = 0;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.cmd.magic = LE32(HOSTFS_MAGIC);
+	resp.cmd.command = LE32(HOSTFS_CMD_DREADBULK);
+	resp.res = LE32(-1);
+
+	do
+	{
+		if(cmdlen != sizeof(struct HostFsDreadBulkCmd)) 
+		{
+			fprintf(stderr, "Error, invalid dreadbulk command size %d\n", cmdlen);
+			break;
+		}
+
+		did = LE32(cmd->did);
+		maxlen = LE32(cmd->maxlen);
+		if(maxlen > sizeof(w->block))
+		{
+			maxlen = sizeof(w->block);
+		}
+		V_PRINTF(2, "Dreadbulk command did: %d, maxlen %d\n", did, maxlen);
+
+		dh = (struct DirHandle *) ht_lookup(&w->ctx->dirs, did);
+		if(dh)
+		{
+			/* Pack whole entries until the next one won't fit */
+			while(dh->pos < dh->count)
+			{
+				SceIoDirent *dir = &dh->pDir[dh->pos];
+				struct HostFsDirent *ent = (struct HostFsDirent *) &w->block[len];
+				int namelen = strlen(dir->name);
+				int reclen = (sizeof(struct HostFsDirent) + sizeof(SceIoStat) + namelen + 1 + 3) & ~3;
+
+				if((len + reclen) > maxlen)
+				{
+					break;
+				}
+
+				memset(ent, 0, reclen);
+				ent->reclen = LE16(reclen);
+				ent->namelen = LE16(namelen);
+				memcpy(&w->block[len + sizeof(struct HostFsDirent)], &dir->stat, sizeof(SceIoStat));
+				memcpy(&w->block[len + sizeof(struct HostFsDirent) + sizeof(SceIoStat)], dir->name, namelen);
+				len += reclen;
+				count++;
+				dh->pos++;
+			}
+
+			if((count == 0) && (dh->pos < dh->count))
+			{
+				fprintf(stderr, "Error dreadbulk buffer too small (%d)\n", maxlen);
+				resp.res = LE32(GETERROR(EINVAL));
+			}
+			else
+			{
+				resp.res = LE32(count);
+				resp.cmd.extralen = LE32(len);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Error invalid did %d\n", did);
+		}
+
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
+		if(ret < 0)
+		{
+			fprintf(stderr, "Error writing dreadbulk response (%d)\n", ret);
+			break;
+		}
+
+		if(len > 0)
+		{
+			ret = trans_write(&w->trans, w->block, len, 10000);
+		}
+	}
+	while(0);
+
+	return ret;
+}
+
+int handle_lseek(struct Worker *w, struct HostFsLseekCmd *cmd, int cmdlen)
+{
+	struct HostFsLseekResp resp;
+	struct FileHandle *file;
 	int  ret = -1;
 	int  fid;
 
@@ -1306,10 +2233,11 @@ int handle_lseek(libusb_device_handle *dev, struct HostFsLseekCmd *cmd, int cmdl
 
 		fid = LE32(cmd->fid);
 		V_PRINTF(2, "Lseek command fid: %d, ofs: %" PRIu64 ", whence: %d\n", fid, LE64(cmd->ofs), LE32(cmd->whence));
-		if((fid > STDERR_FILENO) && (fid < MAX_FILES) && (open_files[fid].opened))
+		file = (struct FileHandle *) ht_lookup(&w->ctx->files, fid);
+		if(file)
 		{
 			/* TODO: Probably should ensure whence is mapped across, just in case */
-			resp.ofs = LE64((int64_t) lseek(fid, (off_t) LE64(cmd->ofs), LE32(cmd->whence)));
+			resp.ofs = LE64(fc_seek(&file->cache, LE64(cmd->ofs), LE32(cmd->whence)));
 			if(LE64(resp.ofs) < 0)
 			{
 				resp.res = LE32(-1);
@@ -1324,14 +2252,14 @@ int handle_lseek(libusb_device_handle *dev, struct HostFsLseekCmd *cmd, int cmdl
 			fprintf(stderr, "Error invalid file id in close command (%d)\n", fid);
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 	}
 	while(0);
 
 	return ret;
 }
 
-int handle_remove(libusb_device_handle *dev, struct HostFsRemoveCmd *cmd, int cmdlen)
+int handle_remove(struct Worker *w, struct HostFsRemoveCmd *cmd, int cmdlen)
 {
 	struct HostFsRemoveResp resp;
 	int  ret = -1;
@@ -1357,17 +2285,22 @@ int handle_remove(libusb_device_handle *dev, struct HostFsRemoveCmd *cmd, int cm
 			break;
 		}
 
-		/* TODO: Should check that length is within a valid range */
+		if(LE32(cmd->cmd.extralen) > sizeof(path))
+		{
+			fprintf(stderr, "Error, filename too long with remove command (%d)\n", LE32(cmd->cmd.extralen));
+			break;
+		}
 
-		ret = euid_usb_bulk_read(dev, 0x81, path, LE32(cmd->cmd.extralen), 10000);
+		ret = trans_read(&w->trans, path, LE32(cmd->cmd.extralen), 10000);
 		if(ret != LE32(cmd->cmd.extralen))
 		{
 			fprintf(stderr, "Error reading remove data cmd->extralen %d, ret %d\n", LE32(cmd->cmd.extralen), ret);
 			break;
 		}
+		path[sizeof(path) - 1] = 0;
 
 		V_PRINTF(2, "Remove command name %s\n", path);
-		if(make_path(LE32(cmd->fsnum), path, fullpath, 0) == 0)
+		if(make_path(w->ctx, LE32(cmd->fsnum), path, fullpath, 0) == 0)
 		{
 			if(unlink(fullpath) < 0)
 			{
@@ -1379,14 +2312,14 @@ int handle_remove(libusb_device_handle *dev, struct HostFsRemoveCmd *cmd, int cm
 			}
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 	}
 	while(0);
 
 	return ret;
 }
 
-int handle_rmdir(libusb_device_handle *dev, struct HostFsRmdirCmd *cmd, int cmdlen)
+int handle_rmdir(struct Worker *w, struct HostFsRmdirCmd *cmd, int cmdlen)
 {
 	struct HostFsRmdirResp resp;
 	int  ret = -1;
@@ -1412,17 +2345,22 @@ int handle_rmdir(libusb_device_handle *dev, struct HostFsRmdirCmd *cmd, int cmdl
 			break;
 		}
 
-		/* TODO: Should check that length is within a valid range */
+		if(LE32(cmd->cmd.extralen) > sizeof(path))
+		{
+			fprintf(stderr, "Error, filename too long with rmdir command (%d)\n", LE32(cmd->cmd.extralen));
+			break;
+		}
 
-		ret = euid_usb_bulk_read(dev, 0x81, path, LE32(cmd->cmd.extralen), 10000);
+		ret = trans_read(&w->trans, path, LE32(cmd->cmd.extralen), 10000);
 		if(ret != LE32(cmd->cmd.extralen))
 		{
 			fprintf(stderr, "Error reading rmdir data cmd->extralen %d, ret %d\n", LE32(cmd->cmd.extralen), ret);
 			break;
 		}
+		path[sizeof(path) - 1] = 0;
 
 		V_PRINTF(2, "Rmdir command name %s\n", path);
-		if(make_path(LE32(cmd->fsnum), path, fullpath, 0) == 0)
+		if(make_path(w->ctx, LE32(cmd->fsnum), path, fullpath, 0) == 0)
 		{
 			if(rmdir(fullpath) < 0)
 			{
@@ -1434,14 +2372,14 @@ int handle_rmdir(libusb_device_handle *dev, struct HostFsRmdirCmd *cmd, int cmdl
 			}
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 	}
 	while(0);
 
 	return ret;
 }
 
-int handle_mkdir(libusb_device_handle *dev, struct HostFsMkdirCmd *cmd, int cmdlen)
+int handle_mkdir(struct Worker *w, struct HostFsMkdirCmd *cmd, int cmdlen)
 {
 	struct HostFsMkdirResp resp;
 	int  ret = -1;
@@ -1467,17 +2405,22 @@ int handle_mkdir(libusb_device_handle *dev, struct HostFsMkdirCmd *cmd, int cmdl
 			break;
 		}
 
-		/* TODO: Should check that length is within a valid range */
+		if(LE32(cmd->cmd.extralen) > sizeof(path))
+		{
+			fprintf(stderr, "Error, filename too long with mkdir command (%d)\n", LE32(cmd->cmd.extralen));
+			break;
+		}
 
-		ret = euid_usb_bulk_read(dev, 0x81, path, LE32(cmd->cmd.extralen), 10000);
+		ret = trans_read(&w->trans, path, LE32(cmd->cmd.extralen), 10000);
 		if(ret != LE32(cmd->cmd.extralen))
 		{
 			fprintf(stderr, "Error reading mkdir data cmd->extralen %d, ret %d\n", LE32(cmd->cmd.extralen), ret);
 			break;
 		}
+		path[sizeof(path) - 1] = 0;
 
 		V_PRINTF(2, "Mkdir command mode %08X, name %s\n", LE32(cmd->mode), path);
-		if(make_path(LE32(cmd->fsnum), path, fullpath, 0) == 0)
+		if(make_path(w->ctx, LE32(cmd->fsnum), path, fullpath, 0) == 0)
 		{
 			if(mkdir(fullpath, LE32(cmd->mode)) < 0)
 			{
@@ -1489,18 +2432,20 @@ int handle_mkdir(libusb_device_handle *dev, struct HostFsMkdirCmd *cmd, int cmdl
 			}
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 	}
 	while(0);
 
 	return ret;
 }
 
-int handle_getstat(libusb_device_handle *dev, struct HostFsGetstatCmd *cmd, int cmdlen)
+int handle_getstat(struct Worker *w, struct HostFsGetstatCmd *cmd, int cmdlen)
 {
 	struct HostFsGetstatResp resp;
+	struct ImageFs *image;
 	SceIoStat st;
 	int  ret = -1;
+	int  imgret;
 	char path[HOSTFS_PATHMAX];
 	char fullpath[PATH_MAX];
 
@@ -1524,18 +2469,41 @@ int handle_getstat(libusb_device_handle *dev, struct HostFsGetstatCmd *cmd, int
 			break;
 		}
 
-		/* TODO: Should check that length is within a valid range */
+		if(LE32(cmd->cmd.extralen) > sizeof(path))
+		{
+			fprintf(stderr, "Error, filename too long with getstat command (%d)\n", LE32(cmd->cmd.extralen));
+			break;
+		}
 
-		ret = euid_usb_bulk_read(dev, 0x81, path, LE32(cmd->cmd.extralen), 10000);
+		ret = trans_read(&w->trans, path, LE32(cmd->cmd.extralen), 10000);
 		if(ret != LE32(cmd->cmd.extralen))
 		{
 			fprintf(stderr, "Error reading getstat data cmd->extralen %d, ret %d\n", LE32(cmd->cmd.extralen), ret);
 			break;
 		}
+		path[sizeof(path) - 1] = 0;
 
 		V_PRINTF(2, "Getstat command name %s\n", path);
-		if(make_path(LE32(cmd->fsnum), path, fullpath, 0) == 0)
+		imgret = image_path(w->ctx, LE32(cmd->fsnum), path, fullpath, &image);
+		if(imgret > 0)
 		{
+			int entry = imfs_lookup(image, fullpath);
+
+			if(entry >= 0)
+			{
+				fill_image_stat(image, entry, &st);
+				resp.res = LE32(0);
+				resp.cmd.extralen = LE32(sizeof(st));
+			}
+			else
+			{
+				resp.res = LE32(GETERROR(ENOENT));
+			}
+			imfs_put(image);
+		}
+		else if((imgret == 0) && (make_path(w->ctx, LE32(cmd->fsnum), path, fullpath, 0) == 0))
+		{
+			flush_path(w->ctx, fullpath);
 			resp.res = LE32(fill_stat(NULL, fullpath, &st));
 			if(LE32(resp.res) == 0)
 			{
@@ -1543,7 +2511,7 @@ int handle_getstat(libusb_device_handle *dev, struct HostFsGetstatCmd *cmd, int
 			}
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 		if(ret < 0)
 		{
 			fprintf(stderr, "Error writing getstat response (%d)\n", ret);
@@ -1552,7 +2520,7 @@ int handle_getstat(libusb_device_handle *dev, struct HostFsGetstatCmd *cmd, int
 
 		if(LE32(resp.cmd.extralen) > 0)
 		{
-			ret = euid_usb_bulk_write(dev, 0x2, (char *) &st, sizeof(st), 10000);
+			ret = trans_write(&w->trans, (char *) &st, sizeof(st), 10000);
 		}
 	}
 	while(0);
@@ -1648,7 +2616,7 @@ int psp_chstat(const char *path, struct HostFsChstatCmd *cmd)
 	return 0;
 }
 
-int handle_chstat(libusb_device_handle *dev, struct HostFsChstatCmd *cmd, int cmdlen)
+int handle_chstat(struct Worker *w, struct HostFsChstatCmd *cmd, int cmdlen)
 {
 	struct HostFsChstatResp resp;
 	int  ret = -1;
@@ -1674,29 +2642,35 @@ int handle_chstat(libusb_device_handle *dev, struct HostFsChstatCmd *cmd, int cm
 			break;
 		}
 
-		/* TODO: Should check that length is within a valid range */
+		if(LE32(cmd->cmd.extralen) > sizeof(path))
+		{
+			fprintf(stderr, "Error, filename too long with chstat command (%d)\n", LE32(cmd->cmd.extralen));
+			break;
+		}
 
-		ret = euid_usb_bulk_read(dev, 0x81, path, LE32(cmd->cmd.extralen), 10000);
+		ret = trans_read(&w->trans, path, LE32(cmd->cmd.extralen), 10000);
 		if(ret != LE32(cmd->cmd.extralen))
 		{
 			fprintf(stderr, "Error reading chstat data cmd->extralen %d, ret %d\n", LE32(cmd->cmd.extralen), ret);
 			break;
 		}
+		path[sizeof(path) - 1] = 0;
 
 		V_PRINTF(2, "Chstat command name %s, bits %08X\n", path, LE32(cmd->bits));
-		if(make_path(LE32(cmd->fsnum), path, fullpath, 0) == 0)
+		if(make_path(w->ctx, LE32(cmd->fsnum), path, fullpath, 0) == 0)
 		{
+			flush_path(w->ctx, fullpath);
 			resp.res = LE32(psp_chstat(fullpath, cmd));
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 	}
 	while(0);
 
 	return ret;
 }
 
-int handle_rename(libusb_device_handle *dev, struct HostFsRenameCmd *cmd, int cmdlen)
+int handle_rename(struct Worker *w, struct HostFsRenameCmd *cmd, int cmdlen)
 {
 	struct HostFsRenameResp resp;
 	int  ret = -1;
@@ -1726,10 +2700,14 @@ int handle_rename(libusb_device_handle *dev, struct HostFsRenameCmd *cmd, int cm
 			break;
 		}
 
-		/* TODO: Should check that length is within a valid range */
+		if(LE32(cmd->cmd.extralen) >= sizeof(path))
+		{
+			fprintf(stderr, "Error, filenames too long with rename command (%d)\n", LE32(cmd->cmd.extralen));
+			break;
+		}
 
 		memset(path, 0, sizeof(path));
-		ret = euid_usb_bulk_read(dev, 0x81, path, LE32(cmd->cmd.extralen), 10000);
+		ret = trans_read(&w->trans, path, LE32(cmd->cmd.extralen), 10000);
 		if(ret != LE32(cmd->cmd.extralen))
 		{
 			fprintf(stderr, "Error reading rename data cmd->extralen %d, ret %d\n", LE32(cmd->cmd.extralen), ret);
@@ -1760,7 +2738,7 @@ int handle_rename(libusb_device_handle *dev, struct HostFsRenameCmd *cmd, int cm
 
 		V_PRINTF(2, "Rename command oldname %s, newname %s\n", path, destpath);
 
-		if(!make_path(LE32(cmd->fsnum), path, oldpath, 0) && !make_path(LE32(cmd->fsnum), destpath, newpath, 0))
+		if(!make_path(w->ctx, LE32(cmd->fsnum), path, oldpath, 0) && !make_path(w->ctx, LE32(cmd->fsnum), destpath, newpath, 0))
 		{
 			if(rename(oldpath, newpath) < 0)
 			{
@@ -1772,14 +2750,14 @@ int handle_rename(libusb_device_handle *dev, struct HostFsRenameCmd *cmd, int cm
 			}
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 	}
 	while(0);
 
 	return ret;
 }
 
-int handle_chdir(libusb_device_handle *dev, struct HostFsChdirCmd *cmd, int cmdlen)
+int handle_chdir(struct Worker *w, struct HostFsChdirCmd *cmd, int cmdlen)
 {
 	struct HostFsChdirResp resp;
 	int  ret = -1;
@@ -1805,35 +2783,41 @@ int handle_chdir(libusb_device_handle *dev, struct HostFsChdirCmd *cmd, int cmdl
 			break;
 		}
 
-		/* TODO: Should check that length is within a valid range */
+		if(LE32(cmd->cmd.extralen) > sizeof(path))
+		{
+			fprintf(stderr, "Error, filename too long with mkdir command (%d)\n", LE32(cmd->cmd.extralen));
+			break;
+		}
 
-		ret = euid_usb_bulk_read(dev, 0x81, path, LE32(cmd->cmd.extralen), 10000);
+		ret = trans_read(&w->trans, path, LE32(cmd->cmd.extralen), 10000);
 		if(ret != LE32(cmd->cmd.extralen))
 		{
 			fprintf(stderr, "Error reading chdir data cmd->extralen %d, ret %d\n", LE32(cmd->cmd.extralen), ret);
 			break;
 		}
+		path[sizeof(path) - 1] = 0;
 
 		V_PRINTF(2, "Chdir command name %s\n", path);
 		
 		fsnum = LE32(cmd->fsnum);
 		if((fsnum >= 0) && (fsnum < MAX_HOSTDRIVES))
 		{
-			strcpy(g_drives[fsnum].currdir, path);
+			pthread_mutex_lock(&w->ctx->drivemtx);
+			strcpy(w->ctx->drives[fsnum].currdir, path);
+			invalidate_paths(w->ctx);
+			pthread_mutex_unlock(&w->ctx->drivemtx);
 			resp.res = 0;
 		}
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 	}
 	while(0);
 
 	return ret;
 }
 
-int handle_ioctl(libusb_device_handle *dev, struct HostFsIoctlCmd *cmd, int cmdlen)
+int handle_ioctl(struct Worker *w, struct HostFsIoctlCmd *cmd, int cmdlen)
 {
-	static char inbuf[64*1024];
-	static char outbuf[64*1024];
 	int inlen;
 	struct HostFsIoctlResp resp;
 	int  ret = -1;
@@ -1852,11 +2836,15 @@ int handle_ioctl(libusb_device_handle *dev, struct HostFsIoctlCmd *cmd, int cmdl
 		}
 
 		inlen = LE32(cmd->cmd.extralen);
-		if(inlen > 0)
+		if((inlen < 0) || (inlen > sizeof(w->inbuf)))
 		{
-			/* TODO: Should check that length is within a valid range */
+			fprintf(stderr, "Error, ioctl data too large (%d)\n", inlen);
+			break;
+		}
 
-			ret = euid_usb_bulk_read(dev, 0x81, inbuf, inlen, 10000);
+		if(inlen > 0)
+		{
+			ret = trans_read(&w->trans, w->inbuf, inlen, 10000);
 			if(ret != inlen)
 			{
 				fprintf(stderr, "Error reading ioctl data cmd->extralen %d, ret %d\n", inlen, ret);
@@ -1866,7 +2854,7 @@ int handle_ioctl(libusb_device_handle *dev, struct HostFsIoctlCmd *cmd, int cmdl
 
 		V_PRINTF(2, "Ioctl command fid %d, cmdno %d, inlen %d\n", LE32(cmd->fid), LE32(cmd->cmdno), inlen);
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 		if(ret < 0)
 		{
 			fprintf(stderr, "Error writing ioctl response (%d)\n", ret);
@@ -1875,7 +2863,7 @@ int handle_ioctl(libusb_device_handle *dev, struct HostFsIoctlCmd *cmd, int cmdl
 
 		if(LE32(resp.cmd.extralen) > 0)
 		{
-			ret = euid_usb_bulk_write(dev, 0x2, (char *) outbuf, LE32(resp.cmd.extralen), 10000);
+			ret = trans_write(&w->trans, (char *) w->outbuf, LE32(resp.cmd.extralen), 10000);
 		}
 	}
 	while(0);
@@ -1883,7 +2871,7 @@ int handle_ioctl(libusb_device_handle *dev, struct HostFsIoctlCmd *cmd, int cmdl
 	return ret;
 }
 
-int get_drive_info(struct DevctlGetInfo *info, unsigned int drive)
+int get_drive_info(struct HostFsCtx *ctx, struct DevctlGetInfo *info, unsigned int drive)
 {
 	int ret = -1;
 
@@ -1893,7 +2881,7 @@ int get_drive_info(struct DevctlGetInfo *info, unsigned int drive)
 		return -1;
 	}
 
-	if(pthread_mutex_lock(&g_drivemtx))
+	if(pthread_mutex_lock(&ctx->drivemtx))
 	{
 		fprintf(stderr, "Could not lock mutex (%s)\n", strerror(errno));
 		return -1;
@@ -1901,12 +2889,26 @@ int get_drive_info(struct DevctlGetInfo *info, unsigned int drive)
 
 	do
 	{
+		if(ctx->drives[drive].image)
+		{
+			/* Report the image as a full disc */
+			unsigned int sectors = ctx->drives[drive].image->size / IMFS_SECTOR_SIZE;
+
+			info->btotal = sectors;
+			info->bfree = 0;
+			info->unk = sectors;
+			info->ssize = 512;
+			info->sects = IMFS_SECTOR_SIZE / 512;
+			ret = 0;
+			break;
+		}
+
 #ifdef __CYGWIN__
 		struct statfs st;
 
-		if(statfs(g_drives[drive].rootdir, &st) < 0)
+		if(statfs(ctx->drives[drive].rootdir, &st) < 0)
 		{
-			fprintf(stderr, "Could not stat %s (%s)\n", g_drives[drive].rootdir, strerror(errno));
+			fprintf(stderr, "Could not stat %s (%s)\n", ctx->drives[drive].rootdir, strerror(errno));
 			break;
 		}
 
@@ -1920,9 +2922,9 @@ int get_drive_info(struct DevctlGetInfo *info, unsigned int drive)
 #else
 		struct statvfs st;
 
-		if(statvfs(g_drives[drive].rootdir, &st) < 0)
+		if(statvfs(ctx->drives[drive].rootdir, &st) < 0)
 		{
-			fprintf(stderr, "Could not stat %s (%s)\n", g_drives[drive].rootdir, strerror(errno));
+			fprintf(stderr, "Could not stat %s (%s)\n", ctx->drives[drive].rootdir, strerror(errno));
 			break;
 		}
 
@@ -1937,61 +2939,476 @@ int get_drive_info(struct DevctlGetInfo *info, unsigned int drive)
 	}
 	while(0);
 
-	pthread_mutex_unlock(&g_drivemtx);
+	pthread_mutex_unlock(&ctx->drivemtx);
 
 	return ret;
 }
 
-int handle_devctl(libusb_device_handle *dev, struct HostFsDevctlCmd *cmd, int cmdlen)
+/* Copy between host paths for the PSP, in is a DevctlHostCopy and the two paths */
+int host_copy(struct HostFsCtx *ctx, const char *in, int inlen, struct DevctlHostCopyResult *result)
 {
-	static char inbuf[64*1024];
-	static char outbuf[64*1024];
-	int inlen;
-	struct HostFsDevctlResp resp;
-	int  ret = -1;
-	unsigned int cmdno;
+	const struct DevctlHostCopy *req = (const struct DevctlHostCopy *) in;
+	char srcpath[PATH_MAX];
+	char dstpath[PATH_MAX];
+	struct HcStats stats;
+	const char *src;
+	const char *dst;
+	int left;
+	int ret;
+
+	left = inlen - (int) sizeof(struct DevctlHostCopy);
+	if(left < 4)
+	{
+		fprintf(stderr, "Error, invalid host copy size %d\n", inlen);
+		return GETERROR(EINVAL);
+	}
 
-	memset(&resp, 0, sizeof(resp));
-	resp.cmd.magic = LE32(HOSTFS_MAGIC);
-	resp.cmd.command = LE32(HOSTFS_CMD_DEVCTL);
-	resp.res = LE32(-1);
+	src = in + sizeof(struct DevctlHostCopy);
+	dst = memchr(src, 0, left);
+	if((dst == NULL) || (memchr(dst + 1, 0, left - (dst + 1 - src)) == NULL))
+	{
+		fprintf(stderr, "Error, host copy paths not terminated\n");
+		return GETERROR(EINVAL);
+	}
+	dst++;
 
-	do
+	if((make_path(ctx, LE32(req->srcfs), src, srcpath, 0) < 0) || (make_path(ctx, LE32(req->dstfs), dst, dstpath, 0) < 0))
 	{
-		if(cmdlen != sizeof(struct HostFsDevctlCmd)) 
+		return GETERROR(ENOENT);
+	}
+
+	/* Anything the PSP wrote to the source must be on disk first, and
+	 * anything it wrote to the destination mustn't land on top of the copy */
+	flush_tree(ctx, srcpath, 0);
+	flush_tree(ctx, dstpath, 1);
+	ret = hc_copy(srcpath, dstpath, LE32(req->flags) & HOSTCOPY_RECURSIVE, &stats);
+	/* Open handles on the destination may have read ahead while it was copied */
+	flush_tree(ctx, dstpath, 1);
+	V_PRINTF(1, "Host copy of %" PRIu64 " bytes in %u file(s), %u cloned, returned %d\n", stats.bytes, stats.files, stats.cloned, ret);
+
+	memset(result, 0, sizeof(*result));
+	result->bytes = LE64(stats.bytes);
+	result->files = LE32(stats.files);
+	result->dirs = LE32(stats.dirs);
+	result->cloned = LE32(stats.cloned);
+
+	return ret;
+}
+
+/* Hash a file inside a disc image, takes over the reference to the image */
+int hash_image_file(struct ImageFs *image, const char *path, int type, int64_t ofs, int64_t len, uint8_t *digest, int64_t *hashed)
+{
+	struct HsCtx hs;
+	char *buf;
+	int entry;
+	int ret;
+
+	*hashed = 0;
+	entry = imfs_lookup(image, path);
+	if((entry < 0) || (image->ents[entry].isdir))
+	{
+		imfs_put(image);
+		return GETERROR(ENOENT);
+	}
+
+	ret = hs_init(&hs, type);
+	buf = (char *) malloc(HS_BUFSIZE);
+	if((ret == 0) && (buf == NULL))
+	{
+		ret = GETERROR(ENOMEM);
+	}
+
+	while((ret == 0) && ((len == 0) || (*hashed < len)))
+	{
+		int want = HS_BUFSIZE;
+		int n;
+
+		if((len > 0) && (want > (len - *hashed)))
 		{
-			fprintf(stderr, "Error, invalid devctl command size %d\n", cmdlen);
-			break;
+			want = len - *hashed;
 		}
 
-		inlen = LE32(cmd->cmd.extralen);
-		if(inlen > 0)
+		n = imfs_read(image, entry, buf, want, ofs + *hashed);
+		if(n < 0)
 		{
-			/* TODO: Should check that length is within a valid range */
-
-			ret = euid_usb_bulk_read(dev, 0x81, inbuf, inlen, 10000);
-			if(ret != inlen)
-			{
-				fprintf(stderr, "Error reading devctl data cmd->extralen %d, ret %d\n", inlen, ret);
-				break;
-			}
+			ret = n;
 		}
-
-		cmdno = LE32(cmd->cmdno);
-		V_PRINTF(2, "Devctl command cmdno %d, inlen %d\n", cmdno, inlen);
-
-		switch(cmdno)
+		else if(n == 0)
 		{
-			case DEVCTL_GET_INFO: resp.res = LE32(get_drive_info((struct DevctlGetInfo *) outbuf, LE32(cmd->fsnum)));
-								  if(LE32(resp.res) == 0)
-								  {
+			break;
+		}
+		else
+		{
+			hs_update(&hs, buf, n);
+			*hashed += n;
+		}
+	}
+
+	free(buf);
+	imfs_put(image);
+
+	if(ret < 0)
+	{
+		return ret;
+	}
+
+	return hs_final(&hs, digest);
+}
+
+/* Hash a host file for the PSP, in is a DevctlHostHash and the path */
+int host_hash(struct HostFsCtx *ctx, unsigned int drive, const char *in, int inlen, struct DevctlHostHashResult *result)
+{
+	const struct DevctlHostHash *req = (const struct DevctlHostHash *) in;
+	char fullpath[PATH_MAX];
+	struct ImageFs *image;
+	const char *path;
+	int64_t hashed = 0;
+	int64_t ofs, len;
+	int type;
+	int ret;
+
+	memset(result, 0, sizeof(*result));
+	if((inlen < (int) sizeof(struct DevctlHostHash) + 2) || (in[inlen - 1] != 0))
+	{
+		fprintf(stderr, "Error, invalid host hash size %d\n", inlen);
+		return GETERROR(EINVAL);
+	}
+
+	path = in + sizeof(struct DevctlHostHash);
+	type = LE32(req->type);
+	ofs = LE64(req->ofs);
+	len = LE64(req->len);
+	if((ofs < 0) || (len < 0))
+	{
+		return GETERROR(EINVAL);
+	}
+
+	ret = image_path(ctx, drive, path, fullpath, &image);
+	if(ret > 0)
+	{
+		ret = hash_image_file(image, fullpath, type, ofs, len, result->digest, &hashed);
+	}
+	else if((ret == 0) && (make_path(ctx, drive, path, fullpath, 0) == 0))
+	{
+		/* Anything the PSP wrote must be on disk first */
+		flush_path(ctx, fullpath);
+		ret = hs_file(fullpath, type, ofs, len, result->digest, &hashed);
+	}
+	else
+	{
+		ret = GETERROR(ENOENT);
+	}
+
+	V_PRINTF(1, "Host hash type %d of %s, %" PRId64 " bytes, returned %d\n", type, path, hashed, ret);
+	if(ret < 0)
+	{
+		return ret;
+	}
+
+	result->len = LE64(hashed);
+	result->digestlen = LE32(ret);
+
+	return 0;
+}
+
+/* Walk a host tree for a sync and return a page of it, the walk is kept for the next page */
+int sync_list(struct HostFsCtx *ctx, unsigned int drive, const char *in, int inlen, char *out, int outlen)
+{
+	const struct DevctlSyncList *req = (const struct DevctlSyncList *) in;
+	struct DevctlSyncListResult *res = (struct DevctlSyncListResult *) out;
+	struct HyList *list = &ctx->synclist;
+	char fullpath[PATH_MAX];
+	const char *path;
+	int start;
+	int count = 0;
+	int used;
+	int ret;
+	int i;
+
+	if((inlen < (int) sizeof(struct DevctlSyncList) + 2) || (in[inlen - 1] != 0) || (outlen < (int) sizeof(*res)))
+	{
+		return GETERROR(EINVAL);
+	}
+
+	path = in + sizeof(struct DevctlSyncList);
+	start = LE32(req->start);
+	if((start == 0) || (list->root == NULL) || (list->drive != drive) || (strcmp(list->root, path) != 0))
+	{
+		if(make_path(ctx, drive, path, fullpath, 0) < 0)
+		{
+			return GETERROR(ENOENT);
+		}
+
+		hy_list_free(list);
+		ret = hy_walk(fullpath, list);
+		if(ret < 0)
+		{
+			return ret;
+		}
+		list->drive = drive;
+		list->root = strdup(path);
+		if(list->root == NULL)
+		{
+			hy_list_free(list);
+			return GETERROR(ENOMEM);
+		}
+	}
+
+	used = sizeof(*res);
+	for(i = start; (i >= 0) && (i < list->count); i++)
+	{
+		struct HyEntry *ent = &list->ents[i];
+		struct SyncListEntry *out_ent = (struct SyncListEntry *) (out + used);
+		ScePspDateTime mtime;
+		int namelen;
+
+		namelen = (strlen(ent->name) + 4) & ~3;
+		if((used + (int) sizeof(struct SyncListEntry) + namelen) > outlen)
+		{
+			break;
+		}
+
+		fill_time(ent->mtime, &mtime);
+		memcpy(out_ent->mtime, &mtime, sizeof(out_ent->mtime));
+		out_ent->size = LE64(ent->size);
+		out_ent->namelen = LE16(namelen);
+		out_ent->isdir = LE16(ent->isdir);
+		used += sizeof(struct SyncListEntry);
+		memset(out + used, 0, namelen);
+		strcpy(out + used, ent->name);
+		used += namelen;
+		count++;
+	}
+
+	if((count == 0) && (start < list->count))
+	{
+		/* Not even one entry fits */
+		return GETERROR(EINVAL);
+	}
+
+	res->total = LE32(list->count);
+	res->count = LE32(count);
+
+	return used;
+}
+
+/* Find a sync session, must be called with syncmtx held */
+int find_sync(struct HostFsCtx *ctx, const char *in, int inlen)
+{
+	uint32_t id;
+	int i;
+
+	if(inlen < (int) sizeof(struct DevctlSyncSession))
+	{
+		return -1;
+	}
+
+	id = LE32(((const struct DevctlSyncSession *) in)->session);
+	for(i = 0; i < HY_MAX_SESSIONS; i++)
+	{
+		if((ctx->syncs[i]) && (ctx->syncs[i]->id == id))
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Start the delta of a host file against the PSP's copy, must be called with syncmtx held */
+int sync_begin(struct HostFsCtx *ctx, unsigned int drive, const char *in, int inlen, char *out, int outlen)
+{
+	const struct DevctlSyncBegin *req = (const struct DevctlSyncBegin *) in;
+	struct DevctlSyncBeginResult *res = (struct DevctlSyncBeginResult *) out;
+	char fullpath[PATH_MAX];
+	struct HySession *s;
+	int slot = 0;
+	int i;
+
+	if((inlen < (int) sizeof(struct DevctlSyncBegin) + 2) || (in[inlen - 1] != 0) || (outlen < (int) sizeof(*res)))
+	{
+		return GETERROR(EINVAL);
+	}
+
+	if(make_path(ctx, drive, in + sizeof(struct DevctlSyncBegin), fullpath, 0) < 0)
+	{
+		return GETERROR(ENOENT);
+	}
+
+	flush_path(ctx, fullpath);
+	s = hy_begin(fullpath, LE32(req->blocksize), LE32(req->nblocks), LE64(req->start));
+	if(s == NULL)
+	{
+		return GETERROR(errno);
+	}
+
+	/* A free slot, or the oldest session which was never ended */
+	for(i = 0; i < HY_MAX_SESSIONS; i++)
+	{
+		if(ctx->syncs[i] == NULL)
+		{
+			slot = i;
+			break;
+		}
+
+		if(ctx->syncs[i]->id < ctx->syncs[slot]->id)
+		{
+			slot = i;
+		}
+	}
+	hy_end(ctx->syncs[slot]);
+
+	s->id = ++ctx->syncid;
+	ctx->syncs[slot] = s;
+	V_PRINTF(1, "Sync %u of %s from %" PRId64 ", %d blocks of %d\n", s->id, fullpath, s->pos, s->nblocks, s->blocksize);
+
+	memset(res, 0, sizeof(*res));
+	res->session = LE32(s->id);
+	res->size = LE64(s->size);
+
+	return sizeof(*res);
+}
+
+/* Delta sync for the PSP, returns the length of the output */
+int host_sync(struct HostFsCtx *ctx, unsigned int cmdno, unsigned int drive, const char *in, int inlen, char *out, int outlen)
+{
+	int ret = GETERROR(EINVAL);
+	int slot;
+
+	pthread_mutex_lock(&ctx->syncmtx);
+	if(cmdno == DEVCTL_SYNC_LIST)
+	{
+		ret = sync_list(ctx, drive, in, inlen, out, outlen);
+	}
+	else if(cmdno == DEVCTL_SYNC_BEGIN)
+	{
+		ret = sync_begin(ctx, drive, in, inlen, out, outlen);
+	}
+	else if((slot = find_sync(ctx, in, inlen)) >= 0)
+	{
+		struct HySession *s = ctx->syncs[slot];
+
+		if(cmdno == DEVCTL_SYNC_SIGS)
+		{
+			const struct DevctlSyncSigs *req = (const struct DevctlSyncSigs *) in;
+			int count = LE32(req->count);
+
+			if((inlen >= (int) sizeof(*req)) && (count >= 0) && (count <= ((inlen - (int) sizeof(*req)) / (int) sizeof(struct SyncSig))))
+			{
+				ret = hy_sigs(s, LE32(req->first), in + sizeof(*req), count);
+			}
+		}
+		else if((cmdno == DEVCTL_SYNC_DELTA) && (outlen >= (int) sizeof(struct DevctlSyncDeltaResult) + 4096))
+		{
+			struct DevctlSyncDeltaResult *res = (struct DevctlSyncDeltaResult *) out;
+			int done;
+
+			ret = hy_delta(s, (uint8_t *) (out + sizeof(*res)), outlen - sizeof(*res), &done);
+			if(ret >= 0)
+			{
+				res->len = LE32(ret);
+				res->done = LE32(done);
+				res->pos = LE64(s->lit - ((int64_t) s->copy_count * s->blocksize));
+				ret += sizeof(*res);
+			}
+		}
+		else if(cmdno == DEVCTL_SYNC_END)
+		{
+			hy_end(s);
+			ctx->syncs[slot] = NULL;
+			ret = 0;
+		}
+	}
+	else
+	{
+		ret = GETERROR(EBADF);
+	}
+	pthread_mutex_unlock(&ctx->syncmtx);
+
+	return ret;
+}
+
+int handle_devctl(struct Worker *w, struct HostFsDevctlCmd *cmd, int cmdlen)
+{
+	int inlen;
+	int outlen;
+	struct HostFsDevctlResp resp;
+	int  ret = -1;
+	unsigned int cmdno;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.cmd.magic = LE32(HOSTFS_MAGIC);
+	resp.cmd.command = LE32(HOSTFS_CMD_DEVCTL);
+	resp.res = LE32(-1);
+
+	do
+	{
+		if(cmdlen != sizeof(struct HostFsDevctlCmd)) 
+		{
+			fprintf(stderr, "Error, invalid devctl command size %d\n", cmdlen);
+			break;
+		}
+
+		inlen = LE32(cmd->cmd.extralen);
+		if((inlen < 0) || (inlen > sizeof(w->inbuf)))
+		{
+			fprintf(stderr, "Error, devctl data too large (%d)\n", inlen);
+			break;
+		}
+
+		if(inlen > 0)
+		{
+			ret = trans_read(&w->trans, w->inbuf, inlen, 10000);
+			if(ret != inlen)
+			{
+				fprintf(stderr, "Error reading devctl data cmd->extralen %d, ret %d\n", inlen, ret);
+				break;
+			}
+		}
+
+		cmdno = LE32(cmd->cmdno);
+		V_PRINTF(2, "Devctl command cmdno %d, inlen %d\n", cmdno, inlen);
+
+		switch(cmdno)
+		{
+			case DEVCTL_GET_INFO: resp.res = LE32(get_drive_info(w->ctx, (struct DevctlGetInfo *) w->outbuf, LE32(cmd->fsnum)));
+								  if(LE32(resp.res) == 0)
+								  {
 									  resp.cmd.extralen = LE32(sizeof(struct DevctlGetInfo));
 								  }
 								  break;
+			case DEVCTL_HOST_COPY: resp.res = LE32(host_copy(w->ctx, w->inbuf, inlen, (struct DevctlHostCopyResult *) w->outbuf));
+								   if(LE32(cmd->outlen) >= (int) sizeof(struct DevctlHostCopyResult))
+								   {
+									   resp.cmd.extralen = LE32(sizeof(struct DevctlHostCopyResult));
+								   }
+								   break;
+			case DEVCTL_HOST_HASH: resp.res = LE32(host_hash(w->ctx, LE32(cmd->fsnum), w->inbuf, inlen, (struct DevctlHostHashResult *) w->outbuf));
+								   if((LE32(resp.res) == 0) && (LE32(cmd->outlen) >= (int) sizeof(struct DevctlHostHashResult)))
+								   {
+									   resp.cmd.extralen = LE32(sizeof(struct DevctlHostHashResult));
+								   }
+								   break;
+			case DEVCTL_SYNC_LIST:
+			case DEVCTL_SYNC_BEGIN:
+			case DEVCTL_SYNC_SIGS:
+			case DEVCTL_SYNC_DELTA:
+			case DEVCTL_SYNC_END: outlen = LE32(cmd->outlen);
+								  if(outlen > (int) sizeof(w->outbuf))
+								  {
+									  outlen = sizeof(w->outbuf);
+								  }
+								  ret = host_sync(w->ctx, cmdno, LE32(cmd->fsnum), w->inbuf, inlen, w->outbuf, outlen);
+								  resp.res = LE32(ret < 0 ? ret : 0);
+								  if(ret > 0)
+								  {
+									  resp.cmd.extralen = LE32(ret);
+								  }
+								  break;
 			default: break;
 		};
 
-		ret = euid_usb_bulk_write(dev, 0x2, (char *) &resp, sizeof(resp), 10000);
+		ret = trans_write(&w->trans, (char *) &resp, sizeof(resp), 10000);
 		if(ret < 0)
 		{
 			fprintf(stderr, "Error writing devctl response (%d)\n", ret);
@@ -2000,7 +3417,7 @@ int handle_devctl(libusb_device_handle *dev, struct HostFsDevctlCmd *cmd, int cm
 
 		if(LE32(resp.cmd.extralen) > 0)
 		{
-			ret = euid_usb_bulk_write(dev, 0x2, (char *) outbuf, LE32(resp.cmd.extralen), 10000);
+			ret = trans_write(&w->trans, (char *) w->outbuf, LE32(resp.cmd.extralen), 10000);
 		}
 	}
 	while(0);
@@ -2008,334 +3425,1149 @@ int handle_devctl(libusb_device_handle *dev, struct HostFsDevctlCmd *cmd, int cm
 	return ret;
 }
 
-libusb_device_handle *wait_for_device(void)
+/* Point a drive at a new root, must be called with the mutex protecting it held */
+void set_drive(struct HostDrive *drive, const char *rootdir, struct ImageFs *image)
 {
-	libusb_device **devs;
-	libusb_device_handle *usbdev = NULL;
+	if(image)
+	{
+		imfs_get(image);
+	}
+	imfs_put(drive->image);
+	drive->image = image;
+	strcpy(drive->rootdir, rootdir);
+	strcpy(drive->currdir, "/");
+}
 
-	fprintf(stderr, "waiting for device...\n");
+int ctx_init(struct HostFsCtx *ctx)
+{
+	int i;
+
+	memset(ctx, 0, sizeof(*ctx));
+	pthread_mutex_init(&ctx->drivemtx, NULL);
+	pthread_mutex_init(&ctx->syncmtx, NULL);
 
-	while(!usbdev)
+	for(i = 0; i < MAX_HOSTDRIVES; i++)
 	{
-		ssize_t devcnt = libusb_get_device_list(usbctx, &devs);
+		strcpy(ctx->drives[i].currdir, "/");
+	}
 
-		for (ssize_t i = 0; i < devcnt; i++)
-		{
-			struct libusb_device_descriptor desc;
-			int r = libusb_get_device_descriptor(devs[i], &desc);
-			if (!r) {
-				if (desc.idVendor == SONY_VID && desc.idProduct == g_pid)
-				{
-					printf("Found Sony PSP device (%04x:%04x) at bus: %d device: %d\n",
-						desc.idVendor, desc.idProduct,
-						libusb_get_bus_number(devs[i]), libusb_get_device_address(devs[i]));
-					usbdev = open_device(devs[i]);
-					if (usbdev)
-					{
-						fprintf(stderr, "Connected to device\n");
-						return usbdev;
-					}
-				}
-			}
-		}
+	if(fc_pool_init(&ctx->fcpool, FC_DEF_BLOCKS, g_radepth, g_wbsize, g_fcthreads) < 0)
+	{
+		fprintf(stderr, "File caching disabled\n");
+	}
 
-		libusb_free_device_list(devs, 1);
+	if(dc_init(&ctx->dircache, g_dirsnaps) < 0)
+	{
+		fprintf(stderr, "Directory caching disabled\n");
+	}
 
-		/* Sleep for one second */
-		sleep(1);
+	if(nc_init(&ctx->ncindex, NC_DEF_MAX) < 0)
+	{
+		fprintf(stderr, "Case insensitive name index disabled\n");
 	}
 
-	return NULL;
+	pc_init(&ctx->pathcache, g_pathcache_size);
+
+	if((ht_init(&ctx->files, HT_DEF_SLOTS) < 0) || (ht_init(&ctx->dirs, HT_DEF_SLOTS) < 0))
+	{
+		fprintf(stderr, "Could not allocate handle tables\n");
+		return -1;
+	}
+
+	return 0;
 }
 
-int init_hostfs(void)
+/* Copy the shell's drive mappings, must be called with g_drivemtx held */
+void ctx_load_drives(struct HostFsCtx *ctx)
 {
 	int i;
 
-	memset(open_files, 0, sizeof(open_files));
-	memset(open_dirs, 0, sizeof(open_dirs));
 	for(i = 0; i < MAX_HOSTDRIVES; i++)
 	{
-		strcpy(g_drives[i].currdir, "/");
+		set_drive(&ctx->drives[i], g_drives[i].rootdir, g_drives[i].image);
 	}
-
-	return 0;
 }
 
-void close_hostfs(void)
+/* Free the caches of a context, close_hostfs must have been called */
+void ctx_free(struct HostFsCtx *ctx)
 {
 	int i;
 
-	for(i = 3; i < MAX_FILES; i++)
+	for(i = 0; i < MAX_HOSTDRIVES; i++)
 	{
-		if(open_files[i].opened)
-		{
-			close(i);
-			open_files[i].opened = 0;
-			if(open_files[i].name)
-			{
-				free(open_files[i].name);
-				open_files[i].name = NULL;
-			}
-		}
+		imfs_put(ctx->drives[i].image);
+		ctx->drives[i].image = NULL;
 	}
+	ht_destroy(&ctx->files);
+	ht_destroy(&ctx->dirs);
+	pc_flush(&ctx->pathcache);
+	nc_destroy(&ctx->ncindex);
+	dc_destroy(&ctx->dircache);
+	fc_pool_destroy(&ctx->fcpool);
+	hy_list_free(&ctx->synclist);
+	pthread_mutex_destroy(&ctx->syncmtx);
+	pthread_mutex_destroy(&ctx->drivemtx);
+}
+
+void close_hostfs(struct HostFsCtx *ctx)
+{
+	struct FileHandle *file;
+	int handle;
+	int iter;
 
-	for(i = 0; i < MAX_DIRS; i++)
+	iter = 0;
+	while((file = (struct FileHandle *) ht_next(&ctx->files, &iter, &handle)))
 	{
-		if(open_dirs[i].opened)
+		ht_free(&ctx->files, handle);
+		fc_close(&file->cache);
+		if(file->image)
 		{
-			dir_close(i);
+			imfs_put(file->image);
 		}
+		else
+		{
+			close(file->fd);
+		}
+		free(file->name);
+		free(file);
+	}
+
+	iter = 0;
+	while(ht_next(&ctx->dirs, &iter, &handle))
+	{
+		dir_close(ctx, handle);
+	}
+
+	pthread_mutex_lock(&ctx->syncmtx);
+	for(iter = 0; iter < HY_MAX_SESSIONS; iter++)
+	{
+		hy_end(ctx->syncs[iter]);
+		ctx->syncs[iter] = NULL;
 	}
+	pthread_mutex_unlock(&ctx->syncmtx);
 }
 
-void do_hostfs(struct HostFsCmd *cmd, int readlen)
+void do_hostfs(struct Worker *w, struct HostFsCmd *cmd, int readlen)
 {
+	struct CsCounter *counter = cs_command(&g_cmdstats, LE32(cmd->command));
+	uint64_t start = get_time_ns();
+	uint64_t rd = w->trans.rd_bytes;
+	uint64_t wr = w->trans.wr_bytes;
+	int ret = 0;
+
 	V_PRINTF(2, "Magic: %08X\n", LE32(cmd->magic));
 	V_PRINTF(2, "Command Num: %08X\n", LE32(cmd->command));
 	V_PRINTF(2, "Extra Len: %d\n", LE32(cmd->extralen));
 
 	switch(LE32(cmd->command))
 	{
-		case HOSTFS_CMD_HELLO: if(handle_hello(usbhdr) < 0)
+		case HOSTFS_CMD_HELLO: if((ret = handle_hello(w, (struct HostFsHelloCmd *) cmd, readlen)) < 0)
 							   {
 								   fprintf(stderr, "Error sending hello response\n");
 							   }
 							   break;
-		case HOSTFS_CMD_OPEN:  if(handle_open(usbhdr, (struct HostFsOpenCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_OPEN:  if((ret = handle_open(w, (struct HostFsOpenCmd *) cmd, readlen)) < 0)
 							   {
 								   fprintf(stderr, "Error in open command\n");
 							   }
 							   break;
-		case HOSTFS_CMD_CLOSE: if(handle_close(usbhdr, (struct HostFsCloseCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_CLOSE: if((ret = handle_close(w, (struct HostFsCloseCmd *) cmd, readlen)) < 0)
 							   {
 								   fprintf(stderr, "Error in close command\n");
 							   }
 							   break;
-		case HOSTFS_CMD_WRITE: if(handle_write(usbhdr, (struct HostFsWriteCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_WRITE: if((ret = handle_write(w, (struct HostFsWriteCmd *) cmd, readlen)) < 0)
 							   {
 								   fprintf(stderr, "Error in write command\n");
 							   }
 							   break;
-		case HOSTFS_CMD_READ:  if(handle_read(usbhdr, (struct HostFsReadCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_READ:  if((ret = handle_read(w, (struct HostFsReadCmd *) cmd, readlen)) < 0)
 							   {
 								   fprintf(stderr, "Error in read command\n");
 							   }
 							   break;
-		case HOSTFS_CMD_LSEEK: if(handle_lseek(usbhdr, (struct HostFsLseekCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_LSEEK: if((ret = handle_lseek(w, (struct HostFsLseekCmd *) cmd, readlen)) < 0)
 							   {
 								   fprintf(stderr, "Error in lseek command\n");
 							   }
 							   break;
-		case HOSTFS_CMD_DOPEN: if(handle_dopen(usbhdr, (struct HostFsDopenCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_DOPEN: if((ret = handle_dopen(w, (struct HostFsDopenCmd *) cmd, readlen)) < 0)
 							   {
 								   fprintf(stderr, "Error in dopen command\n");
 							   }
 							   break;
-		case HOSTFS_CMD_DCLOSE: if(handle_dclose(usbhdr, (struct HostFsDcloseCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_DCLOSE: if((ret = handle_dclose(w, (struct HostFsDcloseCmd *) cmd, readlen)) < 0)
 								{
 									fprintf(stderr, "Error in dclose command\n");
 								}
 								break;
-		case HOSTFS_CMD_DREAD: if(handle_dread(usbhdr, (struct HostFsDreadCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_DREAD: if((ret = handle_dread(w, (struct HostFsDreadCmd *) cmd, readlen)) < 0)
 							   {
 									fprintf(stderr, "Error in dread command\n");
 							   }
 							   break;
-		case HOSTFS_CMD_REMOVE: if(handle_remove(usbhdr, (struct HostFsRemoveCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_REMOVE: if((ret = handle_remove(w, (struct HostFsRemoveCmd *) cmd, readlen)) < 0)
 								{
 									fprintf(stderr, "Error in remove command\n");
 								}
 								break;
-		case HOSTFS_CMD_RMDIR: if(handle_rmdir(usbhdr, (struct HostFsRmdirCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_RMDIR: if((ret = handle_rmdir(w, (struct HostFsRmdirCmd *) cmd, readlen)) < 0)
 								{
 									fprintf(stderr, "Error in rmdir command\n");
 								}
 								break;
-		case HOSTFS_CMD_MKDIR: if(handle_mkdir(usbhdr, (struct HostFsMkdirCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_MKDIR: if((ret = handle_mkdir(w, (struct HostFsMkdirCmd *) cmd, readlen)) < 0)
 								{
 									fprintf(stderr, "Error in mkdir command\n");
 								}
 								break;
-		case HOSTFS_CMD_CHDIR: if(handle_chdir(usbhdr, (struct HostFsChdirCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_CHDIR: if((ret = handle_chdir(w, (struct HostFsChdirCmd *) cmd, readlen)) < 0)
 								{
 									fprintf(stderr, "Error in chdir command\n");
 								}
 								break;
-		case HOSTFS_CMD_RENAME: if(handle_rename(usbhdr, (struct HostFsRenameCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_RENAME: if((ret = handle_rename(w, (struct HostFsRenameCmd *) cmd, readlen)) < 0)
 								{
 									fprintf(stderr, "Error in rename command\n");
 								}
 								break;
-		case HOSTFS_CMD_GETSTAT:if(handle_getstat(usbhdr, (struct HostFsGetstatCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_GETSTAT:if((ret = handle_getstat(w, (struct HostFsGetstatCmd *) cmd, readlen)) < 0)
 								{
 									fprintf(stderr, "Error in getstat command\n");
 								}
 								break;
-		case HOSTFS_CMD_CHSTAT: if(handle_chstat(usbhdr, (struct HostFsChstatCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_CHSTAT: if((ret = handle_chstat(w, (struct HostFsChstatCmd *) cmd, readlen)) < 0)
 								{
 									fprintf(stderr, "Error in chstat command\n");
 								}
 								break;
-		case HOSTFS_CMD_IOCTL: if(handle_ioctl(usbhdr, (struct HostFsIoctlCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_IOCTL: if((ret = handle_ioctl(w, (struct HostFsIoctlCmd *) cmd, readlen)) < 0)
 							   {
 								   fprintf(stderr, "Error in ioctl command\n");
 							   }
 							   break;
-		case HOSTFS_CMD_DEVCTL: if(handle_devctl(usbhdr, (struct HostFsDevctlCmd *) cmd, readlen) < 0)
+		case HOSTFS_CMD_DEVCTL: if((ret = handle_devctl(w, (struct HostFsDevctlCmd *) cmd, readlen)) < 0)
 							   {
 								   fprintf(stderr, "Error in devctl command\n");
 							   }
 							   break;
+		case HOSTFS_CMD_DREADBULK: if((ret = handle_dreadbulk(w, (struct HostFsDreadBulkCmd *) cmd, readlen)) < 0)
+							   {
+								   fprintf(stderr, "Error in dreadbulk command\n");
+							   }
+							   break;
+		case HOSTFS_CMD_READSTREAM: if((ret = handle_readstream(w, (struct HostFsReadStreamCmd *) cmd, readlen)) < 0)
+							   {
+								   fprintf(stderr, "Error in readstream command\n");
+							   }
+							   break;
+		case HOSTFS_CMD_READFILE: if((ret = handle_readfile(w, (struct HostFsReadFileCmd *) cmd, readlen)) < 0)
+							   {
+								   fprintf(stderr, "Error in readfile command\n");
+							   }
+							   break;
 		default: fprintf(stderr, "Error, unknown command %08X\n", cmd->command);
+							 ret = -1;
 							 break;
 	};
+
+	cs_record(counter, get_time_ns() - start, readlen + (w->trans.rd_bytes - rd), w->trans.wr_bytes - wr, ret < 0);
 }
 
 
-void do_async(struct AsyncCommand *cmd, int readlen)
+int make_socket(unsigned short port)
+{
+	int sock;
+	int on = 1;
+	struct sockaddr_in name;
+
+	sock = socket(PF_INET, SOCK_STREAM, 0);
+	if(sock < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&name, 0, sizeof(name));
+	name.sin_family = AF_INET;
+	name.sin_port = htons(port);
+	if(g_globalbind)
+	{
+		name.sin_addr.s_addr = htonl(INADDR_ANY);
+	}
+	else
+	{
+		name.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+
+	if(bind(sock, (struct sockaddr *) &name, sizeof(name)) < 0)
+	{
+		perror("bind");
+		close(sock);
+		return -1;
+	}
+
+	if(listen(sock, 1) < 0)
+	{
+		perror("listen");
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+void do_async(struct Worker *w, struct AsyncCommand *cmd, int readlen)
+{
+	uint64_t start = get_time_ns();
+	uint8_t *data;
+
+	V_PRINTF(2, "Async Magic: %08X\n", LE32(cmd->magic));
+	V_PRINTF(2, "Async Channel: %08X\n", LE32(cmd->channel));
+	V_PRINTF(2, "Async Extra Len: %d\n", readlen - (int)sizeof(struct AsyncCommand));
+
+	if(readlen > sizeof(struct AsyncCommand))
+	{
+		data = (uint8_t *) cmd + sizeof(struct AsyncCommand);
+		unsigned int chan = LE32(cmd->channel);
+		if(am_write(&g_mux, w->slot, chan, data, readlen - sizeof(struct AsyncCommand)) > 0)
+		{
+			if((chan == ASYNC_GDB) && (g_gdbdebug))
+			{
+				print_gdbdebug(0, data, readlen - sizeof(struct AsyncCommand));
+			}
+		}
+
+		if(chan < MAX_ASYNC_CHANNELS)
+		{
+			cs_record(&g_cmdstats.async[chan], get_time_ns() - start, readlen, 0, 0);
+		}
+	}
+}
+
+void do_bulk(struct Worker *w, struct BulkCommand *cmd, int readlen)
+{
+	uint64_t start = get_time_ns();
+	int  read = 0;
+	int  len = 0;
+	unsigned int chan = 0;
+	int  ret = -1;
+
+	chan = LE32(cmd->channel);
+	len = LE32(cmd->size);
+
+	V_PRINTF(2, "Bulk write command length: %d channel %d\n", len, chan);
+
+	if((len < 0) || (len > HOSTFS_BULK_MAXWRITE))
+	{
+		fprintf(stderr, "Error bulk write length invalid (%d)\n", len);
+		return;
+	}
+
+	while(read < len)
+	{
+		int readsize;
+
+		readsize = (len - read) > HOSTFS_MAX_BLOCK ? HOSTFS_MAX_BLOCK : (len - read);
+		ret = trans_read(&w->trans, &w->bulk[read], readsize, 10000);
+		if(ret != readsize)
+		{
+			fprintf(stderr, "Error reading write data readsize %d, ret %d\n", readsize, ret);
+			break;
+		}
+		read += readsize;
+	}
+
+	if(read >= len)
+	{
+		am_write(&g_mux, w->slot, chan, w->bulk, len);
+	}
+
+	if(chan < MAX_ASYNC_CHANNELS)
+	{
+		cs_record(&g_cmdstats.bulk[chan], get_time_ns() - start, readlen + read, 0, read < len);
+	}
+}
+
+/* Commands on a handle have to run in order, so they are keyed by it */
+int tag_key(struct HostFsCmd *cmd, int cmdlen)
+{
+	int32_t handle;
+
+	if(cmdlen < sizeof(struct HostFsCmd) + sizeof(int32_t))
+	{
+		return -1;
+	}
+
+	/* The handle always comes straight after the header */
+	handle = LE32(*((int32_t *) (cmd + 1)));
+
+	switch(LE32(cmd->command))
+	{
+		case HOSTFS_CMD_CLOSE:
+		case HOSTFS_CMD_READ:
+		case HOSTFS_CMD_READSTREAM:
+		case HOSTFS_CMD_WRITE:
+		case HOSTFS_CMD_LSEEK:
+		case HOSTFS_CMD_IOCTL: return (handle & 0x3FFFFFFF) << 1;
+		case HOSTFS_CMD_DREAD:
+		case HOSTFS_CMD_DREADBULK:
+		case HOSTFS_CMD_DCLOSE: return ((handle & 0x3FFFFFFF) << 1) | 1;
+		default: break;
+	};
+
+	return -1;
+}
+
+/* Read a tagged command and its data and queue it for the lanes */
+int do_tagged(struct Worker *w, uint32_t *data, int readlen)
+{
+	struct HostFsCmd *cmd = (struct HostFsCmd *) (data + 2);
+	int cmdlen = readlen - sizeof(struct HostFsTag);
+	struct RpReq *req;
+	int extralen;
+
+	if((w->pool == NULL) || (!(w->caps.caps & HOSTFS_CAP_TAGGED)))
+	{
+		fprintf(stderr, "Error, tagged command but tags were not agreed\n");
+		return -1;
+	}
+
+	if((cmdlen < (int) sizeof(struct HostFsCmd)) || (LE32(cmd->magic) != HOSTFS_MAGIC))
+	{
+		fprintf(stderr, "Error, invalid tagged command (%d bytes)\n", readlen);
+		return -1;
+	}
+
+	/* These change the state of the whole connection */
+	if((LE32(cmd->command) == HOSTFS_CMD_HELLO) || (LE32(cmd->command) == HOSTFS_CMD_BYE))
+	{
+		fprintf(stderr, "Error, command %08X cannot be tagged\n", LE32(cmd->command));
+		return -1;
+	}
+
+	/* Nothing sends more than a block with a command */
+	extralen = LE32(cmd->extralen);
+	if((extralen < 0) || (extralen > HOSTFS_MAX_BLOCK))
+	{
+		fprintf(stderr, "Error, tagged command data too large (%d)\n", extralen);
+		return -1;
+	}
+
+	req = rp_alloc(extralen);
+	if(req == NULL)
+	{
+		fprintf(stderr, "Could not allocate memory for tagged command\n");
+		return -1;
+	}
+
+	req->tag = data[1];
+	req->cmdlen = cmdlen;
+	memcpy(req->cmd, cmd, cmdlen);
+
+	if((extralen > 0) && (trans_read(&w->trans, req->extra, extralen, 10000) != extralen))
+	{
+		fprintf(stderr, "Error reading tagged command data\n");
+		free(req);
+		return -1;
+	}
+
+	rp_submit(w->pool, req, tag_key(cmd, cmdlen));
+
+	return 0;
+}
+
+void set_offline(struct Worker *w)
+{
+	pthread_mutex_lock(&g_workermtx);
+	if(w->online)
+	{
+		g_slots[w->slot].gone_time = get_time_ns();
+	}
+	w->online = 0;
+	pthread_mutex_unlock(&g_workermtx);
+}
+
+void set_ready(struct Worker *w)
+{
+	struct WorkerSlot *slot = &g_slots[w->slot];
+	uint64_t now = get_time_ns();
+	uint64_t ready;
+
+	pthread_mutex_lock(&g_workermtx);
+	ready = now - w->found_time;
+	g_connstats.connects++;
+	g_connstats.ready_ns += ready;
+	if(ready > g_connstats.ready_max)
+	{
+		g_connstats.ready_max = ready;
+	}
+
+	if(slot->gone_time)
+	{
+		uint64_t gap = now - slot->gone_time;
+
+		g_connstats.reconnects++;
+		g_connstats.gap_ns += gap;
+		if(gap > g_connstats.gap_max)
+		{
+			g_connstats.gap_max = gap;
+		}
+		V_PRINTF(1, "Device %d back %.1fms after it went away\n", w->slot, gap / 1e6);
+		slot->gone_time = 0;
+	}
+	pthread_mutex_unlock(&g_workermtx);
+}
+
+void *worker_thread(void *arg)
+{
+	struct Worker *w = (struct Worker *) arg;
+	uint32_t data[512/sizeof(uint32_t)];
+	uint32_t magic;
+	int readlen;
+
+	magic = LE32(HOSTFS_MAGIC);
+
+	if((trans_start(&w->trans) == 0)
+		&& (trans_write(&w->trans, (char *) &magic, sizeof(magic), 1000) == sizeof(magic))
+		&& (trans_flush(&w->trans) == 0))
+	{
+		set_ready(w);
+
+		if(g_tracefile)
+		{
+			w->trans.trace = &g_trace;
+			w->trans.trace_slot = w->slot;
+			trace_record(&g_trace, TRACE_CONNECT, w->slot, w->trans.desc, strlen(w->trans.desc), 1);
+		}
+
+		while(1)
+		{
+			readlen = trans_read_cmd(&w->trans, data, 512);
+			if(readlen == 0)
+			{
+				fprintf(stderr, "Read cancelled (remote disconnected)\n");
+				break;
+			}
+			else if(readlen == TRANS_ERROR_TIMEOUT)
+			{
+				continue;
+			}
+			else if(readlen < 0)
+			{
+				break;
+			}
+
+			if(readlen < sizeof(uint32_t))
+			{
+				fprintf(stderr, "Error could not read magic\n");
+				break;
+			}
+
+			if(LE32(data[0]) == HOSTFS_MAGIC)
+			{
+				if(readlen < sizeof(struct HostFsCmd))
+				{
+					fprintf(stderr, "Error reading command header %d\n", readlen);
+					break;
+				}
+
+				/* Write data is only kept if asked for, everything else is needed to replay */
+				w->trans.trace_keep = (g_tracepayloads) || (LE32(data[1]) != HOSTFS_CMD_WRITE);
+				w->trans.trace_reply = 1;
+
+				/* Untagged commands see everything sent before them finished */
+				if(w->pool)
+				{
+					rp_drain(w->pool);
+				}
+				do_hostfs(w, (struct HostFsCmd *) data, readlen);
+			}
+			else if(LE32(data[0]) == HOSTFS_TAG_MAGIC)
+			{
+				if(do_tagged(w, data, readlen) < 0)
+				{
+					break;
+				}
+			}
+			else if(LE32(data[0]) == ASYNC_MAGIC)
+			{
+				if(readlen < sizeof(struct AsyncCommand))
+				{
+					fprintf(stderr, "Error reading async header %d\n", readlen);
+					break;
+				}
+
+				do_async(w, (struct AsyncCommand *) data, readlen);
+			}
+			else if(LE32(data[0]) == BULK_MAGIC)
+			{
+				if(readlen < sizeof(struct BulkCommand))
+				{
+					fprintf(stderr, "Error reading bulk header %d\n", readlen);
+					break;
+				}
+
+				w->trans.trace_keep = g_tracepayloads;
+				do_bulk(w, (struct BulkCommand *) data, readlen);
+			}
+			else
+			{
+				fprintf(stderr, "Error, invalid magic %08X\n", LE32(data[0]));
+			}
+		}
+
+	}
+
+	if(w->trans.trace)
+	{
+		trace_record(w->trans.trace, TRACE_DISCONNECT, w->slot, NULL, 0, 0);
+	}
+
+	stop_lanes(w);
+
+	/* Stop the async thread writing before the transfers go away */
+	set_offline(w);
+	trans_stop(&w->trans);
+	trans_close(&w->trans);
+	close_hostfs(w->ctx);
+
+	fprintf(stderr, "Disconnected from device %d\n", w->slot);
+	w->done = 1;
+
+	return NULL;
+}
+
+/* Create the async sockets of a slot if it doesn't have them yet */
+void open_slot(int num)
+{
+	int port;
+	int sock;
+	int i;
+
+	if(am_listening(&g_mux, num))
+	{
+		return;
+	}
+
+	for(i = 0; i < MAX_ASYNC_CHANNELS; i++)
+	{
+		port = g_baseport + (num * MAX_ASYNC_CHANNELS) + i;
+		if(port <= 65535)
+		{
+			sock = make_socket(port);
+			if(sock >= 0)
+			{
+				am_listen(&g_mux, num, i, sock);
+			}
+		}
+	}
+}
+
+/* Find a slot for a device, prefer the one last used on the same USB port.
+ * Must be called with g_workermtx held */
+int find_slot(uint8_t bus, const uint8_t *ports, int nports)
+{
+	int fallback = -1;
+	int unused = -1;
+	int i;
+
+	for(i = 0; i < MAX_WORKERS; i++)
+	{
+		struct WorkerSlot *slot = &g_slots[i];
+
+		if(slot->w)
+		{
+			continue;
+		}
+
+		if(slot->used)
+		{
+			if((slot->bus == bus) && (slot->nports == nports) && (memcmp(slot->ports, ports, nports) == 0))
+			{
+				return i;
+			}
+
+			if(fallback < 0)
+			{
+				fallback = i;
+			}
+		}
+		else if(unused < 0)
+		{
+			unused = i;
+		}
+	}
+
+	return unused >= 0 ? unused : fallback;
+}
+
+int is_served(uint8_t bus, uint8_t addr)
+{
+	int ret = 0;
+	int i;
+
+	pthread_mutex_lock(&g_workermtx);
+	for(i = 0; i < MAX_WORKERS; i++)
+	{
+		struct Worker *w = g_slots[i].w;
+
+		if((w) && (w->bus == bus) && (w->addr == addr))
+		{
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_workermtx);
+
+	return ret;
+}
+
+void free_worker(struct Worker *w)
+{
+	if(w->ctx)
+	{
+		ctx_free(w->ctx);
+		free(w->ctx);
+	}
+	free(w);
+}
+
+/* Finish off the worker of a slot, it must have gone offline */
+void reap_slot(int num)
+{
+	struct Worker *w = g_slots[num].w;
+
+	pthread_join(w->thid, NULL);
+	pthread_mutex_lock(&g_workermtx);
+	g_slots[num].w = NULL;
+	pthread_mutex_unlock(&g_workermtx);
+	free_worker(w);
+}
+
+/* A PSP which resets can turn up again before its old worker has finished,
+ * wait for it so the device gets its old slot back */
+void reap_same_port(uint8_t bus, const uint8_t *ports, int nports)
+{
+	int found = -1;
+	int i;
+
+	pthread_mutex_lock(&g_workermtx);
+	for(i = 0; i < MAX_WORKERS; i++)
+	{
+		struct WorkerSlot *slot = &g_slots[i];
+
+		if((slot->w) && (!slot->w->online) && (slot->bus == bus) && (slot->nports == nports)
+				&& (memcmp(slot->ports, ports, nports) == 0))
+		{
+			found = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_workermtx);
+
+	if(found >= 0)
+	{
+		reap_slot(found);
+	}
+}
+
+/* Serve a PSP on an already set up transport, the worker is freed on failure */
+int start_worker(struct Worker *w, const uint8_t *ports, int nports)
+{
+	int num;
+
+	pthread_mutex_lock(&g_startmtx);
+	reap_same_port(w->bus, ports, nports);
+
+	pthread_mutex_lock(&g_workermtx);
+	num = find_slot(w->bus, ports, nports);
+	pthread_mutex_unlock(&g_workermtx);
+
+	if(num < 0)
+	{
+		pthread_mutex_unlock(&g_startmtx);
+		fprintf(stderr, "Already serving %d devices, ignoring this one\n", MAX_WORKERS);
+		trans_close(&w->trans);
+		free(w);
+		return -1;
+	}
+
+	w->slot = num;
+
+	w->ctx = (struct HostFsCtx *) malloc(sizeof(struct HostFsCtx));
+	if((w->ctx == NULL) || (ctx_init(w->ctx) < 0))
+	{
+		pthread_mutex_unlock(&g_startmtx);
+		trans_close(&w->trans);
+		free_worker(w);
+		return -1;
+	}
+
+	open_slot(num);
+
+	/* Publish with g_drivemtx held so a mount from the shell can't be missed */
+	pthread_mutex_lock(&g_drivemtx);
+	ctx_load_drives(w->ctx);
+	pthread_mutex_lock(&g_workermtx);
+	w->online = 1;
+	g_slots[num].w = w;
+	g_slots[num].used = 1;
+	g_slots[num].bus = w->bus;
+	g_slots[num].nports = nports;
+	memcpy(g_slots[num].ports, ports, nports);
+	pthread_mutex_unlock(&g_workermtx);
+	pthread_mutex_unlock(&g_drivemtx);
+
+	if(pthread_create(&w->thid, NULL, worker_thread, w))
+	{
+		fprintf(stderr, "Could not create device thread\n");
+		pthread_mutex_lock(&g_workermtx);
+		g_slots[num].w = NULL;
+		pthread_mutex_unlock(&g_workermtx);
+		pthread_mutex_unlock(&g_startmtx);
+		trans_close(&w->trans);
+		close_hostfs(w->ctx);
+		free_worker(w);
+		return -1;
+	}
+	pthread_mutex_unlock(&g_startmtx);
+
+	fprintf(stderr, "Connected to device %d (%s), async ports %d-%d\n", num, w->trans.desc,
+			g_baseport + (num * MAX_ASYNC_CHANNELS), g_baseport + (num * MAX_ASYNC_CHANNELS) + MAX_ASYNC_CHANNELS - 1);
+
+	return 0;
+}
+
+struct Worker *alloc_worker(uint64_t found_time)
+{
+	struct Worker *w;
+
+	w = (struct Worker *) malloc(sizeof(struct Worker));
+	if(w == NULL)
+	{
+		fprintf(stderr, "Could not allocate memory for device\n");
+		return NULL;
+	}
+
+	memset(w, 0, sizeof(*w));
+	w->found_time = found_time;
+
+	return w;
+}
+
+int start_usb_worker(libusb_device *usbdev, uint64_t found_time)
 {
-	uint8_t *data;
+	uint8_t ports[MAX_PORT_DEPTH];
+	libusb_device_handle *dev;
+	struct Worker *w;
+	int nports;
 
-	V_PRINTF(2, "Async Magic: %08X\n", LE32(cmd->magic));
-	V_PRINTF(2, "Async Channel: %08X\n", LE32(cmd->channel));
-	V_PRINTF(2, "Async Extra Len: %d\n", readlen - (int)sizeof(struct AsyncCommand));
+	nports = libusb_get_port_numbers(usbdev, ports, MAX_PORT_DEPTH);
+	if(nports < 0)
+	{
+		nports = 0;
+	}
 
-	if(readlen > sizeof(struct AsyncCommand))
+	w = alloc_worker(found_time);
+	if(w == NULL)
 	{
-		data = (uint8_t *) cmd + sizeof(struct AsyncCommand);
-		unsigned int chan = LE32(cmd->channel);
-		if((chan < MAX_ASYNC_CHANNELS) && (g_clientsocks[chan] >= 0))
+		return -1;
+	}
+
+	w->bus = libusb_get_bus_number(usbdev);
+	w->addr = libusb_get_device_address(usbdev);
+
+	dev = open_device(usbdev);
+	if(dev == NULL)
+	{
+		free(w);
+		return -1;
+	}
+
+	trans_init_usb(&w->trans, usbctx, dev, g_xferdepth, g_timeout);
+
+	return start_worker(w, ports, nports);
+}
+
+/* Clean up after workers whose device has gone, returns the number reaped */
+int reap_workers(int *running)
+{
+	int reaped = 0;
+	int i;
+
+	*running = 0;
+	pthread_mutex_lock(&g_startmtx);
+	for(i = 0; i < MAX_WORKERS; i++)
+	{
+		struct Worker *w = g_slots[i].w;
+
+		if(w == NULL)
 		{
-			write(g_clientsocks[chan], data, readlen - sizeof(struct AsyncCommand));
-			if((chan == ASYNC_GDB) && (g_gdbdebug))
-			{
-				print_gdbdebug(0, data, readlen - sizeof(struct AsyncCommand));
-			}
+			continue;
+		}
+
+		if(!w->done)
+		{
+			(*running)++;
+			continue;
 		}
+
+		reap_slot(i);
+		reaped++;
 	}
+	pthread_mutex_unlock(&g_startmtx);
+
+	return reaped;
 }
 
-void do_bulk(struct BulkCommand *cmd, int readlen)
+/* Start serving a device if it isn't already, returns 1 if started, 0 if
+ * there was nothing to do and < 0 on error */
+int serve_device(libusb_device *dev, uint64_t found_time)
 {
-	static char block[HOSTFS_BULK_MAXWRITE];
-	int  read = 0;
-	int  len = 0;
-	unsigned int chan = 0;
-	int  ret = -1;
+	struct libusb_device_descriptor desc;
+	uint8_t bus;
+	uint8_t addr;
 
-	chan = LE32(cmd->channel);
-	len = LE32(cmd->size);
+	if(libusb_get_device_descriptor(dev, &desc))
+	{
+		return 0;
+	}
 
-	V_PRINTF(2, "Bulk write command length: %d channel %d\n", len, chan);
+	if((desc.idVendor != SONY_VID) || (desc.idProduct != g_pid))
+	{
+		return 0;
+	}
 
-	while(read < len)
+	bus = libusb_get_bus_number(dev);
+	addr = libusb_get_device_address(dev);
+	if(is_served(bus, addr))
 	{
-		int readsize;
+		return 0;
+	}
 
-		readsize = (len - read) > HOSTFS_MAX_BLOCK ? HOSTFS_MAX_BLOCK : (len - read);
-		ret = euid_usb_bulk_read(usbhdr, 0x81, &block[read], readsize, 10000);
-		if(ret != readsize)
+	printf("Found Sony PSP device (%04x:%04x) at bus: %d device: %d\n",
+		desc.idVendor, desc.idProduct, bus, addr);
+
+	return start_usb_worker(dev, found_time) == 0 ? 1 : -1;
+}
+
+/* Start a worker for each new device, returns the number started */
+int scan_devices(int *failed)
+{
+	libusb_device **devs;
+	ssize_t devcnt;
+	ssize_t i;
+	uint64_t now = get_time_ns();
+	int count = 0;
+
+	pthread_mutex_lock(&g_workermtx);
+	g_connstats.scans++;
+	pthread_mutex_unlock(&g_workermtx);
+
+	devcnt = libusb_get_device_list(usbctx, &devs);
+	for(i = 0; i < devcnt; i++)
+	{
+		int ret = serve_device(devs[i], now);
+
+		if(ret > 0)
 		{
-			fprintf(stderr, "Error reading write data readsize %d, ret %d\n", readsize, ret);
-			break;
+			count++;
+		}
+		else if(ret < 0)
+		{
+			*failed = 1;
 		}
-		read += readsize;
 	}
 
-	if(read >= len)
+	if(devcnt >= 0)
+	{
+		libusb_free_device_list(devs, 1);
+	}
+
+	return count;
+}
+
+#ifdef HAVE_HOTPLUG
+int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *arg)
+{
+	/* Runs inside libusb event handling, possibly on a worker thread, so
+	 * only queue the device for the main thread */
+	pthread_mutex_lock(&g_hotplugmtx);
+	if(g_narrivals < MAX_ARRIVALS)
+	{
+		g_arrivals[g_narrivals] = libusb_ref_device(dev);
+		g_arrival_times[g_narrivals] = get_time_ns();
+		g_narrivals++;
+	}
+	else
+	{
+		g_hotplug_lost = 1;
+	}
+	g_hotplug_event = 1;
+	pthread_mutex_unlock(&g_hotplugmtx);
+
+	return 0;
+}
+#endif
+
+int init_hotplug(void)
+{
+#ifdef HAVE_HOTPLUG
+	libusb_hotplug_callback_handle handle;
+
+	if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{
+		V_PRINTF(1, "No hotplug support, polling for devices\n");
+		return 0;
+	}
+
+	if(libusb_hotplug_register_callback(usbctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0, SONY_VID, g_pid,
+				LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &handle) != LIBUSB_SUCCESS)
+	{
+		fprintf(stderr, "Could not register for hotplug events, polling for devices\n");
+		return 0;
+	}
+
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Serve the devices the hotplug callback queued, returns the number started */
+int serve_arrivals(int *failed)
+{
+	libusb_device *devs[MAX_ARRIVALS];
+	uint64_t times[MAX_ARRIVALS];
+	int count;
+	int started = 0;
+	int i;
+
+	pthread_mutex_lock(&g_hotplugmtx);
+	count = g_narrivals;
+	memcpy(devs, g_arrivals, count * sizeof(libusb_device *));
+	memcpy(times, g_arrival_times, count * sizeof(uint64_t));
+	g_narrivals = 0;
+	g_hotplug_event = 0;
+	if(g_hotplug_lost)
+	{
+		*failed = 1;
+		g_hotplug_lost = 0;
+	}
+	pthread_mutex_unlock(&g_hotplugmtx);
+
+	pthread_mutex_lock(&g_workermtx);
+	g_connstats.arrivals += count;
+	pthread_mutex_unlock(&g_workermtx);
+
+	for(i = 0; i < count; i++)
 	{
-		if((chan < MAX_ASYNC_CHANNELS) && (g_clientsocks[chan] >= 0))
+		int ret = serve_device(devs[i], times[i]);
+
+		if(ret > 0)
 		{
-			fixed_write(g_clientsocks[chan], block, len);
+			started++;
 		}
+		else if(ret < 0)
+		{
+			*failed = 1;
+		}
+		libusb_unref_device(devs[i]);
 	}
+
+	return started;
 }
 
-int start_hostfs(void)
+/* Accept PSPs (or anything else speaking the protocol) on a stream socket */
+void *listen_thread(void *arg)
 {
-	uint32_t data[512/sizeof(uint32_t)];
-	int readlen;
+	int lfd = *(int *) arg;
+	uint8_t noports[1];
 
 	while(1)
 	{
-		init_hostfs();
+		struct Worker *w;
 
-		usbhdr = wait_for_device();
+		w = alloc_worker(0);
+		if(w == NULL)
+		{
+			sleep(1);
+			continue;
+		}
 
-		if(usbhdr)
+		if(trans_accept(lfd, &w->trans, g_timeout) < 0)
 		{
-			uint32_t magic;
+			fprintf(stderr, "Error accepting connection (%s)\n", strerror(errno));
+			free(w);
+			sleep(1);
+			continue;
+		}
+
+		printf("Accepted PSP connection from %s\n", w->trans.desc);
+		w->found_time = get_time_ns();
+		start_worker(w, noports, 0);
+	}
 
-			magic = LE32(HOSTFS_MAGIC);
+	return NULL;
+}
 
-			if(euid_usb_bulk_write(usbhdr, 0x2, (char *) &magic, sizeof(magic), 1000) == sizeof(magic))
-			{
-				while(1)
-				{
-					readlen = euid_usb_bulk_read(usbhdr, 0x81, (char*) data, 512, g_timeout);
-					if(readlen == 0)
-					{
-						fprintf(stderr, "Read cancelled (remote disconnected)\n");
-						break;
-					}
-					else if(readlen == LIBUSB_ERROR_TIMEOUT)
-					{
-						continue;
-					}
-					else if(readlen < 0)
-					{
-						break;
-					}
+/* Serve every matching device with its own thread, main thread just watches for them */
+int start_hostfs(void)
+{
+	int hotplug;
+	int running = 0;
+	int rescan = 1;
 
-					if(readlen < sizeof(uint32_t))
-					{
-						fprintf(stderr, "Error could not read magic\n");
-						break;
-					}
+	hotplug = init_hotplug();
+	g_connstats.hotplug = hotplug;
 
-					if(LE32(data[0]) == HOSTFS_MAGIC)
-					{
-						if(readlen < sizeof(struct HostFsCmd))
-						{
-							fprintf(stderr, "Error reading command header %d\n", readlen);
-							break;
-						}
+	fprintf(stderr, "waiting for device...\n");
 
-						do_hostfs((struct HostFsCmd *) data, readlen);
-					}
-					else if(LE32(data[0]) == ASYNC_MAGIC)
-					{
-						if(readlen < sizeof(struct AsyncCommand))
-						{
-							fprintf(stderr, "Error reading async header %d\n", readlen);
-							break;
-						}
+	while(1)
+	{
+		int count;
+		int failed = 0;
 
-						do_async((struct AsyncCommand *) data, readlen);
-					}
-					else if(LE32(data[0]) == BULK_MAGIC)
-					{
-						if(readlen < sizeof(struct BulkCommand))
-						{
-							fprintf(stderr, "Error reading bulk header %d\n", readlen);
-							break;
-						}
+		/* A device can still be attached after its worker gave up, look again */
+		if(reap_workers(&count))
+		{
+			rescan = 1;
+		}
 
-						do_bulk((struct BulkCommand *) data, readlen);
-					}
-					else
-					{
-						fprintf(stderr, "Error, invalid magic %08X\n", LE32(data[0]));
-					}
-				}
-			}
+		if((running) && (count == 0))
+		{
+			fprintf(stderr, "waiting for device...\n");
+		}
+
+		if(hotplug)
+		{
+			count += serve_arrivals(&failed);
+		}
 
-			close_device(usbhdr);
-			usbhdr = NULL;
+		if((!hotplug) || (rescan))
+		{
+			count += scan_devices(&failed);
 		}
 
-		close_hostfs();
+		running = count;
+		/* Keep polling while something couldn't be opened, it might just be udev being slow */
+		rescan = failed;
+
+		if(hotplug)
+		{
+			struct timeval tv = { 1, 0 };
+
+			/* Returns as soon as the callback has queued a device, or after a second to reap workers */
+			libusb_handle_events_timeout_completed(usbctx, &tv, &g_hotplug_event);
+		}
+		else
+		{
+			/* Sleep for one second */
+			sleep(1);
+		}
 	}
 
 	return 0;
@@ -2343,6 +4575,7 @@ int start_hostfs(void)
 
 int parse_args(int argc, char **argv)
 {
+	struct stat st;
 	int i;
 
 	if(getcwd(g_rootdir, PATH_MAX) < 0)
@@ -2360,7 +4593,7 @@ int parse_args(int argc, char **argv)
 	{
 		int ch;
 
-		ch = getopt(argc, argv, "vghndcmb:p:f:t:");
+		ch = getopt(argc, argv, "vghndcmPb:p:f:l:t:q:a:w:s:r:o:k:T:C:j:i:");
 		if(ch == -1)
 		{
 			break;
@@ -2384,8 +4617,39 @@ int parse_args(int argc, char **argv)
 					  break;
 			case 'f': g_mapfile = optarg;
 					  break;
+			case 'l': g_listenaddr = optarg;
+					  break;
 			case 't': g_timeout = atoi(optarg);
 					  break;
+			case 'q': g_xferdepth = atoi(optarg);
+					  break;
+			case 'a': g_radepth = atoi(optarg);
+					  break;
+			case 'w': g_wbsize = atoi(optarg) * 1024;
+					  break;
+			case 'i': g_fcthreads = atoi(optarg);
+					  break;
+			case 's': g_dirsnaps = atoi(optarg);
+					  break;
+			case 'r': g_pathcache_size = atoi(optarg);
+					  break;
+			case 'o': g_asyncbuf = atoi(optarg) * 1024;
+					  break;
+			case 'k': g_asyncpolicy = am_parse_policy(optarg);
+					  if(g_asyncpolicy < 0)
+					  {
+						  printf("Invalid async policy '%s'\n", optarg);
+						  return 0;
+					  }
+					  break;
+			case 'T': g_tracefile = optarg;
+					  break;
+			case 'P': g_tracepayloads = 1;
+					  break;
+			case 'C': g_capmask = strtoul(optarg, NULL, 0);
+					  break;
+			case 'j': g_lanes = atoi(optarg);
+					  break;
 			case 'n': g_daemon = 1;
 					  break;
 			case 'h': return 0;
@@ -2418,6 +4682,10 @@ int parse_args(int argc, char **argv)
 				strcpy(g_drives[i].rootdir, argv[i]);
 			}
 			gen_path(g_drives[i].rootdir, 0);
+			if((stat(g_drives[i].rootdir, &st) == 0) && (S_ISREG(st.st_mode)))
+			{
+				g_drives[i].image = imfs_open(g_drives[i].rootdir);
+			}
 			V_PRINTF(2, "Root %d: %s\n", i, g_drives[i].rootdir);
 		}
 	}
@@ -2432,49 +4700,55 @@ int parse_args(int argc, char **argv)
 void print_help(void)
 {
 	fprintf(stderr, "Usage: usbhostfs_pc [options] [rootdir0..rootdir%d]\n", MAX_HOSTDRIVES-1);
+	fprintf(stderr, "A rootdir can also be an .iso, .cso or .zip image, served read-only\n");
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "-v                : Set verbose mode\n");
 	fprintf(stderr, "-vv               : More verbose\n");
-	fprintf(stderr, "-b port           : Specify the base async port (default %d)\n", BASE_PORT);
+	fprintf(stderr, "-b port           : Specify the base async port, each further PSP uses the next %d (default %d)\n", MAX_ASYNC_CHANNELS, BASE_PORT);
 	fprintf(stderr, "-g                : Specify global bind for the sockets, as opposed to just localhost\n");
 	fprintf(stderr, "-p pid            : Specify the product ID of the PSP device\n");
 	fprintf(stderr, "-d                : Print GDB transfers\n");
 	fprintf(stderr, "-f filename       : Load the host drive mappings from a file\n");
+	fprintf(stderr, "-l addr           : Also accept PSPs on a socket, [host:]port for TCP or a Unix socket path\n");
 	fprintf(stderr, "-c                : Enable case-insensitive filenames\n");
 	fprintf(stderr, "-m                : Convert backslashes to forward slashes\n");
 	fprintf(stderr, "-t timeout        : Specify the USB timeout (default %d)\n", USB_TIMEOUT);
 	fprintf(stderr, "-n                : Daemon mode, the shell is accessed through pcterm\n");
+	fprintf(stderr, "-q depth          : Number of queued USB IN transfers (default %d, max %d)\n", XFER_DEF_DEPTH, XFER_MAX_DEPTH);
+	fprintf(stderr, "-a depth          : Number of 64KiB blocks to read ahead per file, 0 disables (default %d)\n", FC_DEF_DEPTH);
+	fprintf(stderr, "-w size           : Size in KiB of the write-behind buffer per file, 0 disables (default %d)\n", FC_DEF_WBSIZE / 1024);
+	fprintf(stderr, "-i num            : Read-ahead with num threads, 0 uses io_uring if the kernel has it (default 0, else %d threads)\n", FC_DEF_THREADS);
+	fprintf(stderr, "-s num            : Number of directory listings to cache, 0 disables (default %d)\n", DC_DEF_MAX);
+	fprintf(stderr, "-r num            : Number of resolved paths to cache, 0 disables (default %d)\n", PC_DEF_MAX);
+	fprintf(stderr, "-o size           : Size in KiB of the output buffer per async channel (default %d)\n", AM_DEF_RING / 1024);
+	fprintf(stderr, "-k policy         : What to do with slow async clients, block|drop|disconnect (default drop)\n");
+	fprintf(stderr, "-T file           : Capture every session to a trace file for hostfs_replay\n");
+	fprintf(stderr, "-P                : Keep write and bulk data in the trace, not just its length\n");
+	fprintf(stderr, "-C mask           : Only offer these capabilities to the PSP, 0 offers none (default 0x%X)\n", HOST_CAPS);
+	fprintf(stderr, "-j num            : Threads per PSP running tagged requests, 0 disables tags (default %d)\n", RP_DEF_LANES);
 	fprintf(stderr, "-h                : Print this help\n");
 }
 
 void shutdown_socket(void)
 {
-	int i;
-
-	for(i = 0; i < MAX_ASYNC_CHANNELS; i++)
-	{
-		if(g_clientsocks[i] >= 0)
-		{
-			close(g_clientsocks[i]);
-			g_clientsocks[i] = -1;
-		}
-
-		if(g_servsocks[i] >= 0)
-		{
-			close(g_servsocks[i]);
-			g_servsocks[i] = -1;
-		}
-	}
+	am_shutdown(&g_mux);
 }
 
 int exit_app(void)
 {
+	int i;
+
 	printf("Exiting\n");
 	shutdown_socket();
-	if(usbhdr)
+	for(i = 0; i < MAX_WORKERS; i++)
 	{
-		/* Nuke the connection */
-		close_device(usbhdr);
+		struct Worker *w = g_slots[i].w;
+
+		if((w) && (w->online))
+		{
+			/* Nuke the connection */
+			trans_shutdown(&w->trans);
+		}
 	}
 	exit(1);
 
@@ -2486,53 +4760,50 @@ void signal_handler(int sig)
 	exit_app();
 }
 
-int make_socket(unsigned short port)
+void dump_handler(int sig)
 {
-	int sock;
-	int on = 1;
-	struct sockaddr_in name;
+	int err = errno;
 
-	sock = socket(PF_INET, SOCK_STREAM, 0);
-	if(sock < 0)
+	/* Printing isn't safe here, leave it to the async thread */
+	if(write(g_dumppipe[1], "", 1) < 0)
 	{
-		perror("socket");
-		return -1;
+		/* Pipe is full, a dump is already pending */
 	}
+	errno = err;
+}
 
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+/* Pass a change to the drive state on to every connected PSP, if drive is
+ * NULL only the resolved paths are thrown away */
+void update_workers(int num, const struct HostDrive *drive)
+{
+	int i;
 
-	memset(&name, 0, sizeof(name));
-	name.sin_family = AF_INET;
-	name.sin_port = htons(port);
-	if(g_globalbind)
-	{
-		name.sin_addr.s_addr = htonl(INADDR_ANY);
-	}
-	else
+	pthread_mutex_lock(&g_workermtx);
+	for(i = 0; i < MAX_WORKERS; i++)
 	{
-		name.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-	}
+		struct Worker *w = g_slots[i].w;
 
-	if(bind(sock, (struct sockaddr *) &name, sizeof(name)) < 0)
-	{
-		perror("bind");
-		close(sock);
-		return -1;
-	}
+		if(w == NULL)
+		{
+			continue;
+		}
 
-	if(listen(sock, 1) < 0)
-	{
-		perror("listen");
-		close(sock);
-		return -1;
+		pthread_mutex_lock(&w->ctx->drivemtx);
+		if(drive)
+		{
+			set_drive(&w->ctx->drives[num], drive->rootdir, drive->image);
+		}
+		invalidate_paths(w->ctx);
+		pthread_mutex_unlock(&w->ctx->drivemtx);
 	}
-
-	return sock;
+	pthread_mutex_unlock(&g_workermtx);
 }
 
 int add_drive(int num, const char *dir)
 {
 	char path[PATH_MAX];
+	struct ImageFs *image = NULL;
+	struct stat st;
 	DIR *pDir;
 
 	if((num < 0) || (num >= MAX_HOSTDRIVES))
@@ -2552,27 +4823,40 @@ int add_drive(int num, const char *dir)
 	}
 	gen_path(path, 0);
 
-	pDir = opendir(path);
-	if(pDir)
+	if((stat(path, &st) == 0) && (S_ISREG(st.st_mode)))
+	{
+		/* A disc image or archive, served read-only */
+		image = imfs_open(path);
+		if(image == NULL)
+		{
+			printf("Invalid image '%s'\n", path);
+			return 0;
+		}
+	}
+	else
 	{
-		closedir(pDir);
-		if(pthread_mutex_lock(&g_drivemtx))
+		pDir = opendir(path);
+		if(pDir == NULL)
 		{
-			printf("Couldn't lock mutex\n");
+			printf("Invalid directory '%s'\n", path);
 			return 0;
 		}
-
-		strcpy(g_drives[num].rootdir, path);
-		strcpy(g_drives[num].currdir, "/");
-
-		pthread_mutex_unlock(&g_drivemtx);
+		closedir(pDir);
 	}
-	else
+
+	if(pthread_mutex_lock(&g_drivemtx))
 	{
-		printf("Invalid directory '%s'\n", path);
+		printf("Couldn't lock mutex\n");
+		imfs_put(image);
 		return 0;
 	}
 
+	set_drive(&g_drives[num], path, image);
+	update_workers(num, &g_drives[num]);
+
+	pthread_mutex_unlock(&g_drivemtx);
+	imfs_put(image);
+
 	return 1;
 }
 
@@ -2597,10 +4881,12 @@ int nocase_set(void)
 		if(strcmp(set, "on") == 0)
 		{
 			g_nocase = 1;
+			update_workers(0, NULL);
 		}
 		else if(strcmp(set, "off") == 0)
 		{
 			g_nocase = 0;
+			update_workers(0, NULL);
 		}
 		else
 		{
@@ -2625,10 +4911,12 @@ int msslash_set(void)
 		if(strcmp(set, "on") == 0)
 		{
 			g_msslash = 1;
+			update_workers(0, NULL);
 		}
 		else if(strcmp(set, "off") == 0)
 		{
 			g_msslash = 0;
+			update_workers(0, NULL);
 		}
 		else
 		{
@@ -2694,7 +4982,7 @@ int list_drives(void)
 
 	for(i = 0; i < MAX_HOSTDRIVES; i++)
 	{
-		printf("host%d: %s\n", i, g_drives[i].rootdir);
+		printf("host%d: %s%s\n", i, g_drives[i].rootdir, g_drives[i].image ? " (image)" : "");
 	}
 
 	return COMMAND_OK;
@@ -2866,20 +5154,336 @@ int ch_dir(void)
 	return COMMAND_OK;
 }
 
+/* Call fn for each connected PSP, the worker can't go away while it runs */
+int each_worker(void (*fn)(struct Worker *w))
+{
+	int count = 0;
+	int i;
+
+	pthread_mutex_lock(&g_workermtx);
+	for(i = 0; i < MAX_WORKERS; i++)
+	{
+		struct Worker *w = g_slots[i].w;
+
+		if((w) && (w->online))
+		{
+			printf("-= Device %d (%s) =-\n", i, w->trans.desc);
+			fn(w);
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&g_workermtx);
+
+	if(count == 0)
+	{
+		printf("No device connected\n");
+	}
+
+	return count;
+}
+
+int list_devices(void)
+{
+	struct ConnStats st;
+	int i;
+
+	pthread_mutex_lock(&g_workermtx);
+	for(i = 0; i < MAX_WORKERS; i++)
+	{
+		struct WorkerSlot *slot = &g_slots[i];
+		int port = g_baseport + (i * MAX_ASYNC_CHANNELS);
+
+		if((slot->w) && (slot->w->online))
+		{
+			printf("%2d: %s, ports %d-%d\n", i, slot->w->trans.desc, port, port + MAX_ASYNC_CHANNELS - 1);
+		}
+		else if(slot->used)
+		{
+			printf("%2d: disconnected, ports %d-%d\n", i, port, port + MAX_ASYNC_CHANNELS - 1);
+		}
+	}
+	st = g_connstats;
+	pthread_mutex_unlock(&g_workermtx);
+
+	if(st.hotplug)
+	{
+		printf("Discovery       : hotplug (%" PRIu64 " arrivals, %" PRIu64 " scans)\n", st.arrivals, st.scans);
+	}
+	else
+	{
+		printf("Discovery       : polling (%" PRIu64 " scans)\n", st.scans);
+	}
+	printf("Connects        : %" PRIu64 " (found to ready avg %.1fms, max %.1fms)\n", st.connects,
+			st.connects ? st.ready_ns / 1e6 / st.connects : 0.0, st.ready_max / 1e6);
+	printf("Reconnects      : %" PRIu64 " (gone to ready avg %.1fms, max %.1fms)\n", st.reconnects,
+			st.reconnects ? st.gap_ns / 1e6 / st.reconnects : 0.0, st.gap_max / 1e6);
+
+	return COMMAND_OK;
+}
+
+void print_usb_stats(struct Worker *w)
+{
+	struct UsbXferStats st;
+	double run;
+
+	trans_get_stats(&w->trans, &st);
+	run = st.run_ns ? (double) st.run_ns : 1.0;
+
+	printf("Transport       : %s\n", w->trans.ops->name);
+	printf("IN queue depth  : %d (queued %d, ready %d, peak ready %d)\n", st.rx_depth, st.rx_queued, st.rx_ready, st.rx_ready_max);
+	printf("Replies queued  : %d (peak %d)\n", st.tx_queued, st.tx_queued_max);
+	printf("IN transfers    : %" PRIu64 " (%" PRIu64 " bytes)\n", st.rx_transfers, st.rx_bytes);
+	printf("OUT transfers   : %" PRIu64 " (%" PRIu64 " bytes)\n", st.tx_transfers, st.tx_bytes);
+	printf("Waiting for PSP : %.3fs (%.1f%%)\n", st.wait_ns / 1e9, st.wait_ns * 100.0 / run);
+	printf("Bus idle        : %.3fs (%.1f%%)\n", st.idle_ns / 1e9, st.idle_ns * 100.0 / run);
+}
+
+int usb_stats(void)
+{
+	each_worker(print_usb_stats);
+
+	return COMMAND_OK;
+}
+
+void print_cache_stats(struct Worker *w)
+{
+	struct FcStats st;
+
+	fc_get_stats(&w->ctx->fcpool, &st);
+
+	printf("Read-ahead depth: %d\n", w->ctx->fcpool.depth);
+	printf("Reads           : %" PRIu64 " (hits %" PRIu64 ", partial %" PRIu64 ", misses %" PRIu64 ")\n", st.reads, st.hits, st.partial, st.misses);
+	printf("Waited on disk  : %" PRIu64 "\n", st.waits);
+	printf("Bytes           : %" PRIu64 " cached, %" PRIu64 " direct\n", st.hit_bytes, st.miss_bytes);
+	printf("Blocks          : %" PRIu64 " prefetched, %" PRIu64 " wasted\n", st.prefetched, st.wasted);
+	printf("Read-ahead I/O  : %s (%" PRIu64 " ring reads, %" PRIu64 " short)\n", w->ctx->fcpool.uring ? "io_uring" : "threads",
+			st.ring_reads, st.ring_short);
+	printf("Write-behind    : %d bytes per file\n", w->ctx->fcpool.wbsize);
+	printf("Buffered writes : %" PRIu64 " (%" PRIu64 " merged)\n", st.wb_writes, st.wb_merged);
+	printf("Flushes         : %" PRIu64 " (%" PRIu64 " on timer, %" PRIu64 " failed)\n", st.wb_flushes, st.wb_timed, st.wb_errors);
+}
+
+int cache_stats(void)
+{
+	each_worker(print_cache_stats);
+
+	return COMMAND_OK;
+}
+
+void print_dir_stats(struct Worker *w)
+{
+	struct DcStats st;
+	int count;
+
+	dc_get_stats(&w->ctx->dircache, &st, &count);
+
+	printf("Cached dirs     : %d (max %d)\n", count, w->ctx->dircache.max);
+	printf("Lookups         : %" PRIu64 " (hits %" PRIu64 ", misses %" PRIu64 ", %.1f%% hit rate)\n", st.lookups, st.hits, st.misses,
+			st.lookups ? st.hits * 100.0 / st.lookups : 0.0);
+	printf("Dropped         : %" PRIu64 " changed, %" PRIu64 " evicted\n", st.invalidated, st.evicted);
+}
+
+int dir_stats(void)
+{
+	each_worker(print_dir_stats);
+
+	return COMMAND_OK;
+}
+
+void print_nocase_stats(struct Worker *w)
+{
+	struct NcStats st;
+	int count;
+
+	nc_get_stats(&w->ctx->ncindex, &st, &count);
+
+	printf("Indexed dirs    : %d (max %d)\n", count, w->ctx->ncindex.max);
+	printf("Lookups         : %" PRIu64 " (hits %" PRIu64 ", %" PRIu64 " directories read)\n", st.lookups, st.hits, st.builds);
+	printf("Dropped         : %" PRIu64 " changed, %" PRIu64 " evicted\n", st.invalidated, st.evicted);
+}
+
+int nocase_stats(void)
+{
+	each_worker(print_nocase_stats);
+
+	return COMMAND_OK;
+}
+
+void print_path_stats(struct Worker *w)
+{
+	struct PcStats st;
+	int count;
+
+	pthread_mutex_lock(&w->ctx->drivemtx);
+	st = w->ctx->pathcache.stats;
+	count = w->ctx->pathcache.count;
+	pthread_mutex_unlock(&w->ctx->drivemtx);
+
+	printf("Cached paths    : %d (max %d)\n", count, w->ctx->pathcache.max);
+	printf("Lookups         : %" PRIu64 " hits, %" PRIu64 " misses\n", st.hits, st.misses);
+	printf("Dropped         : %" PRIu64 " evicted, %" PRIu64 " flushes\n", st.evicted, st.flushes);
+}
+
+int path_stats(void)
+{
+	each_worker(print_path_stats);
+
+	return COMMAND_OK;
+}
+
+/* Time path resolution with and without the cache, on a private context so
+ * it works without a PSP and doesn't disturb the connected ones */
+int path_bench(void)
+{
+	char retpath[PATH_MAX];
+	struct HostFsCtx *ctx;
+	char *path;
+	char *cnt;
+	uint64_t start;
+	double uncached;
+	double cached;
+	int count = 100000;
+	int i;
+
+	path = strtok(NULL, " \t");
+	cnt = strtok(NULL, " \t");
+	if(path == NULL)
+	{
+		printf("Must specify a path to resolve\n");
+		return COMMAND_ERR;
+	}
+
+	if(cnt)
+	{
+		count = atoi(cnt);
+		if(count <= 0)
+		{
+			printf("Invalid iteration count '%s'\n", cnt);
+			return COMMAND_ERR;
+		}
+	}
+
+	ctx = (struct HostFsCtx *) malloc(sizeof(struct HostFsCtx));
+	if(ctx == NULL)
+	{
+		printf("Could not allocate memory\n");
+		return COMMAND_ERR;
+	}
+
+	if(ctx_init(ctx) < 0)
+	{
+		ctx_free(ctx);
+		free(ctx);
+		return COMMAND_ERR;
+	}
+
+	pthread_mutex_lock(&g_drivemtx);
+	ctx_load_drives(ctx);
+	pthread_mutex_unlock(&g_drivemtx);
+
+	start = get_time_ns();
+	for(i = 0; i < count; i++)
+	{
+		pthread_mutex_lock(&ctx->drivemtx);
+		resolve_path(ctx, 0, path, retpath, 0);
+		pthread_mutex_unlock(&ctx->drivemtx);
+	}
+	uncached = (get_time_ns() - start) / 1e9;
+
+	start = get_time_ns();
+	for(i = 0; i < count; i++)
+	{
+		make_path(ctx, 0, path, retpath, 0);
+	}
+	cached = (get_time_ns() - start) / 1e9;
+
+	ctx_free(ctx);
+	free(ctx);
+
+	printf("Resolved %s to %s\n", path, retpath);
+	printf("Uncached        : %.0f resolutions/s\n", uncached > 0 ? count / uncached : 0.0);
+	printf("Cached          : %.0f resolutions/s\n", cached > 0 ? count / cached : 0.0);
+
+	return COMMAND_OK;
+}
+
+const char *g_channames[MAX_ASYNC_CHANNELS] = { "shell", "gdb", "stdout", "stderr" };
+
+int async_stats(void)
+{
+	struct AmStats st;
+	int slot;
+	int i;
+
+	printf("Policy          : %s, %d bytes per channel\n", am_policy_name(g_asyncpolicy), g_asyncbuf);
+	for(slot = 0; slot < MAX_WORKERS; slot++)
+	{
+		for(i = 0; i < MAX_ASYNC_CHANNELS; i++)
+		{
+			if((am_get_stats(&g_mux, slot, i, &st) < 0) || ((st.bytes == 0) && (st.clients == 0)))
+			{
+				continue;
+			}
+
+			printf("Device %d %-6s : %d clients, %" PRIu64 " bytes, %" PRIu64 " sent, %" PRIu64 " unheard\n", slot,
+					g_channames[i] ? g_channames[i] : "user", st.clients, st.bytes, st.sent, st.discarded);
+			printf("                  %" PRIu64 " dropped, %" PRIu64 " disconnected, blocked %" PRIu64 " times (%.3fs)\n",
+					st.dropped, st.kicked, st.blocked, st.blocked_ns / 1e9);
+		}
+	}
+
+	return COMMAND_OK;
+}
+
 int help_cmd(void)
 {
 	return COMMAND_HELP;
 }
 
+int cmd_stats(void)
+{
+	char *arg;
+
+	arg = strtok(NULL, " \t");
+	if((arg) && (strcmp(arg, "reset") == 0))
+	{
+		cs_reset(&g_cmdstats);
+		printf("Command statistics reset\n");
+		return COMMAND_OK;
+	}
+
+	cs_print(&g_cmdstats, stdout, g_channames);
+
+	return COMMAND_OK;
+}
+
+void dump_stats(int fd, void *arg)
+{
+	char buf[16];
+
+	while(read(fd, buf, sizeof(buf)) > 0);
+
+	cs_print(&g_cmdstats, stderr, g_channames);
+}
+
 struct ShellCmd g_commands[] = {
 	{ "drives", "Print the current drives", list_drives },
-	{ "mount", "Mount a directory (mount num dir)", mount_drive },
+	{ "mount", "Mount a directory or .iso/.cso/.zip image (mount num dir)", mount_drive },
 	{ "save",  "Save the list of mounts to a file (save filename)", save_drives },
 	{ "load",  "Load a list of mounts from a file (load filename)", load_drives },
 	{ "nocase", "Set case sensitivity (nocase on|off)", nocase_set },
 	{ "msslash", "Convert backslash to forward slash in filename", msslash_set },
 	{ "gdbdebug", "Set the GDB debug option (gdbdebug on|off)", gdbdebug_set },
 	{ "verbose", "Set the verbose level (verbose 0|1|2)", verbose_set },
+	{ "devices", "List the connected PSPs and their async ports", list_devices },
+	{ "usbstat", "Print the USB transfer queue statistics", usb_stats },
+	{ "asyncstat", "Print the async channel statistics", async_stats },
+	{ "stats", "Print the per command counters and latencies (stats [reset])", cmd_stats },
+	{ "cachestat", "Print the read-ahead cache statistics", cache_stats },
+	{ "dirstat", "Print the directory cache statistics", dir_stats },
+	{ "nocasestat", "Print the case insensitive name index statistics", nocase_stats },
+	{ "pathstat", "Print the resolved path cache statistics", path_stats },
+	{ "pathbench", "Time host0: path resolution with and without the cache (pathbench path [count])", path_bench },
 	{ "pwd", "Print the current directory", print_wd },
 	{ "cd", "Change the current local directory", ch_dir },
 	{ "help", "Print this help", help_cmd },
@@ -2963,155 +5567,93 @@ int init_readline(void)
 }
 #endif
 
-void *async_thread(void *arg)
+void shell_input(int fd, void *arg)
 {
-	char buf[512];
-	char *data;
-	struct AsyncCommand *cmd;
-	fd_set read_set, read_save;
-	struct sockaddr_in client;
-	socklen_t size;
-	int max_fd = 0;
-	int flag = 1;
-	int i;
-
-	FD_ZERO(&read_save);
+#ifdef READLINE_SHELL
+	rl_callback_read_char();
+#else
+	char buffer[4096];
 
-	if(!g_daemon)
+	if(fgets(buffer, sizeof(buffer), stdin))
 	{
-#ifdef READLINE_SHELL
-		init_readline();
+		parse_shell(buffer);
+	}
 #endif
+}
+
+/* Data from an async client, pass it on to the PSP */
+void async_input(int slot, int chan, char *data, int len)
+{
+	char buf[512+1];
+	struct AsyncCommand *cmd;
 
-		FD_SET(STDIN_FILENO, &read_save);
-		max_fd = STDIN_FILENO;
+	if((chan == ASYNC_GDB) && (g_gdbdebug))
+	{
+		print_gdbdebug(1, (uint8_t *) data, len);
 	}
 
-	for(i = 0; i < MAX_ASYNC_CHANNELS; i++)
+	if((g_daemon) && (chan == ASYNC_SHELL) && (data[0] == '@'))
 	{
-		if(g_servsocks[i] >= 0)
-		{
-			FD_SET(g_servsocks[i], &read_save);
-			if(g_servsocks[i] > max_fd)
-			{
-				max_fd = g_servsocks[i];
-			}
-		}
+		/* We assume locally it should be able to load everything in one go */
+		memcpy(buf, data, len);
+		buf[len] = 0;
+		parse_shell(&buf[1]);
+		return;
 	}
 
 	cmd = (struct AsyncCommand *) buf;
 	cmd->magic = LE32(ASYNC_MAGIC);
-	data = buf + sizeof(struct AsyncCommand);
+	cmd->channel = LE32(chan);
+	memcpy(buf + sizeof(struct AsyncCommand), data, len);
 
-	while(1)
+	/* Hold the lock so the device can't be closed under us */
+	pthread_mutex_lock(&g_workermtx);
+	if((slot < MAX_WORKERS) && (g_slots[slot].w) && (g_slots[slot].w->online))
 	{
-		read_set = read_save;
-		if(select(max_fd+1, &read_set, NULL, NULL, NULL) > 0)
+		if((trans_write_async(&g_slots[slot].w->trans, buf, len + sizeof(struct AsyncCommand), 10000) > 0)
+			&& (chan < MAX_ASYNC_CHANNELS))
 		{
-			if(!g_daemon)
-			{
-				if(FD_ISSET(STDIN_FILENO, &read_set))
-				{
-#ifdef READLINE_SHELL
-					rl_callback_read_char();
-#else
-					char buffer[4096];
-
-					if(fgets(buffer, sizeof(buffer), stdin))
-					{
-						parse_shell(buffer);
-					}
-#endif
-				}
-			}
+			cs_add_out(&g_cmdstats.async[chan], len);
+		}
+	}
+	pthread_mutex_unlock(&g_workermtx);
+}
 
-			for(i = 0; i < MAX_ASYNC_CHANNELS; i++)
-			{
-				if(g_servsocks[i] >= 0)
-				{
-					if(FD_ISSET(g_servsocks[i], &read_set))
-					{
-						if(g_clientsocks[i] >= 0)
-						{
-							FD_CLR(g_clientsocks[i], &read_save);
-							close(g_clientsocks[i]);
-						}
-						size = sizeof(client);
-						g_clientsocks[i] = accept(g_servsocks[i], (struct sockaddr *) &client, &size);
-						if(g_clientsocks[i] >= 0)
-						{
-							printf("Accepting async connection (%d) from %s\n", i, inet_ntoa(client.sin_addr));
-							FD_SET(g_clientsocks[i], &read_save);
-							if((g_daemon) && (i == ASYNC_SHELL))
-							{
-								/* Duplicate to stdout for the local shell */
-								dup2(g_clientsocks[i], 1);
-							}
-							setsockopt(g_clientsocks[i], SOL_TCP, TCP_NODELAY, &flag, sizeof(int));
-							if(g_clientsocks[i] > max_fd)
-							{
-								max_fd = g_clientsocks[i];
-							}
-						}
-					}
-				}
-			}
+void async_connect(int slot, int chan, int fd, const char *addr)
+{
+	printf("Accepting async connection (%d) for device %d from %s\n", chan, slot, addr);
+	if((g_daemon) && (chan == ASYNC_SHELL))
+	{
+		/* Duplicate to stdout for the local shell */
+		dup2(fd, 1);
+	}
+}
 
-			for(i = 0; i < MAX_ASYNC_CHANNELS; i++)
-			{
-				if(g_clientsocks[i] >= 0)
-				{
-					if(FD_ISSET(g_clientsocks[i], &read_set))
-					{
-						int readbytes;
+void async_disconnect(int slot, int chan, int fd)
+{
+	if((g_daemon) && (chan == ASYNC_SHELL))
+	{
+		dup2(2, 1);
+	}
+	printf("Closing async connection (%d) for device %d\n", chan, slot);
+}
 
-						readbytes = read(g_clientsocks[i], data, sizeof(buf) - sizeof(struct AsyncCommand));
-						if(readbytes > 0)
-						{
-							if((i == ASYNC_GDB) && (g_gdbdebug))
-							{
-								print_gdbdebug(1, (uint8_t *) data, readbytes);
-							}
-
-							if(g_daemon)
-							{
-								if((i == ASYNC_SHELL) && (data[0] == '@'))
-								{
-									/* We assume locally it should be able to load everything in one go */
-									if(readbytes < (sizeof(buf)-sizeof(struct AsyncCommand)))
-									{
-										data[readbytes] = 0;
-									}
-									else
-									{
-										data[sizeof(buf)-sizeof(struct AsyncCommand)-1] = 0;
-									}
-
-									parse_shell(&data[1]);
-									continue;
-								}
-							}
+void *async_thread(void *arg)
+{
+	if(!g_daemon)
+	{
+#ifdef READLINE_SHELL
+		init_readline();
+#endif
+		am_watch(&g_mux, STDIN_FILENO, shell_input, NULL);
+	}
 
-							if(usbhdr)
-							{
-								cmd->channel = LE32(i);
-								euid_usb_bulk_write(usbhdr, 0x3, buf, readbytes+sizeof(struct AsyncCommand), 10000);
-							}
-						}
-						else
-						{
-							FD_CLR(g_clientsocks[i], &read_save);
-							if((g_daemon) && (i == ASYNC_SHELL))
-							{
-								dup2(2, 1);
-							}
-							close(g_clientsocks[i]);
-							g_clientsocks[i] = -1;
-							printf("Closing async connection (%d)\n", i);
-						}
-					}
-				}
-			}
+	while(1)
+	{
+		if(am_poll(&g_mux, -1) < 0)
+		{
+			fprintf(stderr, "Error waiting for async events (%s)\n", strerror(errno));
+			sleep(1);
 		}
 	}
 	
@@ -3120,7 +5662,7 @@ void *async_thread(void *arg)
 
 int main(int argc, char **argv)
 {
-	int i;
+	struct AmCallbacks callbacks = { async_input, async_connect, async_disconnect };
 
 	printf("USBHostFS (c) TyRaNiD 2k6\n");
 	printf("Built %s %s\n", __DATE__, __TIME__);
@@ -3136,6 +5678,8 @@ int main(int argc, char **argv)
 
 		signal(SIGINT, signal_handler);
 		signal(SIGTERM, signal_handler);
+		/* Clients going away are seen as send errors */
+		signal(SIGPIPE, SIG_IGN);
 
 		if(g_daemon)
 		{
@@ -3166,13 +5710,45 @@ int main(int argc, char **argv)
 			load_mapfile(g_mapfile);
 		}
 
-		for(i = 0; i < MAX_ASYNC_CHANNELS; i++)
+		if(am_init(&g_mux, MAX_WORKERS, g_asyncbuf, g_asyncpolicy, &callbacks) < 0)
+		{
+			return 1;
+		}
+
+		if((g_tracefile) && (trace_open(&g_trace, g_tracefile, g_tracepayloads) < 0))
+		{
+			return 1;
+		}
+
+		cs_reset(&g_cmdstats);
+		if(pipe(g_dumppipe) == 0)
 		{
-			g_servsocks[i] = make_socket(g_baseport + i);
-			g_clientsocks[i] = -1;
+			fcntl(g_dumppipe[0], F_SETFL, O_NONBLOCK);
+			fcntl(g_dumppipe[1], F_SETFL, O_NONBLOCK);
+			am_watch(&g_mux, g_dumppipe[0], dump_stats, NULL);
+			signal(SIGUSR1, dump_handler);
 		}
 
+		/* The first device's ports are always there, same as with a single PSP */
+		open_slot(0);
+
 		pthread_create(&thid, NULL, async_thread, NULL);
+
+		if(g_listenaddr)
+		{
+			static int lfd;
+
+			lfd = trans_listen(g_listenaddr, g_globalbind);
+			if(lfd < 0)
+			{
+				fprintf(stderr, "Could not listen for PSPs on %s\n", g_listenaddr);
+				return 1;
+			}
+
+			printf("Listening for PSPs on %s\n", g_listenaddr);
+			pthread_create(&thid, NULL, listen_thread, &lfd);
+		}
+
 		start_hostfs();
 		libusb_exit(usbctx);
 	}
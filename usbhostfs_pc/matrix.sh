@@ -0,0 +1,67 @@
+#!/bin/sh
+# Runs hostfs_bench against usbhostfs_pc over a socket for an old PSP (a
+# plain HELLO) and a new one, with the server offering no capabilities, only
+# streaming reads and everything. Fails if any workload fails, the server
+# goes away or the capabilities agreed are not the ones expected.
+
+SERVER=./usbhostfs_pc
+BENCH=./hostfs_bench
+# What hostfs_bench offers, the same as a current PSP
+PSP_CAPS=0x27
+BENCH_ARGS="-t 1 -S 1024 -n 16 -b 4096,65536"
+
+TMP=$(mktemp -d /tmp/hostfs_matrix.XXXXXX) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+mkdir "$TMP/root"
+
+failed=0
+
+run()
+{
+	name=$1
+	caps=$2
+	legacy=$3
+	expect=$4
+
+	sock="$TMP/hostfs.sock"
+	rm -f "$sock"
+	if [ -n "$caps" ]; then
+		$SERVER -C "$caps" -l "$sock" "$TMP/root" > "$TMP/server.log" 2>&1 &
+	else
+		$SERVER -l "$sock" "$TMP/root" > "$TMP/server.log" 2>&1 &
+	fi
+	pid=$!
+
+	tries=0
+	while [ ! -S "$sock" ] && [ $tries -lt 50 ]; do
+		sleep 0.1
+		tries=$((tries + 1))
+	done
+
+	if $BENCH $legacy -E "$expect" $BENCH_ARGS "$sock" > "$TMP/bench.log" 2>&1 && kill -0 $pid 2> /dev/null; then
+		echo "PASS $name"
+	else
+		echo "FAIL $name"
+		sed 's/^/  bench: /' "$TMP/bench.log"
+		sed 's/^/  server: /' "$TMP/server.log"
+		failed=1
+	fi
+
+	kill $pid 2> /dev/null
+	wait $pid 2> /dev/null
+}
+
+for server in 0 2 full; do
+	if [ "$server" = "full" ]; then
+		offer=
+		agreed=$PSP_CAPS
+	else
+		offer=$server
+		agreed=$((server & PSP_CAPS))
+	fi
+
+	run "old PSP, server caps $server" "$offer" -L 0
+	run "new PSP, server caps $server" "$offer" "" $agreed
+done
+
+exit $failed
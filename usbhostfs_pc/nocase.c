@@ -0,0 +1,531 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * nocase.c - Case insensitive name index for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ * With case insensitive filenames every component of every path has to be
+ * matched against the real directory contents. Rather than reading the
+ * directory each time we keep a hash of the case folded names for each
+ * directory we have looked in, kept up to date with inotify. Any entry being
+ * created, deleted or renamed throws the directory's index away, it is read
+ * again on the next lookup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "usbhostfs_pc.h"
+#include "nocase.h"
+
+#ifdef __linux__
+#define NC_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+int calc_rating(const char *str1, const char *str2)
+{
+	int rating = 0;
+
+	while((*str1) && (*str2))
+	{
+		if(*str1 == *str2)
+		{
+			rating++;
+		}
+		str1++;
+		str2++;
+	}
+
+	return rating;
+}
+
+/* FNV-1a of the string, case folded the same way as strcasecmp */
+static uint32_t hash_fold(const char *str)
+{
+	uint32_t hash = 2166136261U;
+
+	while(*str)
+	{
+		hash ^= (uint32_t) tolower((unsigned char) *str);
+		hash *= 16777619U;
+		str++;
+	}
+
+	return hash;
+}
+
+static uint32_t hash_str(const char *str)
+{
+	uint32_t hash = 2166136261U;
+
+	while(*str)
+	{
+		hash ^= (uint32_t) (unsigned char) *str;
+		hash *= 16777619U;
+		str++;
+	}
+
+	return hash;
+}
+
+int nc_init(struct NcIndex *nc, int max)
+{
+	memset(nc, 0, sizeof(*nc));
+	pthread_mutex_init(&nc->lock, NULL);
+	nc->ifd = -1;
+
+	if(max <= 0)
+	{
+		return 0;
+	}
+
+#ifdef __linux__
+	nc->ifd = inotify_init();
+	if(nc->ifd < 0)
+	{
+		fprintf(stderr, "Could not create inotify descriptor (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	fcntl(nc->ifd, F_SETFL, fcntl(nc->ifd, F_GETFL) | O_NONBLOCK);
+	fcntl(nc->ifd, F_SETFD, FD_CLOEXEC);
+	nc->max = max;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static void free_dir(struct NcDir *d)
+{
+	int i;
+
+	for(i = 0; i < d->nbuckets; i++)
+	{
+		struct NcEnt *ent = d->buckets[i];
+
+		while(ent)
+		{
+			struct NcEnt *next = ent->next;
+
+			free(ent);
+			ent = next;
+		}
+	}
+
+	free(d->buckets);
+	free(d);
+}
+
+/* Remove a watch if no indexed directory uses it, must be called with the lock held */
+static void release_wd(struct NcIndex *nc, int wd)
+{
+#ifdef __linux__
+	int i;
+
+	/* Paths which resolve to the same directory share a watch */
+	for(i = 0; i < NC_DIR_BUCKETS; i++)
+	{
+		struct NcDir *p;
+
+		for(p = nc->dirs[i]; p; p = p->next)
+		{
+			if(p->wd == wd)
+			{
+				return;
+			}
+		}
+	}
+
+	inotify_rm_watch(nc->ifd, wd);
+#endif
+}
+
+/* Remove a directory from the index, must be called with the lock held */
+static void remove_dir(struct NcIndex *nc, struct NcDir *d)
+{
+	struct NcDir **pp;
+
+	for(pp = &nc->dirs[d->hash % NC_DIR_BUCKETS]; *pp; pp = &(*pp)->next)
+	{
+		if(*pp == d)
+		{
+			*pp = d->next;
+			break;
+		}
+	}
+	nc->count--;
+
+	release_wd(nc, d->wd);
+	free_dir(d);
+}
+
+/* Read any pending change events, must be called with the lock held */
+static void drain_events(struct NcIndex *nc)
+{
+#ifdef __linux__
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while(1)
+	{
+		ssize_t len;
+		char *p;
+
+		len = read(nc->ifd, buf, sizeof(buf));
+		if(len <= 0)
+		{
+			if((len < 0) && (errno == EINTR))
+			{
+				continue;
+			}
+			break;
+		}
+
+		for(p = buf; p < buf + len; )
+		{
+			struct inotify_event *ev = (struct inotify_event *) p;
+			int i;
+
+			if((ev->mask & IN_Q_OVERFLOW) || (!(ev->mask & IN_IGNORED)))
+			{
+				for(i = 0; i < NC_DIR_BUCKETS; i++)
+				{
+					struct NcDir *d = nc->dirs[i];
+
+					while(d)
+					{
+						struct NcDir *next = d->next;
+
+						/* On overflow we have lost track, throw everything away */
+						if((ev->mask & IN_Q_OVERFLOW) || (d->wd == ev->wd))
+						{
+							V_PRINTF(2, "Directory %s changed, dropping name index\n", d->path);
+							remove_dir(nc, d);
+							nc->stats.invalidated++;
+							nc->gen++;
+						}
+						d = next;
+					}
+				}
+			}
+
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+#endif
+}
+
+/* Make room for a new directory, must be called with the lock held */
+static void evict(struct NcIndex *nc)
+{
+	while(nc->count >= nc->max)
+	{
+		struct NcDir *old = NULL;
+		int i;
+
+		for(i = 0; i < NC_DIR_BUCKETS; i++)
+		{
+			struct NcDir *d;
+
+			for(d = nc->dirs[i]; d; d = d->next)
+			{
+				if((old == NULL) || (d->last_used < old->last_used))
+				{
+					old = d;
+				}
+			}
+		}
+
+		if(old == NULL)
+		{
+			break;
+		}
+
+		remove_dir(nc, old);
+		nc->stats.evicted++;
+	}
+}
+
+/* Read a directory into a new index, must be called with the lock held */
+static struct NcDir *build_dir(struct NcIndex *nc, const char *dirpath, uint32_t hash)
+{
+	struct NcEnt **tails;
+	struct NcDir *d;
+	struct dirent *ent;
+	DIR *dir;
+	int i;
+
+	/* Make room first, evicting could remove a watch shared with this directory */
+	evict(nc);
+
+	d = (struct NcDir *) malloc(sizeof(struct NcDir));
+	if(d == NULL)
+	{
+		return NULL;
+	}
+
+	memset(d, 0, sizeof(*d));
+	strncpy(d->path, dirpath, PATH_MAX - 1);
+	d->hash = hash;
+	d->wd = -1;
+
+#ifdef __linux__
+	/* Watch before reading so a change while reading is not missed */
+	d->wd = inotify_add_watch(nc->ifd, dirpath, NC_EVENTS | IN_ONLYDIR);
+#endif
+	if(d->wd < 0)
+	{
+		V_PRINTF(2, "Couldn't watch %s\n", dirpath);
+		free(d);
+		return NULL;
+	}
+
+	dir = opendir(dirpath);
+	if(dir == NULL)
+	{
+		V_PRINTF(2, "Couldn't open %s\n", dirpath);
+		release_wd(nc, d->wd);
+		free(d);
+		return NULL;
+	}
+
+	/* Start small and grow to keep the chains short */
+	d->nbuckets = 64;
+	d->buckets = (struct NcEnt **) calloc(d->nbuckets, sizeof(struct NcEnt *));
+	tails = (struct NcEnt **) calloc(d->nbuckets, sizeof(struct NcEnt *));
+	if((d->buckets == NULL) || (tails == NULL))
+	{
+		free(tails);
+		free(d->buckets);
+		release_wd(nc, d->wd);
+		free(d);
+		closedir(dir);
+		return NULL;
+	}
+
+	while((ent = readdir(dir)))
+	{
+		struct NcEnt *e;
+		int len = strlen(ent->d_name);
+		int b;
+
+		if(d->count >= d->nbuckets)
+		{
+			struct NcEnt **newb;
+			struct NcEnt **newt;
+			int newsize = d->nbuckets * 2;
+
+			newb = (struct NcEnt **) calloc(newsize, sizeof(struct NcEnt *));
+			newt = (struct NcEnt **) calloc(newsize, sizeof(struct NcEnt *));
+			if((newb != NULL) && (newt != NULL))
+			{
+				/* Rehash in order so each chain stays in directory order */
+				for(i = 0; i < d->nbuckets; i++)
+				{
+					struct NcEnt *p = d->buckets[i];
+
+					while(p)
+					{
+						struct NcEnt *next = p->next;
+						int nb = p->hash & (newsize - 1);
+
+						p->next = NULL;
+						if(newt[nb])
+						{
+							newt[nb]->next = p;
+						}
+						else
+						{
+							newb[nb] = p;
+						}
+						newt[nb] = p;
+						p = next;
+					}
+				}
+
+				free(d->buckets);
+				free(tails);
+				d->buckets = newb;
+				tails = newt;
+				d->nbuckets = newsize;
+			}
+			else
+			{
+				free(newb);
+				free(newt);
+			}
+		}
+
+		e = (struct NcEnt *) malloc(sizeof(struct NcEnt) + len);
+		if(e == NULL)
+		{
+			break;
+		}
+
+		strcpy(e->name, ent->d_name);
+		e->hash = hash_fold(ent->d_name);
+		e->next = NULL;
+		b = e->hash & (d->nbuckets - 1);
+		if(tails[b])
+		{
+			tails[b]->next = e;
+		}
+		else
+		{
+			d->buckets[b] = e;
+		}
+		tails[b] = e;
+		d->count++;
+	}
+
+	closedir(dir);
+	free(tails);
+
+	d->next = nc->dirs[hash % NC_DIR_BUCKETS];
+	nc->dirs[hash % NC_DIR_BUCKETS] = d;
+	nc->count++;
+	nc->stats.builds++;
+
+	V_PRINTF(2, "Indexed %d names in %s\n", d->count, dirpath);
+
+	return d;
+}
+
+int nc_lookup(struct NcIndex *nc, const char *dirpath, char *token)
+{
+	struct NcDir *d;
+	struct NcEnt *e;
+	const char *match = NULL;
+	uint32_t hash;
+	uint32_t thash;
+	int rating = -1;
+	int ret = 0;
+
+	if(nc->ifd < 0)
+	{
+		return -1;
+	}
+
+	hash = hash_str(dirpath);
+	thash = hash_fold(token);
+
+	pthread_mutex_lock(&nc->lock);
+	nc->stats.lookups++;
+	drain_events(nc);
+
+	for(d = nc->dirs[hash % NC_DIR_BUCKETS]; d; d = d->next)
+	{
+		if((d->hash == hash) && (strcmp(d->path, dirpath) == 0))
+		{
+			nc->stats.hits++;
+			break;
+		}
+	}
+
+	if(d == NULL)
+	{
+		d = build_dir(nc, dirpath, hash);
+	}
+
+	if(d != NULL)
+	{
+		d->last_used = get_time_ns();
+		for(e = d->buckets[thash & (d->nbuckets - 1)]; e; e = e->next)
+		{
+			if((e->hash == thash) && (strcasecmp(e->name, token) == 0))
+			{
+				int tmp;
+
+				tmp = calc_rating(token, e->name);
+				V_PRINTF(2, "Found match %s for %s rating %d\n", e->name, token, tmp);
+				if(tmp > rating)
+				{
+					match = e->name;
+					rating = tmp;
+				}
+			}
+		}
+
+		if(match)
+		{
+			strcpy(token, match);
+			ret = 1;
+		}
+	}
+	pthread_mutex_unlock(&nc->lock);
+
+	if(d == NULL)
+	{
+		/* Could not index it, let the caller scan the directory */
+		return -1;
+	}
+
+	return ret;
+}
+
+uint32_t nc_generation(struct NcIndex *nc)
+{
+	uint32_t gen;
+
+	if(nc->ifd < 0)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&nc->lock);
+	drain_events(nc);
+	gen = nc->gen;
+	pthread_mutex_unlock(&nc->lock);
+
+	return gen;
+}
+
+void nc_flush(struct NcIndex *nc)
+{
+	int i;
+
+	pthread_mutex_lock(&nc->lock);
+	for(i = 0; i < NC_DIR_BUCKETS; i++)
+	{
+		while(nc->dirs[i])
+		{
+			remove_dir(nc, nc->dirs[i]);
+		}
+	}
+	pthread_mutex_unlock(&nc->lock);
+}
+
+void nc_destroy(struct NcIndex *nc)
+{
+	nc_flush(nc);
+	if(nc->ifd >= 0)
+	{
+		close(nc->ifd);
+		nc->ifd = -1;
+	}
+	pthread_mutex_destroy(&nc->lock);
+}
+
+void nc_get_stats(struct NcIndex *nc, struct NcStats *stats, int *count)
+{
+	pthread_mutex_lock(&nc->lock);
+	memcpy(stats, &nc->stats, sizeof(*stats));
+	if(count)
+	{
+		*count = nc->count;
+	}
+	pthread_mutex_unlock(&nc->lock);
+}
@@ -0,0 +1,123 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * nocase.h - Case insensitive name index for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __NOCASE_H__
+#define __NOCASE_H__
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define NC_DEF_MAX      256
+#define NC_DIR_BUCKETS  256
+
+struct NcEnt
+{
+	/* Next entry in the hash chain, chains keep the readdir order */
+	struct NcEnt *next;
+	uint32_t hash;
+	char name[1];
+};
+
+struct NcDir
+{
+	/* Next directory in the hash chain */
+	struct NcDir *next;
+	char path[PATH_MAX];
+	uint32_t hash;
+	/* inotify watch descriptor */
+	int wd;
+	uint64_t last_used;
+	int count;
+	/* Power of two number of buckets */
+	int nbuckets;
+	struct NcEnt **buckets;
+};
+
+struct NcStats
+{
+	uint64_t lookups;
+	/* Lookups answered from an existing index */
+	uint64_t hits;
+	/* Directories read to build an index */
+	uint64_t builds;
+	uint64_t invalidated;
+	uint64_t evicted;
+};
+
+struct NcIndex
+{
+	pthread_mutex_t lock;
+	/* inotify descriptor, -1 if the index is not available */
+	int ifd;
+	int max;
+	int count;
+	/* Bumped whenever a directory's names change */
+	uint32_t gen;
+	struct NcDir *dirs[NC_DIR_BUCKETS];
+	struct NcStats stats;
+};
+
+/**
+ * Rate how closely two names which match case insensitive match in case
+ *
+ * @return Number of characters which are the same
+ */
+int  calc_rating(const char *str1, const char *str2);
+
+/**
+ * Initialise the index
+ *
+ * @param nc - The index
+ * @param max - Maximum number of directories to index, 0 disables
+ *
+ * @return 0 on success, < 0 if the index is not available
+ */
+int  nc_init(struct NcIndex *nc, int max);
+
+/**
+ * Find the real name of a directory entry, case insensitive. If more than
+ * one entry matches the one with the most characters in the same case wins,
+ * the first in directory order on a tie.
+ *
+ * @param nc - The index
+ * @param dirpath - The host directory to look in
+ * @param token - The name to look for, replaced with the real name if found
+ *
+ * @return 1 if found, 0 if not found, < 0 if the index is not available
+ */
+int  nc_lookup(struct NcIndex *nc, const char *dirpath, char *token);
+
+/**
+ * Get the index generation, it changes whenever an indexed directory has
+ * had entries added, removed or renamed
+ */
+uint32_t nc_generation(struct NcIndex *nc);
+
+/**
+ * Throw away the whole index
+ */
+void nc_flush(struct NcIndex *nc);
+
+/**
+ * Throw away the index and close the inotify descriptor
+ */
+void nc_destroy(struct NcIndex *nc);
+
+/**
+ * Get a snapshot of the index statistics
+ *
+ * @param nc - The index
+ * @param stats - Receives the statistics
+ * @param count - Receives the number of indexed directories, can be NULL
+ */
+void nc_get_stats(struct NcIndex *nc, struct NcStats *stats, int *count);
+
+#endif
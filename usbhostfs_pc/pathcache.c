@@ -0,0 +1,218 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * pathcache.c - Resolved path cache for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ * make_path does a fair bit of string work for every request, more so with
+ * case insensitive names. The PSP tends to use the same few paths over and
+ * over so keep a bounded LRU of the results, keyed on everything the
+ * resolution depends on which is not global drive state.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "usbhostfs_pc.h"
+#include "pathcache.h"
+
+static uint32_t hash_key(unsigned int drive, int dir, const char *key, int keylen)
+{
+	uint32_t hash = 2166136261U;
+	int i;
+
+	hash = (hash ^ drive) * 16777619U;
+	hash = (hash ^ (uint32_t) dir) * 16777619U;
+	for(i = 0; i < keylen; i++)
+	{
+		hash ^= (uint32_t) (unsigned char) key[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Build the key in buf, returns the length or -1 if it doesn't fit */
+static int make_key(char *buf, int size, const char *currdir, const char *path)
+{
+	int clen = strlen(currdir) + 1;
+	int plen = strlen(path) + 1;
+
+	if(clen + plen > size)
+	{
+		return -1;
+	}
+
+	memcpy(buf, currdir, clen);
+	memcpy(buf + clen, path, plen);
+
+	return clen + plen;
+}
+
+void pc_init(struct PathCache *pc, int max)
+{
+	memset(pc, 0, sizeof(*pc));
+	if(max > 0)
+	{
+		pc->max = max;
+	}
+}
+
+static void lru_unlink(struct PathCache *pc, struct PcEnt *ent)
+{
+	if(ent->lru_prev)
+	{
+		ent->lru_prev->lru_next = ent->lru_next;
+	}
+	else
+	{
+		pc->lru_head = ent->lru_next;
+	}
+
+	if(ent->lru_next)
+	{
+		ent->lru_next->lru_prev = ent->lru_prev;
+	}
+	else
+	{
+		pc->lru_tail = ent->lru_prev;
+	}
+
+	ent->lru_prev = NULL;
+	ent->lru_next = NULL;
+}
+
+static void lru_push(struct PathCache *pc, struct PcEnt *ent)
+{
+	ent->lru_prev = NULL;
+	ent->lru_next = pc->lru_head;
+	if(pc->lru_head)
+	{
+		pc->lru_head->lru_prev = ent;
+	}
+	else
+	{
+		pc->lru_tail = ent;
+	}
+	pc->lru_head = ent;
+}
+
+static void remove_ent(struct PathCache *pc, struct PcEnt *ent)
+{
+	struct PcEnt **pp;
+
+	for(pp = &pc->buckets[ent->hash % PC_BUCKETS]; *pp; pp = &(*pp)->next)
+	{
+		if(*pp == ent)
+		{
+			*pp = ent->next;
+			break;
+		}
+	}
+
+	lru_unlink(pc, ent);
+	pc->count--;
+	free(ent);
+}
+
+int pc_lookup(struct PathCache *pc, unsigned int drive, const char *currdir, const char *path, int dir, char *retpath)
+{
+	char key[PATH_MAX * 2];
+	struct PcEnt *ent;
+	uint32_t hash;
+	int keylen;
+
+	if(pc->max == 0)
+	{
+		return 0;
+	}
+
+	keylen = make_key(key, sizeof(key), currdir, path);
+	if(keylen < 0)
+	{
+		return 0;
+	}
+
+	hash = hash_key(drive, dir, key, keylen);
+	for(ent = pc->buckets[hash % PC_BUCKETS]; ent; ent = ent->next)
+	{
+		if((ent->hash == hash) && (ent->drive == drive) && (ent->dir == dir)
+				&& (ent->keylen == keylen) && (memcmp(ent->key, key, keylen) == 0))
+		{
+			strcpy(retpath, ent->result);
+			if(pc->lru_head != ent)
+			{
+				lru_unlink(pc, ent);
+				lru_push(pc, ent);
+			}
+			pc->stats.hits++;
+			return 1;
+		}
+	}
+
+	pc->stats.misses++;
+
+	return 0;
+}
+
+void pc_insert(struct PathCache *pc, unsigned int drive, const char *currdir, const char *path, int dir, const char *retpath)
+{
+	char key[PATH_MAX * 2];
+	struct PcEnt *ent;
+	int keylen;
+	int reslen;
+
+	if(pc->max == 0)
+	{
+		return;
+	}
+
+	keylen = make_key(key, sizeof(key), currdir, path);
+	if(keylen < 0)
+	{
+		return;
+	}
+
+	while((pc->count >= pc->max) && (pc->lru_tail))
+	{
+		remove_ent(pc, pc->lru_tail);
+		pc->stats.evicted++;
+	}
+
+	reslen = strlen(retpath) + 1;
+	/* Key and result live in the same allocation as the entry */
+	ent = (struct PcEnt *) malloc(sizeof(struct PcEnt) + keylen + reslen);
+	if(ent == NULL)
+	{
+		return;
+	}
+
+	memset(ent, 0, sizeof(*ent));
+	ent->key = (char *) (ent + 1);
+	ent->result = ent->key + keylen;
+	memcpy(ent->key, key, keylen);
+	memcpy(ent->result, retpath, reslen);
+	ent->keylen = keylen;
+	ent->drive = drive;
+	ent->dir = dir;
+	ent->hash = hash_key(drive, dir, key, keylen);
+
+	ent->next = pc->buckets[ent->hash % PC_BUCKETS];
+	pc->buckets[ent->hash % PC_BUCKETS] = ent;
+	lru_push(pc, ent);
+	pc->count++;
+}
+
+void pc_flush(struct PathCache *pc)
+{
+	while(pc->lru_head)
+	{
+		remove_ent(pc, pc->lru_head);
+	}
+
+	pc->stats.flushes++;
+}
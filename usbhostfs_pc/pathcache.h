@@ -0,0 +1,88 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * pathcache.h - Resolved path cache for USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __PATHCACHE_H__
+#define __PATHCACHE_H__
+
+#include <stdint.h>
+
+#define PC_DEF_MAX  1024
+#define PC_BUCKETS  1024
+
+struct PcEnt
+{
+	/* Next entry in the hash chain */
+	struct PcEnt *next;
+	/* Links in the LRU list, most recently used first */
+	struct PcEnt *lru_prev;
+	struct PcEnt *lru_next;
+	uint32_t hash;
+	unsigned int drive;
+	int dir;
+	/* Key is the current directory and the PSP path, both nul terminated */
+	int keylen;
+	char *key;
+	char *result;
+};
+
+struct PcStats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evicted;
+	/* Number of times the drive state changed and the cache was emptied */
+	uint64_t flushes;
+};
+
+/* Not locked, all calls must be made with the drive mutex held */
+struct PathCache
+{
+	/* Maximum number of entries, 0 disables */
+	int max;
+	int count;
+	struct PcEnt *buckets[PC_BUCKETS];
+	struct PcEnt *lru_head;
+	struct PcEnt *lru_tail;
+	struct PcStats stats;
+};
+
+/**
+ * Initialise the cache
+ *
+ * @param pc - The cache
+ * @param max - Maximum number of resolved paths to keep, 0 disables
+ */
+void pc_init(struct PathCache *pc, int max);
+
+/**
+ * Look up a resolved path
+ *
+ * @param pc - The cache
+ * @param drive - The host drive number
+ * @param currdir - The drive's current directory
+ * @param path - The path from the PSP
+ * @param dir - The directory flag passed to make_path
+ * @param retpath - Receives the resolved host path, PATH_MAX bytes
+ *
+ * @return 1 if found, 0 if not
+ */
+int  pc_lookup(struct PathCache *pc, unsigned int drive, const char *currdir, const char *path, int dir, char *retpath);
+
+/**
+ * Add a resolved path, evicting the least recently used if full
+ */
+void pc_insert(struct PathCache *pc, unsigned int drive, const char *currdir, const char *path, int dir, const char *retpath);
+
+/**
+ * Throw away every entry, call whenever the drive state changes
+ */
+void pc_flush(struct PathCache *pc);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * reqpool.c - Threads running tagged USB HostFS requests
+ *
+ * Copyright (c) pspdev
+ *
+ * The worker reads each tagged command and its data off the transport and
+ * queues it here. Commands on a handle are keyed by it and always go to the
+ * same lane, so they run in the order the PSP sent them. Everything else
+ * goes on a shared queue any idle lane takes from, which is what lets a slow
+ * stat run alongside a read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usbhostfs_pc.h"
+#include "reqpool.h"
+
+static struct RpReq *take_req(struct ReqPool *rp, struct RpLane *lane)
+{
+	struct RpReq *req = NULL;
+
+	/* Keyed requests first, they can't go to anyone else */
+	if(lane->head)
+	{
+		req = lane->head;
+		lane->head = req->next;
+		if(lane->head == NULL)
+		{
+			lane->tail = NULL;
+		}
+	}
+	else if(rp->head)
+	{
+		req = rp->head;
+		rp->head = req->next;
+		if(rp->head == NULL)
+		{
+			rp->tail = NULL;
+		}
+	}
+
+	return req;
+}
+
+static void *lane_thread(void *arg)
+{
+	struct RpLane *lane = (struct RpLane *) arg;
+	struct ReqPool *rp = lane->pool;
+	struct RpReq *req;
+
+	pthread_mutex_lock(&rp->lock);
+	while(1)
+	{
+		req = take_req(rp, lane);
+		if(req == NULL)
+		{
+			if(rp->stop)
+			{
+				break;
+			}
+
+			pthread_cond_wait(&rp->work, &rp->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&rp->lock);
+		rp->run(lane->arg, req);
+		free(req);
+		pthread_mutex_lock(&rp->lock);
+
+		rp->inflight--;
+		pthread_cond_broadcast(&rp->done);
+	}
+	pthread_mutex_unlock(&rp->lock);
+
+	return NULL;
+}
+
+int rp_start(struct ReqPool *rp, int nlanes, void (*run)(void *arg, struct RpReq *req), void **args)
+{
+	int i;
+
+	if(nlanes > RP_MAX_LANES)
+	{
+		nlanes = RP_MAX_LANES;
+	}
+
+	memset(rp, 0, sizeof(*rp));
+	pthread_mutex_init(&rp->lock, NULL);
+	pthread_cond_init(&rp->work, NULL);
+	pthread_cond_init(&rp->done, NULL);
+	pthread_mutex_init(&rp->reply_lock, NULL);
+	rp->run = run;
+
+	for(i = 0; i < nlanes; i++)
+	{
+		struct RpLane *lane = &rp->lanes[i];
+
+		lane->pool = rp;
+		lane->arg = args[i];
+		if(pthread_create(&lane->thid, NULL, lane_thread, lane))
+		{
+			fprintf(stderr, "Could not create request lane %d\n", i);
+			break;
+		}
+		lane->started = 1;
+		rp->nlanes++;
+	}
+
+	if(rp->nlanes < nlanes)
+	{
+		rp_stop(rp);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct RpReq *rp_alloc(int extralen)
+{
+	struct RpReq *req;
+
+	req = (struct RpReq *) malloc(sizeof(struct RpReq) + extralen);
+	if(req)
+	{
+		memset(req, 0, sizeof(*req));
+		req->extralen = extralen;
+		req->extra = (char *) (req + 1);
+	}
+
+	return req;
+}
+
+void rp_submit(struct ReqPool *rp, struct RpReq *req, int key)
+{
+	req->next = NULL;
+
+	pthread_mutex_lock(&rp->lock);
+	if(rp->inflight >= RP_MAX_QUEUED)
+	{
+		rp->stats.full++;
+		while(rp->inflight >= RP_MAX_QUEUED)
+		{
+			pthread_cond_wait(&rp->done, &rp->lock);
+		}
+	}
+
+	if(key >= 0)
+	{
+		struct RpLane *lane = &rp->lanes[key % rp->nlanes];
+
+		if(lane->tail)
+		{
+			lane->tail->next = req;
+		}
+		else
+		{
+			lane->head = req;
+		}
+		lane->tail = req;
+	}
+	else
+	{
+		if(rp->tail)
+		{
+			rp->tail->next = req;
+		}
+		else
+		{
+			rp->head = req;
+		}
+		rp->tail = req;
+	}
+
+	rp->inflight++;
+	rp->stats.reqs++;
+	if(rp->inflight > rp->stats.inflight_max)
+	{
+		rp->stats.inflight_max = rp->inflight;
+	}
+
+	/* Only the lane owning a key can take it, so wake them all */
+	pthread_cond_broadcast(&rp->work);
+	pthread_mutex_unlock(&rp->lock);
+}
+
+void rp_drain(struct ReqPool *rp)
+{
+	pthread_mutex_lock(&rp->lock);
+	if(rp->inflight > 0)
+	{
+		rp->stats.drains++;
+		while(rp->inflight > 0)
+		{
+			pthread_cond_wait(&rp->done, &rp->lock);
+		}
+	}
+	pthread_mutex_unlock(&rp->lock);
+}
+
+void rp_stop(struct ReqPool *rp)
+{
+	int i;
+
+	pthread_mutex_lock(&rp->lock);
+	rp->stop = 1;
+	pthread_cond_broadcast(&rp->work);
+	pthread_mutex_unlock(&rp->lock);
+
+	for(i = 0; i < RP_MAX_LANES; i++)
+	{
+		if(rp->lanes[i].started)
+		{
+			pthread_join(rp->lanes[i].thid, NULL);
+			rp->lanes[i].started = 0;
+		}
+	}
+
+	pthread_mutex_destroy(&rp->reply_lock);
+	pthread_cond_destroy(&rp->done);
+	pthread_cond_destroy(&rp->work);
+	pthread_mutex_destroy(&rp->lock);
+}
@@ -0,0 +1,117 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * reqpool.h - Threads running tagged USB HostFS requests
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __REQPOOL_H__
+#define __REQPOOL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define RP_MAX_LANES   16
+#define RP_DEF_LANES   4
+/* Requests queued or running before the worker stops reading more */
+#define RP_MAX_QUEUED  32
+
+/* A tagged command read by the worker, with its extra data */
+struct RpReq
+{
+	struct RpReq *next;
+	/* Tag exactly as the PSP sent it, echoed in the reply */
+	uint32_t tag;
+	int cmdlen;
+	uint32_t cmd[512/sizeof(uint32_t)];
+	int extralen;
+	char *extra;
+};
+
+struct RpStats
+{
+	uint64_t reqs;
+	/* Most requests queued or running at once */
+	int inflight_max;
+	/* Times the worker had to wait for room */
+	uint64_t full;
+	/* Untagged commands which waited for the lanes to empty */
+	uint64_t drains;
+};
+
+struct ReqPool;
+
+/* One thread, requests with the same key always run on the same lane */
+struct RpLane
+{
+	struct ReqPool *pool;
+	pthread_t thid;
+	int started;
+	struct RpReq *head;
+	struct RpReq *tail;
+	/* Passed to the run function */
+	void *arg;
+};
+
+struct ReqPool
+{
+	pthread_mutex_t lock;
+	/* Signalled when a request is queued or the pool is stopping */
+	pthread_cond_t work;
+	/* Signalled when a request has finished */
+	pthread_cond_t done;
+	/* Requests without a key, taken by whichever lane is free */
+	struct RpReq *head;
+	struct RpReq *tail;
+	struct RpLane lanes[RP_MAX_LANES];
+	int nlanes;
+	int inflight;
+	int stop;
+	void (*run)(void *arg, struct RpReq *req);
+	/* Held by a lane while it sends a reply so the packets stay together */
+	pthread_mutex_t reply_lock;
+	struct RpStats stats;
+};
+
+/**
+ * Start the lanes of a pool
+ *
+ * @param rp - The pool
+ * @param nlanes - Number of lanes
+ * @param run - Called on a lane for each request, which is freed afterwards
+ * @param args - Argument passed to run for each lane
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  rp_start(struct ReqPool *rp, int nlanes, void (*run)(void *arg, struct RpReq *req), void **args);
+
+/**
+ * Allocate a request with room for its extra data
+ *
+ * @return The request, NULL if out of memory
+ */
+struct RpReq *rp_alloc(int extralen);
+
+/**
+ * Queue a request, waits if too many are already queued
+ *
+ * @param rp - The pool
+ * @param req - The request, owned by the pool from now on
+ * @param key - Requests with the same key run in order, < 0 for none
+ */
+void rp_submit(struct ReqPool *rp, struct RpReq *req, int key);
+
+/**
+ * Wait for every queued request to finish
+ */
+void rp_drain(struct ReqPool *rp);
+
+/**
+ * Run what is still queued then stop the lanes
+ */
+void rp_stop(struct ReqPool *rp);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * trace.c - Capture of USB HostFS sessions for replay
+ *
+ * Copyright (c) pspdev
+ *
+ * A trace is a header followed by one record for everything the PSP sent,
+ * plus the start of each reply so a replay can map handles and spot
+ * differences. Write and bulk data is reduced to its length unless payloads
+ * were asked for, which keeps traces of long loading sessions small.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "usbhostfs_pc.h"
+#include "trace.h"
+
+int trace_open(struct Trace *tr, const char *path, int payloads)
+{
+	struct TraceHeader hdr;
+
+	memset(tr, 0, sizeof(*tr));
+	tr->fp = fopen(path, "wb");
+	if(tr->fp == NULL)
+	{
+		fprintf(stderr, "Could not open trace file %s\n", path);
+		return -1;
+	}
+
+	pthread_mutex_init(&tr->lock, NULL);
+	tr->payloads = payloads;
+	tr->start = get_time_ns();
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = LE32(TRACE_VERSION);
+	hdr.flags = LE32(payloads ? TRACE_FLAG_PAYLOADS : 0);
+	hdr.start = LE64((uint64_t) time(NULL));
+
+	if(fwrite(&hdr, sizeof(hdr), 1, tr->fp) != 1)
+	{
+		fprintf(stderr, "Could not write trace file %s\n", path);
+		fclose(tr->fp);
+		tr->fp = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void trace_record(struct Trace *tr, int type, int slot, const void *data, int len, int keep)
+{
+	struct TraceRec rec;
+
+	rec.type = type;
+	rec.slot = slot;
+	rec.flags = LE16((keep) && (len > 0) ? TRACE_REC_DATA : 0);
+	rec.len = LE32(len);
+	rec.time_ns = LE64(get_time_ns() - tr->start);
+
+	pthread_mutex_lock(&tr->lock);
+	if(tr->fp)
+	{
+		fwrite(&rec, sizeof(rec), 1, tr->fp);
+		tr->bytes += sizeof(rec);
+		if(LE16(rec.flags) & TRACE_REC_DATA)
+		{
+			fwrite(data, len, 1, tr->fp);
+			tr->bytes += len;
+		}
+		tr->records++;
+		/* Sessions are complete on disk as soon as they end, the rest is
+		 * flushed on exit */
+		if(type == TRACE_DISCONNECT)
+		{
+			fflush(tr->fp);
+		}
+	}
+	pthread_mutex_unlock(&tr->lock);
+}
+
+int trace_read_header(FILE *fp, struct TraceHeader *hdr)
+{
+	if(fread(hdr, sizeof(*hdr), 1, fp) != 1)
+	{
+		fprintf(stderr, "Could not read trace header\n");
+		return -1;
+	}
+
+	if(memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0)
+	{
+		fprintf(stderr, "Not a HostFS trace\n");
+		return -1;
+	}
+
+	if(LE32(hdr->version) != TRACE_VERSION)
+	{
+		fprintf(stderr, "Unsupported trace version %d\n", LE32(hdr->version));
+		return -1;
+	}
+
+	return 0;
+}
+
+int trace_read_rec(FILE *fp, struct TraceRec *rec, void *data, int max)
+{
+	int len;
+
+	if(fread(rec, sizeof(*rec), 1, fp) != 1)
+	{
+		return feof(fp) ? 0 : -1;
+	}
+
+	rec->flags = LE16(rec->flags);
+	rec->len = LE32(rec->len);
+	rec->time_ns = LE64(rec->time_ns);
+
+	if(rec->flags & TRACE_REC_DATA)
+	{
+		len = rec->len < max ? rec->len : max;
+		if((len > 0) && (fread(data, len, 1, fp) != 1))
+		{
+			return -1;
+		}
+
+		if((rec->len > len) && (fseek(fp, rec->len - len, SEEK_CUR) < 0))
+		{
+			return -1;
+		}
+	}
+
+	return 1;
+}
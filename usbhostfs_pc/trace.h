@@ -0,0 +1,109 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * trace.h - Capture of USB HostFS sessions for replay
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define TRACE_MAGIC   "PSPHFSTR"
+#define TRACE_VERSION 1
+/* Most of a reply kept in the trace, enough for the header and result */
+#define TRACE_REPLY_MAX 32
+
+/* Set in the file header if write and bulk data was kept */
+#define TRACE_FLAG_PAYLOADS 1
+
+enum TraceType
+{
+	/* A device was connected, the data is its description */
+	TRACE_CONNECT = 1,
+	TRACE_DISCONNECT,
+	/* A command packet from the PSP */
+	TRACE_CMD,
+	/* Data from the PSP following a command */
+	TRACE_DATA,
+	/* The start of the reply to a HostFS command */
+	TRACE_REPLY,
+};
+
+/* Set if the data follows the record, otherwise only the length is known */
+#define TRACE_REC_DATA 1
+
+struct TraceHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	/* Wall clock time the capture started, in seconds */
+	uint64_t start;
+} __attribute__((packed));
+
+/* Every field is little endian */
+struct TraceRec
+{
+	uint8_t type;
+	uint8_t slot;
+	uint16_t flags;
+	uint32_t len;
+	/* Time since the capture started */
+	uint64_t time_ns;
+} __attribute__((packed));
+
+struct Trace
+{
+	FILE *fp;
+	pthread_mutex_t lock;
+	uint64_t start;
+	int payloads;
+	uint64_t records;
+	uint64_t bytes;
+};
+
+/**
+ * Start a capture
+ *
+ * @param tr - The trace
+ * @param path - File to write
+ * @param payloads - Keep write and bulk data as well as the commands
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  trace_open(struct Trace *tr, const char *path, int payloads);
+
+/**
+ * Write a record, can be called from any thread
+ *
+ * @param tr - The trace
+ * @param type - One of TraceType
+ * @param slot - The device slot
+ * @param data - The data
+ * @param len - Length of the data
+ * @param keep - Write the data and not just its length
+ */
+void trace_record(struct Trace *tr, int type, int slot, const void *data, int len, int keep);
+
+/**
+ * Read and check the header of a trace file
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  trace_read_header(FILE *fp, struct TraceHeader *hdr);
+
+/**
+ * Read the next record, data is truncated to max bytes
+ *
+ * @return 1 on success, 0 at the end of the file, < 0 on error
+ */
+int  trace_read_rec(FILE *fp, struct TraceRec *rec, void *data, int max);
+
+#endif
@@ -0,0 +1,818 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * transport.c - Transports carrying the USB HostFS protocol
+ *
+ * Copyright (c) pspdev
+ *
+ * The USB transport drives the pipelined transfer engine in usbxfer.c. The
+ * socket transport carries the same packets over TCP or a Unix socket so an
+ * emulator or a test client can stand in for the PSP. The PSP only ever has
+ * one request outstanding so the socket side just reads and writes directly,
+ * the frame boundaries take the place of USB short packets. Tagged requests
+ * run on other threads with a transport of their own, which reads from the
+ * data the worker already took off the wire and replies on the worker's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <usbhostfs.h>
+#include "usbhostfs_pc.h"
+#include "transport.h"
+
+static int usb_start(struct Transport *t)
+{
+	return xfer_start(&t->xfer, t->usbctx, t->dev, t->depth, t->timeout);
+}
+
+static void usb_stop(struct Transport *t)
+{
+	xfer_stop(&t->xfer);
+}
+
+static int usb_read_cmd(struct Transport *t, void *data, int size)
+{
+	return xfer_read_cmd(&t->xfer, data, size);
+}
+
+static int usb_read(struct Transport *t, void *data, int size, int timeout)
+{
+	return xfer_read(&t->xfer, data, size, timeout);
+}
+
+static int usb_write(struct Transport *t, const void *data, int size, int timeout)
+{
+	return xfer_write(&t->xfer, data, size, timeout);
+}
+
+static int usb_write_async(struct Transport *t, const void *data, int size, int timeout)
+{
+	int wrbytes;
+	int ret;
+
+	V_PRINTF(2, "Bulk Write dev %p, ep 0x%x, size %d, timeout %d\n", t->dev, TRANS_EP_ASYNC, size, timeout);
+
+	ret = libusb_bulk_transfer(t->dev, TRANS_EP_ASYNC, (unsigned char *) data, size, &wrbytes, timeout);
+	if(!ret)
+	{
+		ret = wrbytes;
+	}
+
+	V_PRINTF(2, "Bulk Write returned %d\n", ret);
+
+	return ret;
+}
+
+static int usb_flush(struct Transport *t)
+{
+	return xfer_flush(&t->xfer);
+}
+
+static void usb_close(struct Transport *t)
+{
+	if(t->dev)
+	{
+		libusb_release_interface(t->dev, 0);
+		libusb_reset_device(t->dev);
+		libusb_close(t->dev);
+		t->dev = NULL;
+	}
+}
+
+static void usb_get_stats(struct Transport *t, struct UsbXferStats *stats)
+{
+	xfer_get_stats(&t->xfer, stats);
+}
+
+static const struct TransOps g_usbops =
+{
+	"usb",
+	usb_start,
+	usb_stop,
+	usb_read_cmd,
+	usb_read,
+	usb_write,
+	usb_write_async,
+	usb_flush,
+	usb_close,
+	usb_close,
+	usb_get_stats,
+};
+
+/* Wait for a socket to become ready, returns 1 if it is, 0 on timeout */
+static int sock_wait(int fd, int events, int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+
+	do
+	{
+		ret = poll(&pfd, 1, timeout > 0 ? timeout : -1);
+	}
+	while((ret < 0) && (errno == EINTR));
+
+	return ret;
+}
+
+/* Read exactly size bytes, returns size, 0 if the remote closed the connection
+ * before anything was read, TRANS_ERROR_TIMEOUT or LIBUSB_ERROR_IO */
+static int sock_read_all(int fd, void *data, int size, int timeout)
+{
+	char *p = (char *) data;
+	int readlen = 0;
+
+	while(readlen < size)
+	{
+		int ret;
+
+		ret = sock_wait(fd, POLLIN, timeout);
+		if(ret == 0)
+		{
+			return TRANS_ERROR_TIMEOUT;
+		}
+		else if(ret < 0)
+		{
+			return LIBUSB_ERROR_IO;
+		}
+
+		ret = recv(fd, p + readlen, size - readlen, 0);
+		if(ret == 0)
+		{
+			return readlen == 0 ? 0 : LIBUSB_ERROR_IO;
+		}
+		else if(ret < 0)
+		{
+			if((errno == EINTR) || (errno == EAGAIN))
+			{
+				continue;
+			}
+			return LIBUSB_ERROR_IO;
+		}
+
+		readlen += ret;
+	}
+
+	return size;
+}
+
+/* Read the header of the next IN frame, returns as sock_read_all */
+static int sock_next_frame(struct Transport *t, int timeout)
+{
+	struct TransFrame frame;
+	int ret;
+
+	ret = sock_read_all(t->fd, &frame, sizeof(frame), timeout);
+	if(ret <= 0)
+	{
+		return ret;
+	}
+
+	if((LE32(frame.ep) != TRANS_EP_IN) || (LE32(frame.size) > TRANS_MAX_FRAME))
+	{
+		fprintf(stderr, "Invalid frame from %s (ep 0x%x, size %d)\n", t->desc, LE32(frame.ep), LE32(frame.size));
+		return LIBUSB_ERROR_IO;
+	}
+
+	t->rxleft = LE32(frame.size);
+
+	pthread_mutex_lock(&t->wlock);
+	t->stats.rx_transfers++;
+	t->stats.rx_bytes += t->rxleft;
+	pthread_mutex_unlock(&t->wlock);
+
+	return ret;
+}
+
+/* Send one frame, must be called with wlock held */
+static int sock_send_frame(struct Transport *t, int ep, const void *data, int size, int timeout)
+{
+	struct TransFrame frame;
+	struct iovec iov[2];
+	struct msghdr msg;
+	int total = sizeof(frame) + size;
+	int sent = 0;
+
+	frame.size = LE32(size);
+	frame.ep = LE32(ep);
+
+	while(sent < total)
+	{
+		int ret;
+
+		iov[0].iov_base = (char *) &frame + sent;
+		iov[0].iov_len = sent < sizeof(frame) ? sizeof(frame) - sent : 0;
+		iov[1].iov_base = (char *) data + (sent > sizeof(frame) ? sent - sizeof(frame) : 0);
+		iov[1].iov_len = size - (sent > sizeof(frame) ? sent - sizeof(frame) : 0);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov[0].iov_len ? &iov[0] : &iov[1];
+		msg.msg_iovlen = iov[0].iov_len ? 2 : 1;
+
+		ret = sendmsg(t->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			if(errno == EAGAIN)
+			{
+				if(sock_wait(t->fd, POLLOUT, timeout) <= 0)
+				{
+					return LIBUSB_ERROR_TIMEOUT;
+				}
+				continue;
+			}
+
+			return LIBUSB_ERROR_IO;
+		}
+
+		sent += ret;
+	}
+
+	t->stats.tx_transfers++;
+	t->stats.tx_bytes += size;
+
+	return size;
+}
+
+static int sock_start(struct Transport *t)
+{
+	t->rxleft = 0;
+	t->start_time = get_time_ns();
+
+	return 0;
+}
+
+static void sock_stop(struct Transport *t)
+{
+}
+
+static int sock_read_cmd(struct Transport *t, void *data, int size)
+{
+	uint64_t start;
+	int len;
+	int ret;
+
+	/* A command starts a new frame unless the last one wasn't used up */
+	if(t->rxleft == 0)
+	{
+		start = get_time_ns();
+		ret = sock_next_frame(t, t->timeout);
+
+		pthread_mutex_lock(&t->wlock);
+		t->stats.wait_ns += get_time_ns() - start;
+		pthread_mutex_unlock(&t->wlock);
+
+		if(ret <= 0)
+		{
+			return ret;
+		}
+	}
+
+	len = t->rxleft < size ? t->rxleft : size;
+	ret = sock_read_all(t->fd, data, len, 10000);
+	if(ret != len)
+	{
+		return ret == 0 ? LIBUSB_ERROR_IO : ret;
+	}
+	t->rxleft -= len;
+
+	V_PRINTF(2, "Command read returned %d\n", len);
+
+	return len;
+}
+
+static int sock_read(struct Transport *t, void *data, int size, int timeout)
+{
+	char *p = (char *) data;
+	int readlen = 0;
+
+	V_PRINTF(2, "Socket read size %d, timeout %d\n", size, timeout);
+
+	while(readlen < size)
+	{
+		int len;
+		int ret;
+
+		if(t->rxleft == 0)
+		{
+			ret = sock_next_frame(t, timeout);
+			if(ret <= 0)
+			{
+				if(ret == TRANS_ERROR_TIMEOUT)
+				{
+					fprintf(stderr, "Timeout waiting for %d bytes of data\n", size - readlen);
+				}
+				return readlen > 0 ? readlen : (ret == 0 ? LIBUSB_ERROR_IO : ret);
+			}
+			continue;
+		}
+
+		len = size - readlen;
+		if(len > t->rxleft)
+		{
+			len = t->rxleft;
+		}
+
+		ret = sock_read_all(t->fd, p + readlen, len, timeout);
+		if(ret != len)
+		{
+			return readlen > 0 ? readlen : (ret == 0 ? LIBUSB_ERROR_IO : ret);
+		}
+
+		t->rxleft -= len;
+		readlen += len;
+	}
+
+	return readlen;
+}
+
+static int sock_write(struct Transport *t, const void *data, int size, int timeout)
+{
+	int ret;
+
+	pthread_mutex_lock(&t->wlock);
+	ret = sock_send_frame(t, TRANS_EP_OUT, data, size, timeout);
+	pthread_mutex_unlock(&t->wlock);
+
+	return ret;
+}
+
+static int sock_write_async(struct Transport *t, const void *data, int size, int timeout)
+{
+	int ret;
+
+	pthread_mutex_lock(&t->wlock);
+	ret = sock_send_frame(t, TRANS_EP_ASYNC, data, size, timeout);
+	pthread_mutex_unlock(&t->wlock);
+
+	return ret;
+}
+
+static int sock_flush(struct Transport *t)
+{
+	/* Replies are written straight to the socket */
+	return 0;
+}
+
+static void sock_shutdown(struct Transport *t)
+{
+	if(t->fd >= 0)
+	{
+		shutdown(t->fd, SHUT_RDWR);
+	}
+}
+
+static void sock_close(struct Transport *t)
+{
+	if(t->fd >= 0)
+	{
+		close(t->fd);
+		t->fd = -1;
+		pthread_mutex_destroy(&t->wlock);
+	}
+}
+
+static void sock_get_stats(struct Transport *t, struct UsbXferStats *stats)
+{
+	pthread_mutex_lock(&t->wlock);
+	*stats = t->stats;
+	stats->run_ns = t->start_time ? get_time_ns() - t->start_time : 0;
+	pthread_mutex_unlock(&t->wlock);
+}
+
+static const struct TransOps g_sockops =
+{
+	"socket",
+	sock_start,
+	sock_stop,
+	sock_read_cmd,
+	sock_read,
+	sock_write,
+	sock_write_async,
+	sock_flush,
+	sock_shutdown,
+	sock_close,
+	sock_get_stats,
+};
+
+static int tag_start(struct Transport *t)
+{
+	return 0;
+}
+
+static void tag_stop(struct Transport *t)
+{
+}
+
+static int tag_read_cmd(struct Transport *t, void *data, int size)
+{
+	return -1;
+}
+
+static int tag_read(struct Transport *t, void *data, int size, int timeout)
+{
+	if(size > t->tag_left)
+	{
+		fprintf(stderr, "Tagged command wanted %d bytes, only %d were sent\n", size, t->tag_left);
+		return -1;
+	}
+
+	memcpy(data, t->tag_data, size);
+	t->tag_data += size;
+	t->tag_left -= size;
+
+	return size;
+}
+
+static int tag_write(struct Transport *t, const void *data, int size, int timeout)
+{
+	struct Transport *p = t->parent;
+	char buf[512];
+	int ret;
+
+	if(t->tag_sent)
+	{
+		return p->ops->write(p, data, size, timeout);
+	}
+
+	/* The tag and the response go in one packet so the PSP can tell whose it is */
+	if(size > (int) (sizeof(buf) - sizeof(uint32_t) * 2))
+	{
+		fprintf(stderr, "Tagged response too large (%d)\n", size);
+		return -1;
+	}
+
+	((uint32_t *) buf)[0] = LE32(HOSTFS_TAG_MAGIC);
+	((uint32_t *) buf)[1] = t->tag;
+	memcpy(buf + sizeof(uint32_t) * 2, data, size);
+
+	pthread_mutex_lock(t->reply_lock);
+	t->tag_sent = 1;
+	ret = p->ops->write(p, buf, size + sizeof(uint32_t) * 2, timeout);
+
+	return ret < 0 ? ret : size;
+}
+
+static int tag_write_async(struct Transport *t, const void *data, int size, int timeout)
+{
+	return trans_write_async(t->parent, data, size, timeout);
+}
+
+static int tag_flush(struct Transport *t)
+{
+	return 0;
+}
+
+static void tag_close(struct Transport *t)
+{
+}
+
+static void tag_get_stats(struct Transport *t, struct UsbXferStats *stats)
+{
+	trans_get_stats(t->parent, stats);
+}
+
+static const struct TransOps g_tagops =
+{
+	"tagged",
+	tag_start,
+	tag_stop,
+	tag_read_cmd,
+	tag_read,
+	tag_write,
+	tag_write_async,
+	tag_flush,
+	tag_close,
+	tag_close,
+	tag_get_stats,
+};
+
+void trans_init_usb(struct Transport *t, libusb_context *ctx, libusb_device_handle *dev, int depth, int timeout)
+{
+	libusb_device *usbdev = libusb_get_device(dev);
+
+	memset(t, 0, sizeof(*t));
+	t->ops = &g_usbops;
+	t->usbctx = ctx;
+	t->dev = dev;
+	t->depth = depth;
+	t->timeout = timeout;
+	t->fd = -1;
+	snprintf(t->desc, sizeof(t->desc), "bus %d device %d",
+			libusb_get_bus_number(usbdev), libusb_get_device_address(usbdev));
+}
+
+int trans_init_socket(struct Transport *t, int fd, const char *peer, int timeout)
+{
+	memset(t, 0, sizeof(*t));
+	t->ops = &g_sockops;
+	t->timeout = timeout;
+	t->fd = fd;
+	snprintf(t->desc, sizeof(t->desc), "%s", peer);
+
+	if(pthread_mutex_init(&t->wlock, NULL))
+	{
+		fprintf(stderr, "Could not create transport lock\n");
+		t->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Split host:port, a plain number is just a port */
+static int parse_tcp_addr(const char *addr, char *host, int hostlen, unsigned short *port)
+{
+	const char *colon;
+	char *endp;
+	unsigned long val;
+
+	colon = strrchr(addr, ':');
+	if(colon)
+	{
+		if((colon - addr) >= hostlen)
+		{
+			return -1;
+		}
+		memcpy(host, addr, colon - addr);
+		host[colon - addr] = 0;
+		addr = colon + 1;
+	}
+	else
+	{
+		host[0] = 0;
+	}
+
+	val = strtoul(addr, &endp, 10);
+	if((*addr == 0) || (*endp != 0) || (val == 0) || (val > 65535))
+	{
+		return -1;
+	}
+
+	*port = (unsigned short) val;
+
+	return 0;
+}
+
+int trans_listen(const char *addr, int global)
+{
+	char host[128];
+	unsigned short port;
+	int sock;
+
+	if(parse_tcp_addr(addr, host, sizeof(host), &port) == 0)
+	{
+		struct sockaddr_in name;
+		int on = 1;
+
+		memset(&name, 0, sizeof(name));
+		name.sin_family = AF_INET;
+		name.sin_port = htons(port);
+		if(host[0])
+		{
+			struct hostent *ent = gethostbyname(host);
+
+			if((ent == NULL) || (ent->h_addrtype != AF_INET))
+			{
+				fprintf(stderr, "Could not resolve %s\n", host);
+				return -1;
+			}
+			memcpy(&name.sin_addr, ent->h_addr_list[0], sizeof(name.sin_addr));
+		}
+		else
+		{
+			name.sin_addr.s_addr = htonl(global ? INADDR_ANY : INADDR_LOOPBACK);
+		}
+
+		sock = socket(PF_INET, SOCK_STREAM, 0);
+		if(sock < 0)
+		{
+			perror("socket");
+			return -1;
+		}
+
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if(bind(sock, (struct sockaddr *) &name, sizeof(name)) < 0)
+		{
+			perror("bind");
+			close(sock);
+			return -1;
+		}
+	}
+	else
+	{
+		struct sockaddr_un name;
+
+		if(strlen(addr) >= sizeof(name.sun_path))
+		{
+			fprintf(stderr, "Socket path %s is too long\n", addr);
+			return -1;
+		}
+
+		memset(&name, 0, sizeof(name));
+		name.sun_family = AF_UNIX;
+		strcpy(name.sun_path, addr);
+
+		sock = socket(PF_UNIX, SOCK_STREAM, 0);
+		if(sock < 0)
+		{
+			perror("socket");
+			return -1;
+		}
+
+		/* Remove a stale socket left behind by an earlier run */
+		unlink(addr);
+		if(bind(sock, (struct sockaddr *) &name, sizeof(name)) < 0)
+		{
+			perror("bind");
+			close(sock);
+			return -1;
+		}
+	}
+
+	if(listen(sock, 4) < 0)
+	{
+		perror("listen");
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int trans_accept(int lfd, struct Transport *t, int timeout)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	char peer[64];
+	int fd;
+
+	do
+	{
+		fd = accept(lfd, (struct sockaddr *) &addr, &len);
+	}
+	while((fd < 0) && (errno == EINTR));
+
+	if(fd < 0)
+	{
+		return -1;
+	}
+
+	if(addr.ss_family == AF_INET)
+	{
+		struct sockaddr_in *in = (struct sockaddr_in *) &addr;
+		int on = 1;
+
+		/* Replies are small and the PSP waits for every one of them */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		snprintf(peer, sizeof(peer), "tcp %s:%d", inet_ntoa(in->sin_addr), ntohs(in->sin_port));
+	}
+	else
+	{
+		snprintf(peer, sizeof(peer), "unix socket");
+	}
+
+	if(trans_init_socket(t, fd, peer, timeout) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+void trans_init_tagged(struct Transport *t, struct Transport *parent, pthread_mutex_t *reply_lock)
+{
+	memset(t, 0, sizeof(*t));
+	t->ops = &g_tagops;
+	t->parent = parent;
+	t->reply_lock = reply_lock;
+	strcpy(t->desc, parent->desc);
+}
+
+void trans_tag_begin(struct Transport *t, uint32_t tag, const void *data, int len)
+{
+	t->tag = tag;
+	t->tag_sent = 0;
+	t->tag_data = (const char *) data;
+	t->tag_left = len;
+}
+
+void trans_tag_end(struct Transport *t)
+{
+	if(t->tag_sent)
+	{
+		pthread_mutex_unlock(t->reply_lock);
+		t->tag_sent = 0;
+	}
+	t->tag_left = 0;
+}
+
+int trans_start(struct Transport *t)
+{
+	return t->ops->start(t);
+}
+
+void trans_stop(struct Transport *t)
+{
+	t->ops->stop(t);
+}
+
+int trans_read_cmd(struct Transport *t, void *data, int size)
+{
+	int ret = t->ops->read_cmd(t, data, size);
+
+	if(ret > 0)
+	{
+		t->rd_bytes += ret;
+		if(t->trace)
+		{
+			trace_record(t->trace, TRACE_CMD, t->trace_slot, data, ret, 1);
+		}
+	}
+
+	return ret;
+}
+
+int trans_read(struct Transport *t, void *data, int size, int timeout)
+{
+	int ret = t->ops->read(t, data, size, timeout);
+
+	if(ret > 0)
+	{
+		t->rd_bytes += ret;
+		if(t->trace)
+		{
+			trace_record(t->trace, TRACE_DATA, t->trace_slot, data, ret, t->trace_keep);
+		}
+	}
+
+	return ret;
+}
+
+int trans_write(struct Transport *t, const void *data, int size, int timeout)
+{
+	int ret = t->ops->write(t, data, size, timeout);
+
+	if(ret > 0)
+	{
+		t->wr_bytes += ret;
+		if((t->trace) && (t->trace_reply))
+		{
+			trace_record(t->trace, TRACE_REPLY, t->trace_slot, data, ret < TRACE_REPLY_MAX ? ret : TRACE_REPLY_MAX, 1);
+			t->trace_reply = 0;
+		}
+	}
+
+	return ret;
+}
+
+int trans_write_async(struct Transport *t, const void *data, int size, int timeout)
+{
+	return t->ops->write_async(t, data, size, timeout);
+}
+
+int trans_flush(struct Transport *t)
+{
+	return t->ops->flush(t);
+}
+
+void trans_shutdown(struct Transport *t)
+{
+	t->ops->shutdown(t);
+}
+
+void trans_close(struct Transport *t)
+{
+	if(t->ops)
+	{
+		t->ops->close(t);
+	}
+}
+
+void trans_get_stats(struct Transport *t, struct UsbXferStats *stats)
+{
+	t->ops->get_stats(t, stats);
+}
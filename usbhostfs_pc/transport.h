@@ -0,0 +1,233 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * transport.h - Transports carrying the USB HostFS protocol
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <libusb.h>
+#include "usbxfer.h"
+#include "trace.h"
+
+/* Endpoints of the PSP's USB interface, the socket transport tags its frames with them */
+#define TRANS_EP_IN     0x81
+#define TRANS_EP_OUT    0x02
+#define TRANS_EP_ASYNC  0x03
+
+/* Returned by trans_read_cmd when nothing arrived in time */
+#define TRANS_ERROR_TIMEOUT LIBUSB_ERROR_TIMEOUT
+
+/* Largest frame accepted from a socket, the most the PSP sends in one write */
+#define TRANS_MAX_FRAME (64*1024)
+
+/* On a stream socket each USB transfer is sent as a frame header followed by
+ * exactly the bytes the transfer would have carried, so the HostFsCmd,
+ * AsyncCommand and BulkCommand packets are unchanged. Both fields are little
+ * endian. */
+struct TransFrame
+{
+	uint32_t size;
+	uint32_t ep;
+} __attribute__((packed));
+
+struct Transport;
+
+struct TransOps
+{
+	const char *name;
+	int  (*start)(struct Transport *t);
+	void (*stop)(struct Transport *t);
+	int  (*read_cmd)(struct Transport *t, void *data, int size);
+	int  (*read)(struct Transport *t, void *data, int size, int timeout);
+	int  (*write)(struct Transport *t, const void *data, int size, int timeout);
+	int  (*write_async)(struct Transport *t, const void *data, int size, int timeout);
+	int  (*flush)(struct Transport *t);
+	void (*shutdown)(struct Transport *t);
+	void (*close)(struct Transport *t);
+	void (*get_stats)(struct Transport *t, struct UsbXferStats *stats);
+};
+
+struct Transport
+{
+	const struct TransOps *ops;
+	/* Where the PSP is, for the device list */
+	char desc[64];
+	/* Timeout waiting for a command (0 for none) */
+	int timeout;
+	/* Bytes read and written by the worker, for the per command statistics */
+	uint64_t rd_bytes;
+	uint64_t wr_bytes;
+	/* Capture of the session, NULL if not tracing. The worker sets trace_keep
+	 * to say whether the data of the current command is worth keeping and
+	 * trace_reply when the next write starts a reply */
+	struct Trace *trace;
+	int trace_slot;
+	int trace_keep;
+	int trace_reply;
+
+	/* USB */
+	libusb_context *usbctx;
+	libusb_device_handle *dev;
+	int depth;
+	struct UsbXfer xfer;
+
+	/* Stream socket */
+	int fd;
+	/* Bytes of the current IN frame not yet read */
+	int rxleft;
+	/* Serialises the worker's replies with async writes, and protects the stats */
+	pthread_mutex_t wlock;
+	uint64_t start_time;
+	struct UsbXferStats stats;
+
+	/* Tagged request, reads come from the data the worker read ahead and
+	 * the reply goes out on the worker's transport */
+	struct Transport *parent;
+	pthread_mutex_t *reply_lock;
+	uint32_t tag;
+	int tag_sent;
+	const char *tag_data;
+	int tag_left;
+};
+
+/**
+ * Set up a transport on an opened and configured USB device
+ *
+ * @param t - The transport
+ * @param ctx - The libusb context
+ * @param dev - The device handle, owned by the transport from now on
+ * @param depth - Number of IN transfers to keep queued
+ * @param timeout - Timeout waiting for a command (0 for none)
+ */
+void trans_init_usb(struct Transport *t, libusb_context *ctx, libusb_device_handle *dev, int depth, int timeout);
+
+/**
+ * Set up a transport on a connected stream socket
+ *
+ * @param t - The transport
+ * @param fd - The socket, owned by the transport from now on
+ * @param peer - Description of the other end
+ * @param timeout - Timeout waiting for a command (0 for none)
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  trans_init_socket(struct Transport *t, int fd, const char *peer, int timeout);
+
+/**
+ * Set up a transport for running tagged requests on another thread
+ *
+ * @param t - The transport
+ * @param parent - The worker's transport the replies are sent on
+ * @param reply_lock - Held from the first packet of a reply to trans_tag_end
+ */
+void trans_init_tagged(struct Transport *t, struct Transport *parent, pthread_mutex_t *reply_lock);
+
+/**
+ * Start a tagged request, its first reply packet is sent with the tag in front
+ *
+ * @param t - A tagged transport
+ * @param tag - The tag, as the PSP sent it
+ * @param data - Extra data of the command, read ahead by the worker
+ * @param len - Length of the data
+ */
+void trans_tag_begin(struct Transport *t, uint32_t tag, const void *data, int len);
+
+/**
+ * Finish a tagged request, letting the other lanes reply
+ */
+void trans_tag_end(struct Transport *t);
+
+/**
+ * Create a socket to accept PSPs on
+ *
+ * @param addr - host:port (or just port) for TCP, otherwise the path of a
+ * Unix socket
+ * @param global - For TCP with no host, bind to all interfaces rather than
+ * just localhost
+ *
+ * @return The listening socket, < 0 on error
+ */
+int  trans_listen(const char *addr, int global);
+
+/**
+ * Accept a PSP on a listening socket
+ *
+ * @param lfd - The listening socket
+ * @param t - Receives the transport
+ * @param timeout - Timeout waiting for a command (0 for none)
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  trans_accept(int lfd, struct Transport *t, int timeout);
+
+/**
+ * Start the transport, must be called before reading or writing
+ */
+int  trans_start(struct Transport *t);
+
+/**
+ * Stop the transport, replies still in flight are thrown away
+ */
+void trans_stop(struct Transport *t);
+
+/**
+ * Read the next command packet
+ *
+ * @return Length of the command, 0 if the remote disconnected,
+ * TRANS_ERROR_TIMEOUT if nothing arrived in time, other < 0 on error
+ */
+int  trans_read_cmd(struct Transport *t, void *data, int size);
+
+/**
+ * Read an exact amount of data following a command
+ *
+ * @return Number of bytes read, < 0 on error
+ */
+int  trans_read(struct Transport *t, void *data, int size, int timeout);
+
+/**
+ * Send a reply to the PSP, may return before it has been delivered
+ *
+ * @return size on success, < 0 if this or an earlier reply failed
+ */
+int  trans_write(struct Transport *t, const void *data, int size, int timeout);
+
+/**
+ * Send async channel data to the PSP, can be called from any thread
+ *
+ * @return size on success, < 0 on error
+ */
+int  trans_write_async(struct Transport *t, const void *data, int size, int timeout);
+
+/**
+ * Wait for all replies to be delivered
+ *
+ * @return 0 on success, < 0 if a reply failed
+ */
+int  trans_flush(struct Transport *t);
+
+/**
+ * Knock the connection down from another thread, for use on exit
+ */
+void trans_shutdown(struct Transport *t);
+
+/**
+ * Close the transport and release the device or socket
+ */
+void trans_close(struct Transport *t);
+
+/**
+ * Take a snapshot of the transport statistics, the queue fields are 0 for
+ * transports without a queue
+ */
+void trans_get_stats(struct Transport *t, struct UsbXferStats *stats);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * usbhostfs_pc.h - Shared definitions for the PC side of USB HostFS
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __USBHOSTFS_PC_H__
+#define __USBHOSTFS_PC_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+extern int g_verbose;
+
+#define V_PRINTF(level, fmt, ...) { if(g_verbose >= level) { fprintf(stderr, fmt, ## __VA_ARGS__); } }
+
+#if defined BUILD_BIGENDIAN || defined _BIG_ENDIAN
+uint16_t swap16(uint16_t i);
+uint32_t swap32(uint32_t i);
+uint64_t swap64(uint64_t i);
+#define LE16(x) swap16(x)
+#define LE32(x) swap32(x)
+#define LE64(x) swap64(x)
+#else
+#define LE16(x) (x)
+#define LE32(x) (x)
+#define LE64(x) (x)
+#endif
+
+#define GETERROR(x) (0x80010000 | (x))
+
+/* Monotonic time in nanoseconds, used for the statistics */
+uint64_t get_time_ns(void);
+
+#endif
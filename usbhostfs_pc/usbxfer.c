@@ -0,0 +1,771 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * usbxfer.c - Pipelined asynchronous USB transfer engine
+ *
+ * Copyright (c) pspdev
+ *
+ * Keeps a ring of bulk IN transfers queued on the device so the PSP can
+ * send its next command while the host is still working on the last one,
+ * and sends the replies without waiting for them to complete.
+ *
+ * The IN side is treated as a stream of packets. Every PSP side write starts
+ * on a packet boundary but the PSP sends no zero length packet after a write
+ * which is a multiple of the packet size, so only a short or a full packet is
+ * sure to end a transfer. The queued transfers are one packet each, a command
+ * read returns the whole of one (as the old single 512 byte read did). A
+ * payload read knows its length, it takes what the queued transfers will hold
+ * and reads the whole packets of the rest with one transfer straight into the
+ * caller's buffer, any part packet left over arrives in a queued transfer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "usbhostfs_pc.h"
+#include "usbxfer.h"
+
+#define XFER_STOP_TRIES 20
+
+/* Work out if the bus is idle, must be called with the lock held */
+static void update_idle(struct UsbXfer *x, uint64_t now)
+{
+	if((x->waiting) || (x->stats.tx_queued > 0))
+	{
+		if(x->idle_start)
+		{
+			x->stats.idle_ns += now - x->idle_start;
+			x->idle_start = 0;
+		}
+	}
+	else if(x->idle_start == 0)
+	{
+		x->idle_start = now;
+	}
+}
+
+static int map_status(enum libusb_transfer_status status)
+{
+	switch(status)
+	{
+		case LIBUSB_TRANSFER_COMPLETED: return 0;
+		case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+		case LIBUSB_TRANSFER_STALL: return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+		default: break;
+	};
+
+	return LIBUSB_ERROR_IO;
+}
+
+static void LIBUSB_CALL rx_done(struct libusb_transfer *trans)
+{
+	struct XferBuf *buf = (struct XferBuf *) trans->user_data;
+	struct UsbXfer *x = buf->owner;
+
+	pthread_mutex_lock(&x->lock);
+	buf->pos = 0;
+	buf->busy = 0;
+	buf->done = 1;
+	x->stats.rx_queued--;
+	x->stats.rx_ready++;
+	if(x->stats.rx_ready > x->stats.rx_ready_max)
+	{
+		x->stats.rx_ready_max = x->stats.rx_ready;
+	}
+	x->stats.rx_transfers++;
+	x->stats.rx_bytes += trans->actual_length;
+	pthread_mutex_unlock(&x->lock);
+}
+
+static void LIBUSB_CALL tx_done(struct libusb_transfer *trans)
+{
+	struct XferBuf *buf = (struct XferBuf *) trans->user_data;
+	struct UsbXfer *x = buf->owner;
+
+	pthread_mutex_lock(&x->lock);
+	buf->busy = 0;
+	buf->done = 1;
+	if((trans->status != LIBUSB_TRANSFER_COMPLETED) || (trans->actual_length != trans->length))
+	{
+		x->tx_error = trans->status == LIBUSB_TRANSFER_COMPLETED ? LIBUSB_ERROR_IO : map_status(trans->status);
+	}
+	x->stats.tx_queued--;
+	x->stats.tx_transfers++;
+	x->stats.tx_bytes += trans->actual_length;
+	update_idle(x, get_time_ns());
+	pthread_mutex_unlock(&x->lock);
+}
+
+static void LIBUSB_CALL payload_done(struct libusb_transfer *trans)
+{
+	struct XferBuf *buf = (struct XferBuf *) trans->user_data;
+	struct UsbXfer *x = buf->owner;
+
+	pthread_mutex_lock(&x->lock);
+	buf->busy = 0;
+	buf->done = 1;
+	x->stats.rx_transfers++;
+	x->stats.rx_bytes += trans->actual_length;
+	pthread_mutex_unlock(&x->lock);
+}
+
+static int rx_submit(struct UsbXfer *x, struct XferBuf *buf)
+{
+	int ret;
+
+	libusb_fill_bulk_transfer(buf->trans, x->dev, x->rx_ep, buf->data, buf->size, rx_done, buf, x->timeout);
+	buf->done = 0;
+	buf->pos = 0;
+	buf->busy = 1;
+	pthread_mutex_lock(&x->lock);
+	x->stats.rx_queued++;
+	pthread_mutex_unlock(&x->lock);
+
+	ret = libusb_submit_transfer(buf->trans);
+	if(ret < 0)
+	{
+		pthread_mutex_lock(&x->lock);
+		buf->busy = 0;
+		x->stats.rx_queued--;
+		pthread_mutex_unlock(&x->lock);
+		fprintf(stderr, "Error submitting IN transfer (%s)\n", libusb_error_name(ret));
+	}
+
+	return ret;
+}
+
+/* Wait for a transfer to complete, timeout in ms, 0 waits forever */
+static int wait_done(struct UsbXfer *x, int *done, int timeout, int rx)
+{
+	uint64_t start;
+	uint64_t end = 0;
+	int ret = 0;
+
+	start = get_time_ns();
+	if(timeout > 0)
+	{
+		end = start + (uint64_t) timeout * 1000000;
+	}
+
+	if(rx)
+	{
+		pthread_mutex_lock(&x->lock);
+		x->waiting = 1;
+		update_idle(x, start);
+		pthread_mutex_unlock(&x->lock);
+	}
+
+	while(!*done)
+	{
+		int err;
+
+		if(end)
+		{
+			struct timeval tv;
+			uint64_t now = get_time_ns();
+
+			if(now >= end)
+			{
+				ret = LIBUSB_ERROR_TIMEOUT;
+				break;
+			}
+
+			tv.tv_sec = (end - now) / 1000000000;
+			tv.tv_usec = ((end - now) % 1000000000) / 1000;
+			err = libusb_handle_events_timeout_completed(x->ctx, &tv, done);
+		}
+		else
+		{
+			err = libusb_handle_events_completed(x->ctx, done);
+		}
+
+		if((err < 0) && (err != LIBUSB_ERROR_INTERRUPTED))
+		{
+			ret = err;
+			break;
+		}
+	}
+
+	if(rx)
+	{
+		uint64_t now = get_time_ns();
+
+		pthread_mutex_lock(&x->lock);
+		x->waiting = 0;
+		x->stats.wait_ns += now - start;
+		update_idle(x, now);
+		pthread_mutex_unlock(&x->lock);
+	}
+
+	return ret;
+}
+
+/* Finished with the oldest IN transfer, queue it up again */
+static int rx_recycle(struct UsbXfer *x)
+{
+	struct XferBuf *buf = &x->rx[x->rx_head];
+
+	pthread_mutex_lock(&x->lock);
+	x->stats.rx_ready--;
+	pthread_mutex_unlock(&x->lock);
+
+	x->rx_head = (x->rx_head + 1) % x->depth;
+	if(((x->payload.busy) || (x->payload.done)) && (x->payload_ahead > 0))
+	{
+		/* Goes back on the queue behind the payload transfer */
+		x->payload_ahead--;
+	}
+
+	return rx_submit(x, buf);
+}
+
+/* Get the oldest IN transfer once it has completed */
+static int rx_next(struct UsbXfer *x, struct XferBuf **pbuf, int timeout)
+{
+	struct XferBuf *buf = &x->rx[x->rx_head];
+	int ret;
+
+	if((!buf->busy) && (!buf->done))
+	{
+		/* A previous submit failed, try again */
+		ret = rx_submit(x, buf);
+		if(ret < 0)
+		{
+			return ret;
+		}
+	}
+
+	ret = wait_done(x, &buf->done, timeout, 1);
+	if(ret < 0)
+	{
+		return ret;
+	}
+
+	ret = map_status(buf->trans->status);
+	if(ret == LIBUSB_ERROR_TIMEOUT)
+	{
+		if(buf->trans->actual_length > 0)
+		{
+			/* Timed out part way through, the data is still good */
+			ret = 0;
+		}
+		else
+		{
+			/* Nothing arrived, requeue it and let the caller decide */
+			rx_recycle(x);
+		}
+	}
+
+	if(ret == 0)
+	{
+		*pbuf = buf;
+	}
+
+	return ret;
+}
+
+int xfer_start(struct UsbXfer *x, libusb_context *ctx, libusb_device_handle *dev, int depth, int timeout)
+{
+	int i;
+
+	memset(x, 0, sizeof(*x));
+	if(depth < 1)
+	{
+		depth = 1;
+	}
+	else if(depth > XFER_MAX_DEPTH)
+	{
+		depth = XFER_MAX_DEPTH;
+	}
+
+	x->ctx = ctx;
+	x->dev = dev;
+	x->rx_ep = 0x81;
+	x->tx_ep = 0x2;
+	x->depth = depth;
+	x->timeout = timeout;
+	pthread_mutex_init(&x->lock, NULL);
+
+	for(i = 0; i < depth; i++)
+	{
+		x->rx[i].owner = x;
+		x->rx[i].trans = libusb_alloc_transfer(0);
+		x->rx[i].data = malloc(XFER_RX_SIZE);
+		x->rx[i].size = XFER_RX_SIZE;
+		if((x->rx[i].trans == NULL) || (x->rx[i].data == NULL))
+		{
+			fprintf(stderr, "Could not allocate IN transfers\n");
+			xfer_stop(x);
+			return -1;
+		}
+	}
+
+	x->payload.owner = x;
+	x->payload.trans = libusb_alloc_transfer(0);
+	if(x->payload.trans == NULL)
+	{
+		fprintf(stderr, "Could not allocate payload transfer\n");
+		xfer_stop(x);
+		return -1;
+	}
+
+	for(i = 0; i < XFER_TX_SLOTS; i++)
+	{
+		x->tx[i].owner = x;
+		x->tx[i].trans = libusb_alloc_transfer(0);
+		if(x->tx[i].trans == NULL)
+		{
+			fprintf(stderr, "Could not allocate OUT transfers\n");
+			xfer_stop(x);
+			return -1;
+		}
+	}
+
+	x->start_time = get_time_ns();
+	x->idle_start = x->start_time;
+	x->stats.rx_depth = depth;
+	x->running = 1;
+
+	for(i = 0; i < depth; i++)
+	{
+		if(rx_submit(x, &x->rx[i]) < 0)
+		{
+			xfer_stop(x);
+			return -1;
+		}
+	}
+
+	V_PRINTF(1, "Transfer engine started, %d IN transfers of %d bytes\n", depth, XFER_RX_SIZE);
+
+	return 0;
+}
+
+static int any_busy(struct UsbXfer *x)
+{
+	int busy = 0;
+	int i;
+
+	pthread_mutex_lock(&x->lock);
+	for(i = 0; i < XFER_MAX_DEPTH; i++)
+	{
+		busy |= x->rx[i].busy;
+	}
+	for(i = 0; i < XFER_TX_SLOTS; i++)
+	{
+		busy |= x->tx[i].busy;
+	}
+	busy |= x->payload.busy;
+	pthread_mutex_unlock(&x->lock);
+
+	return busy;
+}
+
+void xfer_stop(struct UsbXfer *x)
+{
+	int tries;
+	int i;
+
+	for(i = 0; i < XFER_MAX_DEPTH; i++)
+	{
+		if(x->rx[i].busy)
+		{
+			libusb_cancel_transfer(x->rx[i].trans);
+		}
+	}
+
+	for(i = 0; i < XFER_TX_SLOTS; i++)
+	{
+		if(x->tx[i].busy)
+		{
+			libusb_cancel_transfer(x->tx[i].trans);
+		}
+	}
+
+	if(x->payload.busy)
+	{
+		libusb_cancel_transfer(x->payload.trans);
+	}
+
+	/* Reap the cancelled transfers, if the device has gone away they complete quickly */
+	for(tries = 0; (tries < XFER_STOP_TRIES) && (any_busy(x)); tries++)
+	{
+		struct timeval tv = { 0, 100000 };
+
+		libusb_handle_events_timeout_completed(x->ctx, &tv, NULL);
+	}
+
+	for(i = 0; i < XFER_MAX_DEPTH; i++)
+	{
+		if(x->rx[i].busy)
+		{
+			/* Never completed, leak it rather than free memory libusb still owns */
+			fprintf(stderr, "IN transfer %d did not cancel\n", i);
+			continue;
+		}
+
+		if(x->rx[i].trans)
+		{
+			libusb_free_transfer(x->rx[i].trans);
+			x->rx[i].trans = NULL;
+		}
+		free(x->rx[i].data);
+		x->rx[i].data = NULL;
+	}
+
+	for(i = 0; i < XFER_TX_SLOTS; i++)
+	{
+		if(x->tx[i].busy)
+		{
+			fprintf(stderr, "OUT transfer %d did not cancel\n", i);
+			continue;
+		}
+
+		if(x->tx[i].trans)
+		{
+			libusb_free_transfer(x->tx[i].trans);
+			x->tx[i].trans = NULL;
+		}
+		free(x->tx[i].data);
+		x->tx[i].data = NULL;
+		x->tx[i].size = 0;
+	}
+
+	if(x->payload.busy)
+	{
+		fprintf(stderr, "Payload transfer did not cancel\n");
+	}
+	else if(x->payload.trans)
+	{
+		/* The data belongs to the caller */
+		libusb_free_transfer(x->payload.trans);
+		x->payload.trans = NULL;
+	}
+
+	if(x->running)
+	{
+		x->stats.run_ns = get_time_ns() - x->start_time;
+		x->running = 0;
+	}
+}
+
+int xfer_read_cmd(struct UsbXfer *x, void *data, int size)
+{
+	struct XferBuf *buf;
+	int avail;
+	int len;
+	int ret;
+
+	ret = rx_next(x, &buf, 0);
+	if(ret < 0)
+	{
+		return ret;
+	}
+
+	avail = buf->trans->actual_length - buf->pos;
+	len = avail < size ? avail : size;
+	memcpy(data, buf->data + buf->pos, len);
+	buf->pos += len;
+	if(buf->pos >= buf->trans->actual_length)
+	{
+		rx_recycle(x);
+	}
+
+	V_PRINTF(2, "Command read returned %d\n", len);
+
+	return len;
+}
+
+/* Work out how much of the next len bytes the queued IN transfers will take,
+ * and how many of them that is. Each one still queued takes a whole packet. */
+static int rx_queued_len(struct UsbXfer *x, int len, int *count)
+{
+	int queued = 0;
+	int i;
+
+	pthread_mutex_lock(&x->lock);
+	for(i = 0; (i < x->depth) && (queued < len); i++)
+	{
+		struct XferBuf *buf = &x->rx[(x->rx_head + i) % x->depth];
+
+		if(buf->done)
+		{
+			queued += buf->trans->actual_length - buf->pos;
+		}
+		else if(buf->busy)
+		{
+			queued += buf->size;
+		}
+		else
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&x->lock);
+
+	*count = i;
+
+	return queued;
+}
+
+static int payload_submit(struct UsbXfer *x, unsigned char *data, int ofs, int len, int ahead)
+{
+	struct XferBuf *buf = &x->payload;
+	int ret;
+
+	libusb_fill_bulk_transfer(buf->trans, x->dev, x->rx_ep, data + ofs, len, payload_done, buf, 0);
+	buf->data = data + ofs;
+	buf->size = len;
+	buf->ofs = ofs;
+	buf->done = 0;
+	buf->busy = 1;
+	x->payload_ahead = ahead;
+
+	ret = libusb_submit_transfer(buf->trans);
+	if(ret < 0)
+	{
+		buf->busy = 0;
+		fprintf(stderr, "Error submitting payload transfer (%s)\n", libusb_error_name(ret));
+	}
+
+	V_PRINTF(2, "Payload transfer of %d bytes behind %d queued\n", len, ahead);
+
+	return ret;
+}
+
+/* Give up on the payload transfer, it points into the caller's buffer so it
+ * has to be back from libusb before the read returns */
+static void payload_cancel(struct UsbXfer *x)
+{
+	int tries;
+
+	if(x->payload.busy)
+	{
+		libusb_cancel_transfer(x->payload.trans);
+		for(tries = 0; (tries < XFER_STOP_TRIES) && (x->payload.busy); tries++)
+		{
+			struct timeval tv = { 0, 100000 };
+
+			libusb_handle_events_timeout_completed(x->ctx, &tv, &x->payload.done);
+		}
+	}
+
+	x->payload.done = 0;
+}
+
+int xfer_read(struct UsbXfer *x, void *data, int size, int timeout)
+{
+	unsigned char *p = (unsigned char *) data;
+	int readlen = 0;
+	int count;
+	int len;
+	int ret;
+
+	V_PRINTF(2, "Queued read size %d, timeout %d\n", size, timeout);
+
+	/* Whole packets the queued transfers can't hold go in one transfer */
+	len = rx_queued_len(x, size, &count);
+	if(((size - len) / XFER_PKT_SIZE) > 0)
+	{
+		ret = payload_submit(x, p, len, ((size - len) / XFER_PKT_SIZE) * XFER_PKT_SIZE, count);
+		if(ret < 0)
+		{
+			return ret;
+		}
+	}
+
+	while(readlen < size)
+	{
+		struct XferBuf *buf;
+		int avail;
+
+		if(((x->payload.busy) || (x->payload.done)) && (x->payload_ahead == 0))
+		{
+			buf = &x->payload;
+			ret = wait_done(x, &buf->done, timeout, 1);
+			if(ret < 0)
+			{
+				if(ret == LIBUSB_ERROR_TIMEOUT)
+				{
+					fprintf(stderr, "Timeout waiting for %d bytes of data\n", size - readlen);
+				}
+				payload_cancel(x);
+				return readlen > 0 ? readlen : ret;
+			}
+
+			len = buf->trans->actual_length;
+			if(buf->ofs != readlen)
+			{
+				/* A queued transfer timed out empty and went behind it */
+				memmove(p + readlen, p + buf->ofs, len);
+			}
+			readlen += len;
+			buf->done = 0;
+
+			ret = map_status(buf->trans->status);
+			if((ret < 0) || (len < buf->size))
+			{
+				/* Short, the PSP sent less than the command said */
+				fprintf(stderr, "Payload transfer returned %d of %d (%s)\n", len, buf->size, libusb_error_name(ret));
+				break;
+			}
+			continue;
+		}
+
+		ret = rx_next(x, &buf, timeout);
+		if(ret < 0)
+		{
+			if(ret == LIBUSB_ERROR_TIMEOUT)
+			{
+				fprintf(stderr, "Timeout waiting for %d bytes of data\n", size - readlen);
+			}
+			payload_cancel(x);
+			return readlen > 0 ? readlen : ret;
+		}
+
+		avail = buf->trans->actual_length - buf->pos;
+		if(avail == 0)
+		{
+			/* Zero length packet where we expected data */
+			rx_recycle(x);
+			break;
+		}
+
+		len = avail < (size - readlen) ? avail : (size - readlen);
+		memcpy(p + readlen, buf->data + buf->pos, len);
+		buf->pos += len;
+		readlen += len;
+		if(buf->pos >= buf->trans->actual_length)
+		{
+			rx_recycle(x);
+		}
+	}
+
+	payload_cancel(x);
+
+	V_PRINTF(2, "Queued read returned %d\n", readlen);
+
+	return readlen;
+}
+
+int xfer_write(struct UsbXfer *x, const void *data, int size, int timeout)
+{
+	struct XferBuf *buf;
+	int ret;
+
+	V_PRINTF(2, "Queued write size %d, timeout %d\n", size, timeout);
+
+	pthread_mutex_lock(&x->lock);
+	ret = x->tx_error;
+	x->tx_error = 0;
+	pthread_mutex_unlock(&x->lock);
+	if(ret < 0)
+	{
+		fprintf(stderr, "Earlier reply failed (%s)\n", libusb_error_name(ret));
+		return ret;
+	}
+
+	buf = &x->tx[x->tx_tail];
+	if(buf->busy)
+	{
+		/* Ring is full, wait for the oldest reply to go */
+		ret = wait_done(x, &buf->done, 0, 0);
+		if(ret < 0)
+		{
+			return ret;
+		}
+	}
+
+	if(buf->size < size)
+	{
+		unsigned char *p;
+
+		p = realloc(buf->data, size);
+		if(p == NULL)
+		{
+			fprintf(stderr, "Could not allocate reply buffer of %d bytes\n", size);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		buf->data = p;
+		buf->size = size;
+	}
+
+	memcpy(buf->data, data, size);
+	libusb_fill_bulk_transfer(buf->trans, x->dev, x->tx_ep, buf->data, size, tx_done, buf, timeout);
+	buf->done = 0;
+
+	pthread_mutex_lock(&x->lock);
+	buf->busy = 1;
+	x->stats.tx_queued++;
+	if(x->stats.tx_queued > x->stats.tx_queued_max)
+	{
+		x->stats.tx_queued_max = x->stats.tx_queued;
+	}
+	update_idle(x, get_time_ns());
+	pthread_mutex_unlock(&x->lock);
+
+	ret = libusb_submit_transfer(buf->trans);
+	if(ret < 0)
+	{
+		pthread_mutex_lock(&x->lock);
+		buf->busy = 0;
+		x->stats.tx_queued--;
+		update_idle(x, get_time_ns());
+		pthread_mutex_unlock(&x->lock);
+		fprintf(stderr, "Error submitting OUT transfer (%s)\n", libusb_error_name(ret));
+		return ret;
+	}
+
+	x->tx_tail = (x->tx_tail + 1) % XFER_TX_SLOTS;
+
+	return size;
+}
+
+int xfer_flush(struct UsbXfer *x)
+{
+	int ret = 0;
+	int i;
+
+	for(i = 0; i < XFER_TX_SLOTS; i++)
+	{
+		if(x->tx[i].busy)
+		{
+			ret = wait_done(x, &x->tx[i].done, 0, 0);
+			if(ret < 0)
+			{
+				return ret;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&x->lock);
+	ret = x->tx_error;
+	x->tx_error = 0;
+	pthread_mutex_unlock(&x->lock);
+
+	return ret;
+}
+
+void xfer_get_stats(struct UsbXfer *x, struct UsbXferStats *stats)
+{
+	uint64_t now;
+
+	pthread_mutex_lock(&x->lock);
+	memcpy(stats, &x->stats, sizeof(*stats));
+	if(x->running)
+	{
+		now = get_time_ns();
+		stats->run_ns = now - x->start_time;
+		if(x->idle_start)
+		{
+			stats->idle_ns += now - x->idle_start;
+		}
+	}
+	pthread_mutex_unlock(&x->lock);
+}
@@ -0,0 +1,174 @@
+/*
+ * PSPLINK
+ * -----------------------------------------------------------------------
+ * Licensed under the BSD license, see LICENSE in PSPLINK root for details.
+ *
+ * usbxfer.h - Pipelined asynchronous USB transfer engine
+ *
+ * Copyright (c) pspdev
+ *
+ */
+#ifndef __USBXFER_H__
+#define __USBXFER_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <libusb.h>
+
+/* Bulk packet size of the PSP's high speed endpoints */
+#define XFER_PKT_SIZE     512
+/* Size of each queued bulk IN transfer. It has to be one packet, the PSP does
+ * not end a write with a zero length packet so a larger transfer would never
+ * complete after a write which is a multiple of the packet size. */
+#define XFER_RX_SIZE      XFER_PKT_SIZE
+#define XFER_DEF_DEPTH    4
+#define XFER_MAX_DEPTH    32
+/* Number of replies which can be in flight before a write has to wait */
+#define XFER_TX_SLOTS     16
+
+struct UsbXfer;
+
+struct XferBuf
+{
+	struct UsbXfer *owner;
+	struct libusb_transfer *trans;
+	unsigned char *data;
+	int size;
+	/* Non-zero while the transfer is owned by libusb */
+	int busy;
+	/* Set by the completion callback */
+	int done;
+	/* Read position in a completed IN transfer */
+	int pos;
+	/* Offset of a payload transfer in the caller's buffer */
+	int ofs;
+};
+
+struct UsbXferStats
+{
+	/* Configured number of queued IN transfers */
+	int rx_depth;
+	/* Number of IN transfers currently submitted */
+	int rx_queued;
+	/* Completed IN transfers waiting to be consumed, and the peak */
+	int rx_ready;
+	int rx_ready_max;
+	/* Replies currently in flight, and the peak */
+	int tx_queued;
+	int tx_queued_max;
+	uint64_t rx_transfers;
+	uint64_t rx_bytes;
+	uint64_t tx_transfers;
+	uint64_t tx_bytes;
+	/* Time the service thread spent waiting for data from the PSP */
+	uint64_t wait_ns;
+	/* Time nothing was in flight while the host was busy */
+	uint64_t idle_ns;
+	/* Time the engine has been running */
+	uint64_t run_ns;
+};
+
+struct UsbXfer
+{
+	libusb_context *ctx;
+	libusb_device_handle *dev;
+	int rx_ep;
+	int tx_ep;
+	int timeout;
+	int depth;
+	int running;
+	pthread_mutex_t lock;
+	struct XferBuf rx[XFER_MAX_DEPTH];
+	/* Index of the oldest IN transfer, the next one to consume */
+	int rx_head;
+	/* Transfer reading the bulk of a payload straight into the caller's buffer */
+	struct XferBuf payload;
+	/* Number of IN transfers queued ahead of the payload transfer */
+	int payload_ahead;
+	struct XferBuf tx[XFER_TX_SLOTS];
+	/* Next reply slot to use */
+	int tx_tail;
+	/* Sticky error from a failed reply */
+	int tx_error;
+	/* Set while the service thread is blocked waiting for IN data */
+	int waiting;
+	uint64_t idle_start;
+	uint64_t start_time;
+	struct UsbXferStats stats;
+};
+
+/**
+ * Start the transfer engine on an opened device, queues depth IN transfers
+ *
+ * @param x - The engine
+ * @param ctx - The libusb context
+ * @param dev - The device handle
+ * @param depth - Number of IN transfers to keep queued
+ * @param timeout - Timeout for the queued IN transfers (0 for none)
+ *
+ * @return 0 on success, < 0 on error
+ */
+int  xfer_start(struct UsbXfer *x, libusb_context *ctx, libusb_device_handle *dev, int depth, int timeout);
+
+/**
+ * Stop the engine, cancels and reaps any outstanding transfers
+ *
+ * @param x - The engine
+ */
+void xfer_stop(struct UsbXfer *x);
+
+/**
+ * Read the next command packet from the IN queue
+ *
+ * @param x - The engine
+ * @param data - Buffer for the command
+ * @param size - Maximum size of the command
+ *
+ * @return Length of the command, 0 if the remote disconnected, LIBUSB_ERROR_TIMEOUT
+ * if the queue timed out, other < 0 on error
+ */
+int  xfer_read_cmd(struct UsbXfer *x, void *data, int size);
+
+/**
+ * Read an exact amount of data from the IN queue. Whatever the queued IN
+ * transfers will not hold is read by one transfer straight into data.
+ *
+ * @param x - The engine
+ * @param data - Buffer to read into
+ * @param size - Number of bytes to read
+ * @param timeout - Timeout in milliseconds (0 for none)
+ *
+ * @return Number of bytes read, < 0 on error
+ */
+int  xfer_read(struct UsbXfer *x, void *data, int size, int timeout);
+
+/**
+ * Queue a reply to the PSP, returns as soon as the data has been copied
+ *
+ * @param x - The engine
+ * @param data - Data to send
+ * @param size - Size of the data
+ * @param timeout - Timeout in milliseconds for the transfer
+ *
+ * @return size on success, < 0 if this or an earlier reply failed
+ */
+int  xfer_write(struct UsbXfer *x, const void *data, int size, int timeout);
+
+/**
+ * Wait for all queued replies to complete
+ *
+ * @param x - The engine
+ *
+ * @return 0 on success, < 0 if a reply failed
+ */
+int  xfer_flush(struct UsbXfer *x);
+
+/**
+ * Take a snapshot of the engine statistics
+ *
+ * @param x - The engine
+ * @param stats - Receives the statistics
+ */
+void xfer_get_stats(struct UsbXfer *x, struct UsbXferStats *stats);
+
+#endif